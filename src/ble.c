@@ -11,7 +11,6 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/gatt.h>
 #include <bluetooth/uuid.h>
-#include <bluetooth/gatt_dm.h>
 #include <bluetooth/scan.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_err.h>
@@ -22,6 +21,10 @@
 #include "ble.h"
 
 #include "ble_codec.h"
+#include "timestamp.h"
+#include "gatt_cache.h"
+#include "gatt_discovery.h"
+#include "gatt_ops.h"
 #include "gateway.h"
 #include "ctype.h"
 #include "nrf_cloud_transport.h"
@@ -30,23 +33,13 @@
 
 #define SEND_NOTIFY_STACK_SIZE 2048
 #define SEND_NOTIFY_PRIORITY 9
-#define SUBSCRIPTION_LIMIT 16
-#define NOTIFICATION_QUEUE_LIMIT 10
-#define MAX_BUF_SIZE 11000
+#define REC_MAX_DATA_LEN 512
 #define STR(x) #x
 #define BT_UUID_GATT_CCC_VAL_STR STR(BT_UUID_GATT_CCC_VAL)
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(ble, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
 
-static char buffer[MAX_BUF_SIZE];
-static struct gw_msg output = {
-	.data.ptr = buffer,
-	.data.len = 0,
-	.data_max_len = MAX_BUF_SIZE
-};
-
-static bool discover_in_progress;
 static bool scan_waiting;
 static bool print_scan_results;
 
@@ -62,33 +55,630 @@ struct k_work ble_device_encode_work;
 struct k_work start_auto_conn_work;
 
 static atomic_t queued_notifications;
+static atomic_t rec_exhausted;
+static atomic_t rec_dropped;
+
+/* Forwarder statistics; only written by the forwarder thread */
+static uint32_t rec_wakeups;
+static uint32_t rec_max_drained;
+static uint32_t rec_sent;
+static uint64_t rec_latency_total_us;
+static uint32_t rec_latency_min_us = UINT32_MAX;
+static uint32_t rec_latency_max_us;
+static uint32_t rec_bulk_skipped;
 
 struct ble_scanned_dev ble_scanned_devices[MAX_SCAN_RESULTS];
 
-/* Must be statically allocated */
-/* TODO: The array needs to remain the entire time the sub exists.
- * Should probably be stored with the conn manager.
+static notification_cb_t notify_callback;
+
+/* Received notifications and read responses are queued in one ring per
+ * priority lane, each record being a header immediately followed by
+ * exactly hdr.length payload bytes.
+ */
+#define REC_FLAG_READ BIT(0)
+#define REC_FLAG_KEEP BIT(1)
+#define REC_FLAG_LATEST BIT(2)
+/* how a GATT operation ended, reported from the forwarder thread; a failed
+ * operation's payload is its int error
  */
-static struct bt_gatt_subscribe_params sub_param[BT_MAX_SUBSCRIBES];
-/* Array of connections corresponding to subscriptions above */
-static struct bt_conn *sub_conn[BT_MAX_SUBSCRIBES];
-static uint16_t sub_value[BT_MAX_SUBSCRIBES];
-static uint8_t curr_subs;
-static int next_sub_index;
+#define REC_FLAG_WRITE BIT(3)
+#define REC_FLAG_FAILED BIT(4)
+#define REC_LATEST_DATA_LEN 64
+
+struct rec_hdr {
+	uint8_t conn_index;
+	uint8_t conn_gen;
+	uint8_t flags;
+	uint16_t handle;
+	uint16_t length;
+	uint32_t rx_cycles;
+} __packed;
+
+struct rec_lane {
+	struct ring_buf *ring;
+	atomic_t queued;
+	uint32_t max_queued;
+	uint32_t max_used;
+	/* only written by the forwarder thread */
+	uint32_t sent;
+	uint64_t latency_total_us;
+	uint32_t latency_max_us;
+};
 
-static notification_cb_t notify_callback;
+RING_BUF_DECLARE(rec_ring_control, CONFIG_GATEWAY_BLE_REC_CONTROL_BUF_SIZE);
+RING_BUF_DECLARE(rec_ring_alarm, CONFIG_GATEWAY_BLE_REC_ALARM_BUF_SIZE);
+RING_BUF_DECLARE(rec_ring_bulk, CONFIG_GATEWAY_BLE_REC_BUF_SIZE);
 
-struct rec_data_t {
-	void *fifo_reserved;
-	struct bt_gatt_subscribe_params sub_params;
-	struct bt_gatt_read_params read_params;
-	char addr_trunc[BT_ADDR_STR_LEN];
-	uint8_t data[256];
-	bool read;
+static struct rec_lane rec_lanes[BLE_RX_PRIOS] = {
+	[BLE_RX_PRIO_CONTROL] = { .ring = &rec_ring_control },
+	[BLE_RX_PRIO_ALARM] = { .ring = &rec_ring_alarm },
+	[BLE_RX_PRIO_BULK] = { .ring = &rec_ring_bulk }
+};
+
+K_MUTEX_DEFINE(rec_lock);
+K_SEM_DEFINE(rec_sem, 0, K_SEM_MAX_LIMIT);
+static struct k_poll_signal rec_signal = K_POLL_SIGNAL_INITIALIZER(rec_signal);
+static atomic_t rec_coalesced;
+
+/* Pending value of each latest-only subscription; for a REC_FLAG_LATEST
+ * record the header handle is the subscription index and the payload is
+ * taken from here when the forwarder dequeues it
+ */
+struct rec_latest {
+	bool pending;
+	uint8_t conn_index;
+	uint8_t conn_gen;
+	uint16_t handle;
 	uint16_t length;
+	uint32_t rx_cycles;
+	uint8_t data[REC_LATEST_DATA_LEN];
+};
+
+/* indexed like the connection manager's subscription pool */
+static struct rec_latest sub_latest[CONFIG_GATEWAY_BLE_SUBSCRIPTIONS];
+
+/* Address of the peer currently using each bt_conn index, and a count
+ * of connections on that index so records from an earlier link are not
+ * attributed to the new peer
+ */
+static char rec_conn_addr[CONFIG_BT_MAX_CONN][BT_ADDR_STR_LEN];
+static uint8_t rec_conn_gen[CONFIG_BT_MAX_CONN];
+static atomic_t rec_conn_coalesced[CONFIG_BT_MAX_CONN];
+static atomic_t rec_conn_dropped[CONFIG_BT_MAX_CONN];
+
+/* Copy into space claimed from the ring; caller has checked there is room */
+static void rec_claim_copy(struct ring_buf *ring, const void *src,
+			   uint32_t len)
+{
+	const uint8_t *p = src;
+	uint8_t *dst;
+	uint32_t n;
+
+	while (len) {
+		n = ring_buf_put_claim(ring, &dst, len);
+		memcpy(dst, p, n);
+		p += n;
+		len -= n;
+	}
+}
+
+/* Copy the start of the oldest queued record without consuming it */
+static uint32_t rec_peek(struct ring_buf *ring, uint8_t *dst, uint32_t len)
+{
+	uint32_t total = 0;
+	uint32_t n;
+	uint8_t *p;
+
+	while (total < len) {
+		n = ring_buf_get_claim(ring, &p, len - total);
+		if (!n) {
+			break;
+		}
+		memcpy(&dst[total], p, n);
+		total += n;
+	}
+	ring_buf_get_finish(ring, 0);
+	return total;
+}
+
+static void rec_count_drop(uint8_t conn_index)
+{
+	atomic_inc(&rec_dropped);
+	atomic_inc(&rec_conn_dropped[conn_index]);
+}
+
+/* Discard the oldest record in a lane unless it is a read response or
+ * indication; caller must hold rec_lock
+ */
+static int rec_drop_oldest(struct rec_lane *lane)
+{
+	struct rec_hdr hdr;
+	uint32_t total;
+	uint32_t left;
+	uint8_t *p;
+
+	if (rec_peek(lane->ring, (uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+		return -ENODATA;
+	}
+	if (hdr.flags & REC_FLAG_KEEP) {
+		return -EPERM;
+	}
+	if (hdr.flags & REC_FLAG_LATEST) {
+		sub_latest[hdr.handle].pending = false;
+	}
+
+	total = left = sizeof(hdr) + hdr.length;
+	while (left) {
+		left -= ring_buf_get_claim(lane->ring, &p, left);
+	}
+	ring_buf_get_finish(lane->ring, total);
+
+	/* the forwarder tolerates a token for a record that is gone */
+	(void)k_sem_take(&rec_sem, K_NO_WAIT);
+	atomic_dec(&queued_notifications);
+	atomic_dec(&lane->queued);
+	rec_count_drop(hdr.conn_index);
+
+	LOG_INF("Dropping oldest message");
+	LOG_INF("Addr %s Handle %d Queued %d",
+		log_strdup(rec_conn_addr[hdr.conn_index]), hdr.handle,
+		atomic_get(&queued_notifications));
+	return 0;
+}
+
+/* Make room for total bytes according to policy; only records in the
+ * same lane are discarded. Caller must hold rec_lock.
+ */
+static int rec_make_room(struct rec_lane *lane, uint32_t total,
+			 enum ble_rx_policy policy)
+{
+	if (ring_buf_space_get(lane->ring) >= total) {
+		return 0;
+	}
+
+	atomic_inc(&rec_exhausted);
+	if ((policy == BLE_RX_DROP_NEW) ||
+	    (total > ring_buf_capacity_get(lane->ring))) {
+		return -ENOMEM;
+	}
+	while (ring_buf_space_get(lane->ring) < total) {
+		if (rec_drop_oldest(lane)) {
+			/* oldest must be kept or is held by the forwarder */
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* Append a record; caller must hold rec_lock and have made room */
+static void rec_commit(struct rec_lane *lane, const struct rec_hdr *hdr,
+		       const void *data)
+{
+	uint32_t total = sizeof(*hdr) + hdr->length;
+	uint32_t used;
+	uint32_t queued;
+
+	rec_claim_copy(lane->ring, hdr, sizeof(*hdr));
+	rec_claim_copy(lane->ring, data, hdr->length);
+	ring_buf_put_finish(lane->ring, total);
+
+	used = ring_buf_capacity_get(lane->ring) -
+	       ring_buf_space_get(lane->ring);
+	if (used > lane->max_used) {
+		lane->max_used = used;
+	}
+
+	atomic_inc(&queued_notifications);
+	queued = atomic_inc(&lane->queued) + 1;
+	if (queued > lane->max_queued) {
+		lane->max_queued = queued;
+	}
+	k_sem_give(&rec_sem);
+}
+
+/* Queue a record from the BT RX thread; never blocks on the forwarder.
+ * Read responses and indications carry REC_FLAG_KEEP; they are never
+ * discarded to make room for later data, though they may discard older
+ * notifications themselves.
+ */
+static int rec_put(struct bt_conn *conn, enum ble_rx_priority prio,
+		   uint16_t handle, uint8_t flags,
+		   const void *data, uint16_t length,
+		   enum ble_rx_policy policy)
+{
+	struct rec_lane *lane = &rec_lanes[prio];
+	struct rec_hdr hdr = {
+		.conn_index = bt_conn_index(conn),
+		.conn_gen = rec_conn_gen[bt_conn_index(conn)],
+		.flags = flags,
+		.handle = handle,
+		.length = MIN(length, REC_MAX_DATA_LEN),
+		.rx_cycles = k_cycle_get_32()
+	};
+	int err;
+
+	k_mutex_lock(&rec_lock, K_FOREVER);
+	err = rec_make_room(lane, sizeof(hdr) + hdr.length, policy);
+	if (!err) {
+		rec_commit(lane, &hdr, data);
+	} else {
+		rec_count_drop(hdr.conn_index);
+	}
+	k_mutex_unlock(&rec_lock);
+	return err;
+}
+
+/* Queue a notification for a latest-only subscription. While an earlier
+ * value is still waiting to be forwarded it is overwritten in place, so
+ * at most one record per subscription is ever queued.
+ */
+static int rec_put_latest(struct bt_conn *conn, struct ble_sub *sub,
+			  const void *data, uint16_t length)
+{
+	uint8_t sub_index = ble_conn_mgr_sub_index(sub);
+	struct rec_latest *latest = &sub_latest[sub_index];
+	struct rec_lane *lane = &rec_lanes[sub->prio];
+	struct rec_hdr hdr = {
+		.conn_index = bt_conn_index(conn),
+		.flags = REC_FLAG_LATEST,
+		.handle = sub_index,
+		.length = 0
+	};
+	int err = 0;
+
+	k_mutex_lock(&rec_lock, K_FOREVER);
+	if (latest->pending) {
+		atomic_inc(&rec_coalesced);
+		atomic_inc(&rec_conn_coalesced[hdr.conn_index]);
+	} else {
+		err = rec_make_room(lane, sizeof(hdr), BLE_RX_LATEST_ONLY);
+		if (err) {
+			rec_count_drop(hdr.conn_index);
+			goto unlock;
+		}
+		latest->rx_cycles = k_cycle_get_32();
+		rec_commit(lane, &hdr, NULL);
+		latest->pending = true;
+	}
+
+	latest->conn_index = hdr.conn_index;
+	latest->conn_gen = rec_conn_gen[hdr.conn_index];
+	latest->handle = sub->params.value_handle;
+	latest->length = length;
+	memcpy(latest->data, data, length);
+
+unlock:
+	k_mutex_unlock(&rec_lock);
+	return err;
+}
+
+/* Pick the lane to serve next: strict priority, except that bulk gets
+ * a turn after CONFIG_GATEWAY_BLE_BULK_STARVE_LIMIT records from higher
+ * lanes were sent ahead of it. Caller must hold rec_lock.
+ */
+static int rec_next_lane(void)
+{
+	bool bulk_waiting = !ring_buf_is_empty(rec_lanes[BLE_RX_PRIO_BULK].ring);
+
+	if (bulk_waiting &&
+	    (rec_bulk_skipped >= CONFIG_GATEWAY_BLE_BULK_STARVE_LIMIT)) {
+		rec_bulk_skipped = 0;
+		return BLE_RX_PRIO_BULK;
+	}
+	for (int prio = 0; prio < BLE_RX_PRIO_BULK; prio++) {
+		if (!ring_buf_is_empty(rec_lanes[prio].ring)) {
+			if (bulk_waiting) {
+				rec_bulk_skipped++;
+			}
+			return prio;
+		}
+	}
+	rec_bulk_skipped = 0;
+	return bulk_waiting ? BLE_RX_PRIO_BULK : -ENODATA;
+}
+
+/* Copy the next record out of its ring so the lock is not held while it
+ * is encoded and sent; data must hold REC_MAX_DATA_LEN bytes
+ */
+static int rec_get(struct rec_hdr *hdr, uint8_t *data,
+		   enum ble_rx_priority *prio)
+{
+	struct rec_latest *latest;
+	struct rec_lane *lane;
+	int err = 0;
+	int next;
+
+	k_mutex_lock(&rec_lock, K_FOREVER);
+	next = rec_next_lane();
+	if (next < 0) {
+		err = next;
+		goto unlock;
+	}
+	lane = &rec_lanes[next];
+	*prio = next;
+
+	ring_buf_get(lane->ring, (uint8_t *)hdr, sizeof(*hdr));
+	ring_buf_get(lane->ring, data, hdr->length);
+	atomic_dec(&queued_notifications);
+	atomic_dec(&lane->queued);
+
+	if (hdr->flags & REC_FLAG_LATEST) {
+		/* take the newest value written since this was queued */
+		latest = &sub_latest[hdr->handle];
+		hdr->conn_index = latest->conn_index;
+		hdr->conn_gen = latest->conn_gen;
+		hdr->handle = latest->handle;
+		hdr->length = latest->length;
+		hdr->rx_cycles = latest->rx_cycles;
+		memcpy(data, latest->data, latest->length);
+		latest->pending = false;
+	}
+
+unlock:
+	k_mutex_unlock(&rec_lock);
+	return err;
+}
+
+struct batch_dev_policy {
+	char addr[BT_ADDR_STR_LEN];
+	struct ble_batch_policy policy;
+};
+
+/* Global and per-device batching policies, set from Kconfig and cloud */
+K_MUTEX_DEFINE(batch_policy_lock);
+static struct ble_batch_policy batch_policy = {
+	.max_bytes = CONFIG_GATEWAY_BLE_BATCH_MAX_BYTES,
+	.max_count = CONFIG_GATEWAY_BLE_BATCH_MAX_COUNT,
+	.max_latency_ms = CONFIG_GATEWAY_BLE_BATCH_MAX_LATENCY_MS
 };
+static struct batch_dev_policy batch_dev_policy[CONFIG_BT_MAX_CONN];
+
+/* Batch being accumulated; only used by the forwarder thread */
+static char batch_buf[CONFIG_GATEWAY_BLE_BATCH_MAX_BYTES];
+static uint32_t batch_len;
+static uint32_t batch_count;
+static int64_t batch_deadline;
+static uint32_t batch_rx_cycles[CONFIG_GATEWAY_BLE_BATCH_MAX_COUNT];
+static struct ble_batch_stats batch_stats;
+
+/* Record time from BLE RX callback to handoff to the MQTT stack */
+static void rec_latency_add(enum ble_rx_priority prio, uint32_t cycles)
+{
+	struct rec_lane *lane = &rec_lanes[prio];
+	uint32_t us = k_cyc_to_us_floor32(cycles);
+
+	lane->sent++;
+	lane->latency_total_us += us;
+	if (us > lane->latency_max_us) {
+		lane->latency_max_us = us;
+	}
+
+	rec_sent++;
+	rec_latency_total_us += us;
+	if (us < rec_latency_min_us) {
+		rec_latency_min_us = us;
+	}
+	if (us > rec_latency_max_us) {
+		rec_latency_max_us = us;
+	}
+}
+
+int ble_get_conn_rx_stats(const char *ble_addr, uint32_t *coalesced,
+			  uint32_t *dropped)
+{
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (strcmp(ble_addr, rec_conn_addr[i]) == 0) {
+			*coalesced = atomic_get(&rec_conn_coalesced[i]);
+			*dropped = atomic_get(&rec_conn_dropped[i]);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+void ble_get_rec_stats(struct ble_rec_stats *stats)
+{
+	stats->queued = atomic_get(&queued_notifications);
+	for (int prio = 0; prio < BLE_RX_PRIOS; prio++) {
+		struct rec_lane *lane = &rec_lanes[prio];
+		struct ble_rec_lane_stats *ls = &stats->lanes[prio];
+
+		ls->size = ring_buf_capacity_get(lane->ring);
+		ls->free = ring_buf_space_get(lane->ring);
+		ls->max_used = lane->max_used;
+		ls->queued = atomic_get(&lane->queued);
+		ls->max_queued = lane->max_queued;
+		ls->sent = lane->sent;
+		ls->latency_avg_us = lane->sent ?
+			(uint32_t)(lane->latency_total_us / lane->sent) : 0;
+		ls->latency_max_us = lane->latency_max_us;
+	}
+	stats->exhausted = atomic_get(&rec_exhausted);
+	stats->dropped = atomic_get(&rec_dropped);
+	stats->coalesced = atomic_get(&rec_coalesced);
+	stats->wakeups = rec_wakeups;
+	stats->max_drained = rec_max_drained;
+	stats->sent = rec_sent;
+	stats->latency_min_us = rec_sent ? rec_latency_min_us : 0;
+	stats->latency_avg_us = rec_sent ?
+				(uint32_t)(rec_latency_total_us / rec_sent) : 0;
+	stats->latency_max_us = rec_latency_max_us;
+}
+
+static void batch_get_policy(const char *addr, struct ble_batch_policy *policy)
+{
+	k_mutex_lock(&batch_policy_lock, K_FOREVER);
+	*policy = batch_policy;
+	for (int i = 0; i < ARRAY_SIZE(batch_dev_policy); i++) {
+		if (strcmp(addr, batch_dev_policy[i].addr) == 0) {
+			policy->max_count = batch_dev_policy[i].policy.max_count;
+			policy->max_latency_ms =
+				batch_dev_policy[i].policy.max_latency_ms;
+			break;
+		}
+	}
+	k_mutex_unlock(&batch_policy_lock);
+
+	policy->max_bytes = MIN(policy->max_bytes, sizeof(batch_buf));
+	policy->max_count = MIN(policy->max_count, ARRAY_SIZE(batch_rx_cycles));
+}
 
-K_FIFO_DEFINE(rec_fifo);
+int ble_batch_set_policy(const char *ble_addr,
+			 const struct ble_batch_policy *policy)
+{
+	int err = 0;
+	int free_idx = -1;
+	int i;
+
+	k_mutex_lock(&batch_policy_lock, K_FOREVER);
+	if (ble_addr == NULL) {
+		batch_policy = *policy;
+		goto unlock;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(batch_dev_policy); i++) {
+		if (strcmp(ble_addr, batch_dev_policy[i].addr) == 0) {
+			break;
+		}
+		if ((free_idx < 0) && !batch_dev_policy[i].addr[0]) {
+			free_idx = i;
+		}
+	}
+
+	if (i < ARRAY_SIZE(batch_dev_policy)) {
+		if (policy) {
+			batch_dev_policy[i].policy = *policy;
+		} else {
+			batch_dev_policy[i].addr[0] = '\0';
+		}
+	} else if (policy == NULL) {
+		err = -ENOENT;
+	} else if (free_idx < 0) {
+		err = -ENOMEM;
+	} else {
+		strncpy(batch_dev_policy[free_idx].addr, ble_addr,
+			BT_ADDR_STR_LEN - 1);
+		batch_dev_policy[free_idx].addr[BT_ADDR_STR_LEN - 1] = '\0';
+		batch_dev_policy[free_idx].policy = *policy;
+	}
+
+unlock:
+	k_mutex_unlock(&batch_policy_lock);
+	return err;
+}
+
+void ble_batch_clear_device_policies(void)
+{
+	k_mutex_lock(&batch_policy_lock, K_FOREVER);
+	for (int i = 0; i < ARRAY_SIZE(batch_dev_policy); i++) {
+		batch_dev_policy[i].addr[0] = '\0';
+	}
+	k_mutex_unlock(&batch_policy_lock);
+}
+
+void ble_get_batch_stats(struct ble_batch_stats *stats)
+{
+	*stats = batch_stats;
+}
+
+/* Send the accumulated batch as one JSON array of messages */
+static void batch_flush(enum ble_batch_flush_reason reason)
+{
+	struct nrf_cloud_data data = {
+		.ptr = batch_buf
+	};
+	int err;
+
+	if (!batch_count) {
+		return;
+	}
+
+	batch_buf[batch_len++] = ']';
+	data.len = batch_len;
+
+	LOG_DBG("Flushing %u events, %u bytes, reason %d",
+		batch_count, batch_len, reason);
+	err = g2c_send(&data);
+	if (err) {
+		LOG_ERR("Unable to send batch, %u events dropped: %d",
+			batch_count, err);
+		batch_stats.failed++;
+		batch_stats.failed_events += batch_count;
+	} else {
+		for (int i = 0; i < batch_count; i++) {
+			rec_latency_add(BLE_RX_PRIO_BULK,
+					k_cycle_get_32() - batch_rx_cycles[i]);
+		}
+		batch_stats.batches++;
+		batch_stats.events += batch_count;
+		batch_stats.bytes += batch_len;
+		batch_stats.flushes[reason]++;
+		if (batch_count > batch_stats.max_events) {
+			batch_stats.max_events = batch_count;
+		}
+		if (batch_len > batch_stats.max_bytes) {
+			batch_stats.max_bytes = batch_len;
+		}
+	}
+
+	batch_len = 0;
+	batch_count = 0;
+}
+
+/* Append an encoded message to the batch, flushing as policy requires */
+static void batch_add(const char *addr, const struct gw_msg *msg,
+		      uint32_t rx_cycles)
+{
+	struct ble_batch_policy policy;
+	uint32_t len = msg->data.len;
+	int64_t deadline;
+	int err;
+
+	batch_get_policy(addr, &policy);
+
+	/* room for '[' or ',' before the message and ']' after it */
+	if ((policy.max_count <= 1) || ((len + 2) > policy.max_bytes)) {
+		batch_flush(BLE_BATCH_FLUSH_OTHER);
+		err = g2c_send(&msg->data);
+		if (err) {
+			LOG_ERR("Unable to send: %d", err);
+		} else {
+			rec_latency_add(BLE_RX_PRIO_BULK,
+					k_cycle_get_32() - rx_cycles);
+		}
+		return;
+	}
+
+	if ((batch_len + len + 2) > policy.max_bytes) {
+		batch_flush(BLE_BATCH_FLUSH_BYTES);
+	}
+
+	batch_buf[batch_len++] = batch_count ? ',' : '[';
+	memcpy(&batch_buf[batch_len], msg->data.ptr, len);
+	batch_len += len;
+	batch_rx_cycles[batch_count++] = rx_cycles;
+
+	deadline = k_uptime_get() + policy.max_latency_ms;
+	if ((batch_count == 1) || (deadline < batch_deadline)) {
+		batch_deadline = deadline;
+	}
+
+	if (batch_count >= policy.max_count) {
+		batch_flush(BLE_BATCH_FLUSH_COUNT);
+	}
+}
+
+/* Time the forwarder may sleep before the current batch is due */
+static k_timeout_t batch_timeout(void)
+{
+	int64_t remaining;
+
+	if (!batch_count) {
+		return K_FOREVER;
+	}
+	remaining = batch_deadline - k_uptime_get();
+	return (remaining > 0) ? K_MSEC(remaining) : K_NO_WAIT;
+}
 
 /* Convert ble address string to uppcase */
 void bt_to_upper(char *addr, uint8_t addr_len)
@@ -128,230 +718,296 @@ void bt_uuid_get_str(const struct bt_uuid *uuid, char *str, size_t len)
 	}
 }
 
-static int svc_attr_data_add(const struct bt_gatt_service_val *gatt_service,
-			      uint16_t handle, struct ble_device_conn *ble_conn_ptr)
+void ble_register_notify_callback(notification_cb_t callback)
 {
-	char str[UUID_STR_LEN];
-
-	bt_uuid_get_str(gatt_service->uuid, str, sizeof(str));
-
-	bt_to_upper(str, strlen(str));
-	LOG_INF("Service %s", log_strdup(str));
-
-	return ble_conn_mgr_add_uuid_pair(gatt_service->uuid, handle, 0, 0,
-					  BT_ATTR_SERVICE, ble_conn_ptr, true);
+	notify_callback = callback;
 }
 
-static int chrc_attr_data_add(const struct bt_gatt_chrc *gatt_chrc,
-			       struct ble_device_conn *ble_conn_ptr)
+/* Tell the cloud how a read or write it asked for ended */
+static void op_result_send(struct ble_device_conn *connected_ptr,
+			   const struct rec_hdr *hdr, uint8_t *data)
 {
-	uint16_t handle = gatt_chrc->value_handle;
+	bool read = (hdr->flags & REC_FLAG_READ) != 0;
+	const struct ble_attr_index *attr;
+	char uuid_buf[BT_UUID_STR_LEN];
+	char path_buf[BT_MAX_PATH_LEN];
+	const char *uuid = uuid_buf;
+	struct gw_msg *out;
+	char msg[64];
+	int err;
 
-	return ble_conn_mgr_add_uuid_pair(gatt_chrc->uuid, handle, 1,
-					  gatt_chrc->properties, BT_ATTR_CHRC,
-					  ble_conn_ptr, false);
-}
+	if (connected_ptr->hidden) {
+		return;
+	}
 
-static int ccc_attr_data_add(const struct bt_uuid *uuid, uint16_t handle,
-			      struct ble_device_conn *ble_conn_ptr)
-{
-	LOG_DBG("\tHandle: %d", handle);
+	out = gw_msg_alloc(GW_MSG_EVENT_LEN(hdr->length), K_FOREVER);
+	if (out == NULL) {
+		return;
+	}
 
-	return ble_conn_mgr_add_uuid_pair(uuid, handle, 2, 0, BT_ATTR_CCC,
-					  ble_conn_ptr, false);
-}
+	if (hdr->flags & REC_FLAG_FAILED) {
+		memcpy(&err, data, sizeof(err));
+		LOG_ERR("%s %s handle %u failed: %d",
+			read ? "Read of" : "Write to",
+			log_strdup(connected_ptr->addr), hdr->handle, err);
+		snprintf(msg, sizeof(msg), "%s handle %u failed: %d",
+			 read ? "Read of" : "Write to", hdr->handle, err);
+		err = device_error_encode(connected_ptr->addr, msg, out);
+		goto send;
+	}
 
-/* Add attributes to the connection manager objects */
-static int attr_add(const struct bt_gatt_dm *dm,
-	const struct bt_gatt_dm_attr *attr,
-	struct ble_device_conn *ble_conn_ptr)
-{
-	const struct bt_gatt_service_val *gatt_service =
-		bt_gatt_dm_attr_service_val(attr);
-	const struct bt_gatt_chrc *gatt_chrc =
-		bt_gatt_dm_attr_chrc_val(attr);
-	int err = 0;
+	attr = ble_conn_mgr_find_attr(connected_ptr, hdr->handle);
+	if ((attr != NULL) && (ble_attr_path(attr) != NULL)) {
+		uuid = ble_attr_uuid(attr);
+		memcpy(path_buf, ble_attr_path(attr), attr->path_len);
+		path_buf[attr->path_len] = '\0';
+		err = 0;
+	} else {
+		err = ble_conn_mgr_get_uuid_by_handle(hdr->handle, uuid_buf,
+						      connected_ptr);
+		if (!err) {
+			err = ble_conn_mgr_generate_path(connected_ptr,
+							 hdr->handle, path_buf,
+							 false);
+		}
+	}
+	if (!err) {
+		err = device_chrc_write_result_encode(connected_ptr->addr,
+						      uuid, path_buf,
+						      (char *)data,
+						      hdr->length, out);
+	}
 
-	if ((bt_uuid_cmp(attr->uuid, BT_UUID_GATT_PRIMARY) == 0) ||
-		(bt_uuid_cmp(attr->uuid, BT_UUID_GATT_SECONDARY) == 0)) {
-		err = svc_attr_data_add(gatt_service, attr->handle,
-					ble_conn_ptr);
-	} else if (bt_uuid_cmp(attr->uuid, BT_UUID_GATT_CHRC) == 0) {
-		err = chrc_attr_data_add(gatt_chrc, ble_conn_ptr);
-	} else if (bt_uuid_cmp(attr->uuid, BT_UUID_GATT_CCC) == 0) {
-		err = ccc_attr_data_add(attr->uuid, attr->handle, ble_conn_ptr);
+send:
+	if (!err) {
+		/* stay in order with batched events */
+		batch_flush(BLE_BATCH_FLUSH_OTHER);
+		err = g2c_send(&out->data);
+		if (err) {
+			LOG_ERR("Unable to send: %d", err);
+		}
+	} else {
+		LOG_ERR("Unable to encode operation result: %d", err);
 	}
-	return err;
+	gw_msg_free(out);
 }
 
-int ble_dm_data_add(struct bt_gatt_dm *dm)
+/* Encode one received record and send it to the cloud */
+static void forward_rec(const struct rec_hdr *hdr, uint8_t *data,
+			enum ble_rx_priority prio)
 {
-	const struct bt_gatt_dm_attr *attr = NULL;
-	char addr_trunc[BT_ADDR_STR_LEN];
-	char addr[BT_ADDR_LE_STR_LEN];
-	struct ble_device_conn *ble_conn_ptr;
-	struct bt_conn *conn_obj;
+	char *addr = rec_conn_addr[hdr->conn_index];
+	bool read = (hdr->flags & REC_FLAG_READ) != 0;
+	char uuid_buf[BT_UUID_STR_LEN];
+	char path_buf[BT_MAX_PATH_LEN];
+	const struct ble_attr_index *attr;
+	struct gw_msg *msg;
+	const char *uuid = uuid_buf;
+	const char *path = path_buf;
+	struct ble_device_conn *connected_ptr;
+	uint16_t handle = hdr->handle;
+	int64_t rx_time_ms;
 	int err;
 
-	conn_obj = bt_gatt_dm_conn_get(dm);
+	if (hdr->conn_gen != rec_conn_gen[hdr->conn_index]) {
+		LOG_DBG("Discarding data from previous link on conn %u",
+			hdr->conn_index);
+		return;
+	}
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn_obj), addr, sizeof(addr));
+	connected_ptr = ble_conn_mgr_get_conn_by_index(hdr->conn_index);
+	if (connected_ptr == NULL) {
+		LOG_ERR("Connection not found for addr %s",
+			log_strdup(addr));
+		return;
+	}
 
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
+	if (hdr->flags & (REC_FLAG_WRITE | REC_FLAG_FAILED)) {
+		op_result_send(connected_ptr, hdr, data);
+		return;
+	}
 
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
+	if (read) {
+		LOG_INF("Read: Addr %s Handle %d",
+			log_strdup(addr), handle);
+	} else {
+		LOG_DBG("Notify Addr %s Handle %d",
+			log_strdup(addr), handle);
+	}
 
-	err = ble_conn_mgr_get_conn_by_addr(addr_trunc, &ble_conn_ptr);
+	attr = ble_conn_mgr_find_attr(connected_ptr, handle);
+	if (attr != NULL) {
+		uuid = ble_attr_uuid(attr);
+		err = 0;
+	} else {
+		err = ble_conn_mgr_get_uuid_by_handle(handle, uuid_buf,
+						      connected_ptr);
+	}
 	if (err) {
-		LOG_ERR("Connection not found for addr %s", log_strdup(addr_trunc));
-		return err;
+		if (connected_ptr->state == BLE_CONN_STATE_DISCOVERING) {
+			LOG_INF("Ignoring notification on %s due to BLE"
+				" discovery in progress",
+				log_strdup(addr));
+		} else {
+			LOG_ERR("Unable to convert handle: %d", err);
+		}
+		return;
 	}
 
-	discover_in_progress = true;
+	bool ccc = !read;
 
-	attr = bt_gatt_dm_service_get(dm);
+	if (strcmp(uuid, BT_UUID_GATT_CCC_VAL_STR) == 0) {
+		ccc = true;
+		handle--;
+		LOG_INF("Force ccc for handle %u", handle);
+		attr = ble_conn_mgr_find_attr(connected_ptr, handle);
+	}
 
-	err = attr_add(dm, attr, ble_conn_ptr);
+	if ((attr != NULL) && (ble_attr_path(attr) != NULL)) {
+		/* rendered with the ccc, if the characteristic has one */
+		path = ble_attr_path(attr);
+		if (!ccc) {
+			memcpy(path_buf, path, attr->path_len);
+			path_buf[attr->path_len] = '\0';
+			path = path_buf;
+		}
+		err = 0;
+	} else {
+		err = ble_conn_mgr_generate_path(connected_ptr, handle,
+						 path_buf, ccc);
+	}
 	if (err) {
-		LOG_ERR("Unable to add attribute: %d", err);
-		return err;
+		LOG_ERR("Unable to generate path: %d", err);
+		return;
 	}
 
-	while (NULL != (attr = bt_gatt_dm_attr_next(dm, attr))) {
-		err = attr_add(dm, attr, ble_conn_ptr);
+	LOG_HEXDUMP_DBG(data, hdr->length, "notify");
+
+	if (!read && notify_callback) {
+		err = notify_callback(addr, uuid,
+				      data, hdr->length);
 		if (err) {
-			LOG_ERR("Unable to add attribute: %d", err);
-			return err;
+			/* callback should return 0 if it did not
+			 * process the data
+			 */
+			return;
 		}
 	}
-	return 0;
-}
+	if (connected_ptr && connected_ptr->hidden) {
+		LOG_DBG("Suppressing notification write to cloud");
+		return;
+	}
 
-void ble_register_notify_callback(notification_cb_t callback)
-{
-	notify_callback = callback;
+	/* stamp the event with when it arrived, not when it is encoded */
+	if (ts_cycles_to_ms(hdr->rx_cycles, &rx_time_ms)) {
+		rx_time_ms = 0;
+	}
+
+	msg = gw_msg_alloc(GW_MSG_EVENT_LEN(hdr->length), K_FOREVER);
+	if (msg == NULL) {
+		return;
+	}
+	if (read && !ccc) {
+		err = device_chrc_read_encode(addr,
+			uuid, path, ((char *)data),
+			hdr->length, msg, rx_time_ms);
+	} else if (read && ccc) {
+		err = device_descriptor_value_encode(addr,
+						     BT_UUID_GATT_CCC_VAL_STR,
+						     path,
+						     ((char *)data),
+						     hdr->length,
+						     msg, false, rx_time_ms);
+	} else {
+		err = device_value_changed_encode(addr,
+			uuid, path, ((char *)data),
+			hdr->length, msg, rx_time_ms);
+	}
+	if (err) {
+		gw_msg_free(msg);
+		LOG_ERR("Unable to encode: %d", err);
+		return;
+	}
+	LOG_DBG("UUID %s, path %s, len %u, json %s",
+		log_strdup(uuid), log_strdup(path),
+		hdr->length, log_strdup((char *)msg->data.ptr));
+	if (!read && (prio == BLE_RX_PRIO_BULK)) {
+		batch_add(addr, msg, hdr->rx_cycles);
+		gw_msg_free(msg);
+		return;
+	}
+
+	/* read responses stay in order with batched events; alarms and
+	 * control traffic go out immediately, ahead of pending bulk
+	 */
+	if (read) {
+		batch_flush(BLE_BATCH_FLUSH_OTHER);
+	}
+	err = g2c_send(&msg->data);
+	gw_msg_free(msg);
+	if (err) {
+		LOG_ERR("Unable to send: %d", err);
+		return;
+	}
+
+	rec_latency_add(prio, k_cycle_get_32() - hdr->rx_cycles);
 }
 
-/* Thread responsible for transferring ble data over MQTT */
+/* Thread responsible for transferring ble data over MQTT; sleeps until
+ * a record is queued, forwarding is stopped or a batch is due, then
+ * drains the queue
+ */
 void send_notify_data(int unused1, int unused2, int unused3)
 {
-	char uuid[BT_UUID_STR_LEN];
-	char path[BT_MAX_PATH_LEN];
-
-	memset(uuid, 0, BT_UUID_STR_LEN);
-	memset(path, 0, BT_MAX_PATH_LEN);
-
-	struct ble_device_conn *connected_ptr;
+	struct k_poll_event events[] = {
+		K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE,
+					 K_POLL_MODE_NOTIFY_ONLY,
+					 &rec_sem),
+		K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+					 K_POLL_MODE_NOTIFY_ONLY,
+					 &rec_signal),
+	};
+	static uint8_t data[REC_MAX_DATA_LEN];
+	enum ble_rx_priority prio;
+	struct rec_hdr hdr;
+	uint32_t drained;
+	bool discard;
 
 	while (1) {
-		int err;
-		struct rec_data_t *rx_data = k_fifo_get(&rec_fifo, K_NO_WAIT);
-
-		if (rx_data == NULL) {
-			/* no pending notifications, so let others take turn */
-			k_sleep(K_MSEC(10));
-			continue;
-		}
-		err = ble_conn_mgr_get_conn_by_addr(rx_data->addr_trunc,
-					      &connected_ptr);
-		if (err) {
-			LOG_ERR("Connection not found for addr %s",
-				log_strdup(rx_data->addr_trunc));
-			goto cleanup;
-		}
-
-		uint16_t handle;
-
-		if (rx_data->read) {
-			handle = rx_data->read_params.single.handle;
-			LOG_INF("Read: Addr %s Handle %d",
-				log_strdup(rx_data->addr_trunc), handle);
-		} else {
-			handle = rx_data->sub_params.value_handle;
-			LOG_DBG("Notify Addr %s Handle %d",
-				log_strdup(rx_data->addr_trunc), handle);
+		k_poll(events, ARRAY_SIZE(events), batch_timeout());
+
+		/* a stop drops what is queued; later records are forwarded */
+		discard = false;
+		if (events[1].state == K_POLL_STATE_SIGNALED) {
+			k_poll_signal_reset(&rec_signal);
+			LOG_INF("Discarding queued BLE data");
+			discard = true;
+			batch_len = 0;
+			batch_count = 0;
 		}
-
-		err = ble_conn_mgr_get_uuid_by_handle(handle, uuid,
-						      connected_ptr);
-		if (err) {
-			if (discover_in_progress) {
-				LOG_INF("Ignoring notification on %s due to BLE"
-					" discovery in progress",
-					log_strdup(rx_data->addr_trunc));
-			} else {
-				LOG_ERR("Unable to convert handle: %d", err);
+		events[0].state = K_POLL_STATE_NOT_READY;
+		events[1].state = K_POLL_STATE_NOT_READY;
+
+		drained = 0;
+		while (k_sem_take(&rec_sem, K_NO_WAIT) == 0) {
+			if (rec_get(&hdr, data, &prio)) {
+				/* record was dropped to make room */
+				continue;
 			}
-			goto cleanup;
-		}
-
-		bool ccc = !rx_data->read;
-
-		if (strcmp(uuid, BT_UUID_GATT_CCC_VAL_STR) == 0) {
-			ccc = true;
-			handle--;
-			LOG_INF("Force ccc for handle %u", handle);
-		}
-
-		err = ble_conn_mgr_generate_path(connected_ptr, handle, path,
-						 ccc);
-		if (err) {
-			LOG_ERR("Unable to generate path: %d", err);
-			goto cleanup;
-		}
-
-		LOG_HEXDUMP_DBG(rx_data->data, rx_data->length, "notify");
-
-		if (!rx_data->read && notify_callback) {
-			err = notify_callback(rx_data->addr_trunc, uuid,
-					      rx_data->data, rx_data->length);
-			if (err) {
-				/* callback should return 0 if it did not
-				 * process the data
-				 */
-				goto cleanup;
+			if (!discard) {
+				forward_rec(&hdr, data, prio);
 			}
-		}
-		if (connected_ptr && connected_ptr->hidden) {
-			LOG_DBG("Suppressing notification write to cloud");
-			goto cleanup;
+			drained++;
 		}
 
-		k_mutex_lock(&output.lock, K_FOREVER);
-		if (rx_data->read && !ccc) {
-			err = device_chrc_read_encode(rx_data->addr_trunc,
-				uuid, path, ((char *)rx_data->data),
-				rx_data->length, &output);
-		} else if (rx_data->read && ccc) {
-			err = device_descriptor_value_encode(rx_data->addr_trunc,
-							     BT_UUID_GATT_CCC_VAL_STR,
-							     path,
-							     ((char *)rx_data->data),
-							     rx_data->length, 
-							     &output, false);
-		} else {
-			err = device_value_changed_encode(rx_data->addr_trunc,
-				uuid, path, ((char *)rx_data->data),
-				rx_data->length, &output);
-		}
-		if (err) {
-			k_mutex_unlock(&output.lock);
-			LOG_ERR("Unable to encode: %d", err);
-			goto cleanup;
-		}
-		LOG_DBG("UUID %s, path %s, len %u, json %s",
-			log_strdup(uuid), log_strdup(path),
-			rx_data->length, log_strdup((char *)output.data.ptr));
-		err = g2c_send(&output.data);
-		k_mutex_unlock(&output.lock);
-		if (err) {
-			LOG_ERR("Unable to send: %d", err);
+		if (batch_count && (k_uptime_get() >= batch_deadline)) {
+			batch_flush(BLE_BATCH_FLUSH_DEADLINE);
 		}
 
-cleanup:
-		k_free(rx_data);
-		atomic_dec(&queued_notifications);
+		rec_wakeups++;
+		if (drained > rec_max_drained) {
+			rec_max_drained = drained;
+		}
 	}
 }
 
@@ -359,188 +1015,145 @@ K_THREAD_DEFINE(ble_rec_thread, SEND_NOTIFY_STACK_SIZE,
 	send_notify_data, NULL, NULL, NULL,
 	SEND_NOTIFY_PRIORITY, 0, 0);
 
-static void discovery_completed(struct bt_gatt_dm *disc, void *ctx)
+/* Called from the system work queue when a discovery session ends */
+static void discovery_done(struct ble_device_conn *connected_ptr,
+			   struct bt_conn *conn, int err)
 {
-	LOG_DBG("Attribute count: %d", bt_gatt_dm_attr_cnt(disc));
-
-	int err;
-
-	err = ble_dm_data_add(disc);
-	/* TBD: how can we cancel remainder of discovery if we get an error? */
-
-	bt_gatt_dm_data_release(disc);
-
-	bt_gatt_dm_continue(disc, NULL);
-}
-
-/* Despite the name. This is what is called at the end of a discovery service.*/
-static void discovery_service_not_found(struct bt_conn *conn, void *ctx)
-{
-	LOG_DBG("Service not found!");
-
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
-	struct ble_device_conn *connected_ptr;
-	int err;
-
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
-
-	err = ble_conn_mgr_get_conn_by_addr(addr_trunc, &connected_ptr);
 	if (err) {
-		LOG_ERR("Connection not found for addr %s", log_strdup(addr_trunc));
+		LOG_ERR("The discovery procedure failed, err %d", err);
+	}
+
+	if (connected_ptr == NULL) {
+		LOG_ERR("Connection not found for conn %u",
+			bt_conn_index(conn));
+	} else if (err) {
+		ble_conn_mgr_clear_attrs(connected_ptr);
+		connected_ptr->discovered = false;
+		ble_conn_mgr_post(connected_ptr, BLE_CONN_EVT_DISCOVERY_FAILED);
 	} else {
 		/* only set discovered true and send results if it seems we were
 		 * successful at doing a full discovery
 		 */
 		if (connected_ptr->connected && connected_ptr->num_pairs) {
-			connected_ptr->encode_discovered = true;
+			(void)ble_conn_mgr_build_attr_index(connected_ptr);
 			connected_ptr->discovered = true;
+			connected_ptr->gatt_cache_save = true;
+			ble_conn_mgr_post(connected_ptr,
+					  BLE_CONN_EVT_DISCOVERED);
 		} else {
 			LOG_WRN("Discovery not completed");
+			ble_conn_mgr_post(connected_ptr,
+					  BLE_CONN_EVT_DISCOVERY_FAILED);
+		}
+	}
+
+	if (err) {
+		if (IS_ENABLED(CONFIG_SETTINGS)) {
+			LOG_INF("Saving settings");
+			settings_save();
 		}
-		connected_ptr->discovering = false;
+
+		/* Disconnect? */
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
 	}
-	discover_in_progress = false;
 
 	/* check scan waiting */
-	if (scan_waiting) {
+	if (scan_waiting && !gatt_discovery_active()) {
 		scan_start(print_scan_results);
 	}
 }
 
-static void discovery_error_found(struct bt_conn *conn, int err, void *ctx)
+/* Called from the system work queue, which every connection's operations
+ * share; encoding and publishing the result is left to the forwarder
+ */
+static void op_result_queue(struct bt_conn *conn, struct gatt_op *op,
+			    int err)
 {
-	LOG_ERR("The discovery procedure failed, err %d", err);
-
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
-	struct ble_device_conn *connected_ptr;
-
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
+	uint8_t flags = REC_FLAG_KEEP;
 
-	err = ble_conn_mgr_get_conn_by_addr(addr_trunc, &connected_ptr);
-	if (err) {
-		LOG_ERR("Connection not found for addr %s", log_strdup(addr_trunc));
+	if (op->type == GATT_OP_READ) {
+		if (!err) {
+			/* the value was queued as it arrived */
+			return;
+		}
+		flags |= REC_FLAG_READ;
 	} else {
-		connected_ptr->num_pairs = 0;
-		connected_ptr->discovering = false;
-		connected_ptr->discovered = false;
+		flags |= REC_FLAG_WRITE;
 	}
-	discover_in_progress = false;
 
-	if (IS_ENABLED(CONFIG_SETTINGS)) {
-		LOG_INF("Saving settings");
-		settings_save();
+	if (err) {
+		err = rec_put(conn, BLE_RX_PRIO_CONTROL, op->handle,
+			      flags | REC_FLAG_FAILED, &err, sizeof(err),
+			      BLE_RX_KEEP_ALL);
+	} else {
+		err = rec_put(conn, BLE_RX_PRIO_CONTROL, op->handle, flags,
+			      op->data, op->len, BLE_RX_KEEP_ALL);
 	}
-
-	/* Disconnect? */
-	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-
-	/* check scan waiting */
-	if (scan_waiting) {
-		scan_start(print_scan_results);
+	if (err) {
+		LOG_ERR("No room to report %s of handle %u",
+			(op->type == GATT_OP_READ) ? "read" : "write",
+			op->handle);
 	}
 }
 
-static uint8_t gatt_read_callback(struct bt_conn *conn, uint8_t err,
-	struct bt_gatt_read_params *params,
-	const void *data, uint16_t length)
+static uint8_t gatt_read_callback(struct bt_conn *conn, struct gatt_op *op,
+				  const void *data, uint16_t length)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
 	int ret = BT_GATT_ITER_CONTINUE;
 
-	if ((length > 0) && (data != NULL)) {
-		bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-		memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-		addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-		bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
-
-		LOG_INF("Read Addr %s", log_strdup(addr_trunc));
+	if (length > 0) {
+		LOG_INF("Read Addr %s",
+			log_strdup(rec_conn_addr[bt_conn_index(conn)]));
 
-		struct rec_data_t read_data = {
-			.fifo_reserved = NULL,
-			.length = length,
-			.read = true
-		};
-
-		memset(&read_data.sub_params, 0, sizeof(read_data.sub_params));
-		memcpy(&read_data.read_params, params,
-			sizeof(struct bt_gatt_read_params));
-		memcpy(&read_data.addr_trunc, addr_trunc, strlen(addr_trunc));
-		memcpy(&read_data.data, data, length);
-
-		size_t size = sizeof(struct rec_data_t);
-
-		char *mem_ptr = k_malloc(size);
-
-		if (mem_ptr == NULL) {
+		/* read responses are never dropped to make room */
+		if (rec_put(conn, BLE_RX_PRIO_CONTROL, op->handle,
+			    REC_FLAG_READ | REC_FLAG_KEEP, data, length,
+			    BLE_RX_KEEP_ALL)) {
 			LOG_ERR("Out of memory error in gatt_read_callback(): "
 				"%d queued notifications",
 				atomic_get(&queued_notifications));
 			ret = BT_GATT_ITER_STOP;
-		} else {
-			atomic_inc(&queued_notifications);
-			memcpy(mem_ptr, &read_data, size);
-			k_fifo_put(&rec_fifo, mem_ptr);
 		}
 	}
 
 	return ret;
 }
 
-static int gatt_read_handle(bt_addr_le_t *addr, uint16_t handle, bool ccc)
+static int gatt_read_handle(struct bt_conn *conn, uint16_t handle)
 {
 	int err;
-	static struct bt_gatt_read_params params;
-	struct bt_conn *conn;
+	struct gatt_op *op;
 
-	if (ccc) {
-		handle++;
-	}
-	params.handle_count = 1;
-	params.single.handle = handle;
-	params.func = gatt_read_callback;
-
-	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, addr);
-	if (conn == NULL) {
-		LOG_ERR("Null Conn object");
-		return -EINVAL;
+	op = gatt_op_alloc();
+	if (op == NULL) {
+		LOG_ERR("No free GATT operation");
+		return -ENOMEM;
 	}
+	op->type = GATT_OP_READ;
+	op->handle = handle;
+	op->on_data = gatt_read_callback;
+	op->done = op_result_queue;
 
-	err = bt_gatt_read(conn, &params);
-	bt_conn_unref(conn);
+	err = gatt_op_submit(conn, op);
+	if (err) {
+		gatt_op_free(op);
+	}
 	return err;
 }
 
 int gatt_read(char *ble_addr, char *chrc_uuid, bool ccc)
 {
+	struct ble_chan chan;
 	int err;
-	struct ble_device_conn *connected_ptr;
-	uint16_t handle;
-
-	err = ble_conn_mgr_get_conn_by_addr(ble_addr, &connected_ptr);
-	if (err) {
-		return err;
-	}
 
-	err = ble_conn_mgr_get_handle_by_uuid(&handle, chrc_uuid,
-					      connected_ptr);
+	err = ble_chan_open(&chan, ble_addr, chrc_uuid);
 	if (err) {
 		return err;
 	}
 
-	return gatt_read_handle(&connected_ptr->bt_addr, handle, ccc);
+	err = gatt_read_handle(chan.conn, ccc ? chan.handle + 1 : chan.handle);
+	ble_chan_close(&chan);
+	return err;
 }
 
 static void on_sent(struct bt_conn *conn, uint8_t err,
@@ -556,186 +1169,237 @@ static void on_sent(struct bt_conn *conn, uint8_t err,
 	LOG_DBG("Sent Data of Length: %d", length);
 }
 
-int gatt_write(const char *ble_addr, const char *chrc_uuid, uint8_t *data,
-	       uint16_t data_len, bt_gatt_write_func_t cb)
+static int gatt_write_handle(struct ble_chan *chan, const uint8_t *data,
+			     uint16_t data_len, bt_gatt_write_func_t cb,
+			     gatt_op_done_t done)
 {
 	int err;
-	struct bt_conn *conn;
-	struct ble_device_conn *connected_ptr;
-	uint16_t handle;
-	static struct bt_gatt_write_params params;
+	struct gatt_op *op;
 
-	err = ble_conn_mgr_get_conn_by_addr(ble_addr, &connected_ptr);
-	if (err) {
-		return err;
+	if (data_len > sizeof(op->data)) {
+		LOG_ERR("Write of %u bytes is too long", data_len);
+		return -EMSGSIZE;
 	}
 
-	err = ble_conn_mgr_get_handle_by_uuid(&handle, chrc_uuid,
-					      connected_ptr);
-	if (err) {
-		return err;
-	}
+	LOG_DBG("Writing to conn %u handle %d",
+		bt_conn_index(chan->conn), chan->handle);
+	LOG_HEXDUMP_DBG(data, data_len, "Data to write");
 
-	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &connected_ptr->bt_addr);
-	if (conn == NULL) {
-		LOG_ERR("Null Conn object");
-		return -EINVAL;
+	op = gatt_op_alloc();
+	if (op == NULL) {
+		LOG_ERR("No free GATT operation");
+		return -ENOMEM;
 	}
+	op->type = GATT_OP_WRITE;
+	op->handle = chan->handle;
+	op->on_write = cb;
+	op->done = done;
+	op->len = data_len;
+	memcpy(op->data, data, data_len);
 
-	for (int i = 0; i < data_len; i++) {
-		LOG_DBG("Writing: %x", data[i]);
+	err = gatt_op_submit(chan->conn, op);
+	if (err) {
+		gatt_op_free(op);
 	}
+	return err;
+}
 
-	LOG_DBG("Writing to addr: %s to chrc %s with handle %d",
-		log_strdup(ble_addr), log_strdup(chrc_uuid), handle);
-	LOG_HEXDUMP_DBG(data, data_len, "Data to write");
-
-	params.func = cb ? cb : on_sent;
-	params.handle = handle;
-	params.offset = 0;
-	params.data = data;
-	params.length = data_len;
+int gatt_write(const char *ble_addr, const char *chrc_uuid, uint8_t *data,
+	       uint16_t data_len, bt_gatt_write_func_t cb)
+{
+	struct ble_chan chan;
+	int err;
 
-	err = bt_gatt_write(conn, &params);
-	bt_conn_unref(conn);
+	err = ble_chan_open(&chan, ble_addr, chrc_uuid);
+	if (err) {
+		return err;
+	}
+	err = ble_chan_write(&chan, data, data_len, cb);
+	ble_chan_close(&chan);
 	return err;
 }
 
-int gatt_write_without_response(char *ble_addr, char *chrc_uuid, uint8_t *data,
-				uint16_t data_len)
+int gatt_write_report(const char *ble_addr, const char *chrc_uuid,
+		      const uint8_t *data, uint16_t data_len)
 {
+	struct ble_chan chan;
 	int err;
 
-	struct bt_conn *conn;
+	err = ble_chan_open(&chan, ble_addr, chrc_uuid);
+	if (err) {
+		return err;
+	}
+	err = gatt_write_handle(&chan, data, data_len, on_sent,
+				op_result_queue);
+	ble_chan_close(&chan);
+	return err;
+}
+
+int ble_chan_open(struct ble_chan *chan, const char *ble_addr,
+		  const char *chrc_uuid)
+{
+	int err;
 	struct ble_device_conn *connected_ptr;
-	uint16_t handle;
-	/* static struct bt_gatt_write_params params; */
 
+	chan->conn = NULL;
 	err = ble_conn_mgr_get_conn_by_addr(ble_addr, &connected_ptr);
 	if (err) {
 		return err;
 	}
 
-	err = ble_conn_mgr_get_handle_by_uuid(&handle, chrc_uuid,
+	err = ble_conn_mgr_get_handle_by_uuid(&chan->handle, chrc_uuid,
 					      connected_ptr);
 	if (err) {
 		return err;
 	}
 
-	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &connected_ptr->bt_addr);
-	if (conn == NULL) {
+	chan->conn = ble_conn_mgr_get_bt_conn(connected_ptr);
+	if (chan->conn == NULL) {
 		LOG_ERR("Null Conn object");
 		return -EINVAL;
 	}
+	chan->mtu = bt_gatt_get_mtu(chan->conn);
 
-	LOG_DBG("Writing w/o resp to addr: %s to chrc %s with handle %d",
-		log_strdup(ble_addr), log_strdup(chrc_uuid), handle);
-	LOG_HEXDUMP_DBG(data, data_len, "Data to write");
+	LOG_DBG("Opened %s chrc %s handle %d, mtu %u",
+		log_strdup(ble_addr), log_strdup(chrc_uuid), chan->handle,
+		chan->mtu);
+	return 0;
+}
 
-	err = bt_gatt_write_without_response(conn, handle, data, data_len,
-					     false);
-	return err;
+void ble_chan_close(struct ble_chan *chan)
+{
+	if (chan->conn != NULL) {
+		bt_conn_unref(chan->conn);
+		chan->conn = NULL;
+	}
+}
+
+int ble_chan_read(struct ble_chan *chan)
+{
+	if (chan->conn == NULL) {
+		return -ENOTCONN;
+	}
+	return gatt_read_handle(chan->conn, chan->handle);
+}
+
+int ble_chan_write(struct ble_chan *chan, const uint8_t *data,
+		   uint16_t data_len, bt_gatt_write_func_t cb)
+{
+	if (chan->conn == NULL) {
+		return -ENOTCONN;
+	}
+	return gatt_write_handle(chan, data, data_len, cb ? cb : on_sent,
+				 NULL);
+}
+
+int ble_chan_write_nr(struct ble_chan *chan, const uint8_t *data,
+		      uint16_t data_len, bt_gatt_complete_func_t sent,
+		      void *user_data)
+{
+	if (chan->conn == NULL) {
+		return -ENOTCONN;
+	}
+	if (data_len > (chan->mtu - 3)) {
+		return -EMSGSIZE;
+	}
+	return bt_gatt_write_without_response_cb(chan->conn, chan->handle,
+						 data, data_len, false,
+						 sent, user_data);
 }
 
 static uint8_t on_received(struct bt_conn *conn,
 	struct bt_gatt_subscribe_params *params,
 	const void *data, uint16_t length)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
 	int ret = BT_GATT_ITER_CONTINUE;
+	struct ble_sub *sub = CONTAINER_OF(params, struct ble_sub, params);
 
 	if (!data) {
+		/* unsubscribed, or the link went down */
+		if (sub->releasing) {
+			ble_conn_mgr_free_sub(sub);
+		}
 		return BT_GATT_ITER_STOP;
 	}
 
-	if ((length > 0) && (data != NULL)) {
-
-		bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-		memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-		addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-		bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
-
-		struct rec_data_t tx_data = {
-			.read = false,
-			.length = length
-		};
+	if (length > 0) {
+		enum ble_rx_policy policy = sub->policy;
+		enum ble_rx_priority prio = sub->prio;
+		int err;
 
-		memcpy(&tx_data.addr_trunc, addr_trunc, strlen(addr_trunc));
-		memcpy(&tx_data.data, data, length);
-		memcpy(&tx_data.sub_params, params,
-			sizeof(struct bt_gatt_subscribe_params));
-
-		size_t size = sizeof(struct rec_data_t);
-
-		if (atomic_get(&queued_notifications) >=
-		     NOTIFICATION_QUEUE_LIMIT) {
-			struct rec_data_t *rx_data = k_fifo_get(&rec_fifo,
-								K_NO_WAIT);
-
-			LOG_INF("Dropping oldest message");
-			if (rx_data != NULL) {
-				uint16_t h;
-
-				if (rx_data->read) {
-					h = rx_data->read_params.single.handle;
-				} else  {
-					h = rx_data->sub_params.value_handle;
-				}
-				LOG_INF("Addr %s Handle %d Queued %d",
-					log_strdup(rx_data->addr_trunc),
-					h,
-					atomic_get(&queued_notifications));
-				k_free(rx_data);
-			}
-			atomic_dec(&queued_notifications);
+		if (params->value & BT_GATT_CCC_INDICATE) {
+			err = rec_put(conn, prio, params->value_handle,
+				      REC_FLAG_KEEP, data, length,
+				      BLE_RX_KEEP_ALL);
+		} else if ((policy == BLE_RX_LATEST_ONLY) &&
+			   (length <= REC_LATEST_DATA_LEN)) {
+			err = rec_put_latest(conn, sub, data, length);
+		} else {
+			err = rec_put(conn, prio, params->value_handle, 0,
+				      data, length, policy);
 		}
-
-		char *mem_ptr = k_malloc(size);
-
-		if (mem_ptr == NULL) {
-			LOG_ERR("Out of memory error in on_received(): "
-				"%d queued notifications",
+		if (err) {
+			LOG_DBG("Notification dropped: %d queued notifications",
 				atomic_get(&queued_notifications));
-			ret = BT_GATT_ITER_STOP;
-		} else {
-			atomic_inc(&queued_notifications);
-			memcpy(mem_ptr, &tx_data, size);
-			k_fifo_put(&rec_fifo, mem_ptr);
 		}
 	}
 
 	return ret;
 }
 
-static void send_sub(char *ble_addr, char *path, struct gw_msg *out,
-		     uint8_t *value)
+static void send_sub(char *ble_addr, char *path, uint8_t *value)
+{
+	struct gw_msg *out;
+
+	out = gw_msg_alloc(GW_MSG_EVENT_LEN(sizeof(value)), K_FOREVER);
+	if (out == NULL) {
+		return;
+	}
+	if (!device_descriptor_value_encode(ble_addr,
+					    BT_UUID_GATT_CCC_VAL_STR,
+					    path, value, sizeof(value),
+					    out, true, 0)) {
+		g2c_send(&out->data);
+	}
+	if (!device_value_write_result_encode(ble_addr,
+					      BT_UUID_GATT_CCC_VAL_STR,
+					      path, value, sizeof(value),
+					      out)) {
+		g2c_send(&out->data);
+	}
+	gw_msg_free(out);
+}
+
+/* Drop a subscription; the slot goes back to the pool once the host no
+ * longer holds its params
+ */
+static void sub_release(struct ble_sub *sub, struct bt_conn *conn)
 {
-	k_mutex_lock(&out->lock, K_FOREVER);
-	device_descriptor_value_encode(ble_addr,
-				       BT_UUID_GATT_CCC_VAL_STR,
-				       path, value, sizeof(value),
-				       out, true);
-	g2c_send(&out->data);
-	device_value_write_result_encode(ble_addr,
-					 BT_UUID_GATT_CCC_VAL_STR,
-					 path, value, sizeof(value),
-					 out);
-	g2c_send(&out->data);
-	k_mutex_unlock(&out->lock);
+	sub->value = 0;
+	if (conn != NULL) {
+		sub->releasing = true;
+		/* on success on_received() frees it */
+		if (!bt_gatt_unsubscribe(conn, &sub->params)) {
+			return;
+		}
+		sub->releasing = false;
+	}
+	ble_conn_mgr_free_sub(sub);
 }
 
-int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
+/* Subscribe and place the characteristic in the given receive lane;
+ * BLE_RX_PRIOS leaves an existing subscription's lane unchanged and puts
+ * new ones in bulk
+ */
+int ble_subscribe_prio(char *ble_addr, char *chrc_uuid, uint8_t value_type,
+		       enum ble_rx_priority prio)
 {
 	int err;
 	char path[BT_MAX_PATH_LEN];
 	struct bt_conn *conn = NULL;
 	struct ble_device_conn *connected_ptr;
+	struct ble_sub *sub;
 	uint16_t handle;
-	bool subscribed;
-	uint8_t param_index;
 
 	err = ble_conn_mgr_get_conn_by_addr(ble_addr, &connected_ptr);
 	if (err) {
@@ -743,55 +1407,44 @@ int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
 		return -ENOLINK;
 	}
 
-	ble_conn_mgr_get_handle_by_uuid(&handle, chrc_uuid, connected_ptr);
+	if (ble_conn_mgr_get_handle_by_uuid(&handle, chrc_uuid,
+					    connected_ptr)) {
+		return -ENOENT;
+	}
 
-	ble_conn_mgr_get_subscribed(handle, connected_ptr, &subscribed,
-				    &param_index);
+	sub = ble_conn_mgr_get_sub(connected_ptr, handle);
+	if ((sub != NULL) && sub->releasing) {
+		return -EBUSY;
+	}
 
 	if (connected_ptr->connected) {
-		conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &connected_ptr->bt_addr);
+		conn = ble_conn_mgr_get_bt_conn(connected_ptr);
 		if (conn == NULL) {
-			/* work around strange error on Flic button --
-			 * type changes when it should not
-			 */
-			connected_ptr->bt_addr.type = 0;
-			conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &connected_ptr->bt_addr);
-			if (conn == NULL) {
-				LOG_ERR("Null Conn object");
-				err = -EINVAL;
-				goto end;
-			}
+			LOG_ERR("Null Conn object");
+			err = -EINVAL;
+			goto end;
 		}
 	}
 
 	err = ble_conn_mgr_generate_path(connected_ptr, handle, path, true);
 	if (err) {
-		return err;
+		goto end;
 	}
 
-	if (subscribed && (value_type == 0)) {
+	if ((sub != NULL) && (value_type == 0)) {
 		/* If subscribed then unsubscribe. */
-		if (conn != NULL) {
-			bt_gatt_unsubscribe(conn, &sub_param[param_index]);
-		}
-		ble_conn_mgr_remove_subscribed(handle, connected_ptr);
+		sub_release(sub, conn);
 
 		uint8_t value[2] = {0, 0};
 
 		if (connected_ptr && connected_ptr->hidden) {
 			LOG_DBG("suppressing value_changed");
 		} else {
-			send_sub(ble_addr, path, &output, value);
+			send_sub(ble_addr, path, value);
 		}
 		LOG_INF("Unsubscribe: Addr %s Handle %d",
 			log_strdup(ble_addr), handle);
-
-		sub_value[param_index] = 0;
-		sub_conn[param_index] = NULL;
-		if (curr_subs) {
-			curr_subs--;
-		}
-	} else if (subscribed && (value_type != 0)) {
+	} else if ((sub != NULL) && (value_type != 0)) {
 		uint8_t value[2] = {
 			value_type,
 			0
@@ -800,7 +1453,10 @@ int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
 		if (connected_ptr && connected_ptr->hidden) {
 			LOG_DBG("suppressing value_changed");
 		} else {
-			send_sub(ble_addr, path, &output, value);
+			send_sub(ble_addr, path, value);
+		}
+		if (prio < BLE_RX_PRIOS) {
+			sub->prio = prio;
 		}
 		LOG_INF("Subscribe Dup: Addr %s Handle %d %s",
 			log_strdup(ble_addr), handle,
@@ -810,22 +1466,25 @@ int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
 	} else if (value_type == 0) {
 		LOG_DBG("Unsubscribe N/A: Addr %s Handle %d",
 			log_strdup(ble_addr), handle);
-	} else if (curr_subs < SUBSCRIPTION_LIMIT) {
+	} else if ((sub = ble_conn_mgr_alloc_sub(connected_ptr,
+						  handle)) != NULL) {
+		sub->params.notify = on_received;
+		sub->params.value = value_type;
+		sub->params.ccc_handle = handle + 1;
+		sub->value = value_type;
+		sub->policy = CONFIG_GATEWAY_BLE_RX_POLICY;
+		sub->prio = (prio < BLE_RX_PRIOS) ? prio : BLE_RX_PRIO_BULK;
+		/* when not connected, ble_subscribe_device() subscribes on
+		 * the next connection
+		 */
 		if (conn != NULL) {
-			sub_param[next_sub_index].notify = on_received;
-			sub_param[next_sub_index].value = value_type;
-			sub_param[next_sub_index].value_handle = handle;
-			sub_param[next_sub_index].ccc_handle = handle + 1;
-			sub_value[next_sub_index] = value_type;
-			sub_conn[next_sub_index] = conn;
-			err = bt_gatt_subscribe(conn, &sub_param[next_sub_index]);
+			err = bt_gatt_subscribe(conn, &sub->params);
 			if (err) {
 				LOG_ERR("Subscribe failed (err %d)", err);
+				ble_conn_mgr_free_sub(sub);
 				goto end;
 			}
 		}
-		ble_conn_mgr_set_subscribed(handle, next_sub_index,
-					    connected_ptr);
 
 		uint8_t value[2] = {
 			value_type,
@@ -835,26 +1494,30 @@ int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
 		if (connected_ptr && connected_ptr->hidden) {
 			LOG_DBG("suppressing value_changed");
 		} else {
-			send_sub(ble_addr, path, &output, value);
+			send_sub(ble_addr, path, value);
 		}
-		LOG_INF("Subscribe: Addr %s Handle %d %s",
+		LOG_INF("Subscribe: Addr %s Handle %d %s (%u for device, "
+			"%d total)",
 			log_strdup(ble_addr), handle,
 			(value_type == BT_GATT_CCC_NOTIFY) ?
-			"Notify" : "Indicate");
-
-		curr_subs++;
-		next_sub_index++;
+			"Notify" : "Indicate", connected_ptr->num_subs,
+			ble_conn_mgr_num_subs());
 	} else {
+		struct gw_msg *out;
 		char msg[64];
 
 		sprintf(msg, "Reached subscription limit of %d",
-			SUBSCRIPTION_LIMIT);
+			CONFIG_GATEWAY_BLE_SUBSCRIPTIONS);
+		err = -ENOMEM;
 
 		/* Send error when limit is reached. */
-		k_mutex_lock(&output.lock, K_FOREVER);
-		device_error_encode(ble_addr, msg, &output);
-		g2c_send(&output.data);
-		k_mutex_unlock(&output.lock);
+		out = gw_msg_alloc(GW_MSG_EVENT_LEN(0), K_FOREVER);
+		if (out != NULL) {
+			if (!device_error_encode(ble_addr, msg, out)) {
+				g2c_send(&out->data);
+			}
+			gw_msg_free(out);
+		}
 	}
 
 end:
@@ -864,6 +1527,85 @@ end:
 	return err;
 }
 
+static struct ble_sub *find_sub(char *ble_addr, uint16_t handle)
+{
+	struct ble_device_conn *connected_ptr;
+
+	if (ble_conn_mgr_get_conn_by_addr(ble_addr, &connected_ptr)) {
+		return NULL;
+	}
+	return ble_conn_mgr_get_sub(connected_ptr, handle);
+}
+
+int ble_set_rx_policy(char *ble_addr, uint16_t handle,
+		      enum ble_rx_policy policy)
+{
+	struct ble_sub *sub;
+
+	if (policy >= BLE_RX_POLICIES) {
+		return -EINVAL;
+	}
+
+	sub = find_sub(ble_addr, handle);
+	if (sub == NULL) {
+		return -ENOENT;
+	}
+
+	LOG_INF("Addr %s Handle %d policy %d", log_strdup(ble_addr), handle,
+		policy);
+	sub->policy = policy;
+	return 0;
+}
+
+int ble_get_rx_policy(uint8_t sub_index, enum ble_rx_policy *policy)
+{
+	struct ble_sub *sub = ble_conn_mgr_get_sub_by_index(sub_index);
+
+	if ((sub == NULL) || (sub->dev == NULL)) {
+		return -EINVAL;
+	}
+	*policy = sub->policy;
+	return 0;
+}
+
+int ble_set_rx_priority(char *ble_addr, uint16_t handle,
+			enum ble_rx_priority prio)
+{
+	struct ble_sub *sub;
+
+	if (prio >= BLE_RX_PRIOS) {
+		return -EINVAL;
+	}
+
+	sub = find_sub(ble_addr, handle);
+	if (sub == NULL) {
+		return -ENOENT;
+	}
+
+	LOG_INF("Addr %s Handle %d priority %d", log_strdup(ble_addr), handle,
+		prio);
+	/* a coalesced value already queued stays in its old lane */
+	sub->prio = prio;
+	return 0;
+}
+
+int ble_get_rx_priority(uint8_t sub_index, enum ble_rx_priority *prio)
+{
+	struct ble_sub *sub = ble_conn_mgr_get_sub_by_index(sub_index);
+
+	if ((sub == NULL) || (sub->dev == NULL)) {
+		return -EINVAL;
+	}
+	*prio = sub->prio;
+	return 0;
+}
+
+int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type)
+{
+	return ble_subscribe_prio(ble_addr, chrc_uuid, value_type,
+				  BLE_RX_PRIOS);
+}
+
 int ble_subscribe_handle(char *ble_addr, uint16_t handle, uint8_t value_type)
 {
 	char uuid[BT_UUID_STR_LEN];
@@ -897,10 +1639,7 @@ int ble_subscribe_all(char *ble_addr, uint8_t value_type)
 	}
 
 	for (i = 0; i < conn_ptr->num_pairs; i++) {
-		up = conn_ptr->uuid_handle_pairs[i];
-		if (up == NULL) {
-			continue;
-		}
+		up = &conn_ptr->uuid_handle_pairs[i];
 		if ((up->properties & BT_GATT_CHRC_NOTIFY) !=
 		    BT_GATT_CHRC_NOTIFY) {
 			continue;
@@ -916,118 +1655,123 @@ int ble_subscribe_all(char *ble_addr, uint8_t value_type)
 
 int ble_subscribe_device(struct bt_conn *conn, bool subscribe)
 {
-	uint16_t handle;
-	int i;
-	int count = 0;
 	struct ble_device_conn *connected_ptr;
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
+	struct ble_sub *sub;
+	int count = 0;
 	int err;
 
 	if (conn == NULL) {
 		return -EINVAL;
 	}
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
 
-	err = ble_conn_mgr_get_conn_by_addr(addr_trunc, &connected_ptr);
-	if (err) {
-		LOG_ERR("Connection not found for addr %s", log_strdup(addr_trunc));
+	connected_ptr = ble_conn_mgr_get_conn_by_bt_conn(conn);
+	if (connected_ptr == NULL) {
+		LOG_ERR("Connection not found for conn %u",
+			bt_conn_index(conn));
 		return -EINVAL;
 	}
 
-	for (i = 0; i < BT_MAX_SUBSCRIBES; i++) {
-		if (conn == sub_conn[i]) {
-			handle = sub_param[i].value_handle;
-			if (subscribe && sub_value[i]) {
-				sub_param[i].value = sub_value[i];
-				bt_gatt_subscribe(conn, &sub_param[i]);
-				ble_conn_mgr_set_subscribed(handle, i,
-							    connected_ptr);
-				LOG_INF("Subscribe: Addr %s Handle %d Idx %d",
-					log_strdup(addr_trunc), handle, i);
-				count++;
-			} else {
-				bt_gatt_unsubscribe(conn, &sub_param[i]);
-				ble_conn_mgr_remove_subscribed(handle,
-							       connected_ptr);
-				sub_conn[i] = NULL;
-				if (curr_subs) {
-					curr_subs--;
-				}
-				LOG_INF("Unsubscribe: Addr %s Handle %d Idx %d",
-					log_strdup(addr_trunc), handle, i);
-				count++;
-			}
+	if (!subscribe) {
+		count = connected_ptr->num_subs;
+		ble_release_subscriptions(connected_ptr);
+		LOG_INF("Unsubscribed %d handles on %s", count,
+			log_strdup(connected_ptr->addr));
+		return 0;
+	}
+
+	/* the host forgets subscriptions when the link drops */
+	for (int i = 0; (sub = ble_conn_mgr_get_sub_by_index(i)) != NULL;
+	     i++) {
+		if ((sub->dev != connected_ptr) || !sub->value ||
+		    sub->releasing) {
+			continue;
+		}
+		sub->params.value = sub->value;
+		err = bt_gatt_subscribe(conn, &sub->params);
+		if (err && (err != -EALREADY)) {
+			LOG_ERR("Resubscribe of handle %u failed: %d",
+				sub->params.value_handle, err);
+			continue;
 		}
+		LOG_INF("Subscribe: Addr %s Handle %d Idx %d",
+			log_strdup(connected_ptr->addr),
+			sub->params.value_handle, i);
+		count++;
 	}
 	LOG_INF("Subscriptions changed for %d handles", count);
 	return 0;
 }
 
-static struct bt_gatt_dm_cb discovery_cb = {
-	.completed = discovery_completed,
-	.service_not_found = discovery_service_not_found,
-	.error_found = discovery_error_found,
-};
+void ble_release_subscriptions(struct ble_device_conn *conn_ptr)
+{
+	struct bt_conn *conn = conn_ptr->connected ?
+			       ble_conn_mgr_get_bt_conn(conn_ptr) : NULL;
+	struct ble_sub *sub;
+
+	for (int i = 0; (sub = ble_conn_mgr_get_sub_by_index(i)) != NULL;
+	     i++) {
+		if ((sub->dev == conn_ptr) && !sub->releasing) {
+			sub_release(sub, conn);
+		}
+	}
+	if (conn != NULL) {
+		bt_conn_unref(conn);
+	}
+}
 
+/* Start discovering connection_ptr's attributes. On 0 the outcome is
+ * posted to the connection manager as BLE_CONN_EVT_DISCOVERED or
+ * BLE_CONN_EVT_DISCOVERY_FAILED; -EBUSY means no session is free yet.
+ */
 int ble_discover(struct ble_device_conn *connection_ptr)
 {
-	int err;
+	int err = 0;
 	char *ble_addr = connection_ptr->addr;
 	struct bt_conn *conn = NULL;
 
 	LOG_INF("Discovering: %s\n", log_strdup(ble_addr));
 
-	if (!discover_in_progress) {
+	conn = ble_conn_mgr_get_bt_conn(connection_ptr);
+	if (conn == NULL) {
+		LOG_DBG("ERROR: Null Conn object");
+		return -EINVAL;
+	}
 
-		conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &connection_ptr->bt_addr);
-		if (conn == NULL) {
-			LOG_DBG("ERROR: Null Conn object");
-			return -EINVAL;
+	if (!connection_ptr->discovered) {
+#if defined(CONFIG_GATEWAY_GATT_CACHE)
+		/* after a reboot, try the table stored last time */
+		if (!connection_ptr->num_pairs) {
+			(void)gatt_cache_restore(connection_ptr);
 		}
-
-		if (!connection_ptr->discovered) {
-			if (connection_ptr->num_pairs) {
-				LOG_INF("Marking device as discovered; "
-					"num pairs = %u",
-					connection_ptr->num_pairs);
-				connection_ptr->discovering = false;
-				connection_ptr->discovered = true;
-				connection_ptr->encode_discovered = true;
-				bt_conn_unref(conn);
-				return 0;
-			}
-			discover_in_progress = true;
-			connection_ptr->discovering = true;
-
-			for (int i = 1; i < 3; i++) {
-				if (i > 1) {
-					LOG_INF("Retrying...");
-				}
-				err = bt_gatt_dm_start(conn, NULL, &discovery_cb, NULL);
-				if (!err) {
-					break;
-				}
-				LOG_WRN("Service discovery err %d", err);
-				k_sleep(K_MSEC(500));
-			}
-			if (err) {
-				LOG_ERR("Aborting discovery.  Disconnecting from device...");
-				connection_ptr->discovering = false;
-				discover_in_progress = false;
-				bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-				bt_conn_unref(conn);
-				ble_conn_set_connected(connection_ptr, false);
-				return err;
+#endif
+		if (connection_ptr->num_pairs) {
+			LOG_INF("Marking device as discovered; "
+				"num pairs = %u",
+				connection_ptr->num_pairs);
+			if (connection_ptr->attr_index == NULL) {
+				(void)ble_conn_mgr_build_attr_index(
+						connection_ptr);
 			}
-		} else {
-			connection_ptr->encode_discovered = true;
+			connection_ptr->discovered = true;
+			ble_conn_mgr_post(connection_ptr,
+					  BLE_CONN_EVT_DISCOVERED);
+			bt_conn_unref(conn);
+			return 0;
+		}
+
+		err = gatt_discovery_start(conn, discovery_done);
+		if (err == -EBUSY) {
+			LOG_DBG("No discovery session free for %s",
+				log_strdup(ble_addr));
+		} else if (err && (err != -EALREADY)) {
+			LOG_ERR("Aborting discovery.  Disconnecting from device...");
+			bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+			bt_conn_unref(conn);
+			ble_conn_set_connected(connection_ptr, false);
+			return err;
 		}
 	} else {
-		return -EBUSY;
+		ble_conn_mgr_post(connection_ptr, BLE_CONN_EVT_DISCOVERED);
 	}
 
 	bt_conn_unref(conn);
@@ -1070,59 +1814,73 @@ int disconnect_device_by_addr(char *ble_addr)
 
 int set_shadow_modem(void *modem)
 {
+	struct gw_msg *out;
 	int err;
 
-	k_mutex_lock(&output.lock, K_FOREVER);
-	err = gateway_shadow_data_encode(modem, &output);
+	out = gw_msg_alloc(CONFIG_GATEWAY_MSG_LARGE_SIZE, K_FOREVER);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
+	err = gateway_shadow_data_encode(modem, out);
 	if (!err) {
-		err = gw_shadow_publish(&output.data);
+		err = gw_shadow_publish(&out->data);
 		if (err) {
 			LOG_ERR("nrf_cloud_gw_shadow_publish() failed %d", err);
 		}
 	} else {
 		LOG_ERR("gateway_shadow_data_encode() failed %d", err);
 	}
-	k_mutex_unlock(&output.lock);
+	gw_msg_free(out);
 	return err;
 }
 
 int set_shadow_ble_conn(char *ble_address, bool connecting, bool connected)
 {
+	struct gw_msg *out;
 	int err;
 
 	LOG_DBG("Connecting=%u, connected=%u", connecting, connected);
-	k_mutex_lock(&output.lock, K_FOREVER);
+	out = gw_msg_alloc(GW_MSG_EVENT_LEN(0), K_FOREVER);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
 	err = device_shadow_data_encode(ble_address, connecting, connected,
-					&output);
+					out);
 	if (!err) {
-		err = gw_shadow_publish(&output.data);
+		err = gw_shadow_publish(&out->data);
 		if (err) {
 			LOG_ERR("nrf_cloud_gw_shadow_publish() failed %d", err);
 		}
 	} else {
 		LOG_ERR("device_shadow_data_encode() failed %d", err);
 	}
-	k_mutex_unlock(&output.lock);
+	gw_msg_free(out);
 	return err;
 }
 
 int set_shadow_desired_conn(struct desired_conn *desired, int num_desired)
 {
+	struct gw_msg *out;
 	int err;
 
-	k_mutex_lock(&output.lock, K_FOREVER);
+	/* each entry is at most {"id":"<addr>"}, */
+	out = gw_msg_alloc(64 + num_desired * (BT_ADDR_STR_LEN + 10),
+			   K_FOREVER);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
 	err = gateway_desired_list_encode(desired,
 					  num_desired,
-					  &output);
+					  out);
 	if (!err) {
-		err = gw_shadow_publish(&output.data);
+		err = gw_shadow_publish(&out->data);
 		if (err) {
 			LOG_ERR("nrf_cloud_gw_shadow_publish() failed %d", err);
 		}
 	} else {
 		LOG_ERR("nrf_cloud_encode_gateway_desired_list() failed %d", err);
 	}
-	k_mutex_unlock(&output.lock);
+	gw_msg_free(out);
 
 	return err;
 }
@@ -1167,48 +1925,58 @@ K_TIMER_DEFINE(auto_conn_start_timer, auto_conn_start_timer_handler, NULL);
 static void connected(struct bt_conn *conn, uint8_t conn_err)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_trunc[BT_ADDR_STR_LEN];
-	struct ble_device_conn *connection_ptr;
+	char *addr_trunc;
+	struct ble_device_conn *connection_ptr = NULL;
 	int err;
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
-	err = ble_conn_mgr_get_conn_by_addr(addr_trunc, &connection_ptr);
+	err = ble_conn_mgr_get_conn_by_bt_addr(bt_conn_get_dst(conn),
+					       &connection_ptr);
 	if (err) {
-		LOG_ERR("Connection not found for addr %s", log_strdup(addr_trunc));
+		bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+		LOG_ERR("Connection not found for addr %s", log_strdup(addr));
+		bt_conn_unref(conn);
+		return;
 	}
-	if (conn_err || err) {
-		LOG_ERR("Failed to connect to %s (%u)", log_strdup(addr),
+	addr_trunc = connection_ptr->addr;
+
+	if (conn_err) {
+		LOG_ERR("Failed to connect to %s (%u)", log_strdup(addr_trunc),
 			conn_err);
-		if (connection_ptr) {
-			ble_conn_set_connected(connection_ptr, false);
-		}
+		ble_conn_set_connected(connection_ptr, false);
 		bt_conn_unref(conn);
 		return;
 	}
 
+	ble_conn_mgr_bind_conn(connection_ptr, conn);
+	rec_conn_gen[bt_conn_index(conn)]++;
+	strcpy(rec_conn_addr[bt_conn_index(conn)], addr_trunc);
+	atomic_set(&rec_conn_coalesced[bt_conn_index(conn)], 0);
+	atomic_set(&rec_conn_dropped[bt_conn_index(conn)], 0);
+
 	if (connection_ptr && connection_ptr->hidden) {
 		LOG_DBG("suppressing device_connect");
 	} else {
-		k_mutex_lock(&output.lock, K_FOREVER);
-		device_connect_result_encode(addr_trunc, true, &output);
-		g2c_send(&output.data);
-		k_mutex_unlock(&output.lock);
+		struct gw_msg *out = gw_msg_alloc(GW_MSG_EVENT_LEN(0),
+						  K_FOREVER);
+
+		if (out != NULL) {
+			if (!device_connect_result_encode(addr_trunc, true,
+							  out)) {
+				g2c_send(&out->data);
+			}
+			gw_msg_free(out);
+		}
 	}
 
 	if (!connection_ptr->connected) {
-		LOG_INF("Connected: %s", log_strdup(addr));
+		LOG_INF("Connected: %s", log_strdup(addr_trunc));
 		if (!connection_ptr->hidden) {
 			set_shadow_ble_conn(addr_trunc, false, true);
 		}
 		ble_conn_set_connected(connection_ptr, true);
 		ble_subscribe_device(conn, true);
 	} else {
-		LOG_INF("Reconnected: %s", log_strdup(addr));
+		LOG_INF("Reconnected: %s", log_strdup(addr_trunc));
 	}
 	if (connection_ptr->added_to_allowlist) {
 		if (!ble_add_to_allowlist(addr_trunc, false)) {
@@ -1226,32 +1994,44 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
 	char addr_trunc[BT_ADDR_STR_LEN];
-	struct ble_device_conn *connection_ptr = NULL;
-
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-	memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
-	addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
-
-	bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
+	struct ble_device_conn *connection_ptr;
 
-	ble_conn_mgr_get_conn_by_addr(addr_trunc, &connection_ptr);
+	connection_ptr = ble_conn_mgr_get_conn_by_bt_conn(conn);
+	if (connection_ptr == NULL) {
+		(void)ble_conn_mgr_get_conn_by_bt_addr(bt_conn_get_dst(conn),
+						       &connection_ptr);
+	}
+	ble_conn_mgr_unbind_conn(conn);
+	if (connection_ptr != NULL) {
+		strcpy(addr_trunc, connection_ptr->addr);
+	} else {
+		bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+		memcpy(addr_trunc, addr, BT_ADDR_LE_DEVICE_LEN);
+		addr_trunc[BT_ADDR_LE_DEVICE_LEN] = 0;
+		bt_to_upper(addr_trunc, BT_ADDR_LE_STR_LEN);
+	}
 
 	if (!ble_conn_mgr_is_desired(addr_trunc)) {
 		LOG_INF("suppressing device_disconnect");
 	} else {
-		k_mutex_lock(&output.lock, K_FOREVER);
-		device_disconnect_result_encode(addr_trunc, false, &output);
-		g2c_send(&output.data);
-		k_mutex_unlock(&output.lock);
+		struct gw_msg *out = gw_msg_alloc(GW_MSG_EVENT_LEN(0),
+						  K_FOREVER);
+
+		if (out != NULL) {
+			if (!device_disconnect_result_encode(addr_trunc, false,
+							     out)) {
+				g2c_send(&out->data);
+			}
+			gw_msg_free(out);
+		}
 	}
 
 	/* if device disconnected on purpose, don't bother updating
 	 * shadow; it will likely reconnect shortly
 	 */
 	if (reason != BT_HCI_ERR_REMOTE_USER_TERM_CONN) {
-		LOG_INF("Disconnected: %s (reason 0x%02x)", log_strdup(addr),
-			reason);
+		LOG_INF("Disconnected: %s (reason 0x%02x)",
+			log_strdup(addr_trunc), reason);
 		if (connection_ptr && !connection_ptr->hidden) {
 			(void)set_shadow_ble_conn(addr_trunc, false, false);
 		}
@@ -1299,12 +2079,18 @@ static bool data_cb(struct bt_data *data, void *user_data)
 
 void ble_device_found_enc_handler(struct k_work *work)
 {
+	struct gw_msg *out;
+
 	LOG_DBG("Encoding scan...");
-	k_mutex_lock(&output.lock, K_FOREVER);
-	device_found_encode(num_devices_found, &output);
-	LOG_DBG("Sending scan...");
-	g2c_send(&output.data);
-	k_mutex_unlock(&output.lock);
+	out = gw_msg_alloc(CONFIG_GATEWAY_MSG_LARGE_SIZE, K_FOREVER);
+	if (out == NULL) {
+		return;
+	}
+	if (!device_found_encode(num_devices_found, out)) {
+		LOG_DBG("Sending scan...");
+		g2c_send(&out->data);
+	}
+	gw_msg_free(out);
 }
 
 K_WORK_DEFINE(ble_device_encode_work, ble_device_found_enc_handler);
@@ -1454,6 +2240,9 @@ void ble_stop_activity(void)
 {
 	int err;
 
+	LOG_INF("Stop forwarding...");
+	k_poll_signal_raise(&rec_signal, 0);
+
 	LOG_INF("Stop scan...");
 	err = bt_le_scan_stop();
 	if (err) {
@@ -1494,15 +2283,26 @@ int device_discovery_send(struct ble_device_conn *conn_ptr)
 		LOG_DBG("suppressing device_discovery_send");
 		return 0;
 	}
-	k_mutex_lock(&output.lock, K_FOREVER);
-	int ret = device_discovery_encode(conn_ptr, &output);
+	struct gw_msg *out;
+	int ret;
+
+	/* measure first so small devices need not hold the large buffer */
+	ret = device_discovery_len(conn_ptr);
+	if (ret < 0) {
+		return ret;
+	}
+	out = gw_msg_alloc(ret + 1, K_FOREVER);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = device_discovery_encode(conn_ptr, out);
 
 	if (!ret) {
-		LOG_INF("Sending discovery; JSON Size: %d", output.data.len);
-		g2c_send(&output.data);
+		LOG_INF("Sending discovery; JSON Size: %d", out->data.len);
+		g2c_send(&out->data);
 	}
-	memset((char *)output.data.ptr, 0, output.data.len);
-	k_mutex_unlock(&output.lock);
+	gw_msg_free(out);
 
 	return ret;
 }
@@ -1523,7 +2323,7 @@ void scan_start(bool print)
 		.window   = 0x0010,
 	};
 
-	if (!discover_in_progress) {
+	if (!gatt_discovery_active()) {
 		/* Stop the auto connect */
 		bt_conn_create_auto_stop();
 
@@ -1545,11 +2345,6 @@ void scan_start(bool print)
 	}
 }
 
-void ble_clear_discover_inprogress()
-{
-	discover_in_progress = false;
-}
-
 static void ble_ready(int err)
 {
 	LOG_INF("Bluetooth ready");
@@ -1562,8 +2357,8 @@ int ble_init(void)
 	int err;
 
 	LOG_INF("Initializing Bluetooth..");
-	k_mutex_init(&output.lock);
 
+	gatt_ops_init();
 	err = bt_enable(ble_ready);
 	if (err) {
 		LOG_ERR("Bluetooth init failed (err %d)", err);
@@ -21,7 +21,6 @@
 
 #define NAME_LEN 30
 #define UUID_STR_LEN 37
-#define BT_MAX_SUBSCRIBES 25
 
 struct ble_scanned_dev {
 	int rssi;
@@ -30,6 +29,89 @@ struct ble_scanned_dev {
 	char addr[18];
 };
 
+/* How notifications on a subscribed characteristic are queued */
+enum ble_rx_policy {
+	BLE_RX_KEEP_ALL,	/* queue every value, drop oldest when full */
+	BLE_RX_LATEST_ONLY,	/* overwrite a value still waiting to be sent */
+	BLE_RX_DROP_NEW,	/* drop new values when full */
+	BLE_RX_POLICIES
+};
+
+/* Receive lanes, served in this order; bulk value changed events are
+ * the only ones batched
+ */
+enum ble_rx_priority {
+	BLE_RX_PRIO_CONTROL,
+	BLE_RX_PRIO_ALARM,
+	BLE_RX_PRIO_BULK,
+	BLE_RX_PRIOS
+};
+
+struct ble_rec_lane_stats {
+	uint32_t size;
+	uint32_t free;
+	uint32_t max_used;
+	uint32_t queued;
+	uint32_t max_queued;
+	uint32_t sent;
+	uint32_t latency_avg_us;
+	uint32_t latency_max_us;
+};
+
+struct ble_rec_stats {
+	struct ble_rec_lane_stats lanes[BLE_RX_PRIOS];
+	uint32_t queued;
+	uint32_t exhausted;
+	uint32_t dropped;
+	uint32_t coalesced;
+	uint32_t wakeups;
+	uint32_t max_drained;
+	uint32_t sent;
+	uint32_t latency_min_us;
+	uint32_t latency_avg_us;
+	uint32_t latency_max_us;
+};
+
+/* Limits on coalescing value changed events into one cloud message;
+ * max_bytes only applies to the global policy
+ */
+struct ble_batch_policy {
+	uint16_t max_bytes;
+	uint16_t max_count;
+	uint32_t max_latency_ms;
+};
+
+enum ble_batch_flush_reason {
+	BLE_BATCH_FLUSH_BYTES,
+	BLE_BATCH_FLUSH_COUNT,
+	BLE_BATCH_FLUSH_DEADLINE,
+	BLE_BATCH_FLUSH_OTHER,
+	BLE_BATCH_FLUSH_REASONS
+};
+
+struct ble_batch_stats {
+	uint32_t batches;
+	uint32_t events;
+	uint32_t bytes;
+	uint32_t max_events;
+	uint32_t max_bytes;
+	uint32_t flushes[BLE_BATCH_FLUSH_REASONS];
+	/* batches g2c_send() refused, and the events lost with them */
+	uint32_t failed;
+	uint32_t failed_events;
+};
+
+/* A characteristic resolved once, for repeated access without looking
+ * the device and handle up each time; see ble_chan_open()
+ */
+struct ble_chan {
+	/* referenced until ble_chan_close(); NULL when closed */
+	struct bt_conn *conn;
+	uint16_t handle;
+	/* ATT MTU when opened */
+	uint16_t mtu;
+};
+
 struct ble_device_conn;
 struct desired_conn;
 
@@ -40,19 +122,60 @@ int ble_init(void);
 int ble_add_to_allowlist(char *addr_str, bool add);
 void scan_start(bool print_scan);
 void ble_register_notify_callback(notification_cb_t callback);
+void ble_get_rec_stats(struct ble_rec_stats *stats);
+int ble_get_conn_rx_stats(const char *ble_addr, uint32_t *coalesced,
+			  uint32_t *dropped);
+int ble_set_rx_policy(char *ble_addr, uint16_t handle,
+		      enum ble_rx_policy policy);
+int ble_get_rx_policy(uint8_t sub_index, enum ble_rx_policy *policy);
+int ble_set_rx_priority(char *ble_addr, uint16_t handle,
+			enum ble_rx_priority prio);
+int ble_get_rx_priority(uint8_t sub_index, enum ble_rx_priority *prio);
+int ble_batch_set_policy(const char *ble_addr,
+			 const struct ble_batch_policy *policy);
+void ble_batch_clear_device_policies(void);
+void ble_get_batch_stats(struct ble_batch_stats *stats);
 int ble_subscribe(char *ble_addr, char *chrc_uuid, uint8_t value_type);
+int ble_subscribe_prio(char *ble_addr, char *chrc_uuid, uint8_t value_type,
+		       enum ble_rx_priority prio);
 int ble_subscribe_handle(char *ble_addr, uint16_t handle, uint8_t value_type);
 int ble_subscribe_all(char *ble_addr, uint8_t value_type);
+/** Unsubscribe everything conn_ptr holds and return it to the pool */
+void ble_release_subscriptions(struct ble_device_conn *conn_ptr);
 int gatt_read(char *ble_addr, char *chrc_uuid, bool ccc);
 int gatt_write(const char *ble_addr, const char *chrc_uuid, uint8_t *data,
 	       uint16_t data_len, bt_gatt_write_func_t cb);
-int gatt_write_without_response(char *ble_addr, char *chrc_uuid, uint8_t *data,
-				uint16_t data_len);
+/** Queue a write and send its result, or an error, to the cloud once the
+ * device answers
+ */
+int gatt_write_report(const char *ble_addr, const char *chrc_uuid,
+		      const uint8_t *data, uint16_t data_len);
+/** Resolve chrc_uuid, a uuid or service/characteristic path, on the
+ * connected device at ble_addr. The channel stays usable until closed,
+ * though requests fail once the link is down.
+ */
+int ble_chan_open(struct ble_chan *chan, const char *ble_addr,
+		  const char *chrc_uuid);
+void ble_chan_close(struct ble_chan *chan);
+static inline bool ble_chan_is_open(const struct ble_chan *chan)
+{
+	return chan->conn != NULL;
+}
+/** Queue a read; the value goes to the cloud as with gatt_read() */
+int ble_chan_read(struct ble_chan *chan);
+/** Queue a write; cb, if set, gets the response from the receive thread */
+int ble_chan_write(struct ble_chan *chan, const uint8_t *data,
+		   uint16_t data_len, bt_gatt_write_func_t cb);
+/** Write without response, at most mtu - 3 bytes; sent, if set, is called
+ * once the packet has gone out
+ */
+int ble_chan_write_nr(struct ble_chan *chan, const uint8_t *data,
+		      uint16_t data_len, bt_gatt_complete_func_t sent,
+		      void *user_data);
 int ble_discover(struct ble_device_conn *conn_ptr);
 void bt_uuid_get_str(const struct bt_uuid *uuid, char *str, size_t len);
 void bt_to_upper(char *addr, uint8_t addr_len);
 int disconnect_device_by_addr(char *ble_addr);
-void ble_clear_discover_inprogress();
 int device_discovery_send(struct ble_device_conn *conn_ptr);
 struct ble_scanned_dev *get_scanned_device(unsigned int i);
 int get_num_scan_results(void);
@@ -24,17 +24,39 @@
 #include "nrf_cloud_mem.h"
 #include "nrf_cloud_transport.h"
 
-#define MAX_SERVICE_BUF_SIZE 300
-
 #include <logging/log.h>
 LOG_MODULE_REGISTER(ble_codec, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
 
-extern struct ble_scanned_dev ble_scanned_devices[MAX_SCAN_RESULTS];
-
-static char service_buffer[MAX_SERVICE_BUF_SIZE];
+#define GW_MSG_BLOCK_SIZE(len) ROUND_UP(sizeof(struct gw_msg) + (len), 4)
+
+K_MEM_SLAB_DEFINE(gw_msg_small_slab,
+		  GW_MSG_BLOCK_SIZE(CONFIG_GATEWAY_MSG_SMALL_SIZE),
+		  CONFIG_GATEWAY_MSG_SMALL_COUNT, 4);
+K_MEM_SLAB_DEFINE(gw_msg_large_slab,
+		  GW_MSG_BLOCK_SIZE(CONFIG_GATEWAY_MSG_LARGE_SIZE), 1, 4);
+
+struct gw_msg_pool {
+	struct k_mem_slab *slab;
+	uint32_t size;
+	uint32_t count;
+	atomic_t in_use;
+	atomic_t max_in_use;
+	atomic_t waits;
+};
+
+static struct gw_msg_pool gw_msg_pools[GW_MSG_POOLS] = {
+	[GW_MSG_POOL_SMALL] = {
+		.slab = &gw_msg_small_slab,
+		.size = CONFIG_GATEWAY_MSG_SMALL_SIZE,
+		.count = CONFIG_GATEWAY_MSG_SMALL_COUNT
+	},
+	[GW_MSG_POOL_LARGE] = {
+		.slab = &gw_msg_large_slab,
+		.size = CONFIG_GATEWAY_MSG_LARGE_SIZE,
+		.count = 1
+	}
+};
 
-static bool first_service = true;
-static bool first_chrc = true;
 static bool desired_conns_strings = false;
 
 /* define macros to enable memory allocation error checking and
@@ -111,535 +133,72 @@ static bool desired_conns_strings = false;
 } while (0)
 
 
-char *get_time_str(char *dst, size_t len)
+/* Take a buffer that can hold len bytes from the smallest pool that fits */
+struct gw_msg *gw_msg_alloc(size_t len, k_timeout_t timeout)
 {
-	int64_t unix_time_ms;
-	int err;
-
-#ifdef CONFIG_DATE_TIME
-	err = date_time_now(&unix_time_ms);
-	if (!err) {
-		time_t unix_time;
-		struct tm *time;
-
-		unix_time = unix_time_ms / MSEC_PER_SEC;
-		LOG_DBG("Unix time %lld", unix_time);
-		time = gmtime(&unix_time);
-		if (time) {
-			/* 2020-02-19T18:38:50.363Z */
-			strftime(dst, len, "%Y-%m-%dT%H:%M:%S.000Z", time);
-			LOG_DBG("Date/time %s", log_strdup(dst));
-		} else {
-			LOG_WRN("Time not valid");
-			dst = NULL;
+	struct gw_msg_pool *pool;
+	struct gw_msg *msg;
+	atomic_val_t in_use;
+	atomic_val_t max;
+	void *block;
+	int id;
+
+	for (id = 0; id < GW_MSG_POOLS; id++) {
+		if (len <= gw_msg_pools[id].size) {
+			break;
 		}
-	} else {
-		dst = NULL;
-		LOG_ERR("Date/time not available: %d", err);
-	}
-#else
-	struct tm tm;
-	struct timespec ts;
-	time_t t;
-
-	if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
-		LOG_DBG("Unix time %lld", ts.tv_sec);
-		t = (time_t)ts.tv_sec;
-		tm = *(gmtime(&t));
-		/* 2020-02-19T18:38:50.363Z */
-		strftime(dst, len, "%Y-%m-%dT%H:%M:%S.000Z", &tm);
-		LOG_DBG("Date/time %s", log_strdup(dst));
-	}
-#endif
-	return dst;
-}
-
-int device_error_encode(char *ble_address, char *error_msg,
-			struct gw_msg *msg)
-{
-	/* TODO: Front end doesn't handle error messages yet.
-	 * This format may change.
-	 */
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *error = cJSON_CreateObject();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (error == NULL)) {
-		goto cleanup;
 	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDSTRCS(root_obj, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(event, "type", "error");
-	CJADDSTRCS(error, "description", error_msg);
-	CJADDSTRCS(device, "deviceAddress", ble_address);
-
-	/* use references so deleting is cleaner below; must be last
-	 * operation on any given cJSON object
-	 */
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "error", error);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(error);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
-
-int device_found_encode(uint8_t num_devices_found, struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *devices = cJSON_CreateArray();
-	cJSON *device = NULL;
-	cJSON *address = NULL;
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (devices == NULL)) {
-		goto cleanup;
+	if (id == GW_MSG_POOLS) {
+		LOG_ERR("No message buffer holds %u bytes", len);
+		return NULL;
 	}
+	pool = &gw_msg_pools[id];
 
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "scan_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-	CJADDSTRCS(event, "subType", "instant");
-	CJADDBOOLCS(event, "timeout", true);
-
-	for (int i = 0; i < num_devices_found; i++) {
-		LOG_DBG("Adding device %s RSSI: %d\n",
-			log_strdup(ble_scanned_devices[i].addr),
-			ble_scanned_devices[i].rssi);
-
-		/* TODO: Update for beacons */
-		CJADDARROBJ(devices, device);
-		CJADDSTRCS(device, "deviceType", "BLE");
-		CJADDNUMCS(device, "rssi", ble_scanned_devices[i].rssi);
-		if (strlen(ble_scanned_devices[i].name) > 0) {
-			CJADDSTRCS(device, "name", ble_scanned_devices[i].name);
+	if (k_mem_slab_alloc(pool->slab, &block, K_NO_WAIT)) {
+		atomic_inc(&pool->waits);
+		if (k_mem_slab_alloc(pool->slab, &block, timeout)) {
+			LOG_ERR("Timed out waiting for message buffer");
+			return NULL;
 		}
-
-		CJCREATE(address);
-		CJADDSTRCS(address, "address", ble_scanned_devices[i].addr);
-		CJADDITEMCS(device, "address", address);
-		address = NULL;
 	}
 
-	/* Figure out a messageId:
-	 * CJADDNUMCS(root_obj, "messageId", 1);
-	 */
-	CJADDREFCS(event, "devices", devices);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
+	in_use = atomic_inc(&pool->in_use) + 1;
+	do {
+		max = atomic_get(&pool->max_in_use);
+	} while ((in_use > max) &&
+		 !atomic_cas(&pool->max_in_use, max, in_use));
 
-cleanup:
-	if (address) {
-		cJSON_Delete(address);
-	}
-	cJSON_Delete(devices);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
+	msg = block;
+	msg->pool = id;
+	msg->data_max_len = pool->size;
+	msg->data.ptr = (char *)block + sizeof(struct gw_msg);
+	msg->data.len = 0;
+	return msg;
 }
 
-int device_connect_result_encode(char *ble_address, bool conn_status,
-				 struct gw_msg *msg)
+void gw_msg_free(struct gw_msg *msg)
 {
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *status = cJSON_CreateObject();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (status == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_connect_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	CJADDBOOLCS(status, "connected", conn_status);
-
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(device, "status", status);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(status);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
-
-int device_disconnect_result_encode(char *ble_address, bool conn_status,
-				    struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *status = cJSON_CreateObject();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (status == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_disconnect");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	CJADDBOOLCS(status, "connected", conn_status);
-
-	CJADDREFCS(device, "status", status);
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(status);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
+	struct gw_msg_pool *pool;
+	void *block = msg;
 
-int device_value_changed_encode(char *ble_address, char *uuid, char *path,
-				char *value, uint16_t value_length,
-				struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *chrc = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (chrc == NULL) || (value_arr == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_characteristic_value_changed");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	/* TODO: Get Type; */
-	CJADDSTRCS(address, "type", "random");
-
-	CJADDSTRCS(chrc, "uuid", uuid);
-	CJADDSTRCS(chrc, "path", path);
-
-	for (int i = 0; i < value_length; i++) {
-		CJADDARRNUM(value_arr, value[i]);
-	}
-
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(chrc, "value", value_arr);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "characteristic", chrc);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(value_arr);
-	cJSON_Delete(chrc);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
-
-int device_value_write_result_encode(char *ble_address, char *uuid, char *path,
-				     char *value, uint16_t value_length,
-				     struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *desc = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (desc == NULL) || (value_arr == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_descriptor_value_write_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	/* TODO: Get Type; */
-	CJADDSTRCS(address, "type", "random");
-
-	CJADDSTRCS(desc, "uuid", uuid);
-	CJADDSTRCS(desc, "path", path);
-
-	for (int i = 0; i < value_length; i++) {
-		CJADDARRNUM(value_arr, value[i]);
+	if (msg == NULL) {
+		return;
 	}
-
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(desc, "value", value_arr);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "descriptor", desc);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(value_arr);
-	cJSON_Delete(desc);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
+	pool = &gw_msg_pools[msg->pool];
+	atomic_dec(&pool->in_use);
+	k_mem_slab_free(pool->slab, &block);
 }
 
-int device_descriptor_value_encode(char *ble_address, char *uuid,
-				   char *path, char *value,
-				   uint16_t value_length,
-				   struct gw_msg *msg, bool changed)
+void gw_msg_get_pool_stats(enum gw_msg_pool_id id,
+			   struct gw_msg_pool_stats *stats)
 {
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *desc = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (desc == NULL) || (value_arr == NULL)) {
-		LOG_ERR("Invalid parameters");
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", changed ? 
-		   "device_descriptor_value_changed" :
-		   "device_descriptor_value_read_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	/* TODO: Get Type; */
-	CJADDSTRCS(address, "type", "random");
-
-	CJADDSTRCS(desc, "uuid", uuid);
-	CJADDSTRCS(desc, "path", path);
-
-	for (int i = 0; i < value_length; i++) {
-		CJADDARRNUM(value_arr, value[i]);
-	}
-
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(desc, "value", value_arr);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "descriptor", desc);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
+	struct gw_msg_pool *pool = &gw_msg_pools[id];
 
-cleanup:
-	cJSON_Delete(value_arr);
-	cJSON_Delete(desc);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
-
-int device_chrc_read_encode(char *ble_address, char *uuid, char *path,
-			    char *value, uint16_t value_length,
-			    struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *chrc = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (chrc == NULL) || (value_arr == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_characteristic_value_read_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	/* TODO: Get Type; */
-	CJADDSTRCS(address, "type", "random");
-
-	CJADDSTRCS(chrc, "uuid", uuid);
-	CJADDSTRCS(chrc, "path", path);
-
-	for (int i = 0; i < value_length; i++) {
-		CJADDARRNUM(value_arr, value[i]);
-	}
-
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(chrc, "value", value_arr);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "characteristic", chrc);
-	CJADDREFCS(root_obj, "event", event);
-
-	CJPRINT(root_obj, (char *)msg->data.ptr, msg->data_max_len, 0);
-	msg->data.len = strlen((char *)msg->data.ptr);
-	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(value_arr);
-	cJSON_Delete(chrc);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
-}
-
-static int create_device_wrapper(char *ble_address, bool conn_status,
-				 struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *root_obj = cJSON_CreateObject();
-	cJSON *event = cJSON_CreateObject();
-	cJSON *device = cJSON_CreateObject();
-	cJSON *address = cJSON_CreateObject();
-	cJSON *status = cJSON_CreateObject();
-	cJSON *services = cJSON_CreateObject();
-	char str[64];
-
-	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
-	    (address == NULL) || (status == NULL) || (services == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(root_obj, "type", "event");
-	CJADDSTRCS(root_obj, "gatewayId", gateway_id);
-	CJADDNULLCS(root_obj, "requestId");
-
-	CJADDSTRCS(event, "type", "device_discover_result");
-	CJADDSTRCS(event, "timestamp", get_time_str(str, sizeof(str)));
-
-	CJADDSTRCS(device, "id", ble_address);
-	CJADDSTRCS(address, "address", ble_address);
-	CJADDBOOLCS(status, "connected", conn_status);
-
-	CJADDREFCS(device, "status", status);
-	CJADDREFCS(device, "address", address);
-	CJADDREFCS(event, "device", device);
-	CJADDREFCS(event, "services", services);
-	CJADDREFCS(root_obj, "event", event);
-
-	char *ptr = (char *)msg->data.ptr;
-
-	CJPRINT(root_obj, ptr, msg->data_max_len, 0);
-	ptr[strlen(ptr) - 3] = 0;
-	msg->data.len = strlen(ptr);
-	ret = 0;
-
-cleanup:
-	cJSON_Delete(services);
-	cJSON_Delete(status);
-	cJSON_Delete(address);
-	cJSON_Delete(device);
-	cJSON_Delete(event);
-	cJSON_Delete(root_obj);
-	return ret;
+	stats->size = pool->size;
+	stats->count = pool->count;
+	stats->in_use = atomic_get(&pool->in_use);
+	stats->max_in_use = atomic_get(&pool->max_in_use);
+	stats->waits = atomic_get(&pool->waits);
 }
 
 int gateway_shadow_data_encode(void *modem_ptr, struct gw_msg *msg)
@@ -819,352 +378,6 @@ cleanup:
 	return ret;
 }
 
-/* Start of functions to assemble large JSON string. No room to create these
- * all at once in cJSON
- */
-static int device_discover_add_service(char *discovered_json,
-				       struct gw_msg *msg)
-{
-	char *ptr = (char *)msg->data.ptr;
-
-	if (first_service == false) {
-		strcat(ptr, "}},");
-	}
-
-	strcat(ptr, discovered_json + 1);
-
-	if (strlen(ptr) >= 3) {
-		ptr[strlen(ptr) - 3] = 0;
-	}
-	msg->data.len = strlen(ptr);
-
-	LOG_DBG("JSON Size: %d", msg->data.len);
-
-	memset(discovered_json, 0, MAX_SERVICE_BUF_SIZE);
-	first_service = false;
-	first_chrc = true;
-	return 0;
-}
-
-static int device_discover_add_chrc(char *discovered_json,
-				    struct gw_msg *msg)
-{
-	char *ptr = (char *)msg->data.ptr;
-
-	if (first_chrc == false) {
-		strcat(ptr, ",");
-	}
-
-	strcat(ptr, discovered_json + 1);
-
-	if (strlen(ptr) >= 1) {
-		ptr[strlen(ptr) - 1] = 0;
-	}
-	msg->data.len = strlen(ptr);
-
-	LOG_DBG("JSON Size: %d", msg->data.len);
-
-	memset(discovered_json, 0, MAX_SERVICE_BUF_SIZE);
-
-	first_chrc = false;
-	return 0;
-}
-
-static int device_discover_add_ccc(char *discovered_json,
-				   struct gw_msg *msg)
-{
-	char *ptr = (char *)msg->data.ptr;
-
-	if (strlen(ptr) >= 2) {
-		ptr[strlen(ptr) - 2] = 0;
-	}
-
-	strcat(ptr, discovered_json + 1);
-	strcat(ptr, "}");
-	msg->data.len = strlen(ptr);
-
-	LOG_DBG("JSON Size: %d", msg->data.len);
-
-	memset(discovered_json, 0, MAX_SERVICE_BUF_SIZE);
-
-	first_chrc = false;
-	return 0;
-}
-
-static int svc_attr_encode(char *uuid, char *path,
-			    struct ble_device_conn *ble_conn_ptr,
-			    struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *services = cJSON_CreateObject();
-	cJSON *service = cJSON_CreateObject();
-	cJSON *chrcs = cJSON_CreateObject();
-
-	if ((services == NULL) || (service == NULL) || (chrcs == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(service, "uuid", uuid);
-
-	CJADDREFCS(service, "characteristics", chrcs);
-	CJADDREF(services, uuid, service);
-
-	/* Print services and add to wrapper */
-	CJPRINT(services, service_buffer, MAX_SERVICE_BUF_SIZE, 0);
-	LOG_DBG("JSON: %s", log_strdup(service_buffer));
-	LOG_DBG("Encoding service %s", log_strdup(uuid));
-	ret = device_discover_add_service(service_buffer, msg);
-
-cleanup:
-	cJSON_Delete(chrcs);
-	cJSON_Delete(service);
-	cJSON_Delete(services);
-	return ret;
-}
-
-static int chrc_attr_encode(char *uuid, char *path, uint8_t properties,
-			     struct ble_device_conn *ble_conn_ptr,
-			    struct gw_msg *msg)
-{
-	int ret = -ENOMEM;
-	cJSON *chrc = cJSON_CreateObject();
-	cJSON *descriptors = cJSON_CreateObject();
-	cJSON *props = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	cJSON *parent_chrc = cJSON_CreateObject();
-
-	if ((chrc == NULL) || (descriptors == NULL) || (props == NULL) ||
-	    (value_arr == NULL) || (parent_chrc == NULL)) {
-		goto cleanup;
-	}
-
-	CJADDSTRCS(chrc, "uuid", uuid);
-	CJADDSTRCS(chrc, "path", path);
-
-	CJADDARRNUM(value_arr, 0);
-
-	/* Check and add properties */
-	if (properties & BT_GATT_CHRC_READ) {
-		CJADDBOOLCS(props, "read", true);
-	}
-	if (properties & BT_GATT_CHRC_WRITE) {
-		CJADDBOOLCS(props, "write", true);
-	}
-	if (properties & BT_GATT_CHRC_INDICATE) {
-		CJADDBOOLCS(props, "indicate", true);
-	}
-	if (properties & BT_GATT_CHRC_NOTIFY) {
-		CJADDBOOLCS(props, "notify", true);
-	}
-	if (properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP) {
-		CJADDBOOLCS(props, "writeWithoutResponse", true);
-	}
-	if (properties & BT_GATT_CHRC_AUTH) {
-		CJADDBOOLCS(props, "authorizedSignedWrite", true);
-	}
-	if ((properties == 0) || ((properties &
-		~(BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE |
-		  BT_GATT_CHRC_INDICATE | BT_GATT_CHRC_NOTIFY |
-		  BT_GATT_CHRC_WRITE_WITHOUT_RESP |
-		  BT_GATT_CHRC_AUTH)) != 0)) {
-		LOG_ERR("Unknown CHRC property: %d\n", properties);
-		cJSON_Delete(parent_chrc);
-		return -EINVAL;
-	}
-
-	CJADDREFCS(chrc, "properties", props);
-	CJADDREFCS(chrc, "value", value_arr);
-	CJADDREFCS(chrc, "descriptors", descriptors);
-	CJADDREF(parent_chrc, uuid, chrc);
-
-	/* Print parent_chrhc and add to service */
-	CJPRINT(parent_chrc, service_buffer, MAX_SERVICE_BUF_SIZE, 0);
-	LOG_DBG("JSON: %s", log_strdup(service_buffer));
-	ret = device_discover_add_chrc(service_buffer, msg);
-
-cleanup:
-	cJSON_Delete(parent_chrc);
-	cJSON_Delete(value_arr);
-	cJSON_Delete(props);
-	cJSON_Delete(descriptors);
-	cJSON_Delete(chrc);
-	return ret;
-}
-
-static int ccc_attr_encode(char *uuid, char *path,
-			   struct ble_device_conn *ble_conn_ptr,
-			   struct gw_msg *msg, bool sub_enabled)
-{
-	int ret = -ENOMEM;
-	cJSON *descriptor = cJSON_CreateObject();
-	cJSON *value_arr = cJSON_CreateArray();
-	cJSON *parent_ccc =  cJSON_CreateObject();
-
-	if ((descriptor == NULL) || (value_arr == NULL) ||
-	     (parent_ccc == NULL)) {
-		goto cleanup;
-	}
-	uint8_t val = sub_enabled ? BT_GATT_CCC_NOTIFY : 0;
-
-	LOG_DBG("value: %u", val);
-	CJADDSTRCS(descriptor, "uuid", uuid);
-	CJADDARRNUM(value_arr, val);
-	CJADDARRNUM(value_arr, 0);
-	CJADDSTRCS(descriptor, "path", path);
-
-	CJADDREFCS(descriptor, "value", value_arr);
-	CJADDREF(parent_ccc, uuid, descriptor);
-
-	/* Print parent_ccc and add to service */
-	CJPRINT(parent_ccc, service_buffer, MAX_SERVICE_BUF_SIZE, 0);
-	ret = device_discover_add_ccc(service_buffer, msg);
-
-cleanup:
-	cJSON_Delete(parent_ccc);
-	cJSON_Delete(value_arr);
-	cJSON_Delete(descriptor);
-	return ret;
-}
-
-static int attr_encode(struct uuid_handle_pair *uuid_handle,
-		       struct uuid_handle_pair *other_handle,
-		       char *uuid_str, char *path,
-		       struct ble_device_conn *ble_conn_ptr,
-		       struct gw_msg *msg)
-{
-	int ret = 0;
-
-	bt_to_upper(uuid_str, strlen(uuid_str));
-	bt_to_upper(path, strlen(path));
-
-	if (uuid_handle->attr_type ==  BT_ATTR_SERVICE) {
-		LOG_INF("Encoding Service : UUID: %s", log_strdup(uuid_str));
-		ret = svc_attr_encode(uuid_str, path, ble_conn_ptr, msg);
-
-	} else if (uuid_handle->attr_type == BT_ATTR_CHRC) {
-		LOG_DBG("Encoding Characteristic : UUID: %s  PATH: %s",
-			log_strdup(uuid_str), log_strdup(path));
-		ret = chrc_attr_encode(uuid_str, path, uuid_handle->properties,
-				       ble_conn_ptr, msg);
-
-	} else if (uuid_handle->attr_type == BT_ATTR_CCC) {
-		LOG_DBG("Encoding CCC : UUID: %s  PATH: %s",
-			log_strdup(uuid_str), log_strdup(path));
-		ret = ccc_attr_encode(uuid_str, path, ble_conn_ptr, msg,
-				      other_handle ?
-				      other_handle->sub_enabled : 0);
-
-	} else {
-		LOG_ERR("Unknown Attr Type");
-		ret = -EINVAL;
-	}
-	memset(service_buffer, 0, MAX_SERVICE_BUF_SIZE);
-	return ret;
-}
-
-void get_uuid_str(struct uuid_handle_pair *uuid_handle, char *str, size_t len)
-{
-	struct bt_uuid *uuid;
-
-	if (uuid_handle->uuid_type == BT_UUID_TYPE_16) {
-		uuid = &uuid_handle->uuid_16.uuid;
-	} else if (uuid_handle->uuid_type == BT_UUID_TYPE_128) {
-		uuid = &uuid_handle->uuid_128.uuid;
-	} else {
-		str[0] = '\0';
-		return;
-	}
-	bt_uuid_get_str(uuid, str, len);
-}
-
-int device_discovery_encode(struct ble_device_conn *conn_ptr,
-			    struct gw_msg *msg)
-{
-	char uuid_str[BT_UUID_STR_LEN];
-	char service_attr_str[BT_UUID_STR_LEN];
-	char path_dep_two_str[BT_UUID_STR_LEN];
-	char path_str[BT_MAX_PATH_LEN];
-	int ret = 0;
-	uint8_t num_encoded = 0;
-
-	first_service = true;
-
-	LOG_INF("Num Pairs: %d", conn_ptr->num_pairs);
-
-	ret = create_device_wrapper(conn_ptr->addr, true, msg);
-	if (ret) {
-		return ret;
-	}
-
-	for (int i = 0; i < conn_ptr->num_pairs; i++) {
-		struct uuid_handle_pair *uuid_handle;
-		struct uuid_handle_pair *uh = NULL;
-
-		uuid_handle = conn_ptr->uuid_handle_pairs[i];
-		if (uuid_handle == NULL) {
-			continue;
-		}
-
-		if ((uuid_handle->uuid_type != BT_UUID_TYPE_16) &&
-		    (uuid_handle->uuid_type != BT_UUID_TYPE_128)) {
-			LOG_ERR("ERROR: unknown UUID type");
-			ret = -EINVAL;
-			continue;
-		}
-		get_uuid_str(uuid_handle, uuid_str, BT_UUID_STR_LEN);
-
-		switch (uuid_handle->path_depth) {
-		case 1:
-			for (int j = i; j >= 0; j--) {
-				uh = conn_ptr->uuid_handle_pairs[j];
-				if (uh == NULL) {
-					continue;
-				}
-				if (uh->is_service == true) {
-					get_uuid_str(uh, service_attr_str,
-						     BT_UUID_STR_LEN);
-					break;
-				}
-			}
-			snprintk(path_str, BT_MAX_PATH_LEN, "%s/%s",
-				 service_attr_str, uuid_str);
-			break;
-		case 2:
-			uh = conn_ptr->uuid_handle_pairs[i - 1];
-			if (uh != NULL) {
-				get_uuid_str(uh, path_dep_two_str,
-					     BT_UUID_STR_LEN);
-				snprintk(path_str, BT_MAX_PATH_LEN, "%s/%s/%s",
-					 service_attr_str, path_dep_two_str,
-					 uuid_str);
-			}
-			break;
-		}
-
-		ret = attr_encode(uuid_handle, uh, uuid_str, path_str,
-				  conn_ptr, msg);
-		if (!ret) {
-			num_encoded++;
-		}
-	}
-
-	/* make sure we output at least one attribute, or
-	 * device_discovery_send() will send malformed JSON
-	 */
-	if (num_encoded) {
-		/* Add the remaing brackets to the JSON string */
-		strcat((char *)msg->data.ptr, "}}}}}");
-		msg->data.len = strlen((char *)msg->data.ptr);
-
-		/* ignore invalid UUID type since others were ok */
-		ret = 0;
-
-	} else if (!ret) {
-		ret = -EINVAL; /* no data to send */
-	}
-	return ret;
-}
-
 static char *get_addr_from_des_conn_array(cJSON *array, int index)
 {
 	cJSON *item;
@@ -1201,6 +414,73 @@ static char *get_addr_from_des_conn_array(cJSON *array, int index)
 	return NULL;
 }
 
+static void get_batch_policy(cJSON *obj, struct ble_batch_policy *policy)
+{
+	cJSON *item;
+
+	item = cJSON_GetObjectItem(obj, "maxBytes");
+	if ((item != NULL) && (item->valueint > 0)) {
+		policy->max_bytes = item->valueint;
+	}
+	item = cJSON_GetObjectItem(obj, "maxCount");
+	if ((item != NULL) && (item->valueint > 0)) {
+		policy->max_count = item->valueint;
+	}
+	item = cJSON_GetObjectItem(obj, "maxLatencyMs");
+	if ((item != NULL) && (item->valueint >= 0)) {
+		policy->max_latency_ms = item->valueint;
+	}
+}
+
+/* Apply optional batching policies from the shadow, such as:
+ * "bleBatch": {"maxBytes": 2048, "maxCount": 8, "maxLatencyMs": 500,
+ *              "devices": [{"address": "...", "maxCount": 1}]}
+ */
+static void batch_policy_handler(cJSON *state_obj)
+{
+	struct ble_batch_policy policy = {
+		.max_bytes = CONFIG_GATEWAY_BLE_BATCH_MAX_BYTES,
+		.max_count = CONFIG_GATEWAY_BLE_BATCH_MAX_COUNT,
+		.max_latency_ms = CONFIG_GATEWAY_BLE_BATCH_MAX_LATENCY_MS
+	};
+	cJSON *batch_obj;
+	cJSON *devices_obj;
+	cJSON *item;
+	cJSON *addr;
+
+	batch_obj = cJSON_GetObjectItem(state_obj, "bleBatch");
+	if (batch_obj == NULL) {
+		return;
+	}
+
+	get_batch_policy(batch_obj, &policy);
+	LOG_INF("Batch policy: %u bytes, %u events, %u ms",
+		policy.max_bytes, policy.max_count, policy.max_latency_ms);
+	ble_batch_set_policy(NULL, &policy);
+
+	devices_obj = cJSON_GetObjectItem(batch_obj, "devices");
+	if (devices_obj == NULL) {
+		return;
+	}
+
+	ble_batch_clear_device_policies();
+	for (int i = 0; i < cJSON_GetArraySize(devices_obj); i++) {
+		struct ble_batch_policy dev_policy = policy;
+
+		item = cJSON_GetArrayItem(devices_obj, i);
+		addr = cJSON_GetObjectItem(item, "address");
+		if ((addr == NULL) || (addr->valuestring == NULL)) {
+			LOG_ERR("Invalid batch policy device");
+			continue;
+		}
+		get_batch_policy(item, &dev_policy);
+		if (ble_batch_set_policy(addr->valuestring, &dev_policy)) {
+			LOG_ERR("No room for batch policy for %s",
+				log_strdup(addr->valuestring));
+		}
+	}
+}
+
 static int gateway_state_handler(void *root_obj)
 {
 	cJSON *state_obj;
@@ -1214,6 +494,8 @@ static int gateway_state_handler(void *root_obj)
 		return 0;
 	}
 
+	batch_policy_handler(state_obj);
+
 	desired_connections_obj = cJSON_GetObjectItem(state_obj,
 						      "desiredConnections");
 	if (desired_connections_obj == NULL) {
@@ -4,32 +4,65 @@
 #include "cJSON.h"
 #include "ble_conn_mgr.h"
 
+/* Messages are encoded into buffers taken from a pool with gw_msg_alloc()
+ * and handed back with gw_msg_free() once sent, so one thread can encode
+ * while another is blocked publishing
+ */
 struct gw_msg {
-	struct k_mutex lock;
 	int data_max_len;
 	struct nrf_cloud_data data;
+	uint8_t pool;
 };
 
+/* Upper bound on an event carrying len attribute value bytes */
+#define GW_MSG_EVENT_LEN(len) (640 + 4 * (len))
+
+enum gw_msg_pool_id {
+	GW_MSG_POOL_SMALL,
+	GW_MSG_POOL_LARGE,
+	GW_MSG_POOLS
+};
+
+struct gw_msg_pool_stats {
+	uint32_t size;
+	uint32_t count;
+	uint32_t in_use;
+	uint32_t max_in_use;
+	uint32_t waits;
+};
+
+struct gw_msg *gw_msg_alloc(size_t len, k_timeout_t timeout);
+void gw_msg_free(struct gw_msg *msg);
+void gw_msg_get_pool_stats(enum gw_msg_pool_id id,
+			   struct gw_msg_pool_stats *stats);
+
 int device_found_encode(uint8_t num_devices_found, struct gw_msg *msg);
 int device_connect_result_encode(char *ble_address, bool conn_status,
 				 struct gw_msg *msg);
-int device_value_changed_encode(char *ble_address, char *uuid, char *path,
-				char *value, uint16_t value_length,
-				struct gw_msg *msg);
-int device_chrc_read_encode(char *ble_address, char *uuid, char *path,
-			    char *value, uint16_t value_length,
-			    struct gw_msg *msg);
-int device_discovery_add_attr(char *discovered_json, bool last_attr,
-			      struct gw_msg *msg);
+/* rx_time_ms is the UTC time the value was received, or 0 for now */
+int device_value_changed_encode(char *ble_address, const char *uuid,
+				const char *path, char *value,
+				uint16_t value_length,
+				struct gw_msg *msg, int64_t rx_time_ms);
+int device_chrc_read_encode(char *ble_address, const char *uuid,
+			    const char *path, char *value,
+			    uint16_t value_length,
+			    struct gw_msg *msg, int64_t rx_time_ms);
+/* Length of the discovery message, so a buffer can be sized for it */
+int device_discovery_len(struct ble_device_conn *conn_ptr);
 int device_discovery_encode(struct ble_device_conn *conn_ptr,
 			    struct gw_msg *msg);
 int device_value_write_result_encode(char *ble_address, char *uuid, char *path,
 				     char *value, uint16_t value_length,
 				     struct gw_msg *msg);
-int device_descriptor_value_encode(char *ble_address, char *uuid,
-				   char *path, char *value,
+int device_chrc_write_result_encode(char *ble_address, const char *uuid,
+				    const char *path, char *value,
+				    uint16_t value_length, struct gw_msg *msg);
+int device_descriptor_value_encode(char *ble_address, const char *uuid,
+				   const char *path, char *value,
 				   uint16_t value_length,
-				   struct gw_msg *msg, bool changed);
+				   struct gw_msg *msg, bool changed,
+				   int64_t rx_time_ms);
 int device_error_encode(char *ble_address, char *error_msg,
 			struct gw_msg *msg);
 int device_disconnect_result_encode(char *ble_address, bool conn_status,
@@ -39,7 +72,9 @@ int device_shadow_data_encode(char *ble_address, bool connecting,
 			      bool connected, struct gw_msg *msg);
 int gateway_desired_list_encode(struct desired_conn *desired,int num_desired,
 				struct gw_msg *msg);
-void get_uuid_str(struct uuid_handle_pair *uuid_handle, char *str, size_t len);
+void get_uuid_str(const struct ble_device_conn *conn_ptr,
+		  const struct uuid_handle_pair *uuid_handle, char *str,
+		  size_t len);
 char *get_time_str(char *dst, size_t len);
 void ble_codec_init(void);
 
@@ -11,6 +11,7 @@
 #include "ble_codec.h"
 #include "cJSON.h"
 #include "ble.h"
+#include "gatt_cache.h"
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(ble_conn_mgr, CONFIG_LOG_DEFAULT_LEVEL);
@@ -20,96 +21,401 @@ static struct ble_device_conn connected_ble_devices[CONFIG_BT_MAX_CONN];
 
 static struct desired_conn desired_connections[CONFIG_BT_MAX_CONN];
 
+/* Device bound to each bt_conn_index() while its link is up */
+static struct ble_device_conn *conn_by_index[CONFIG_BT_MAX_CONN];
+
+/* Subscription pool; free entries are reused most recent first */
+static struct k_spinlock sub_lock;
+static struct ble_sub subs[CONFIG_GATEWAY_BLE_SUBSCRIPTIONS];
+static uint8_t sub_free[CONFIG_GATEWAY_BLE_SUBSCRIPTIONS];
+static uint16_t num_sub_free;
+
 #define CONN_MGR_STACK_SIZE 3072
 #define CONN_MGR_PRIORITY 1
 
 static struct uuid_handle_pair *find_pair_by_handle(uint16_t handle,
 					      struct ble_device_conn *conn_ptr,
 					      int *index);
+static void free_attr_index(struct ble_device_conn *dev);
+static void ble_conn_mgr_conn_reset(struct ble_device_conn *dev);
+
+static const char *const state_names[BLE_CONN_STATE_COUNT] = {
+	[BLE_CONN_STATE_IDLE] = "idle",
+	[BLE_CONN_STATE_ALLOWLISTED] = "allowlisted",
+	[BLE_CONN_STATE_CONNECTING] = "connecting",
+	[BLE_CONN_STATE_CONNECTED] = "connected",
+	[BLE_CONN_STATE_DISCOVERING] = "discovering",
+	[BLE_CONN_STATE_DISCOVERED] = "discovered",
+	[BLE_CONN_STATE_PUBLISHED] = "published",
+	[BLE_CONN_STATE_DFU] = "dfu",
+};
+
+static const char *const evt_names[BLE_CONN_EVT_COUNT] = {
+	[BLE_CONN_EVT_ADDED] = "added",
+	[BLE_CONN_EVT_REMOVED] = "removed",
+	[BLE_CONN_EVT_CONNECTED] = "connected",
+	[BLE_CONN_EVT_DISCONNECTED] = "disconnected",
+	[BLE_CONN_EVT_DISCOVERED] = "discovered",
+	[BLE_CONN_EVT_DISCOVERY_FAILED] = "discovery failed",
+	[BLE_CONN_EVT_REPUBLISH] = "republish",
+	[BLE_CONN_EVT_STALE] = "stale",
+	[BLE_CONN_EVT_CLOUD_READY] = "cloud ready",
+	[BLE_CONN_EVT_RETRY] = "retry",
+	[BLE_CONN_EVT_DFU_START] = "dfu start",
+	[BLE_CONN_EVT_DFU_END] = "dfu end",
+};
+
+const char *ble_conn_state_str(enum ble_conn_state state)
+{
+	return (state < BLE_CONN_STATE_COUNT) ? state_names[state] : "?";
+}
 
-static void process_connection(int i)
+const char *ble_conn_evt_str(enum ble_conn_event evt)
 {
-	int err;
-	struct ble_device_conn *dev = &connected_ble_devices[i];
+	return (evt < BLE_CONN_EVT_COUNT) ? evt_names[evt] : "?";
+}
 
-	if (dev->free) {
+static struct k_spinlock trace_lock;
+static struct ble_conn_trace trace[CONFIG_GATEWAY_CONN_TRACE_LEN];
+/* total entries ever written; the last ARRAY_SIZE(trace) are retained */
+static uint32_t trace_count;
+
+static void trace_add(const struct ble_device_conn *dev,
+		      enum ble_conn_state to, enum ble_conn_event evt)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+	struct ble_conn_trace *t = &trace[trace_count++ % ARRAY_SIZE(trace)];
+
+	t->time = k_uptime_get();
+	memcpy(t->addr, dev->addr, sizeof(t->addr));
+	t->from = dev->state;
+	t->to = to;
+	t->evt = evt;
+	k_spin_unlock(&trace_lock, key);
+}
+
+int ble_conn_mgr_get_trace(int i, struct ble_conn_trace *entry)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+	uint32_t kept = MIN(trace_count, ARRAY_SIZE(trace));
+	int err = -ENOENT;
+
+	if ((i >= 0) && (i < kept)) {
+		*entry = trace[(trace_count - kept + i) % ARRAY_SIZE(trace)];
+		err = 0;
+	}
+	k_spin_unlock(&trace_lock, key);
+	return err;
+}
+
+static void set_state(struct ble_device_conn *dev, enum ble_conn_state state,
+		      enum ble_conn_event evt)
+{
+	if (dev->state == state) {
 		return;
 	}
+	LOG_DBG("%s: %s -> %s (%s)", log_strdup(dev->addr),
+		ble_conn_state_str(dev->state), ble_conn_state_str(state),
+		ble_conn_evt_str(evt));
+	trace_add(dev, state, evt);
+	dev->state = state;
+}
+
+struct conn_mgr_msg {
+	uint8_t index;
+	uint8_t evt;
+	uint8_t gen;
+};
+
+/* Bumped each time a slot is reset, so events posted for the device that
+ * used it before are dropped rather than applied to the next one
+ */
+static uint8_t conn_gen[CONFIG_BT_MAX_CONN];
+
+#define CONN_MGR_ALL 0xff
+#define CONN_MGR_QUEUE_LEN (4 * CONFIG_BT_MAX_CONN)
+#define CONN_MGR_RETRY_MS 500
+
+K_MSGQ_DEFINE(conn_mgr_msgq, sizeof(struct conn_mgr_msg), CONN_MGR_QUEUE_LEN,
+	      4);
+
+static void retry_timer_fn(struct k_timer *timer)
+{
+	ble_conn_mgr_post(NULL, BLE_CONN_EVT_RETRY);
+}
+
+K_TIMER_DEFINE(retry_timer, retry_timer_fn, NULL);
+
+/* Something could not be done now; look at every device again shortly */
+static void retry_later(void)
+{
+	if (k_timer_remaining_get(&retry_timer) == 0) {
+		k_timer_start(&retry_timer, K_MSEC(CONN_MGR_RETRY_MS),
+			      K_NO_WAIT);
+	}
+}
 
-	if (!get_cloud_ready_status()) {
+void ble_conn_mgr_post(struct ble_device_conn *conn_ptr,
+		       enum ble_conn_event evt)
+{
+	struct conn_mgr_msg msg = {
+		.index = conn_ptr ? (conn_ptr - connected_ble_devices) :
+			 CONN_MGR_ALL,
+		.evt = evt
+	};
+
+	if (msg.index < CONFIG_BT_MAX_CONN) {
+		msg.gen = conn_gen[msg.index];
+	}
+	if (k_msgq_put(&conn_mgr_msgq, &msg, K_NO_WAIT)) {
+		/* every step also checks the link state, so a full
+		 * reconciliation pass recovers the lost event
+		 */
+		LOG_WRN("Event queue full; dropped %s", ble_conn_evt_str(evt));
+		retry_later();
+	}
+}
+
+/* Do whatever the device's state allows, until it has to wait for an
+ * event
+ */
+static void conn_step(struct ble_device_conn *dev, enum ble_conn_event evt)
+{
+	enum ble_conn_state prev;
+	int err;
+
+	if (dev->free || !get_cloud_ready_status()) {
 		return;
 	}
 
-	/* Add devices to allowlist */
-	if (!dev->added_to_allowlist && !dev->shadow_updated && !dev->connected) {
-		if (!ble_add_to_allowlist(dev->addr, true)) {
-			dev->added_to_allowlist = true;
-			LOG_INF("Device added to allowlist.");
-		}
-		if (!dev->hidden) {
-			err = set_shadow_ble_conn(dev->addr, true, false);
-			if (!err) {
-				dev->shadow_updated = true;
+	do {
+		prev = dev->state;
+
+		switch (dev->state) {
+		case BLE_CONN_STATE_IDLE:
+			if (dev->connected) {
+				set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+			} else if (dev->added_to_allowlist) {
+				/* back in the allowlist after a disconnect */
+				set_state(dev, BLE_CONN_STATE_CONNECTING, evt);
+			} else if (!ble_add_to_allowlist(dev->addr, true)) {
+				dev->added_to_allowlist = true;
+				LOG_INF("Device added to allowlist.");
+				set_state(dev, BLE_CONN_STATE_ALLOWLISTED,
+					  evt);
+			} else {
+				retry_later();
+			}
+			break;
+
+		case BLE_CONN_STATE_ALLOWLISTED:
+			if (dev->connected) {
+				set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+				break;
+			}
+			if (!dev->hidden) {
+				err = set_shadow_ble_conn(dev->addr, true,
+							  false);
+				if (err) {
+					retry_later();
+					break;
+				}
 				LOG_INF("Shadow updated.");
 			}
+			set_state(dev, BLE_CONN_STATE_CONNECTING, evt);
+			break;
+
+		case BLE_CONN_STATE_CONNECTING:
+			if (dev->connected) {
+				set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+			}
+			break;
+
+		case BLE_CONN_STATE_CONNECTED:
+			if (!dev->connected) {
+				set_state(dev, BLE_CONN_STATE_IDLE, evt);
+				break;
+			}
+			/* the result arrives as an event, also when the
+			 * table is already known
+			 */
+			err = ble_discover(dev);
+			if (!err || (err == -EALREADY)) {
+				set_state(dev, BLE_CONN_STATE_DISCOVERING, evt);
+			} else if (err != -EBUSY) {
+				LOG_DBG("ble_discover(%s) failed: %d",
+					log_strdup(dev->addr), err);
+				retry_later();
+			}
+			/* when busy, the next discovery result retries */
+			break;
+
+		case BLE_CONN_STATE_DISCOVERED:
+			if (!dev->connected) {
+				set_state(dev, BLE_CONN_STATE_IDLE, evt);
+				break;
+			}
+#if defined(CONFIG_GATEWAY_GATT_CACHE)
+			if (dev->gatt_cache_save) {
+				dev->gatt_cache_save = false;
+				(void)gatt_cache_save(dev);
+			}
+			/* restored, rediscovered or still in memory */
+			gatt_cache_watch(dev);
+#endif
+			device_discovery_send(dev);
+			if (!dev->ready_ms) {
+				dev->ready_ms = MAX(k_uptime_get() -
+						    dev->connect_time, 1);
+			}
+			set_state(dev, BLE_CONN_STATE_PUBLISHED, evt);
+
+			LOG_INF("Checking for BLE update...");
+			nrf_cloud_fota_ble_update_check(&dev->bt_addr.a);
+			break;
+
+		case BLE_CONN_STATE_DISCOVERING:
+		case BLE_CONN_STATE_PUBLISHED:
+			if (!dev->connected) {
+				set_state(dev, BLE_CONN_STATE_IDLE, evt);
+			}
+			break;
+
+		default:
+			break;
+		}
+	} while (dev->state != prev);
+}
+
+/* Retry devices waiting for a free discovery session */
+static void step_waiting_discovery(enum ble_conn_event evt)
+{
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (connected_ble_devices[i].state == BLE_CONN_STATE_CONNECTED) {
+			conn_step(&connected_ble_devices[i], evt);
 		}
 	}
+}
 
-	/* Connected. Do discovering if not discovered or currently
-	 * discovering.
-	 */
-	if (dev->connected && !dev->discovered && !dev->discovering) {
+static ble_conn_event_cb_t event_cb;
 
-		err = ble_discover(dev);
+void ble_conn_mgr_set_event_cb(ble_conn_event_cb_t cb)
+{
+	event_cb = cb;
+}
 
-		if (!err) {
-			LOG_DBG("ble_discover(%s) failed: %d",
-				log_strdup(dev->addr), err);
-		}
+static void conn_handle_event(struct ble_device_conn *dev,
+			      enum ble_conn_event evt)
+{
+	if (dev->free) {
+		return;
 	}
 
-	/* Discovering done. Encode and send. */
-	if (dev->connected && dev->encode_discovered) {
-		dev->encode_discovered = false;
-		device_discovery_send(&connected_ble_devices[i]);
+	switch (evt) {
+	case BLE_CONN_EVT_CONNECTED:
+		if (dev->state != BLE_CONN_STATE_DFU) {
+			set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+		}
+		break;
 
-		bt_addr_t ble_id;
+	case BLE_CONN_EVT_DISCONNECTED:
+		if (dev->state != BLE_CONN_STATE_DFU) {
+			set_state(dev, BLE_CONN_STATE_IDLE, evt);
+		}
+		break;
 
-		err = bt_addr_from_str(connected_ble_devices[i].addr,
-				       &ble_id);
-		if (!err) {
-			LOG_INF("Checking for BLE update...");
-			nrf_cloud_fota_ble_update_check(&ble_id);
+	case BLE_CONN_EVT_DISCOVERED:
+		if (dev->state == BLE_CONN_STATE_DISCOVERING) {
+			set_state(dev, BLE_CONN_STATE_DISCOVERED, evt);
+		}
+		step_waiting_discovery(evt);
+		break;
+
+	case BLE_CONN_EVT_DISCOVERY_FAILED:
+		step_waiting_discovery(evt);
+		if (dev->state == BLE_CONN_STATE_DISCOVERING) {
+			/* try again later, not in a tight loop */
+			set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+			retry_later();
+			return;
+		}
+		break;
+
+	case BLE_CONN_EVT_REPUBLISH:
+		if (dev->state == BLE_CONN_STATE_PUBLISHED) {
+			set_state(dev, BLE_CONN_STATE_DISCOVERED, evt);
+		}
+		break;
+
+	case BLE_CONN_EVT_STALE:
+		if (dev->state == BLE_CONN_STATE_DISCOVERING) {
+			break;
+		}
+		LOG_INF("Marking device %s to be rediscovered",
+			log_strdup(dev->addr));
+		dev->discovered = false;
+		ble_conn_mgr_clear_attrs(dev);
+		/* the stored copy is as old; drop it rather than restore it */
+		dev->gatt_cache_stale = true;
+		if ((dev->state == BLE_CONN_STATE_DISCOVERED) ||
+		    (dev->state == BLE_CONN_STATE_PUBLISHED)) {
+			set_state(dev, BLE_CONN_STATE_CONNECTED, evt);
+		}
+		break;
+
+	case BLE_CONN_EVT_REMOVED:
+		if (dev->added_to_allowlist &&
+		    !ble_add_to_allowlist(dev->addr, false)) {
+			dev->added_to_allowlist = false;
 		}
+#if defined(CONFIG_GATEWAY_GATT_CACHE)
+		(void)gatt_cache_delete(dev->addr);
+#endif
+		if (event_cb) {
+			event_cb(dev, evt);
+		}
+		ble_conn_mgr_conn_reset(dev);
+		return;
+
+	case BLE_CONN_EVT_DFU_START:
+		set_state(dev, BLE_CONN_STATE_DFU, evt);
+		break;
+
+	case BLE_CONN_EVT_DFU_END:
+		if (dev->state == BLE_CONN_STATE_DFU) {
+			set_state(dev, dev->connected ?
+				  BLE_CONN_STATE_CONNECTED :
+				  BLE_CONN_STATE_IDLE, evt);
+		}
+		break;
+
+	default:
+		break;
+	}
+	conn_step(dev, evt);
+	if (event_cb) {
+		event_cb(dev, evt);
 	}
 }
 
 void connection_manager(int unused1, int unused2, int unused3)
 {
-	int i;
+	struct conn_mgr_msg msg;
 
 	ble_conn_mgr_init();
 	while (1) {
+		k_msgq_get(&conn_mgr_msgq, &msg, K_FOREVER);
 
-		for (i = 0; i < CONFIG_BT_MAX_CONN; i++) {
-			/* Manager is busy. Do nothing. */
-			if (connected_ble_devices[i].discovering) {
-				LOG_DBG("Connection work busy.");
-				goto end;
+		if (msg.index == CONN_MGR_ALL) {
+			for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+				conn_handle_event(&connected_ble_devices[i],
+						  msg.evt);
 			}
+		} else if ((msg.index < CONFIG_BT_MAX_CONN) &&
+			   (msg.gen == conn_gen[msg.index])) {
+			conn_handle_event(&connected_ble_devices[msg.index],
+					  msg.evt);
 		}
-
-		for (i = 0; i < CONFIG_BT_MAX_CONN; i++) {
-			process_connection(i);
-		}
-
-end:
-		/* give up the CPU for a while; otherwise we spin much faster
-		 * than the cloud side could reasonably change things,
-		 * or that devices might connect and disconnect, and so
-		 * would needlessly consume CPU
-		 */
-		k_sleep(K_MSEC(100));
 	}
 }
 
@@ -123,28 +429,58 @@ static void init_conn(struct ble_device_conn *dev)
 	dev->free = true;
 }
 
-static void ble_conn_mgr_conn_reset(struct ble_device_conn
-					*dev)
+static void free_attr_index(struct ble_device_conn *dev)
 {
-	struct uuid_handle_pair *uuid_handle;
+	struct ble_attr_index *attr_index = dev->attr_index;
+
+	if (attr_index == NULL) {
+		return;
+	}
+
+	dev->attr_index = NULL;
+	dev->num_index = 0;
+	k_free(dev->uuid_hash);
+	dev->uuid_hash = NULL;
+	k_free(attr_index);
+}
 
+/* Unsubscribes still pending when dev is reset finish after the entry
+ * may have been reused; they only return the subscription to the pool
+ */
+static void detach_subs(struct ble_device_conn *dev)
+{
+	k_spinlock_key_t key = k_spin_lock(&sub_lock);
+
+	for (int i = 0; i < ARRAY_SIZE(subs); i++) {
+		if (subs[i].dev == dev) {
+			subs[i].dev = NULL;
+		}
+	}
+	dev->num_subs = 0;
+	k_spin_unlock(&sub_lock, key);
+}
+
+/* Only on the connection manager thread; see BLE_CONN_EVT_REMOVED */
+static void ble_conn_mgr_conn_reset(struct ble_device_conn *dev)
+{
 	LOG_INF("Connection removed to %s", log_strdup(dev->addr));
 
 	if (!dev->free) {
+		trace_add(dev, BLE_CONN_STATE_IDLE, BLE_CONN_EVT_REMOVED);
 		if (num_connected) {
 			num_connected--;
 		}
 	}
 
-	/* free in backwards order to try to reduce fragmentation */
-	while (dev->num_pairs) {
-		uuid_handle = dev->uuid_handle_pairs[dev->num_pairs - 1];
-		if (uuid_handle != NULL) {
-			dev->uuid_handle_pairs[dev->num_pairs - 1] = NULL;
-			k_free(uuid_handle);
-		}
-		dev->num_pairs--;
+	free_attr_index(dev);
+	ble_release_subscriptions(dev);
+	detach_subs(dev);
+	if (dev->conn != NULL) {
+		ble_conn_mgr_unbind_conn(dev->conn);
 	}
+
+	k_free(dev->uuid_handle_pairs);
+	conn_gen[dev - connected_ble_devices]++;
 	init_conn(dev);
 }
 
@@ -156,7 +492,7 @@ void ble_conn_mgr_update_connections(void)
 		struct ble_device_conn *dev = &connected_ble_devices[i];
 
 		if (dev->connected || dev->added_to_allowlist) {
-			dev->disconnect = true;
+			bool disconnect = true;
 
 			for (int j = 0; j < CONFIG_BT_MAX_CONN; j++) {
 				if (desired_connections[j].active) {
@@ -165,28 +501,23 @@ void ble_conn_mgr_update_connections(void)
 						/* If in the list then don't
 						 * disconnect.
 						 */
-						dev->disconnect = false;
+						disconnect = false;
 						break;
 					}
 				}
 			}
 
-			if (dev->disconnect) {
+			if (disconnect) {
 				int err;
 
 				LOG_INF("Cloud: disconnect device %s",
 					log_strdup(dev->addr));
-				if (dev->added_to_allowlist) {
-					if (!ble_add_to_allowlist(dev->addr, false)) {
-						dev->added_to_allowlist = false;
-					}
-				}
 				err = disconnect_device_by_addr(dev->addr);
 				if (err) {
 					LOG_ERR("Device might still be connected: %d",
 						err);
 				}
-				ble_conn_mgr_conn_reset(dev);
+				ble_conn_mgr_post(dev, BLE_CONN_EVT_REMOVED);
 				if (IS_ENABLED(CONFIG_SETTINGS)) {
 					LOG_INF("Saving settings");
 					settings_save();
@@ -339,17 +670,11 @@ int ble_conn_mgr_generate_path(struct ble_device_conn *conn_ptr,
 	path_depth = uuid_handle->path_depth;
 	LOG_DBG("Path Depth %d", path_depth);
 
-	get_uuid_str(uuid_handle, chrc_uuid, BT_UUID_STR_LEN);
+	get_uuid_str(conn_ptr, uuid_handle, chrc_uuid, BT_UUID_STR_LEN);
 
 	if (ccc && ((i + 1) < conn_ptr->num_pairs)) {
-		uuid_handle = conn_ptr->uuid_handle_pairs[i + 1];
-		if (uuid_handle == NULL) {
-			LOG_ERR("Path not generated; handle after %u "
-				"not found for addr %s",
-				handle, log_strdup(conn_ptr->addr));
-			return -ENXIO;
-		}
-		get_uuid_str(uuid_handle, ccc_uuid, BT_UUID_STR_LEN);
+		uuid_handle = &conn_ptr->uuid_handle_pairs[i + 1];
+		get_uuid_str(conn_ptr, uuid_handle, ccc_uuid, BT_UUID_STR_LEN);
 	} else {
 		LOG_DBG("No ccc; end of the array");
 		ccc_uuid[0] = '\0';
@@ -357,12 +682,9 @@ int ble_conn_mgr_generate_path(struct ble_device_conn *conn_ptr,
 	}
 
 	for (int j = i; j >= 0; j--) {
-		uuid_handle = conn_ptr->uuid_handle_pairs[j];
-		if (uuid_handle == NULL) {
-			continue;
-		}
+		uuid_handle = &conn_ptr->uuid_handle_pairs[j];
 		if (uuid_handle->is_service) {
-			get_uuid_str(uuid_handle, service_uuid,
+			get_uuid_str(conn_ptr, uuid_handle, service_uuid,
 				     BT_UUID_STR_LEN);
 			LOG_DBG("Service uuid in path %s",
 				log_strdup(service_uuid));
@@ -416,6 +738,7 @@ int ble_conn_mgr_add_conn(const char *addr)
 	}
 	num_connected++;
 	LOG_INF("BLE conn to %s added to manager", log_strdup(addr));
+	ble_conn_mgr_post(connected_ble_ptr, BLE_CONN_EVT_ADDED);
 	return err;
 }
 
@@ -426,11 +749,16 @@ int ble_conn_set_connected(struct ble_device_conn *connected_ble_ptr,
 
 	if (connected) {
 		connected_ble_ptr->connected = true;
+		connected_ble_ptr->connect_time = k_uptime_get();
+		connected_ble_ptr->ready_ms = 0;
+		connected_ble_ptr->gatt_cache_hit = false;
 	} else {
 		connected_ble_ptr->connected = false;
-		connected_ble_ptr->shadow_updated = false;
 	}
 	LOG_INF("Conn updated: connected=%u", connected);
+	ble_conn_mgr_post(connected_ble_ptr, connected ?
+			  BLE_CONN_EVT_CONNECTED :
+			  BLE_CONN_EVT_DISCONNECTED);
 	return err;
 }
 
@@ -445,19 +773,18 @@ int ble_conn_mgr_rediscover(const char *addr)
 		return err;
 	}
 
-	if (!connected_ble_ptr->discovering) {
-		if (connected_ble_ptr->discovered) {
-			/* cloud wants data again; just send it */
-			LOG_INF("Skipping device discovery on %s",
-				log_strdup(connected_ble_ptr->addr));
-			if (connected_ble_ptr->connected) {
-				connected_ble_ptr->encode_discovered = true;
-			} else {
-				err = device_discovery_send(connected_ble_ptr);
-			}
+	if (connected_ble_ptr->discovered) {
+		/* cloud wants data again; just send it */
+		LOG_INF("Skipping device discovery on %s",
+			log_strdup(connected_ble_ptr->addr));
+		if (connected_ble_ptr->connected) {
+			ble_conn_mgr_post(connected_ble_ptr,
+					  BLE_CONN_EVT_REPUBLISH);
 		} else {
-			connected_ble_ptr->num_pairs = 0;
+			err = device_discovery_send(connected_ble_ptr);
 		}
+	} else {
+		ble_conn_mgr_post(connected_ble_ptr, BLE_CONN_EVT_STALE);
 	}
 
 	return err;
@@ -499,13 +826,7 @@ int ble_conn_mgr_force_dfu_rediscover(const char *addr)
 		return err;
 	}
 
-	if (!connected_ble_ptr->discovering) {
-		LOG_INF("Marking device %s to be rediscovered",
-			log_strdup(addr));
-		connected_ble_ptr->discovered = false;
-		connected_ble_ptr->num_pairs = 0;
-	}
-
+	ble_conn_mgr_post(connected_ble_ptr, BLE_CONN_EVT_STALE);
 	return 0;
 }
 
@@ -520,7 +841,7 @@ int ble_conn_mgr_remove_conn(const char *addr)
 		return err;
 	}
 
-	ble_conn_mgr_conn_reset(connected_ble_ptr);
+	ble_conn_mgr_post(connected_ble_ptr, BLE_CONN_EVT_REMOVED);
 	return err;
 }
 
@@ -570,6 +891,71 @@ int ble_conn_mgr_get_conn_by_addr(const char *addr, struct ble_device_conn **con
 
 }
 
+/* Only the device address is compared; some peripherals report a
+ * different address type after reconnecting
+ */
+int ble_conn_mgr_get_conn_by_bt_addr(const bt_addr_le_t *addr,
+				     struct ble_device_conn **conn_ptr)
+{
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		if (!connected_ble_devices[i].free &&
+		    !bt_addr_cmp(&addr->a, &connected_ble_devices[i].bt_addr.a)) {
+			*conn_ptr = &connected_ble_devices[i];
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+struct ble_device_conn *ble_conn_mgr_get_conn_by_bt_conn(struct bt_conn *conn)
+{
+	return conn_by_index[bt_conn_index(conn)];
+}
+
+struct ble_device_conn *ble_conn_mgr_get_conn_by_index(uint8_t index)
+{
+	if (index < CONFIG_BT_MAX_CONN) {
+		return conn_by_index[index];
+	}
+	return NULL;
+}
+
+/* Called when a link comes up so later lookups by bt_conn or by device
+ * need neither address formatting nor a stack lookup
+ */
+void ble_conn_mgr_bind_conn(struct ble_device_conn *conn_ptr,
+			    struct bt_conn *conn)
+{
+	if (conn_ptr->conn == conn) {
+		return;
+	}
+	if (conn_ptr->conn != NULL) {
+		ble_conn_mgr_unbind_conn(conn_ptr->conn);
+	}
+	conn_ptr->conn = bt_conn_ref(conn);
+	conn_by_index[bt_conn_index(conn)] = conn_ptr;
+}
+
+void ble_conn_mgr_unbind_conn(struct bt_conn *conn)
+{
+	uint8_t index = bt_conn_index(conn);
+	struct ble_device_conn *conn_ptr = conn_by_index[index];
+
+	conn_by_index[index] = NULL;
+	if ((conn_ptr != NULL) && (conn_ptr->conn == conn)) {
+		conn_ptr->conn = NULL;
+		bt_conn_unref(conn);
+	}
+}
+
+/* Returns a new reference the caller must release, or NULL */
+struct bt_conn *ble_conn_mgr_get_bt_conn(struct ble_device_conn *conn_ptr)
+{
+	struct bt_conn *conn = conn_ptr->conn;
+
+	return (conn != NULL) ? bt_conn_ref(conn) : NULL;
+}
+
 bool ble_conn_mgr_is_addr_connected(const char *addr)
 {
 	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
@@ -580,75 +966,167 @@ bool ble_conn_mgr_is_addr_connected(const char *addr)
 	return false;
 }
 
+const struct ble_attr_index *ble_conn_mgr_find_attr(
+				const struct ble_device_conn *conn_ptr,
+				uint16_t handle)
+{
+	const struct ble_attr_index *attr_index = conn_ptr->attr_index;
+	int lo = 0;
+	int hi = (int)conn_ptr->num_index - 1;
+
+	if (attr_index == NULL) {
+		return NULL;
+	}
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (attr_index[mid].handle == handle) {
+			return &attr_index[mid];
+		} else if (attr_index[mid].handle < handle) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return NULL;
+}
+
+/* Index of the first pair whose handle is not below handle */
+static int pair_lower_bound(const struct ble_device_conn *conn_ptr,
+			    uint16_t handle)
+{
+	int lo = 0;
+	int hi = conn_ptr->num_pairs;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (conn_ptr->uuid_handle_pairs[mid].handle < handle) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
 static struct uuid_handle_pair *find_pair_by_handle(uint16_t handle,
 					       struct ble_device_conn *conn_ptr,
 					       int *index)
 {
-	struct uuid_handle_pair *uuid_handle;
+	int i = pair_lower_bound(conn_ptr, handle);
 
-	for (int i = 0; i < conn_ptr->num_pairs; i++) {
-		uuid_handle = conn_ptr->uuid_handle_pairs[i];
-		if (uuid_handle == NULL) {
-			continue;
-		}
-		if (handle == uuid_handle->handle) {
-			if (index != NULL) {
-				*index = i;
-			}
-			return uuid_handle;
-		}
+	if ((i >= conn_ptr->num_pairs) ||
+	    (conn_ptr->uuid_handle_pairs[i].handle != handle)) {
+		return NULL;
 	}
-	return NULL;
+	if (index != NULL) {
+		*index = i;
+	}
+	return &conn_ptr->uuid_handle_pairs[i];
 }
 
-int ble_conn_mgr_set_subscribed(uint16_t handle, uint8_t sub_index,
-				 struct ble_device_conn *conn_ptr)
+struct ble_sub *ble_conn_mgr_alloc_sub(struct ble_device_conn *conn_ptr,
+				       uint16_t handle)
 {
 	struct uuid_handle_pair *uuid_handle;
+	struct ble_sub *sub = NULL;
+	k_spinlock_key_t key;
 
 	uuid_handle = find_pair_by_handle(handle, conn_ptr, NULL);
-	if (uuid_handle) {
-		uuid_handle->sub_enabled = true;
-		uuid_handle->sub_index = sub_index;
-		return 0;
+	if (uuid_handle == NULL) {
+		return NULL;
 	}
 
-	return 1;
+	key = k_spin_lock(&sub_lock);
+	if (num_sub_free) {
+		sub = &subs[sub_free[--num_sub_free]];
+		memset(sub, 0, sizeof(*sub));
+		sub->dev = conn_ptr;
+		sub->params.value_handle = handle;
+		conn_ptr->num_subs++;
+	}
+	k_spin_unlock(&sub_lock, key);
+
+	if (sub != NULL) {
+		uuid_handle->sub_enabled = true;
+		uuid_handle->sub_index = sub - subs;
+	}
+	return sub;
 }
 
+void ble_conn_mgr_free_sub(struct ble_sub *sub)
+{
+	struct uuid_handle_pair *uuid_handle;
+	struct ble_device_conn *dev;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&sub_lock);
+	dev = sub->dev;
+	/* already in the pool */
+	if ((dev == NULL) && !sub->releasing) {
+		k_spin_unlock(&sub_lock, key);
+		return;
+	}
+	/* NULL if detach_subs() let go of it */
+	if (dev != NULL) {
+		uuid_handle = find_pair_by_handle(sub->params.value_handle,
+						  dev, NULL);
+		if ((uuid_handle != NULL) &&
+		    (uuid_handle->sub_index == sub - subs)) {
+			uuid_handle->sub_enabled = false;
+		}
+		dev->num_subs--;
+	}
+	sub->dev = NULL;
+	sub->releasing = false;
+	sub_free[num_sub_free++] = sub - subs;
+	k_spin_unlock(&sub_lock, key);
+}
 
-int ble_conn_mgr_remove_subscribed(uint16_t handle,
-				    struct ble_device_conn *conn_ptr)
+struct ble_sub *ble_conn_mgr_get_sub(struct ble_device_conn *conn_ptr,
+				     uint16_t handle)
 {
 	struct uuid_handle_pair *uuid_handle;
+	struct ble_sub *sub;
 
 	uuid_handle = find_pair_by_handle(handle, conn_ptr, NULL);
-	if (uuid_handle) {
-		uuid_handle->sub_enabled = false;
-		return 0;
+	if ((uuid_handle == NULL) || !uuid_handle->sub_enabled) {
+		return NULL;
 	}
-	return 1;
+	sub = &subs[uuid_handle->sub_index];
+	return (sub->dev == conn_ptr) ? sub : NULL;
 }
 
+struct ble_sub *ble_conn_mgr_get_sub_by_index(unsigned int index)
+{
+	return (index < ARRAY_SIZE(subs)) ? &subs[index] : NULL;
+}
 
-int ble_conn_mgr_get_subscribed(uint16_t handle,
-				struct ble_device_conn *conn_ptr,
-				bool *status, uint8_t *sub_index)
+int ble_conn_mgr_num_subs(void)
+{
+	return ARRAY_SIZE(subs) - num_sub_free;
+}
+
+/* Point conn_ptr's rebuilt attribute table back at the subscriptions it
+ * holds
+ */
+static void relink_subs(struct ble_device_conn *conn_ptr)
 {
 	struct uuid_handle_pair *uuid_handle;
 
-	uuid_handle = find_pair_by_handle(handle, conn_ptr, NULL);
-	if (uuid_handle) {
-		if (status) {
-			*status = uuid_handle->sub_enabled;
+	for (int i = 0; i < ARRAY_SIZE(subs); i++) {
+		if (subs[i].dev != conn_ptr) {
+			continue;
 		}
-		if (sub_index) {
-			*sub_index = uuid_handle->sub_index;
+		uuid_handle = find_pair_by_handle(subs[i].params.value_handle,
+						  conn_ptr, NULL);
+		if (uuid_handle != NULL) {
+			uuid_handle->sub_enabled = true;
+			uuid_handle->sub_index = i;
 		}
-		return 0;
 	}
-
-	return 1;
 }
 
 int ble_conn_mgr_get_uuid_by_handle(uint16_t handle, char *uuid,
@@ -661,7 +1139,7 @@ int ble_conn_mgr_get_uuid_by_handle(uint16_t handle, char *uuid,
 
 	uuid_handle = find_pair_by_handle(handle, conn_ptr, NULL);
 	if (uuid_handle) {
-		get_uuid_str(uuid_handle, uuid_str, BT_UUID_STR_LEN);
+		get_uuid_str(conn_ptr, uuid_handle, uuid_str, BT_UUID_STR_LEN);
 		bt_to_upper(uuid_str, strlen(uuid_str));
 		memcpy(uuid, uuid_str, strlen(uuid_str));
 		LOG_DBG("Found UUID: %s For Handle: %d",
@@ -677,45 +1155,323 @@ int ble_conn_mgr_get_uuid_by_handle(uint16_t handle, char *uuid,
 }
 
 
-int ble_conn_mgr_get_handle_by_uuid(uint16_t *handle, const char *uuid,
-				     struct ble_device_conn *conn_ptr)
+static int hex_val(char c)
 {
-	char str[BT_UUID_STR_LEN];
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	}
+	c |= 0x20;
+	if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
 
-	LOG_DBG("Num Pairs: %d", conn_ptr->num_pairs);
+int ble_conn_mgr_parse_uuid(const char *str, size_t len,
+			    union ble_uuid_any *uuid)
+{
+	/* most significant byte first, as printed */
+	uint8_t msb[16];
+	int digits = 0;
+	int val;
+
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '-') {
+			continue;
+		}
+		val = hex_val(str[i]);
+		if ((val < 0) || (digits == 2 * sizeof(msb))) {
+			return -EINVAL;
+		}
+		if (digits & 1) {
+			msb[digits / 2] |= val;
+		} else {
+			msb[digits / 2] = val << 4;
+		}
+		digits++;
+	}
+
+	if (digits == 4) {
+		uuid->uuid_16.uuid.type = BT_UUID_TYPE_16;
+		uuid->uuid_16.val = (msb[0] << 8) | msb[1];
+	} else if (digits == 2 * sizeof(msb)) {
+		uuid->uuid_128.uuid.type = BT_UUID_TYPE_128;
+		for (int i = 0; i < sizeof(msb); i++) {
+			uuid->uuid_128.val[i] = msb[sizeof(msb) - 1 - i];
+		}
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+#define UUID_HASH_EMPTY UINT8_MAX
+#define UUID_HASH_MIN_BITS 3
+
+static uint32_t uuid_hash_slot(const struct bt_uuid *uuid, uint8_t bits)
+{
+	uint32_t h;
 
+	if (uuid->type == BT_UUID_TYPE_16) {
+		h = BT_UUID_16(uuid)->val;
+	} else {
+		/* FNV-1a */
+		h = 2166136261u;
+		for (int i = 0; i < sizeof(BT_UUID_128(uuid)->val); i++) {
+			h = (h ^ BT_UUID_128(uuid)->val[i]) * 16777619u;
+		}
+	}
+	return (h * 2654435761u) >> (32 - bits);
+}
+
+/* Only services and characteristic values are looked up by uuid */
+static bool pair_hashed(const struct uuid_handle_pair *pair)
+{
+	return pair->is_service || (pair->attr_type == BT_ATTR_CHRC);
+}
+
+static bool pair_matches(const struct ble_device_conn *conn_ptr, int i,
+			 const struct bt_uuid *svc, const struct bt_uuid *chrc)
+{
+	const struct uuid_handle_pair *pairs = conn_ptr->uuid_handle_pairs;
+
+	if (!pair_hashed(&pairs[i]) ||
+	    bt_uuid_cmp(ble_conn_mgr_pair_uuid(conn_ptr, &pairs[i]), chrc)) {
+		return false;
+	}
+	if (svc == NULL) {
+		return true;
+	}
+	if (pairs[i].is_service) {
+		return false;
+	}
+	/* pairs are sorted by handle, so the owning service precedes it */
+	while (--i >= 0) {
+		if (pairs[i].is_service) {
+			return !bt_uuid_cmp(ble_conn_mgr_pair_uuid(conn_ptr,
+								   &pairs[i]),
+					    svc);
+		}
+	}
+	return false;
+}
+
+int ble_conn_mgr_find_handle(const struct ble_device_conn *conn_ptr,
+			     const struct bt_uuid *svc,
+			     const struct bt_uuid *chrc, uint16_t *handle)
+{
+	uint32_t mask;
+	uint32_t slot;
+	int i;
+
+	if (conn_ptr->uuid_hash == NULL) {
+		/* still being discovered */
+		for (i = 0; i < conn_ptr->num_pairs; i++) {
+			if (pair_matches(conn_ptr, i, svc, chrc)) {
+				goto found;
+			}
+		}
+		return -ENOENT;
+	}
+
+	/* equal uuids were inserted in handle order along the same probe
+	 * sequence, so the first match is the lowest handle
+	 */
+	mask = BIT(conn_ptr->uuid_hash_bits) - 1;
+	for (slot = uuid_hash_slot(chrc, conn_ptr->uuid_hash_bits);
+	     conn_ptr->uuid_hash[slot] != UUID_HASH_EMPTY;
+	     slot = (slot + 1) & mask) {
+		i = conn_ptr->uuid_hash[slot];
+		if (pair_matches(conn_ptr, i, svc, chrc)) {
+			goto found;
+		}
+	}
+	return -ENOENT;
+
+found:
+	*handle = conn_ptr->uuid_handle_pairs[i].handle;
+	return 0;
+}
+
+static int build_uuid_hash(struct ble_device_conn *conn_ptr)
+{
+	uint8_t bits = UUID_HASH_MIN_BITS;
+	uint32_t mask;
+	uint32_t slot;
+	int count = 0;
+
+	for (int i = 0; i < conn_ptr->num_pairs; i++) {
+		count += pair_hashed(&conn_ptr->uuid_handle_pairs[i]);
+	}
+	/* at most half full */
+	while (BIT(bits) < 2 * count) {
+		bits++;
+	}
+
+	conn_ptr->uuid_hash = k_malloc(BIT(bits));
+	if (conn_ptr->uuid_hash == NULL) {
+		return -ENOMEM;
+	}
+	memset(conn_ptr->uuid_hash, UUID_HASH_EMPTY, BIT(bits));
+	conn_ptr->uuid_hash_bits = bits;
+
+	mask = BIT(bits) - 1;
 	for (int i = 0; i < conn_ptr->num_pairs; i++) {
-		struct uuid_handle_pair *uuid_handle =
-			conn_ptr->uuid_handle_pairs[i];
+		const struct uuid_handle_pair *pair =
+			&conn_ptr->uuid_handle_pairs[i];
 
-		if (uuid_handle == NULL) {
+		if (!pair_hashed(pair)) {
 			continue;
 		}
+		slot = uuid_hash_slot(ble_conn_mgr_pair_uuid(conn_ptr, pair),
+				      bits);
+		while (conn_ptr->uuid_hash[slot] != UUID_HASH_EMPTY) {
+			slot = (slot + 1) & mask;
+		}
+		conn_ptr->uuid_hash[slot] = i;
+	}
+	return 0;
+}
 
-		get_uuid_str(uuid_handle, str, sizeof(str));
-		bt_to_upper(str, strlen(str));
-		LOG_DBG("UUID IN: %s UUID FOUND: %s", log_strdup(uuid),
-			log_strdup(str));
+int ble_conn_mgr_get_handle_by_uuid(uint16_t *handle, const char *uuid,
+				     struct ble_device_conn *conn_ptr)
+{
+	const char *sep = strchr(uuid, '/');
+	union ble_uuid_any svc;
+	union ble_uuid_any chrc;
+	int err;
 
-		if (!strcmp(uuid, str)) {
-			*handle = uuid_handle->handle;
-			LOG_DBG("16 Bit UUID Found");
-			return 0;
+	if (sep != NULL) {
+		err = ble_conn_mgr_parse_uuid(uuid, sep - uuid, &svc);
+		if (!err) {
+			err = ble_conn_mgr_parse_uuid(sep + 1, strlen(sep + 1),
+						      &chrc);
 		}
+	} else {
+		err = ble_conn_mgr_parse_uuid(uuid, strlen(uuid), &chrc);
+	}
+	if (err) {
+		LOG_ERR("Invalid UUID: %s", log_strdup(uuid));
+		return 1;
+	}
 
-		get_uuid_str(uuid_handle, str, sizeof(str));
-		bt_to_upper(str, strlen(str));
-		LOG_DBG("UUID IN: %s UUID FOUND: %s", log_strdup(uuid),
-			log_strdup(str));
-		if (!strcmp(uuid, str)) {
-			*handle = uuid_handle->handle;
-			LOG_DBG("128 Bit UUID Found");
-			return 0;
+	err = ble_conn_mgr_find_handle(conn_ptr, sep ? &svc.uuid : NULL,
+				       &chrc.uuid, handle);
+	if (err) {
+		LOG_ERR("Handle Not Found for UUID: %s", log_strdup(uuid));
+		return 1;
+	}
+	LOG_DBG("UUID %s is handle %u", log_strdup(uuid), *handle);
+	return 0;
+}
+
+#define ARENA_MIN_PAIRS 16
+#define ARENA_STEP_PAIRS 16
+#define ARENA_MIN_UUIDS 4
+
+static size_t arena_size(uint8_t max_pairs, uint8_t max_uuids)
+{
+	return (max_pairs * sizeof(struct uuid_handle_pair)) +
+	       (max_uuids * sizeof(struct bt_uuid_128));
+}
+
+/* Doubling up to MAX_UUID_PAIRS, then in small steps to the ceiling */
+static uint8_t arena_grow(uint8_t cur, uint8_t min, unsigned int need)
+{
+	unsigned int n = cur ? cur : min;
+
+	while (n < need) {
+		n = (n < MAX_UUID_PAIRS) ? MIN(2 * n, MAX_UUID_PAIRS) :
+					   (n + ARENA_STEP_PAIRS);
+	}
+	return MIN(n, MAX_UUID_PAIRS_CEILING);
+}
+
+/* Make room for one more pair and, if uuid_128 is set, one more 128-bit
+ * uuid; moves the arena when it has to grow
+ */
+static int arena_reserve(struct ble_device_conn *conn_ptr, bool uuid_128)
+{
+	unsigned int need_pairs = conn_ptr->num_pairs + 1;
+	unsigned int need_uuids = conn_ptr->num_uuids_128 + uuid_128;
+	uint8_t max_pairs = conn_ptr->max_pairs;
+	uint8_t max_uuids = conn_ptr->max_uuids_128;
+	struct uuid_handle_pair *arena;
+	struct bt_uuid_128 *uuids;
+
+	if ((need_pairs <= max_pairs) && (need_uuids <= max_uuids)) {
+		return 0;
+	}
+	if ((need_pairs > MAX_UUID_PAIRS_CEILING) ||
+	    (need_uuids > MAX_UUID_PAIRS_CEILING)) {
+		return -E2BIG;
+	}
+	if (need_pairs > max_pairs) {
+		max_pairs = arena_grow(max_pairs, ARENA_MIN_PAIRS, need_pairs);
+		if (max_pairs > MAX_UUID_PAIRS) {
+			LOG_WRN("%s has more than %u attributes",
+				log_strdup(conn_ptr->addr), MAX_UUID_PAIRS);
 		}
 	}
+	if (need_uuids > max_uuids) {
+		max_uuids = arena_grow(max_uuids, ARENA_MIN_UUIDS, need_uuids);
+	}
 
-	LOG_ERR("Handle Not Found for UUID: %s", log_strdup(uuid));
-	return 1;
+	arena = k_malloc(arena_size(max_pairs, max_uuids));
+	if (arena == NULL) {
+		return -ENOMEM;
+	}
+	uuids = (struct bt_uuid_128 *)&arena[max_pairs];
+	if (conn_ptr->uuid_handle_pairs != NULL) {
+		memcpy(arena, conn_ptr->uuid_handle_pairs,
+		       conn_ptr->num_pairs * sizeof(*arena));
+		memcpy(uuids, conn_ptr->uuids_128,
+		       conn_ptr->num_uuids_128 * sizeof(*uuids));
+		k_free(conn_ptr->uuid_handle_pairs);
+	}
+	conn_ptr->uuid_handle_pairs = arena;
+	conn_ptr->uuids_128 = uuids;
+	conn_ptr->max_pairs = max_pairs;
+	conn_ptr->max_uuids_128 = max_uuids;
+	return 0;
+}
+
+/* Index of uuid in the device's 128-bit uuid table, adding it if new;
+ * the caller reserved room
+ */
+static uint8_t uuid_128_intern(struct ble_device_conn *conn_ptr,
+			       const struct bt_uuid_128 *uuid)
+{
+	uint8_t i;
+
+	for (i = 0; i < conn_ptr->num_uuids_128; i++) {
+		if (!memcmp(conn_ptr->uuids_128[i].val, uuid->val,
+			    sizeof(uuid->val))) {
+			return i;
+		}
+	}
+	memcpy(&conn_ptr->uuids_128[i], uuid, sizeof(*uuid));
+	conn_ptr->num_uuids_128++;
+	return i;
+}
+
+static bool uuid_128_known(const struct ble_device_conn *conn_ptr,
+			   const struct bt_uuid_128 *uuid)
+{
+	for (int i = 0; i < conn_ptr->num_uuids_128; i++) {
+		if (!memcmp(conn_ptr->uuids_128[i].val, uuid->val,
+			    sizeof(uuid->val))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void ble_conn_mgr_clear_attrs(struct ble_device_conn *conn_ptr)
+{
+	free_attr_index(conn_ptr);
+	conn_ptr->num_pairs = 0;
+	conn_ptr->num_uuids_128 = 0;
 }
 
 int ble_conn_mgr_add_uuid_pair(const struct bt_uuid *uuid, uint16_t handle,
@@ -724,99 +1480,228 @@ int ble_conn_mgr_add_uuid_pair(const struct bt_uuid *uuid, uint16_t handle,
 				struct ble_device_conn *conn_ptr,
 				bool is_service)
 {
-	char str[BT_UUID_STR_LEN];
+	struct uuid_handle_pair *uuid_handle;
+	bool uuid_128;
+	int err;
+	int i;
 
 	if (!conn_ptr) {
 		LOG_ERR("No connection ptr!");
 		return -EINVAL;
 	}
 
-	if (conn_ptr->num_pairs >= MAX_UUID_PAIRS) {
-		LOG_ERR("Max uuid pair limit reached on %s",
-			log_strdup(conn_ptr->addr));
-		return -E2BIG;
-	}
-
 	LOG_DBG("Handle Added: %d", handle);
 
 	if (!uuid) {
 		return 0;
 	}
+	if ((uuid->type != BT_UUID_TYPE_16) &&
+	    (uuid->type != BT_UUID_TYPE_128)) {
+		return -EINVAL;
+	}
 
-	struct uuid_handle_pair *uuid_handle;
-	int err = 0;
+	/* attribute table is changing; index is rebuilt after discovery */
+	free_attr_index(conn_ptr);
 
-	uuid_handle = conn_ptr->uuid_handle_pairs[conn_ptr->num_pairs];
-	if (uuid_handle != NULL) {
-		/* we already discovered this device */
-		if (uuid_handle->uuid_type != uuid->type) {
-			if (uuid_handle->uuid_type == BT_UUID_TYPE_16) {
-				/* likely got larger, so free and reallocate */
-				k_free(uuid_handle);
-				uuid_handle = NULL;
-			}
-		}
+	uuid_128 = (uuid->type == BT_UUID_TYPE_128) &&
+		   !uuid_128_known(conn_ptr, BT_UUID_128(uuid));
+	err = arena_reserve(conn_ptr, uuid_128);
+	if (err) {
+		LOG_ERR("Unable to add handle %u on %s: %d", handle,
+			log_strdup(conn_ptr->addr), err);
+		return err;
 	}
 
-	switch (uuid->type) {
-	case BT_UUID_TYPE_16:
-		if (uuid_handle == NULL) {
-			uuid_handle = (struct uuid_handle_pair *)
-				      k_calloc(1, SMALL_UUID_HANDLE_PAIR_SIZE);
-			if (uuid_handle == NULL) {
-				LOG_ERR("Out of memory error allocating "
-					"for handle %u", handle);
-				err = -ENOMEM;
-				break;
-			}
-		}
+	/* discovery runs in handle order, so this normally appends */
+	i = pair_lower_bound(conn_ptr, handle);
+	uuid_handle = &conn_ptr->uuid_handle_pairs[i];
+	if ((i == conn_ptr->num_pairs) || (uuid_handle->handle != handle)) {
+		memmove(uuid_handle + 1, uuid_handle,
+			(conn_ptr->num_pairs - i) * sizeof(*uuid_handle));
+		memset(uuid_handle, 0, sizeof(*uuid_handle));
+		conn_ptr->num_pairs++;
+	}
+
+	if (uuid->type == BT_UUID_TYPE_16) {
 		memcpy(&uuid_handle->uuid_16, BT_UUID_16(uuid),
 		       sizeof(struct bt_uuid_16));
-		uuid_handle->uuid_type = uuid->type;
-		bt_uuid_get_str(&uuid_handle->uuid_16.uuid, str, sizeof(str));
+	} else {
+		uuid_handle->uuid_128_index =
+			uuid_128_intern(conn_ptr, BT_UUID_128(uuid));
+	}
+	uuid_handle->uuid_type = uuid->type;
+	uuid_handle->properties = properties;
+	uuid_handle->attr_type = attr_type;
+	uuid_handle->path_depth = path_depth;
+	uuid_handle->is_service = is_service;
+	uuid_handle->handle = handle;
+	LOG_DBG("%d. Handle Added: %d", i, handle);
+	return 0;
+}
 
-		LOG_DBG("\tCONN MGR Characteristic: 0x%s", log_strdup(str));
-		break;
-	case BT_UUID_TYPE_128:
-		if (uuid_handle == NULL) {
-			uuid_handle = (struct uuid_handle_pair *)
-				      k_calloc(1, LARGE_UUID_HANDLE_PAIR_SIZE);
-			if (uuid_handle == NULL) {
-				LOG_ERR("Out of memory error allocating "
-					"for handle %u", handle);
-				err = -ENOMEM;
-				break;
-			}
+static size_t attr_index_mem(const struct ble_device_conn *conn_ptr)
+{
+	size_t bytes;
+
+	if (conn_ptr->attr_index == NULL) {
+		return 0;
+	}
+	bytes = conn_ptr->num_index * sizeof(struct ble_attr_index);
+	for (int i = 0; i < conn_ptr->num_index; i++) {
+		const struct ble_attr_index *attr = &conn_ptr->attr_index[i];
+		const char *path = ble_attr_path(attr);
+
+		bytes += attr->uuid_len + 1;
+		if (path != NULL) {
+			bytes += strlen(path) + 1;
 		}
-		memcpy(&uuid_handle->uuid_128, BT_UUID_128(uuid),
-		       sizeof(struct bt_uuid_128));
-		uuid_handle->uuid_type = uuid->type;
-		bt_uuid_get_str(&uuid_handle->uuid_128.uuid, str, sizeof(str));
+	}
+	if (conn_ptr->uuid_hash != NULL) {
+		bytes += BIT(conn_ptr->uuid_hash_bits);
+	}
+	return bytes;
+}
 
-		LOG_DBG("\tCONN MGR Characteristic: 0x%s", log_strdup(str));
-		break;
-	default:
-		err = -EINVAL;
+void ble_conn_mgr_get_mem(const struct ble_device_conn *conn_ptr,
+			  size_t *arena, size_t *index)
+{
+	*arena = conn_ptr->uuid_handle_pairs ?
+		 arena_size(conn_ptr->max_pairs, conn_ptr->max_uuids_128) : 0;
+	*index = attr_index_mem(conn_ptr);
+}
+
+void ble_conn_mgr_print_mem(void)
+{
+	size_t total = 0;
+	size_t arena;
+	size_t index;
+
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		struct ble_device_conn *dev = &connected_ble_devices[i];
+
+		if (dev->free) {
+			continue;
+		}
+		ble_conn_mgr_get_mem(dev, &arena, &index);
+		LOG_INF("%s: %u attrs (room for %u), %u uuid128 (room for %u),"
+			" arena %u B, index %u B", log_strdup(dev->addr),
+			dev->num_pairs, dev->max_pairs, dev->num_uuids_128,
+			dev->max_uuids_128, arena, index);
+		total += arena + index;
 	}
+	LOG_INF("Attribute tables use %u bytes in total", total);
+}
+
+/* Render pair i's uppercase uuid and, for a characteristic, its path with
+ * the following ccc uuid, if any; path_len is set to the length without it.
+ * Returns the bytes both strings take in the index.
+ */
+static int attr_strs_render(struct ble_device_conn *conn_ptr, int i,
+			    char *uuid, char *path, uint8_t *path_len)
+{
+	struct uuid_handle_pair *uuid_handle = &conn_ptr->uuid_handle_pairs[i];
+	size_t uuid_len;
+	int err;
+
+	get_uuid_str(conn_ptr, uuid_handle, uuid, BT_UUID_STR_LEN);
+	uuid_len = strlen(uuid);
+	bt_to_upper(uuid, uuid_len);
 
+	*path_len = 0;
+	/* only characteristic values are forwarded with a path */
+	if (uuid_handle->attr_type != BT_ATTR_CHRC) {
+		return uuid_len + 1;
+	}
+	err = ble_conn_mgr_generate_path(conn_ptr, uuid_handle->handle,
+					 path, false);
+	if (err) {
+		return err;
+	}
+	*path_len = strlen(path);
+	err = ble_conn_mgr_generate_path(conn_ptr, uuid_handle->handle,
+					 path, true);
 	if (err) {
-		conn_ptr->uuid_handle_pairs[conn_ptr->num_pairs] = NULL;
 		return err;
 	}
+	return uuid_len + 1 + strlen(path) + 1;
+}
 
-	uuid_handle->properties = properties;
-	uuid_handle->attr_type = attr_type;
-	uuid_handle->path_depth = path_depth;
-	uuid_handle->is_service = is_service;
-	uuid_handle->handle = handle;
-	LOG_DBG("%d. Handle Added: %d", conn_ptr->num_pairs, handle);
+/* Render the uuid and path strings of each attribute once, so forwarding
+ * a notification only needs a binary search by handle. The entries and
+ * their strings share one allocation, sized by rendering everything once
+ * before it is made.
+ */
+int ble_conn_mgr_build_attr_index(struct ble_device_conn *conn_ptr)
+{
+	char uuid[BT_UUID_STR_LEN];
+	char path[BT_MAX_PATH_LEN];
+	struct ble_attr_index *attr_index;
+	size_t strs_len = 0;
+	uint8_t path_len;
+	char *strs;
+	int len;
+	int i;
+
+	free_attr_index(conn_ptr);
+	if (!conn_ptr->num_pairs) {
+		return -ENODATA;
+	}
+	relink_subs(conn_ptr);
+
+	for (i = 0; i < conn_ptr->num_pairs; i++) {
+		len = attr_strs_render(conn_ptr, i, uuid, path, &path_len);
+		if (len < 0) {
+			goto failed;
+		}
+		strs_len += len;
+	}
+
+	attr_index = k_malloc(conn_ptr->num_pairs * sizeof(*attr_index) +
+			      strs_len);
+	if (attr_index == NULL) {
+		LOG_ERR("Out of memory building attribute index for %s",
+			log_strdup(conn_ptr->addr));
+		return -ENOMEM;
+	}
+	strs = (char *)&attr_index[conn_ptr->num_pairs];
 
-	/* finally, store it in the array of pointers to uuid_handle_pairs */
-	conn_ptr->uuid_handle_pairs[conn_ptr->num_pairs] = uuid_handle;
+	/* pairs are sorted by handle, so the index is too */
+	for (i = 0; i < conn_ptr->num_pairs; i++) {
+		struct ble_attr_index *attr = &attr_index[i];
 
-	conn_ptr->num_pairs++;
+		len = attr_strs_render(conn_ptr, i, uuid, path, &path_len);
+		if (len < 0) {
+			k_free(attr_index);
+			goto failed;
+		}
+		attr->handle = conn_ptr->uuid_handle_pairs[i].handle;
+		attr->pair = i;
+		attr->uuid_len = strlen(uuid);
+		attr->path_len = path_len;
+		attr->strs = strs;
+		memcpy(strs, uuid, attr->uuid_len + 1);
+		if (path_len) {
+			memcpy(strs + attr->uuid_len + 1, path,
+			       len - (attr->uuid_len + 1));
+		}
+		strs += len;
+	}
 
+	conn_ptr->num_index = conn_ptr->num_pairs;
+	conn_ptr->attr_index = attr_index;
+	if (build_uuid_hash(conn_ptr)) {
+		/* lookups fall back to scanning the table */
+		LOG_WRN("No memory for uuid hash of %s",
+			log_strdup(conn_ptr->addr));
+	}
+	LOG_DBG("Attribute index for %s has %u entries, %u bytes of strings",
+		log_strdup(conn_ptr->addr), conn_ptr->num_index, strs_len);
 	return 0;
+
+failed:
+	LOG_ERR("Unable to build attribute index for %s: %d",
+		log_strdup(conn_ptr->addr), len);
+	return len;
 }
 
 struct ble_device_conn *get_connected_device(unsigned int i)
@@ -840,4 +1725,8 @@ void ble_conn_mgr_init()
 	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
 		init_conn(&connected_ble_devices[i]);
 	}
+	for (num_sub_free = 0; num_sub_free < ARRAY_SIZE(subs);
+	     num_sub_free++) {
+		sub_free[num_sub_free] = ARRAY_SIZE(subs) - 1 - num_sub_free;
+	}
 }
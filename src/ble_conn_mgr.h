@@ -3,8 +3,13 @@
 
 #include "ble.h"
 #include <bluetooth/uuid.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
 
+/* Attribute tables grow past this while memory allows, more slowly */
 #define MAX_UUID_PAIRS 68
+/* Hard ceiling; counts and indices are 8 bit */
+#define MAX_UUID_PAIRS_CEILING UINT8_MAX
 #define DEVICE_ADDR_LEN 18
 
 #define BT_MAX_UUID_LEN 37
@@ -12,42 +17,148 @@
 
 #define MAX_DFU_ATTEMPTS 3
 
-#define SMALL_UUID_HANDLE_PAIR_SIZE (sizeof(struct uuid_handle_pair) - \
-				     sizeof(struct bt_uuid_128) + \
-				     sizeof(struct bt_uuid_16))
-#define LARGE_UUID_HANDLE_PAIR_SIZE (sizeof(struct uuid_handle_pair))
-
 struct uuid_handle_pair {
 	uint16_t handle;
 	uint8_t uuid_type;
 	uint8_t attr_type;
 	uint8_t path_depth;
 	uint8_t properties;
-	bool is_service;
-	bool sub_enabled;
 	uint8_t sub_index;
+	bool is_service : 1;
+	bool sub_enabled : 1;
 	union {
 		struct bt_uuid_16 uuid_16;
-		struct bt_uuid_128 uuid_128;
+		/* into the device's uuids_128; use ble_conn_mgr_pair_uuid() */
+		uint8_t uuid_128_index;
 	};
 };
 
+/* Uppercase uuid and, for characteristics, the path used in cloud messages,
+ * rendered once when discovery completes; entries are sorted by handle
+ */
+struct ble_attr_index {
+	uint16_t handle;
+	uint8_t pair;
+	uint8_t uuid_len;
+	/* path without the trailing ccc uuid; 0 if no path was rendered */
+	uint8_t path_len;
+	/* uuid, then the path including the following ccc uuid if any;
+	 * points into the allocation holding the whole index
+	 */
+	char *strs;
+};
+
+/* Where each device is between being added and being usable by the cloud;
+ * changed only by the connection manager thread
+ */
+enum ble_conn_state {
+	BLE_CONN_STATE_IDLE,
+	/* in the controller's allowlist; link state not yet reported */
+	BLE_CONN_STATE_ALLOWLISTED,
+	/* waiting for the auto connect to reach the device */
+	BLE_CONN_STATE_CONNECTING,
+	BLE_CONN_STATE_CONNECTED,
+	BLE_CONN_STATE_DISCOVERING,
+	/* attribute table complete; not yet sent to the cloud */
+	BLE_CONN_STATE_DISCOVERED,
+	BLE_CONN_STATE_PUBLISHED,
+	/* firmware update in progress; lifecycle paused */
+	BLE_CONN_STATE_DFU,
+	BLE_CONN_STATE_COUNT
+};
+
+enum ble_conn_event {
+	BLE_CONN_EVT_ADDED,
+	BLE_CONN_EVT_REMOVED,
+	BLE_CONN_EVT_CONNECTED,
+	BLE_CONN_EVT_DISCONNECTED,
+	BLE_CONN_EVT_DISCOVERED,
+	BLE_CONN_EVT_DISCOVERY_FAILED,
+	/* cloud asked for the attribute table again */
+	BLE_CONN_EVT_REPUBLISH,
+	/* attribute table no longer matches the device */
+	BLE_CONN_EVT_STALE,
+	BLE_CONN_EVT_CLOUD_READY,
+	/* retry timer expired */
+	BLE_CONN_EVT_RETRY,
+	BLE_CONN_EVT_DFU_START,
+	BLE_CONN_EVT_DFU_END,
+	BLE_CONN_EVT_COUNT
+};
+
+struct ble_conn_trace {
+	/* k_uptime_get() when the transition happened */
+	int64_t time;
+	char addr[DEVICE_ADDR_LEN];
+	uint8_t from;
+	uint8_t to;
+	uint8_t evt;
+};
+
 struct ble_device_conn {
 	char addr[DEVICE_ADDR_LEN];
 	bt_addr_le_t bt_addr;
-	struct uuid_handle_pair *uuid_handle_pairs[MAX_UUID_PAIRS];
+	/* referenced while the link is up; see ble_conn_mgr_bind_conn() */
+	struct bt_conn *conn;
+	/* attribute table: one allocation holding max_pairs pairs sorted
+	 * by handle, then max_uuids_128 distinct 128-bit uuids; kept for
+	 * reuse when the device is rediscovered
+	 */
+	struct uuid_handle_pair *uuid_handle_pairs;
+	struct bt_uuid_128 *uuids_128;
 	uint8_t num_pairs;
+	uint8_t max_pairs;
+	uint8_t num_uuids_128;
+	uint8_t max_uuids_128;
+	struct ble_attr_index *attr_index;
+	uint8_t num_index;
+	/* subscriptions this device holds in the pool */
+	uint8_t num_subs;
+	/* open addressing table of service and characteristic pair indices
+	 * keyed by uuid value, 1 << uuid_hash_bits slots; built with
+	 * attr_index
+	 */
+	uint8_t *uuid_hash;
+	uint8_t uuid_hash_bits;
 	uint8_t dfu_attempts;
+	/* k_uptime_get() at connection, and ms from then until the
+	 * discovery result was sent; 0 until it was
+	 */
+	int64_t connect_time;
+	uint32_t ready_ms;
+	enum ble_conn_state state;
 	bool connected : 1;
-	bool discovering : 1;
 	bool free : 1;
 	bool discovered : 1;
-	bool encode_discovered : 1;
 	bool added_to_allowlist : 1;
-	bool shadow_updated : 1;
-	bool disconnect : 1;
 	bool dfu_pending : 1;
 	bool hidden : 1;
+	bool gatt_cache_hit : 1;
+	bool gatt_cache_save : 1;
+	bool gatt_cache_stale : 1;
+};
+
+/* A subscription from the pool shared by all devices; it belongs to dev
+ * and the characteristic at params.value_handle
+ */
+struct ble_sub {
+	/* must stay put while the host holds it */
+	struct bt_gatt_subscribe_params params;
+	/* NULL while free */
+	struct ble_device_conn *dev;
+	/* ccc value to restore on reconnect; 0 once unsubscribed */
+	uint8_t value;
+	uint8_t policy;
+	uint8_t prio;
+	/* unsubscribe in progress; freed when the host lets go */
+	bool releasing;
+};
+
+/* A 16 or 128-bit uuid parsed from a cloud message */
+union ble_uuid_any {
+	struct bt_uuid uuid;
+	struct bt_uuid_16 uuid_16;
+	struct bt_uuid_128 uuid_128;
 };
 
 struct desired_conn {
@@ -62,10 +173,19 @@ int ble_conn_mgr_calc_other_addr(const char *old_addr, char *new_addr,
 int ble_conn_mgr_generate_path(struct ble_device_conn *conn_ptr,
 			       uint16_t handle,
 				char *path, bool ccc);
+/* Queues the removal; the connection manager thread releases the device */
 int ble_conn_mgr_remove_conn(const char *addr);
 int ble_conn_mgr_get_free_conn(struct ble_device_conn **conn_ptr);
 int ble_conn_mgr_get_conn_by_addr(const char *addr,
 				  struct ble_device_conn **conn_ptr);
+int ble_conn_mgr_get_conn_by_bt_addr(const bt_addr_le_t *addr,
+				     struct ble_device_conn **conn_ptr);
+struct ble_device_conn *ble_conn_mgr_get_conn_by_bt_conn(struct bt_conn *conn);
+struct ble_device_conn *ble_conn_mgr_get_conn_by_index(uint8_t index);
+void ble_conn_mgr_bind_conn(struct ble_device_conn *conn_ptr,
+			    struct bt_conn *conn);
+void ble_conn_mgr_unbind_conn(struct bt_conn *conn);
+struct bt_conn *ble_conn_mgr_get_bt_conn(struct ble_device_conn *conn_ptr);
 int ble_conn_mgr_add_uuid_pair(const struct bt_uuid *uuid, uint16_t handle,
 			       uint8_t path_depth, uint8_t properties,
 			       uint8_t attr_type,
@@ -73,17 +193,48 @@ int ble_conn_mgr_add_uuid_pair(const struct bt_uuid *uuid, uint16_t handle,
 			       bool is_service);
 int ble_conn_mgr_get_uuid_by_handle(uint16_t handle, char *uuid,
 				    struct ble_device_conn *conn_ptr);
+/** uuid is either a characteristic or service uuid, or a service/
+ * characteristic path as sent by the cloud; returns 1 if not found
+ */
 int ble_conn_mgr_get_handle_by_uuid(uint16_t *handle, const char *uuid,
 				    struct ble_device_conn *conn_ptr);
+/** Parse 4 or 32 hex digits, dashes allowed, as printed by
+ * bt_uuid_get_str()
+ */
+int ble_conn_mgr_parse_uuid(const char *str, size_t len,
+			    union ble_uuid_any *uuid);
+/** Handle of the first service or characteristic whose uuid is chrc; when
+ * svc is given, only characteristics inside a service svc match.
+ * Returns -ENOENT if there is none.
+ */
+int ble_conn_mgr_find_handle(const struct ble_device_conn *conn_ptr,
+			     const struct bt_uuid *svc,
+			     const struct bt_uuid *chrc, uint16_t *handle);
+int ble_conn_mgr_build_attr_index(struct ble_device_conn *conn_ptr);
+const struct ble_attr_index *ble_conn_mgr_find_attr(
+				const struct ble_device_conn *conn_ptr,
+				uint16_t handle);
 void ble_conn_mgr_init();
 int ble_conn_set_connected(struct ble_device_conn *conn_ptr, bool connected);
-int ble_conn_mgr_set_subscribed(uint16_t handle, uint8_t sub_index,
-				struct ble_device_conn *conn_ptr);
-int ble_conn_mgr_remove_subscribed(uint16_t handle,
-				   struct ble_device_conn *conn_ptr);
-int ble_conn_mgr_get_subscribed(uint16_t handle,
-				struct ble_device_conn *conn_ptr,
-				bool *status, uint8_t *sub_index);
+/** Take a subscription from the pool for handle; NULL when the pool is
+ * empty or handle is not an attribute of conn_ptr
+ */
+struct ble_sub *ble_conn_mgr_alloc_sub(struct ble_device_conn *conn_ptr,
+				       uint16_t handle);
+/** Return sub to the pool; the host must no longer hold its params */
+void ble_conn_mgr_free_sub(struct ble_sub *sub);
+/** conn_ptr's subscription to handle, or NULL */
+struct ble_sub *ble_conn_mgr_get_sub(struct ble_device_conn *conn_ptr,
+				     uint16_t handle);
+/** Pool entry by index, whether in use or not; NULL past the end */
+struct ble_sub *ble_conn_mgr_get_sub_by_index(unsigned int index);
+/** Subscriptions in use across all devices */
+int ble_conn_mgr_num_subs(void);
+
+static inline uint8_t ble_conn_mgr_sub_index(const struct ble_sub *sub)
+{
+	return sub - ble_conn_mgr_get_sub_by_index(0);
+}
 void ble_conn_mgr_update_desired(const char *addr, uint8_t index);
 int ble_conn_mgr_add_desired(const char *addr, bool manual);
 int ble_conn_mgr_rem_desired(const char *addr, bool manual);
@@ -97,8 +248,52 @@ int get_num_connected(void);
 struct desired_conn *get_desired_array(int *array_size);
 bool ble_conn_mgr_is_addr_connected(const char *addr);
 void ble_conn_mgr_print_mem(void);
+/** Heap bytes held by conn_ptr's attribute arena and its string index */
+void ble_conn_mgr_get_mem(const struct ble_device_conn *conn_ptr,
+			  size_t *arena, size_t *index);
+/** Forget conn_ptr's attributes, keeping the arena for rediscovery */
+void ble_conn_mgr_clear_attrs(struct ble_device_conn *conn_ptr);
 int ble_conn_mgr_find_related_addr(const char *old_addr, char *new_addr, int len);
 int ble_conn_mgr_force_dfu_rediscover(const char *addr);
 void ble_conn_mgr_check_pending(void);
 
+/** Queue an event for conn_ptr's state machine; NULL applies it to every
+ * device. Safe to call from any context.
+ */
+void ble_conn_mgr_post(struct ble_device_conn *conn_ptr,
+		       enum ble_conn_event evt);
+
+/** Called from the connection manager thread once it has handled an
+ * event for conn_ptr
+ */
+typedef void (*ble_conn_event_cb_t)(struct ble_device_conn *conn_ptr,
+				    enum ble_conn_event evt);
+void ble_conn_mgr_set_event_cb(ble_conn_event_cb_t cb);
+
+/** Copy the i-th retained transition, oldest first; -ENOENT past the end */
+int ble_conn_mgr_get_trace(int i, struct ble_conn_trace *entry);
+const char *ble_conn_state_str(enum ble_conn_state state);
+const char *ble_conn_evt_str(enum ble_conn_event evt);
+
+static inline const struct bt_uuid *ble_conn_mgr_pair_uuid(
+				const struct ble_device_conn *conn_ptr,
+				const struct uuid_handle_pair *pair)
+{
+	if (pair->uuid_type == BT_UUID_TYPE_16) {
+		return &pair->uuid_16.uuid;
+	}
+	return &conn_ptr->uuids_128[pair->uuid_128_index].uuid;
+}
+
+static inline const char *ble_attr_uuid(const struct ble_attr_index *attr)
+{
+	return attr->strs;
+}
+
+/* Path including the ccc uuid when one follows the characteristic */
+static inline const char *ble_attr_path(const struct ble_attr_index *attr)
+{
+	return attr->path_len ? attr->strs + attr->uuid_len + 1 : NULL;
+}
+
 #endif
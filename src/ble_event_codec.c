@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <string.h>
+#include <bluetooth/uuid.h>
+#include <bluetooth/gatt.h>
+#include <net/nrf_cloud.h>
+
+#include "ble_codec.h"
+#include "json_writer.h"
+#include "timestamp.h"
+#include "ble_conn_mgr.h"
+#include "ble.h"
+#include "gateway.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(ble_event_codec, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
+
+extern struct ble_scanned_dev ble_scanned_devices[MAX_SCAN_RESULTS];
+
+char *get_time_str(char *dst, size_t len)
+{
+	int64_t unix_time_ms;
+
+	if (ts_now_ms(&unix_time_ms)) {
+		return NULL;
+	}
+	return ts_format(unix_time_ms, dst, len);
+}
+
+/* Open an event message up to and including its timestamp; members
+ * common to all event messages are written in the order cJSON used to.
+ * A time_ms of 0 stamps the event with the current time.
+ */
+static void event_open(struct json_writer *w, char *time_buf,
+		       size_t time_len, const char *type, int64_t time_ms)
+{
+	jw_obj_start(w);
+	jw_key_str(w, "type", "event");
+	jw_key_str(w, "gatewayId", gateway_id);
+	jw_key_null(w, "requestId");
+	jw_key_obj_start(w, "event");
+	jw_key_str(w, "type", type);
+	jw_key_str(w, "timestamp", time_ms ?
+		   ts_format(time_ms, time_buf, time_len) :
+		   get_time_str(time_buf, time_len));
+}
+
+static void event_start(struct json_writer *w, struct gw_msg *msg,
+			char *time_buf, size_t time_len, const char *type,
+			int64_t time_ms)
+{
+	jw_init(w, (char *)msg->data.ptr, msg->data_max_len);
+	event_open(w, time_buf, time_len, type, time_ms);
+}
+
+static int msg_finish(struct json_writer *w, struct gw_msg *msg)
+{
+	int len = jw_finish(w);
+
+	if (len < 0) {
+		if (len == -ENOMEM) {
+			LOG_ERR("Insufficient buffer size %d",
+				msg->data_max_len);
+		} else {
+			LOG_ERR("Unable to encode: %d", len);
+		}
+		return len;
+	}
+	msg->data.len = len;
+	LOG_DBG("Device JSON: %s", log_strdup((char *)msg->data.ptr));
+	return 0;
+}
+
+/* "device":{"id":addr,"address":{"address":addr[,"type":"random"]} */
+static void device_start(struct json_writer *w, const char *ble_address,
+			 bool addr_type)
+{
+	jw_key_obj_start(w, "device");
+	jw_key_str(w, "id", ble_address);
+	jw_key_obj_start(w, "address");
+	jw_key_str(w, "address", ble_address);
+	if (addr_type) {
+		/* TODO: Get Type; */
+		jw_key_str(w, "type", "random");
+	}
+	jw_obj_end(w);
+}
+
+/* Value changed, read and write result events for an attribute */
+static int attr_value_encode(const char *type, const char *attr,
+			     char *ble_address, const char *uuid,
+			     const char *path, char *value,
+			     uint16_t value_length, struct gw_msg *msg,
+			     int64_t rx_time_ms)
+{
+	struct json_writer w;
+	char str[64];
+
+	event_start(&w, msg, str, sizeof(str), type, rx_time_ms);
+	device_start(&w, ble_address, true);
+	jw_obj_end(&w);
+	jw_key_obj_start(&w, attr);
+	jw_key_str(&w, "uuid", uuid);
+	jw_key_str(&w, "path", path);
+	jw_key(&w, "value");
+	jw_bytes(&w, (const uint8_t *)value, value_length);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	return msg_finish(&w, msg);
+}
+
+int device_error_encode(char *ble_address, char *error_msg,
+			struct gw_msg *msg)
+{
+	/* TODO: Front end doesn't handle error messages yet.
+	 * This format may change.
+	 */
+	struct json_writer w;
+	char str[64];
+
+	jw_init(&w, (char *)msg->data.ptr, msg->data_max_len);
+	jw_obj_start(&w);
+	jw_key_str(&w, "type", "event");
+	jw_key_str(&w, "gatewayId", gateway_id);
+	jw_key_str(&w, "timestamp", get_time_str(str, sizeof(str)));
+
+	jw_key_obj_start(&w, "event");
+	jw_key_str(&w, "type", "error");
+	jw_key_obj_start(&w, "device");
+	jw_key_str(&w, "deviceAddress", ble_address);
+	jw_obj_end(&w);
+	jw_key_obj_start(&w, "error");
+	jw_key_str(&w, "description", error_msg);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	return msg_finish(&w, msg);
+}
+
+int device_found_encode(uint8_t num_devices_found, struct gw_msg *msg)
+{
+	struct json_writer w;
+	char str[64];
+
+	event_start(&w, msg, str, sizeof(str), "scan_result", 0);
+	jw_key_str(&w, "subType", "instant");
+	jw_key_bool(&w, "timeout", true);
+
+	jw_key(&w, "devices");
+	jw_arr_start(&w);
+	for (int i = 0; i < num_devices_found; i++) {
+		LOG_DBG("Adding device %s RSSI: %d\n",
+			log_strdup(ble_scanned_devices[i].addr),
+			ble_scanned_devices[i].rssi);
+
+		/* TODO: Update for beacons */
+		jw_obj_start(&w);
+		jw_key_str(&w, "deviceType", "BLE");
+		jw_key_int(&w, "rssi", ble_scanned_devices[i].rssi);
+		if (strlen(ble_scanned_devices[i].name) > 0) {
+			jw_key_str(&w, "name", ble_scanned_devices[i].name);
+		}
+		jw_key_obj_start(&w, "address");
+		jw_key_str(&w, "address", ble_scanned_devices[i].addr);
+		jw_obj_end(&w);
+		jw_obj_end(&w);
+	}
+	jw_arr_end(&w);
+
+	/* Figure out a messageId:
+	 * jw_key_int(&w, "messageId", 1);
+	 */
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	return msg_finish(&w, msg);
+}
+
+int device_connect_result_encode(char *ble_address, bool conn_status,
+				 struct gw_msg *msg)
+{
+	struct json_writer w;
+	char str[64];
+
+	event_start(&w, msg, str, sizeof(str), "device_connect_result", 0);
+	device_start(&w, ble_address, false);
+	jw_key_obj_start(&w, "status");
+	jw_key_bool(&w, "connected", conn_status);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	return msg_finish(&w, msg);
+}
+
+int device_disconnect_result_encode(char *ble_address, bool conn_status,
+				    struct gw_msg *msg)
+{
+	struct json_writer w;
+	char str[64];
+
+	event_start(&w, msg, str, sizeof(str), "device_disconnect", 0);
+	jw_key_obj_start(&w, "device");
+	jw_key_str(&w, "id", ble_address);
+	jw_key_obj_start(&w, "status");
+	jw_key_bool(&w, "connected", conn_status);
+	jw_obj_end(&w);
+	jw_key_obj_start(&w, "address");
+	jw_key_str(&w, "address", ble_address);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	jw_obj_end(&w);
+	return msg_finish(&w, msg);
+}
+
+int device_value_changed_encode(char *ble_address, const char *uuid,
+				const char *path, char *value,
+				uint16_t value_length,
+				struct gw_msg *msg, int64_t rx_time_ms)
+{
+	return attr_value_encode("device_characteristic_value_changed",
+				 "characteristic", ble_address, uuid, path,
+				 value, value_length, msg, rx_time_ms);
+}
+
+int device_value_write_result_encode(char *ble_address, char *uuid, char *path,
+				     char *value, uint16_t value_length,
+				     struct gw_msg *msg)
+{
+	return attr_value_encode("device_descriptor_value_write_result",
+				 "descriptor", ble_address, uuid, path,
+				 value, value_length, msg, 0);
+}
+
+int device_chrc_write_result_encode(char *ble_address, const char *uuid,
+				    const char *path, char *value,
+				    uint16_t value_length, struct gw_msg *msg)
+{
+	return attr_value_encode("device_characteristic_value_write_result",
+				 "characteristic", ble_address, uuid, path,
+				 value, value_length, msg, 0);
+}
+
+int device_descriptor_value_encode(char *ble_address, const char *uuid,
+				   const char *path, char *value,
+				   uint16_t value_length,
+				   struct gw_msg *msg, bool changed,
+				   int64_t rx_time_ms)
+{
+	return attr_value_encode(changed ?
+				 "device_descriptor_value_changed" :
+				 "device_descriptor_value_read_result",
+				 "descriptor", ble_address, uuid, path,
+				 value, value_length, msg, rx_time_ms);
+}
+
+int device_chrc_read_encode(char *ble_address, const char *uuid,
+			    const char *path, char *value,
+			    uint16_t value_length,
+			    struct gw_msg *msg, int64_t rx_time_ms)
+{
+	return attr_value_encode("device_characteristic_value_read_result",
+				 "characteristic", ble_address, uuid, path,
+				 value, value_length, msg, rx_time_ms);
+}
+
+void get_uuid_str(const struct ble_device_conn *conn_ptr,
+		  const struct uuid_handle_pair *uuid_handle, char *str,
+		  size_t len)
+{
+	if ((uuid_handle->uuid_type != BT_UUID_TYPE_16) &&
+	    (uuid_handle->uuid_type != BT_UUID_TYPE_128)) {
+		str[0] = '\0';
+		return;
+	}
+	bt_uuid_get_str(ble_conn_mgr_pair_uuid(conn_ptr, uuid_handle), str,
+			len);
+}
+
+#define CHRC_PROPS_KNOWN (BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | \
+			  BT_GATT_CHRC_INDICATE | BT_GATT_CHRC_NOTIFY | \
+			  BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_AUTH)
+
+static void chrc_props_write(struct json_writer *w, uint8_t properties)
+{
+	jw_key_obj_start(w, "properties");
+	if (properties & BT_GATT_CHRC_READ) {
+		jw_key_bool(w, "read", true);
+	}
+	if (properties & BT_GATT_CHRC_WRITE) {
+		jw_key_bool(w, "write", true);
+	}
+	if (properties & BT_GATT_CHRC_INDICATE) {
+		jw_key_bool(w, "indicate", true);
+	}
+	if (properties & BT_GATT_CHRC_NOTIFY) {
+		jw_key_bool(w, "notify", true);
+	}
+	if (properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP) {
+		jw_key_bool(w, "writeWithoutResponse", true);
+	}
+	if (properties & BT_GATT_CHRC_AUTH) {
+		jw_key_bool(w, "authorizedSignedWrite", true);
+	}
+	jw_obj_end(w);
+}
+
+/* Write the whole discovery document in one pass over the attribute
+ * table. A characteristic's descriptors object is left open so a
+ * following CCC can be added to it, and is closed by the next
+ * characteristic or service.
+ */
+static int discovery_write(struct json_writer *w,
+			   struct ble_device_conn *conn_ptr)
+{
+	char time_str[64];
+	char uuid_str[BT_UUID_STR_LEN];
+	char service_attr_str[BT_UUID_STR_LEN] = "";
+	char path_dep_two_str[BT_UUID_STR_LEN];
+	char path_str[BT_MAX_PATH_LEN] = "";
+	struct uuid_handle_pair *service = NULL;
+	bool in_service = false;
+	bool in_chrc = false;
+	uint8_t num_encoded = 0;
+	int ret = 0;
+
+	event_open(w, time_str, sizeof(time_str), "device_discover_result", 0);
+	jw_key_obj_start(w, "device");
+	jw_key_str(w, "id", conn_ptr->addr);
+	jw_key_obj_start(w, "status");
+	jw_key_bool(w, "connected", true);
+	jw_obj_end(w);
+	jw_key_obj_start(w, "address");
+	jw_key_str(w, "address", conn_ptr->addr);
+	jw_obj_end(w);
+	jw_obj_end(w);
+	jw_key_obj_start(w, "services");
+
+	for (int i = 0; i < conn_ptr->num_pairs; i++) {
+		struct uuid_handle_pair *uuid_handle;
+		struct uuid_handle_pair *uh = NULL;
+
+		uuid_handle = &conn_ptr->uuid_handle_pairs[i];
+		if (uuid_handle->is_service) {
+			service = uuid_handle;
+		}
+
+		if ((uuid_handle->uuid_type != BT_UUID_TYPE_16) &&
+		    (uuid_handle->uuid_type != BT_UUID_TYPE_128)) {
+			LOG_ERR("ERROR: unknown UUID type");
+			ret = -EINVAL;
+			continue;
+		}
+		get_uuid_str(conn_ptr, uuid_handle, uuid_str, BT_UUID_STR_LEN);
+
+		switch (uuid_handle->path_depth) {
+		case 1:
+			uh = service;
+			if (uh != NULL) {
+				get_uuid_str(conn_ptr, uh, service_attr_str,
+					     BT_UUID_STR_LEN);
+			}
+			snprintk(path_str, BT_MAX_PATH_LEN, "%s/%s",
+				 service_attr_str, uuid_str);
+			break;
+		case 2:
+			uh = (i > 0) ? &conn_ptr->uuid_handle_pairs[i - 1] :
+				       NULL;
+			if (uh != NULL) {
+				get_uuid_str(conn_ptr, uh, path_dep_two_str,
+					     BT_UUID_STR_LEN);
+				snprintk(path_str, BT_MAX_PATH_LEN, "%s/%s/%s",
+					 service_attr_str, path_dep_two_str,
+					 uuid_str);
+			}
+			break;
+		}
+		bt_to_upper(uuid_str, strlen(uuid_str));
+		bt_to_upper(path_str, strlen(path_str));
+
+		switch (uuid_handle->attr_type) {
+		case BT_ATTR_SERVICE:
+			LOG_INF("Encoding Service : UUID: %s",
+				log_strdup(uuid_str));
+			if (in_chrc) {
+				jw_obj_end(w); /* descriptors */
+				jw_obj_end(w); /* characteristic */
+				in_chrc = false;
+			}
+			if (in_service) {
+				jw_obj_end(w); /* characteristics */
+				jw_obj_end(w); /* service */
+			}
+			jw_key_obj_start(w, uuid_str);
+			jw_key_str(w, "uuid", uuid_str);
+			jw_key_obj_start(w, "characteristics");
+			in_service = true;
+			break;
+
+		case BT_ATTR_CHRC:
+			LOG_DBG("Encoding Characteristic : UUID: %s  PATH: %s",
+				log_strdup(uuid_str), log_strdup(path_str));
+			if (in_chrc) {
+				jw_obj_end(w);
+				jw_obj_end(w);
+				in_chrc = false;
+			}
+			if ((uuid_handle->properties == 0) ||
+			    (uuid_handle->properties & ~CHRC_PROPS_KNOWN)) {
+				LOG_ERR("Unknown CHRC property: %d\n",
+					uuid_handle->properties);
+				ret = -EINVAL;
+				continue;
+			}
+			jw_key_obj_start(w, uuid_str);
+			jw_key_str(w, "uuid", uuid_str);
+			jw_key_str(w, "path", path_str);
+			chrc_props_write(w, uuid_handle->properties);
+			jw_key(w, "value");
+			jw_arr_start(w);
+			jw_int(w, 0);
+			jw_arr_end(w);
+			jw_key_obj_start(w, "descriptors");
+			in_chrc = true;
+			break;
+
+		case BT_ATTR_CCC:
+			LOG_DBG("Encoding CCC : UUID: %s  PATH: %s",
+				log_strdup(uuid_str), log_strdup(path_str));
+			if (!in_chrc) {
+				LOG_ERR("CCC without characteristic");
+				ret = -EINVAL;
+				continue;
+			}
+			jw_key_obj_start(w, uuid_str);
+			jw_key_str(w, "uuid", uuid_str);
+			jw_key_str(w, "path", path_str);
+			jw_key(w, "value");
+			jw_arr_start(w);
+			jw_int(w, (uh && uh->sub_enabled) ?
+				  BT_GATT_CCC_NOTIFY : 0);
+			jw_int(w, 0);
+			jw_arr_end(w);
+			jw_obj_end(w);
+			break;
+
+		default:
+			LOG_ERR("Unknown Attr Type");
+			ret = -EINVAL;
+			continue;
+		}
+		num_encoded++;
+	}
+
+	/* make sure we output at least one attribute, or
+	 * device_discovery_send() will send malformed JSON
+	 */
+	if (!num_encoded) {
+		return ret ? ret : -EINVAL; /* no data to send */
+	}
+
+	if (in_chrc) {
+		jw_obj_end(w);
+		jw_obj_end(w);
+	}
+	if (in_service) {
+		jw_obj_end(w);
+		jw_obj_end(w);
+	}
+	jw_obj_end(w); /* services */
+	jw_obj_end(w); /* event */
+	jw_obj_end(w);
+
+	/* ignore invalid attributes since others were ok */
+	return 0;
+}
+
+int device_discovery_len(struct ble_device_conn *conn_ptr)
+{
+	struct json_writer w;
+	int ret;
+
+	jw_init(&w, NULL, 0);
+	ret = discovery_write(&w, conn_ptr);
+	if (ret) {
+		return ret;
+	}
+	return jw_finish(&w);
+}
+
+int device_discovery_encode(struct ble_device_conn *conn_ptr,
+			    struct gw_msg *msg)
+{
+	struct json_writer w;
+	int ret;
+
+	LOG_INF("Num Pairs: %d", conn_ptr->num_pairs);
+
+	jw_init(&w, (char *)msg->data.ptr, msg->data_max_len);
+	ret = discovery_write(&w, conn_ptr);
+	if (ret) {
+		return ret;
+	}
+	return msg_finish(&w, msg);
+}
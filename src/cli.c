@@ -31,6 +31,9 @@
 #include "nrf_cloud_transport.h"
 #include "ble.h"
 #include "ble_codec.h"
+#include "gatt_cache.h"
+#include "gatt_discovery.h"
+#include "gatt_ops.h"
 #include "ble_conn_mgr.h"
 #include "peripheral_dfu.h"
 #include "gateway.h"
@@ -121,6 +124,77 @@ void print_log_strdup(const struct shell *shell)
 		    num_free, num_used, max_used);
 }
 
+static const char * const rx_priorities[] = {"control", "alarm", "bulk"};
+
+void print_ble_rec(const struct shell *shell)
+{
+	struct ble_rec_stats stats;
+
+	ble_get_rec_stats(&stats);
+	for (int i = 0; i < BLE_RX_PRIOS; i++) {
+		struct ble_rec_lane_stats *ls = &stats.lanes[i];
+
+		shell_print(shell, "ble rec %s: \tSize:%u, Free:%u, "
+			    "Max Used:%u bytes, Queued:%u, Max Queued:%u",
+			    rx_priorities[i], ls->size, ls->free, ls->max_used,
+			    ls->queued, ls->max_queued);
+		shell_print(shell, "ble fwd %s: \tSent:%u, "
+			    "Latency Avg:%u us, Max:%u us",
+			    rx_priorities[i], ls->sent, ls->latency_avg_us,
+			    ls->latency_max_us);
+	}
+	shell_print(shell, "ble rec: \tQueued:%u, "
+		    "Exhausted:%u, Dropped:%u, Coalesced:%u",
+		    stats.queued,
+		    stats.exhausted, stats.dropped, stats.coalesced);
+	shell_print(shell, "ble fwd: \tSent:%u, Wakeups:%u, Max Drained:%u",
+		    stats.sent, stats.wakeups, stats.max_drained);
+	shell_print(shell, "ble fwd latency: \tMin:%u us, Avg:%u us, "
+		    "Max:%u us",
+		    stats.latency_min_us, stats.latency_avg_us,
+		    stats.latency_max_us);
+}
+
+void print_ble_batch(const struct shell *shell)
+{
+	struct ble_batch_stats stats;
+
+	ble_get_batch_stats(&stats);
+	shell_print(shell, "ble batch: \tSent:%u, Events:%u, Avg:%u, "
+		    "Max:%u events",
+		    stats.batches, stats.events,
+		    stats.batches ? stats.events / stats.batches : 0,
+		    stats.max_events);
+	shell_print(shell, "ble batch: \tBytes:%u, Avg:%u, Max:%u bytes",
+		    stats.bytes,
+		    stats.batches ? stats.bytes / stats.batches : 0,
+		    stats.max_bytes);
+	shell_print(shell, "ble batch flush: \tBytes:%u, Count:%u, "
+		    "Deadline:%u, Other:%u",
+		    stats.flushes[BLE_BATCH_FLUSH_BYTES],
+		    stats.flushes[BLE_BATCH_FLUSH_COUNT],
+		    stats.flushes[BLE_BATCH_FLUSH_DEADLINE],
+		    stats.flushes[BLE_BATCH_FLUSH_OTHER]);
+	shell_print(shell, "ble batch failed: \t%u batches, %u events",
+		    stats.failed, stats.failed_events);
+}
+
+void print_msg_pool(const struct shell *shell)
+{
+	static const char * const pool_names[GW_MSG_POOLS] = {
+		"small", "large"
+	};
+	struct gw_msg_pool_stats stats;
+
+	for (int i = 0; i < GW_MSG_POOLS; i++) {
+		gw_msg_get_pool_stats(i, &stats);
+		shell_print(shell, "msg pool %s: \tSize:%u, Count:%u, "
+			    "In use:%u, Max in use:%u, Waits:%u",
+			    pool_names[i], stats.size, stats.count,
+			    stats.in_use, stats.max_in_use, stats.waits);
+	}
+}
+
 void print_modem_info(const struct shell *shell)
 {
 #ifdef CONFIG_MODEM_INFO
@@ -388,6 +462,8 @@ static void print_scan_info(const struct shell *shell)
 	}
 }
 
+static const char * const rx_policies[] = {"keep", "latest", "drop"};
+
 static void print_conn_info(const struct shell *shell, bool show_path,
 			    bool notify)
 {
@@ -401,8 +477,8 @@ static void print_conn_info(const struct shell *shell, bool show_path,
 	const char *types[] = {"svc", "chr", "---", "ccc"};
 
 	if (!notify) {
-		shell_print(shell, "   MAC, connected, discovered, shadow"
-				   " updated, denylist status, ctrld by,"
+		shell_print(shell, "   MAC, connected, discovered, state,"
+				   " denylist status, ctrld by,"
 				   " visible, num UUIDs");
 	}
 	for (i = 0; i < CONFIG_BT_MAX_CONN; i++) {
@@ -415,16 +491,42 @@ static void print_conn_info(const struct shell *shell, bool show_path,
 			    count,
 			    dev->addr,
 			    dev->connected ? "CONNNECTED" : "disconnected",
-			    dev->discovered ? "DISCOVERED" :
-			    (dev->discovering ? "DISCOVERING" : "not dscvred"),
-			    dev->shadow_updated ? "SHADOW UPDATED" :
-			    "shadow not set",
+			    dev->discovered ? "DISCOVERED" : "not dscvred",
+			    ble_conn_state_str(dev->state),
 			    dev->added_to_allowlist ? "CONN ALLOWED" :
 			    "conn denied",
 			    ble_conn_mgr_enabled(dev->addr) ? "CLOUD" : "local",
 			    !dev->hidden ? "VISIBLE" : "hidden",
 			    (unsigned int)dev->num_pairs
 			   );
+		uint32_t coalesced;
+		uint32_t dropped;
+
+		if (!ble_get_conn_rx_stats(dev->addr, &coalesced, &dropped)) {
+			shell_print(shell, "   rx coalesced:%u, dropped:%u",
+				    coalesced, dropped);
+		}
+		if (notify) {
+			shell_print(shell, "   subscriptions: %u",
+				    dev->num_subs);
+		}
+		size_t arena;
+		size_t index;
+
+		ble_conn_mgr_get_mem(dev, &arena, &index);
+		if (arena) {
+			shell_print(shell, "   memory: %u B arena (%u/%u attrs,"
+				    " %u/%u uuid128), %u B index",
+				    arena, dev->num_pairs, dev->max_pairs,
+				    dev->num_uuids_128, dev->max_uuids_128,
+				    index);
+		}
+		if (dev->ready_ms) {
+			shell_print(shell, "   ready in %u ms, gatt %s",
+				    dev->ready_ms,
+				    dev->gatt_cache_hit ? "CACHED" :
+				    "discovered");
+		}
 		if (!notify) {
 			shell_print(shell, "   is service, UUID, UUID type, "
 					   "handle, type, path depth, "
@@ -432,14 +534,11 @@ static void print_conn_info(const struct shell *shell, bool show_path,
 					   "enabled");
 		}
 		for (j = 0; j < dev->num_pairs; j++) {
-			up = dev->uuid_handle_pairs[j];
-			if (up == NULL) {
-				continue;
-			}
+			up = &dev->uuid_handle_pairs[j];
 			if (notify && !up->sub_enabled) {
 				continue;
 			}
-			get_uuid_str(up, uuid_str, BT_UUID_STR_LEN);
+			get_uuid_str(dev, up, uuid_str, BT_UUID_STR_LEN);
 			shell_print(shell,
 				    "   %u, %s, %s, %u, %u, %s, %u, 0x%02X, %u, %s",
 				    j + 1,
@@ -454,6 +553,20 @@ static void print_conn_info(const struct shell *shell, bool show_path,
 				    (unsigned int)up->sub_index,
 				    up->sub_enabled ? "NOTIFY ON" : "notify off"
 			);
+			if (notify && up->sub_enabled) {
+				enum ble_rx_policy policy;
+				enum ble_rx_priority prio;
+
+				if (!ble_get_rx_policy(up->sub_index,
+						       &policy) &&
+				    !ble_get_rx_priority(up->sub_index,
+							 &prio)) {
+					shell_print(shell, "       policy: %s, "
+						    "priority: %s",
+						    rx_policies[policy],
+						    rx_priorities[prio]);
+				}
+			}
 			if (show_path) {
 				ble_conn_mgr_generate_path(dev, up->handle, path,
 						  up->attr_type == BT_ATTR_CCC);
@@ -462,6 +575,44 @@ static void print_conn_info(const struct shell *shell, bool show_path,
 			}
 		}
 	}
+#if defined(CONFIG_GATEWAY_GATT_CACHE)
+	if (!notify) {
+		struct gatt_cache_stats stats;
+
+		gatt_cache_get_stats(&stats);
+		shell_print(shell, "gatt cache: \tHits:%u, Misses:%u, "
+			    "Stale:%u, Saves:%u, Errors:%u",
+			    stats.hits, stats.misses, stats.stale,
+			    stats.saves, stats.errors);
+	}
+#endif
+	if (notify) {
+		shell_print(shell, "subscriptions: %d of %d in use",
+			    ble_conn_mgr_num_subs(),
+			    CONFIG_GATEWAY_BLE_SUBSCRIPTIONS);
+	}
+	if (!notify) {
+		struct gatt_discovery_stats disc;
+
+		gatt_discovery_get_stats(&disc);
+		shell_print(shell, "gatt discovery: Active:%u (max %u), "
+			    "Completed:%u, Failed:%u, Timeouts:%u",
+			    disc.active, disc.max_active, disc.completed,
+			    disc.failed, disc.timeouts);
+		shell_print(shell, "   last burst: %u devices in %u ms",
+			    disc.last_burst_devices, disc.last_burst_ms);
+
+		struct gatt_ops_stats ops;
+
+		gatt_ops_get_stats(&ops);
+		shell_print(shell, "gatt ops: Queued:%u (max %u), Active:%u "
+			    "(max %u), Completed:%u, Failed:%u, Rejected:%u",
+			    ops.queued, ops.max_queued, ops.active,
+			    ops.max_active, ops.completed, ops.failed,
+			    ops.rejected);
+		shell_print(shell, "   last burst: %u ops in %u ms",
+			    ops.last_burst_ops, ops.last_burst_ms);
+	}
 }
 
 static void print_irq_info(const struct shell *shell)
@@ -880,6 +1031,9 @@ static int cmd_info_gateway(const struct shell *shell, size_t argc, char **argv)
 	print_fw_info(shell);
 	print_heap(detailed);
 	print_log_strdup(shell);
+	print_ble_rec(shell);
+	print_ble_batch(shell);
+	print_msg_pool(shell);
 	return 0;
 }
 
@@ -949,6 +1103,144 @@ static int cmd_info_irq(const struct shell *shell, size_t argc,
 	return 0;
 }
 
+/* Connection manager state transitions, oldest first */
+static int cmd_info_trace(const struct shell *shell, size_t argc,
+			  char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct ble_conn_trace t;
+	int64_t first = 0;
+	int i;
+
+	shell_print(shell, "   uptime ms, +ms in state, MAC, from -> to, "
+			   "event");
+	for (i = 0; !ble_conn_mgr_get_trace(i, &t); i++) {
+		struct ble_conn_trace prev;
+		int64_t since = 0;
+		int j;
+
+		if (!i) {
+			first = t.time;
+		}
+		/* time spent in the state being left */
+		for (j = i - 1; j >= 0; j--) {
+			if (!ble_conn_mgr_get_trace(j, &prev) &&
+			    !strcmp(prev.addr, t.addr)) {
+				since = t.time - prev.time;
+				break;
+			}
+		}
+		shell_print(shell, "%8u %s%6u %s, %s -> %s, %s",
+			    (uint32_t)t.time, (j >= 0) ? "+" : " ",
+			    (uint32_t)since, t.addr,
+			    ble_conn_state_str(t.from),
+			    ble_conn_state_str(t.to),
+			    ble_conn_evt_str(t.evt));
+	}
+	if (!i) {
+		shell_print(shell, "No transitions recorded.");
+	} else {
+		shell_print(shell, "%d transitions over %u ms", i,
+			    (uint32_t)(t.time - first));
+	}
+	return 0;
+}
+
+#define GATT_BENCH_TIMEOUT_MS 10000
+
+static uint8_t gatt_bench_data(struct bt_conn *conn, struct gatt_op *op,
+			       const void *data, uint16_t length)
+{
+	return BT_GATT_ITER_CONTINUE;
+}
+
+/* Value handle of the device's first readable characteristic */
+static int gatt_bench_handle(struct ble_device_conn *dev)
+{
+	struct uuid_handle_pair *up;
+
+	for (int i = 0; i < dev->num_pairs; i++) {
+		up = &dev->uuid_handle_pairs[i];
+		if ((up->attr_type == BT_ATTR_CHRC) &&
+		    (up->properties & BT_GATT_CHRC_READ)) {
+			return up->handle;
+		}
+	}
+	return -ENOENT;
+}
+
+/* Read every connected device at once; the values are not forwarded */
+static int cmd_info_gatt(const struct shell *shell, size_t argc,
+			 char **argv)
+{
+	int per_dev = CONFIG_GATEWAY_GATT_OP_QUEUE_LEN;
+	struct gatt_ops_stats before;
+	struct gatt_ops_stats after;
+	struct ble_device_conn *dev;
+	struct bt_conn *conn;
+	struct gatt_op *op;
+	int devices = 0;
+	int queued = 0;
+	int64_t start;
+	uint32_t ms;
+	int handle;
+
+	if (argc > 1) {
+		per_dev = atoi(argv[1]);
+	}
+	if (gatt_ops_pending()) {
+		shell_error(shell, "GATT operations in progress");
+		return -EBUSY;
+	}
+
+	gatt_ops_get_stats(&before);
+	start = k_uptime_get();
+	for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+		dev = get_connected_device(i);
+		if ((dev == NULL) || !dev->connected || !dev->discovered) {
+			continue;
+		}
+		handle = gatt_bench_handle(dev);
+		conn = ble_conn_mgr_get_bt_conn(dev);
+		if ((handle < 0) || (conn == NULL)) {
+			if (conn != NULL) {
+				bt_conn_unref(conn);
+			}
+			continue;
+		}
+		devices++;
+		for (int j = 0; j < per_dev; j++) {
+			op = gatt_op_alloc();
+			if (op == NULL) {
+				break;
+			}
+			op->type = GATT_OP_READ;
+			op->handle = handle;
+			op->on_data = gatt_bench_data;
+			if (gatt_op_submit(conn, op)) {
+				gatt_op_free(op);
+				break;
+			}
+			queued++;
+		}
+		bt_conn_unref(conn);
+	}
+
+	while (gatt_ops_pending() &&
+	       ((k_uptime_get() - start) < GATT_BENCH_TIMEOUT_MS)) {
+		k_sleep(K_MSEC(1));
+	}
+	ms = k_uptime_get() - start;
+	gatt_ops_get_stats(&after);
+
+	shell_print(shell, "%d reads on %d devices in %u ms, %u per second",
+		    queued, devices, ms, ms ? (queued * 1000U) / ms : 0);
+	shell_print(shell, "failed %u, most devices in flight %u",
+		    after.failed - before.failed, after.max_active);
+	return 0;
+}
+
 #if CONFIG_GATEWAY_BLE_FOTA
 static int cmd_ble_test(const struct shell *shell, size_t argc, char **argv)
 {
@@ -959,6 +1251,30 @@ static int cmd_ble_test(const struct shell *shell, size_t argc, char **argv)
 	test_mode = !test_mode;
 	return 0;
 }
+
+static int cmd_info_dfu(const struct shell *shell, size_t argc, char **argv)
+{
+	struct peripheral_dfu_stats stats;
+
+	peripheral_dfu_get_stats(&stats);
+	shell_print(shell, "LTE download: %u bytes in %u ms, %u bytes/s, "
+		    "held back %u ms",
+		    stats.dl_bytes, stats.dl_ms,
+		    stats.dl_ms ? (uint32_t)(stats.dl_bytes * 1000LL /
+					     stats.dl_ms) : 0,
+		    stats.dl_stall_ms);
+	shell_print(shell, "BLE transfer: %u bytes in %u ms, %u bytes/s, "
+		    "waited %u ms",
+		    stats.ble_bytes, stats.ble_ms,
+		    stats.ble_ms ? (uint32_t)(stats.ble_bytes * 1000LL /
+					      stats.ble_ms) : 0,
+		    stats.ble_idle_ms);
+	shell_print(shell, "most buffers queued %u of %u",
+		    stats.max_queued, CONFIG_GATEWAY_DFU_BUFS);
+	shell_print(shell, "resumed, not sent again: %u bytes",
+		    stats.saved_bytes);
+	return 0;
+}
 #endif
 
 static int cmd_ble_scan(const struct shell *shell, size_t argc, char **argv)
@@ -1186,6 +1502,108 @@ static void get_dynamic_ble_dis(size_t idx, struct shell_static_entry *entry)
 
 SHELL_DYNAMIC_CMD_CREATE(dynamic_ble_dis, get_dynamic_ble_dis);
 
+static int cmd_ble_policy(const struct shell *shell, size_t argc, char **argv)
+{
+	char *arg = argv[0];
+	uint16_t handle;
+	int policy;
+	int err;
+
+	if ((argc < 3) || (get_cmd_type(arg) != BLE_CMD_MAC)) {
+		return -EINVAL;
+	}
+
+	handle = atoi(argv[1]);
+	for (policy = 0; policy < BLE_RX_POLICIES; policy++) {
+		if (strcmp(argv[2], rx_policies[policy]) == 0) {
+			break;
+		}
+	}
+	if (policy == BLE_RX_POLICIES) {
+		shell_error(shell, "Policy must be keep, latest or drop");
+		return -EINVAL;
+	}
+
+	err = ble_set_rx_policy(arg, handle, policy);
+	if (err) {
+		shell_error(shell, "Unable to set policy on MAC %s handle %u: %d",
+			    arg, handle, err);
+		return err;
+	}
+	shell_print(shell, "policy %s on MAC %s handle %u", argv[2], arg,
+		    handle);
+	return 0;
+}
+
+static void get_dynamic_ble_policy(size_t idx,
+				   struct shell_static_entry *entry)
+{
+	entry->syntax = get_cmd_param(idx);
+
+	if (entry->syntax == NULL) {
+		return;
+	}
+
+	entry->handler = cmd_ble_policy;
+	entry->subcmd = NULL;
+	entry->help = DYNAMIC_PARAM_HELP;
+	entry->args.mandatory = 3;
+	entry->args.optional = 0;
+}
+
+SHELL_DYNAMIC_CMD_CREATE(dynamic_ble_policy, get_dynamic_ble_policy);
+
+static int cmd_ble_prio(const struct shell *shell, size_t argc, char **argv)
+{
+	char *arg = argv[0];
+	uint16_t handle;
+	int prio;
+	int err;
+
+	if ((argc < 3) || (get_cmd_type(arg) != BLE_CMD_MAC)) {
+		return -EINVAL;
+	}
+
+	handle = atoi(argv[1]);
+	for (prio = 0; prio < BLE_RX_PRIOS; prio++) {
+		if (strcmp(argv[2], rx_priorities[prio]) == 0) {
+			break;
+		}
+	}
+	if (prio == BLE_RX_PRIOS) {
+		shell_error(shell, "Priority must be control, alarm or bulk");
+		return -EINVAL;
+	}
+
+	err = ble_set_rx_priority(arg, handle, prio);
+	if (err) {
+		shell_error(shell, "Unable to set priority on MAC %s "
+			    "handle %u: %d", arg, handle, err);
+		return err;
+	}
+	shell_print(shell, "priority %s on MAC %s handle %u", argv[2], arg,
+		    handle);
+	return 0;
+}
+
+static void get_dynamic_ble_prio(size_t idx,
+				 struct shell_static_entry *entry)
+{
+	entry->syntax = get_cmd_param(idx);
+
+	if (entry->syntax == NULL) {
+		return;
+	}
+
+	entry->handler = cmd_ble_prio;
+	entry->subcmd = NULL;
+	entry->help = DYNAMIC_PARAM_HELP;
+	entry->args.mandatory = 3;
+	entry->args.optional = 0;
+}
+
+SHELL_DYNAMIC_CMD_CREATE(dynamic_ble_prio, get_dynamic_ble_prio);
+
 static void set_at_prompt(const struct shell *shell, bool at_mode)
 {
 	static bool normal_prompt = true;
@@ -1547,6 +1965,13 @@ SHELL_STATIC_SUBCMD_SET_CREATE(sub_info,
 	          cmd_info_conn),
 	SHELL_CMD(gateway, NULL, "<verbose> Gateway information.",
 		  cmd_info_gateway),
+	SHELL_COND_CMD(CONFIG_GATEWAY_DBG_CMDS,
+		       gatt, NULL, "[reads per device] GATT read throughput "
+		       "across connected devices.",
+		       cmd_info_gatt),
+	SHELL_COND_CMD(CONFIG_GATEWAY_BLE_FOTA,
+		       dfu, NULL, "BLE DFU download and transfer rates.",
+		       cmd_info_dfu),
 	SHELL_COND_CMD(CONFIG_GATEWAY_DBG_CMDS,
 		       irq, NULL, "Dump IRQ table.", cmd_info_irq),
 	SHELL_COND_CMD(CONFIG_GATEWAY_DBG_CMDS,
@@ -1558,6 +1983,8 @@ SHELL_STATIC_SUBCMD_SET_CREATE(sub_info,
 		       "List parameters.", NULL),
 	SHELL_CMD(scan, NULL, "Bluetooth scan results.",
 		  cmd_info_scan),
+	SHELL_CMD(trace, NULL, "Bluetooth device state transitions.",
+		  cmd_info_trace),
 	SHELL_SUBCMD_SET_END /* Array terminated. */
 );
 SHELL_CMD_REGISTER(info, &sub_info, "Informational commands", NULL);
@@ -1576,6 +2003,12 @@ SHELL_STATIC_SUBCMD_SET_CREATE(sub_ble,
 	SHELL_CMD(dis, &dynamic_ble_dis,
 		  "<all | MAC [all | handle]> Disable "
 		  "notifications on BLE device(s).", NULL),
+	SHELL_CMD(policy, &dynamic_ble_policy,
+		  "<MAC> <handle> <keep | latest | drop> Set queueing "
+		  "policy for a subscribed characteristic.", NULL),
+	SHELL_CMD(prio, &dynamic_ble_prio,
+		  "<MAC> <handle> <control | alarm | bulk> Set forwarding "
+		  "priority for a subscribed characteristic.", NULL),
 #if CONFIG_GATEWAY_BLE_FOTA
 	SHELL_CMD(fota, &dynamic_ble_fota,
 		 "<addr> <host> <path> <size> <final> "
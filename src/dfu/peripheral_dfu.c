@@ -1,10 +1,14 @@
 #include <zephyr.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
 #include <malloc.h>
 #include <logging/log.h>
 #include <net/fota_download.h>
 #include <sys/crc.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+#include <settings/settings.h>
 #include <cJSON.h>
 
 #include "nrf_cloud_fota.h"
@@ -19,8 +23,20 @@ LOG_MODULE_REGISTER(peripheral_dfu, CONFIG_NRF_CLOUD_FOTA_LOG_LEVEL);
 #define DFU_PACKET_UUID            "8EC90002F3154F609FB8838830DAEA50"
 #define DFU_BUTTONLESS_UUID        "8EC90003F3154F609FB8838830DAEA50"
 #define DFU_BUTTONLESS_BONDED_UUID "8EC90004F3154F609FB8838830DAEA50"
-#define MAX_CHUNK_SIZE 20
+/* payload of a write without response at the default ATT MTU */
+#define MIN_CHUNK_SIZE 20
+#define DEFAULT_ATT_MTU 23
+#define DFU_NOTIFY_LEN 20
+/* data packets handed to the host and not yet sent */
+#define TX_WINDOW 8
 #define PROGRESS_UPDATE_INTERVAL 5
+/* how long the download waits for the target to take a buffer */
+#define DFU_BUF_TIMEOUT K_SECONDS(60)
+#define DFU_SEND_STACK_SIZE 3072
+#define DFU_SEND_PRIORITY 7
+#define DFU_RESUME_SUBTREE "gw_dfu"
+#define DFU_RESUME_VERSION 1
+#define DFU_RESUME_KEY_LEN 32
 #define MAX_FOTA_FILES 2
 
 #define CALL_TO_PRINTK(fmt, ...) do {		 \
@@ -159,10 +175,10 @@ static uint32_t flash_page_size;
 static uint32_t page_remaining;
 
 /* responses from peripheral device */
-static bool notify_received;
+static K_SEM_DEFINE(notify_sem, 0, 1);
 static bool normal_mode;
 static uint16_t notify_length;
-static uint8_t dfu_notify_data[MAX_CHUNK_SIZE];
+static uint8_t dfu_notify_data[DFU_NOTIFY_LEN];
 
 /* normal mode BLE device address */
 static char ble_norm_addr[BT_ADDR_STR_LEN];
@@ -179,6 +195,7 @@ struct dfu_notify_packet *dfu_notify_packet_data =
 
 static struct nrf_cloud_fota_ble_job fota_ble_job;
 static struct nrf_cloud_fota_job_info fota_files[MAX_FOTA_FILES];
+static size_t prev_update_percent;
 static int total_completed_size;
 static int active_num;
 static int num_fota_files;
@@ -193,14 +210,162 @@ static bool init_packet;
 static bool use_printk;
 static struct download_client dlc;
 
+/* data packet size and packets between receipt notifications, set
+ * from the link negotiated before streaming
+ */
+static uint16_t chunk_size = MIN_CHUNK_SIZE;
+static uint16_t prn_interval;
+static uint16_t prn_left;
+static K_SEM_DEFINE(mtu_sem, 0, 1);
+static uint8_t mtu_err;
+static K_SEM_DEFINE(tx_window, TX_WINDOW, TX_WINDOW);
+
+/* DFU target's packet and control point characteristics, opened once
+ * the link is set up
+ */
+static struct ble_chan packet_chan;
+static struct ble_chan ctrl_chan;
+
+/* Steps of a Secure DFU job. Every wait on the target is bounded by the
+ * timeout of the step it happens in, and the time spent in each step is
+ * reported at the end of the job.
+ */
+enum dfu_state {
+	DFU_IDLE,
+	/* buttonless device restarting into its bootloader */
+	DFU_SWITCHING,
+	/* bootloader being connected and discovered */
+	DFU_CONNECTING,
+	/* PHY, data length and MTU negotiation */
+	DFU_LINK,
+	/* receipt interval, versions and the target's current object */
+	DFU_SELECT,
+	DFU_CREATE,
+	DFU_STREAM,
+	DFU_CRC,
+	DFU_EXECUTE,
+	/* waiting for the next fragment of the file */
+	DFU_DOWNLOAD,
+	DFU_STATES
+};
+
+/* The timeout bounds each wait for the target in that state; an Abort
+ * can be sent from any of them, so none is 0
+ */
+static const struct {
+	const char *name;
+	uint16_t timeout_ms;
+} dfu_states[DFU_STATES] = {
+	[DFU_IDLE] = {"idle", 5000},
+	[DFU_SWITCHING] = {"switch", 10000},
+	[DFU_CONNECTING] = {"connect", 30000},
+	[DFU_LINK] = {"link", 5000},
+	[DFU_SELECT] = {"select", 10000},
+	[DFU_CREATE] = {"create", 10000},
+	[DFU_STREAM] = {"stream", 5000},
+	[DFU_CRC] = {"crc", 5000},
+	[DFU_EXECUTE] = {"execute", 10000},
+	[DFU_DOWNLOAD] = {"download", 5000}
+};
+
+static enum dfu_state dfu_state;
+static int64_t state_start;
+static uint32_t phase_ms[DFU_STATES];
+static int64_t job_start;
+
+/* given on every connection manager event while waiting for the
+ * bootloader to be discovered
+ */
+static K_SEM_DEFINE(conn_sem, 0, 1);
+
+/* CRC of the object stream sent so far, and the offset the target last
+ * confirmed with a receipt
+ */
+static uint32_t stream_crc;
+static uint32_t receipt_offset;
+
+/* The download client thread gathers fragments into page buffers which
+ * the sender thread streams to the target, so the next page downloads
+ * while the last one is sent. With every buffer waiting to be sent the
+ * download client thread blocks, which holds back the download.
+ */
+enum dfu_buf_flags {
+	/* final buffer of the file, possibly empty */
+	DFU_BUF_LAST = BIT(0),
+	/* the download failed; cancel the job */
+	DFU_BUF_ABORT = BIT(1),
+	/* set up the target, then start downloading */
+	DFU_BUF_START = BIT(2)
+};
+
+struct dfu_buf {
+	void *fifo_reserved;
+	uint16_t len;
+	uint8_t flags;
+	/* download the buffer belongs to; older ones are dropped */
+	uint8_t gen;
+	uint8_t *data;
+};
+
+static uint8_t dfu_buf_data[CONFIG_GATEWAY_DFU_BUFS]
+			   [CONFIG_GATEWAY_DFU_BUF_SIZE];
+static struct dfu_buf dfu_bufs[CONFIG_GATEWAY_DFU_BUFS];
+static struct dfu_buf abort_buf = {.flags = DFU_BUF_ABORT};
+static struct dfu_buf start_buf = {.flags = DFU_BUF_START};
+static const char *dl_file;
+static atomic_t abort_queued;
+static K_FIFO_DEFINE(dfu_free_fifo);
+static K_FIFO_DEFINE(dfu_send_fifo);
+/* only used by the download client thread */
+static struct dfu_buf *fill_buf;
+static bool dl_first;
+static int64_t dl_mark;
+/* the sender failed the current download */
+static atomic_t send_failed;
+static uint8_t pipe_gen;
+static atomic_t pipe_queued;
+static struct peripheral_dfu_stats pipe_stats;
+
+/* How far the target got with each file, kept in settings per target so
+ * an interrupted job carries on from the last object the target executed
+ * instead of from the start
+ */
+struct dfu_resume_file {
+	/* crc32 of the file's path */
+	uint32_t path_crc;
+	uint32_t size;
+	/* end of the last object executed, and the CRC of the file up
+	 * to there as computed here while sending it
+	 */
+	uint32_t exec_offset;
+	uint32_t exec_crc;
+} __packed;
+
+struct dfu_resume {
+	uint8_t version;
+	uint8_t reserved[3];
+	/* init packet, then firmware */
+	struct dfu_resume_file files[2];
+} __packed;
+
+static struct dfu_resume resume;
+
 static int send_select_command(char *ble_addr);
 static int send_create_command(char *ble_addr, uint32_t size);
 static int send_switch_to_dfu(char *ble_addr);
 static int send_select_data(char *ble_addr);
 static int send_create_data(char *ble_addr, uint32_t size);
 static int send_prn(char *ble_addr, uint16_t receipt_rate);
-static int send_data(char *ble_addr, const char *buf, size_t len);
+static void dfu_set_state(enum dfu_state state);
+static int link_setup(void);
+static int dfu_setup(void);
+static void resume_save(void);
+static void resume_clear(void);
+static uint16_t prn_size(void);
+static int send_data(char *ble_addr, const char *buf, size_t len,
+		     size_t offset);
 static int send_request_crc(char *ble_addr);
+static int check_crc(char *ble_addr);
 static int send_execute(char *ble_addr);
 static int send_abort(char *ble_addr);
 static void on_sent(struct bt_conn *conn, uint8_t err,
@@ -208,6 +373,7 @@ static void on_sent(struct bt_conn *conn, uint8_t err,
 static int send_hw_version_get(char *ble_addr);
 static int send_fw_version_get(char *ble_addr, uint8_t fw_type);
 static uint8_t peripheral_dfu(const char *buf, size_t len);
+static int job_progress(size_t percent);
 static int download_client_callback(const struct download_client_evt *event);
 static void cancel_dfu(enum nrf_cloud_fota_error error);
 static void fota_ble_callback(const struct nrf_cloud_fota_ble_job *
@@ -241,21 +407,41 @@ static int notification_callback(const char *addr, const char *chrc_uuid,
 	}
 	notify_length = MIN(len, sizeof(dfu_notify_data));
 	memcpy(dfu_notify_data, data, notify_length);
-	notify_received = true;
+	k_sem_give(&notify_sem);
 	LOG_DBG("%sdfu notified %u bytes", normal_mode ? "secure " : "", notify_length);
 	LOG_HEXDUMP_DBG(data, notify_length, "notify packet");
 	return 1;
 }
 
-static int wait_for_notification(void)
+static void dfu_set_state(enum dfu_state state)
 {
-	int max_loops = 1000;
+	int64_t now = k_uptime_get();
+
+	phase_ms[dfu_state] += now - state_start;
+	state_start = now;
+	if (state != dfu_state) {
+		LOG_DBG("DFU state %s -> %s", dfu_states[dfu_state].name,
+			dfu_states[state].name);
+		dfu_state = state;
+	}
+}
 
-	while (!notify_received) {
-		k_sleep(K_MSEC(10));
-		if (!max_loops--) {
-			return -ETIMEDOUT;
-		}
+static k_timeout_t state_timeout(void)
+{
+	return K_MSEC(dfu_states[dfu_state].timeout_ms);
+}
+
+static void conn_event(struct ble_device_conn *conn_ptr,
+		       enum ble_conn_event evt)
+{
+	k_sem_give(&conn_sem);
+}
+
+/* The caller resets notify_sem before sending what the target answers */
+static int wait_for_notification(void)
+{
+	if (k_sem_take(&notify_sem, state_timeout())) {
+		return -ETIMEDOUT;
 	}
 	return 0;
 }
@@ -392,6 +578,11 @@ int peripheral_dfu_init(void)
 	int err;
 
 	k_work_init_delayable(&fota_job_work, fota_job_next);
+	ble_conn_mgr_set_event_cb(conn_event);
+	for (int i = 0; i < ARRAY_SIZE(dfu_bufs); i++) {
+		dfu_bufs[i].data = dfu_buf_data[i];
+		k_fifo_put(&dfu_free_fifo, &dfu_bufs[i]);
+	}
 
 	err = download_client_init(&dlc, download_client_callback);
 	if (err) {
@@ -402,9 +593,17 @@ int peripheral_dfu_init(void)
 
 int peripheral_dfu_cleanup(void)
 {
+	struct ble_device_conn *conn;
+
+	if (!ble_conn_mgr_get_conn_by_addr(ble_norm_addr, &conn)) {
+		ble_conn_mgr_post(conn, BLE_CONN_EVT_DFU_END);
+	}
+	ble_chan_close(&packet_chan);
+	ble_chan_close(&ctrl_chan);
 	ble_subscribe(ble_norm_addr, DFU_BUTTONLESS_UUID, 0);
 	ble_conn_mgr_remove_conn(ble_dfu_addr);
 	ble_conn_mgr_rem_desired(ble_dfu_addr, true);
+	dfu_set_state(DFU_IDLE);
 	k_sem_give(&peripheral_dfu_active);
 	return 0;
 }
@@ -414,6 +613,7 @@ int peripheral_dfu_config(const char *addr, int size, const char *version,
 {
 	struct ble_device_conn *conn;
 	uint16_t handle;
+	int64_t deadline;
 	int err;
 
 	err = ble_conn_mgr_get_conn_by_addr(addr, &conn);
@@ -431,6 +631,12 @@ int peripheral_dfu_config(const char *addr, int size, const char *version,
 	}
 
 	dfu_conn_ptr = NULL;
+	job_start = k_uptime_get();
+	state_start = job_start;
+	dfu_state = DFU_IDLE;
+	memset(phase_ms, 0, sizeof(phase_ms));
+	memset(&pipe_stats, 0, sizeof(pipe_stats));
+	k_sem_reset(&conn_sem);
 
 	strncpy(ble_norm_addr, addr, sizeof(ble_norm_addr));
 
@@ -470,18 +676,18 @@ int peripheral_dfu_config(const char *addr, int size, const char *version,
 	}
 
 	LOG_INF("Enabling indication");
-	err = ble_subscribe(ble_norm_addr, DFU_BUTTONLESS_UUID,
-			    BT_GATT_CCC_INDICATE);
+	err = ble_subscribe_prio(ble_norm_addr, DFU_BUTTONLESS_UUID,
+				 BT_GATT_CCC_INDICATE, BLE_RX_PRIO_CONTROL);
 	if (err) {
 		goto failed;
 	}
 
 	LOG_INF("Switching to DFU mode");
+	dfu_set_state(DFU_SWITCHING);
 	err = send_switch_to_dfu(ble_norm_addr);
 	if (err) {
 		goto failed;
 	}
-	int max_loops = 300;
 
 	err = ble_conn_mgr_get_conn_by_addr(ble_dfu_addr, &conn);
 	if (err) {
@@ -492,12 +698,16 @@ int peripheral_dfu_config(const char *addr, int size, const char *version,
 	conn->hidden = true;
 
 	LOG_INF("Waiting for device discovery...");
-	while (!conn->discovered && !conn->encode_discovered) {
-		k_sleep(K_MSEC(100));
-		if (!max_loops--) {
-			LOG_ERR("Timeout: conn:%u, ding:%u, disc:%u, enc:%u, np:%u",
-				conn->connected, conn->discovering,
-				conn->discovered, conn->encode_discovered,
+	dfu_set_state(DFU_CONNECTING);
+	deadline = k_uptime_get() + dfu_states[DFU_CONNECTING].timeout_ms;
+	while (!conn->discovered) {
+		int64_t remaining = deadline - k_uptime_get();
+
+		if ((remaining <= 0) ||
+		    k_sem_take(&conn_sem, K_MSEC(remaining))) {
+			LOG_ERR("Timeout: conn:%u, state:%s, np:%u",
+				conn->connected,
+				ble_conn_state_str(conn->state),
 				conn->num_pairs);
 			err = -ETIMEDOUT;
 			goto failed;
@@ -506,19 +716,195 @@ int peripheral_dfu_config(const char *addr, int size, const char *version,
 	LOG_INF("Continuing BLE DFU");
 
 ready:
+	total_completed_size = 0;
 	strncpy(app_version, version, sizeof(app_version));
 	image_size = size;
 	original_crc = crc;
 	init_packet = init_pkt;
 	use_printk = use_prtk;
 	dfu_conn_ptr = conn;
+	if (!ble_conn_mgr_get_conn_by_addr(ble_norm_addr, &conn)) {
+		ble_conn_mgr_post(conn, BLE_CONN_EVT_DFU_START);
+	}
 	return 0;
 
 failed:
 	LOG_ERR("Error configuring update:%d", err);
+	dfu_set_state(DFU_IDLE);
 	return err;
 }
 
+static int pipe_get_buf(void)
+{
+	int64_t start = k_uptime_get();
+
+	fill_buf = k_fifo_get(&dfu_free_fifo, DFU_BUF_TIMEOUT);
+	pipe_stats.dl_stall_ms += k_uptime_get() - start;
+	if (fill_buf == NULL) {
+		LOG_ERR("Timeout waiting for a DFU buffer");
+		return -ETIMEDOUT;
+	}
+	fill_buf->len = 0;
+	fill_buf->flags = 0;
+	fill_buf->gen = pipe_gen;
+	return 0;
+}
+
+static void pipe_send_buf(void)
+{
+	atomic_val_t queued = atomic_inc(&pipe_queued) + 1;
+
+	pipe_stats.max_queued = MAX(pipe_stats.max_queued, queued);
+	k_fifo_put(&dfu_send_fifo, fill_buf);
+	fill_buf = NULL;
+}
+
+/* Called from the download client thread with each fragment; blocks while
+ * every buffer is waiting to be sent
+ */
+static int pipe_put(const uint8_t *buf, size_t len)
+{
+	size_t n;
+	int err;
+
+	pipe_stats.dl_ms += k_uptime_get() - dl_mark;
+	pipe_stats.dl_bytes += len;
+
+	while (len) {
+		if (atomic_get(&send_failed)) {
+			return -ECANCELED;
+		}
+		if (fill_buf == NULL) {
+			err = pipe_get_buf();
+			if (err) {
+				return err;
+			}
+		}
+		n = MIN(len, CONFIG_GATEWAY_DFU_BUF_SIZE - fill_buf->len);
+		memcpy(&fill_buf->data[fill_buf->len], buf, n);
+		fill_buf->len += n;
+		buf += n;
+		len -= n;
+		if (fill_buf->len == CONFIG_GATEWAY_DFU_BUF_SIZE) {
+			pipe_send_buf();
+		}
+	}
+	dl_mark = k_uptime_get();
+	return 0;
+}
+
+/* Hand over what is left of the file, marked as its end */
+static int pipe_end(void)
+{
+	int err;
+
+	if (fill_buf == NULL) {
+		err = pipe_get_buf();
+		if (err) {
+			return err;
+		}
+	}
+	fill_buf->flags |= DFU_BUF_LAST;
+	pipe_send_buf();
+	return 0;
+}
+
+static void pipe_abort(void)
+{
+	if (atomic_cas(&abort_queued, 0, 1)) {
+		abort_buf.gen = pipe_gen;
+		k_fifo_put(&dfu_send_fifo, &abort_buf);
+	}
+}
+
+static void pipe_start(void)
+{
+	int offset = 0;
+	int err;
+
+	if (!test_mode) {
+		offset = dfu_setup();
+	}
+	if (offset == -EALREADY) {
+		(void)download_client_disconnect(&dlc);
+		total_completed_size += resume.files[!init_packet].size;
+		if (fota_ble_job.info.id &&
+		    job_progress((100 * total_completed_size) /
+				 fota_ble_job.info.file_size)) {
+			cancel_dfu(NRF_CLOUD_FOTA_ERROR_APPLY_FAIL);
+			return;
+		}
+		k_work_reschedule(&fota_job_work, K_NO_WAIT);
+		return;
+	}
+	if (offset >= 0) {
+		dl_mark = k_uptime_get();
+		err = download_client_start(&dlc, dl_file, offset);
+		if (!err) {
+			return;
+		}
+		LOG_ERR("Unable to start download: %d", err);
+	}
+	(void)download_client_disconnect(&dlc);
+	atomic_set(&send_failed, 1);
+	cancel_dfu(NRF_CLOUD_FOTA_ERROR_APPLY_FAIL);
+}
+
+static void dfu_send_process(int unused1, int unused2, int unused3)
+{
+	struct dfu_buf *b;
+	int64_t start;
+	bool current;
+
+	while (1) {
+		b = k_fifo_get(&dfu_send_fifo, K_FOREVER);
+		current = (b->gen == pipe_gen) && !atomic_get(&send_failed);
+
+		if (b->flags & DFU_BUF_ABORT) {
+			atomic_clear(&abort_queued);
+			if (current) {
+				atomic_set(&send_failed, 1);
+				cancel_dfu(NRF_CLOUD_FOTA_ERROR_DOWNLOAD);
+			}
+			continue;
+		}
+		if (b->flags & DFU_BUF_START) {
+			if (current) {
+				pipe_start();
+			}
+			continue;
+		}
+
+		if (current && b->len) {
+			start = k_uptime_get();
+			if (peripheral_dfu(b->data, b->len)) {
+				/* the job has been cancelled */
+				LOG_ERR("Error from peripheral_dfu");
+				atomic_set(&send_failed, 1);
+				current = false;
+			} else {
+				pipe_stats.ble_bytes += b->len;
+			}
+			pipe_stats.ble_ms += k_uptime_get() - start;
+		}
+		if (current && (b->flags & DFU_BUF_LAST)) {
+			k_work_reschedule(&fota_job_work, K_SECONDS(1));
+		}
+		atomic_dec(&pipe_queued);
+		k_fifo_put(&dfu_free_fifo, b);
+	}
+}
+
+K_THREAD_DEFINE(dfu_send_thread, DFU_SEND_STACK_SIZE,
+		dfu_send_process, NULL, NULL, NULL,
+		DFU_SEND_PRIORITY, 0, 0);
+
+void peripheral_dfu_get_stats(struct peripheral_dfu_stats *stats)
+{
+	*stats = pipe_stats;
+	stats->ble_idle_ms = phase_ms[DFU_DOWNLOAD];
+}
+
 int peripheral_dfu_start(const char *host, const char *file, int sec_tag,
 			 const char *apn, size_t fragment_size)
 {
@@ -539,20 +925,28 @@ int peripheral_dfu_start(const char *host, const char *file, int sec_tag,
 	socket_retries_left = CONFIG_FOTA_SOCKET_RETRIES;
 
 	first_fragment = true;
-
-	err = download_client_connect(&dlc, host, &config);
-	if (err != 0) {
-		peripheral_dfu_cleanup();
-		return err;
+	dl_first = true;
+	/* buffers still queued from an earlier download are dropped */
+	pipe_gen++;
+	atomic_clear(&send_failed);
+	if (fill_buf != NULL) {
+		k_fifo_put(&dfu_free_fifo, fill_buf);
+		fill_buf = NULL;
 	}
+	dl_mark = k_uptime_get();
 
-	err = download_client_start(&dlc, file, 0);
+	err = download_client_connect(&dlc, host, &config);
 	if (err != 0) {
-		download_client_disconnect(&dlc);
 		peripheral_dfu_cleanup();
 		return err;
 	}
 
+	/* the sender sets up the target and starts the download where the
+	 * target left off
+	 */
+	dl_file = file;
+	start_buf.gen = pipe_gen;
+	k_fifo_put(&dfu_send_fifo, &start_buf);
 	return 0;
 }
 
@@ -566,7 +960,8 @@ static int download_client_callback(const struct download_client_evt *event)
 
 	switch (event->id) {
 	case DOWNLOAD_CLIENT_EVT_FRAGMENT:
-		if (first_fragment) {
+		if (dl_first) {
+			dl_first = false;
 			err = download_client_file_size_get(&dlc, &image_size);
 			if (err) {
 				LOG_ERR("Error determining file size: %d", err);
@@ -574,10 +969,10 @@ static int download_client_callback(const struct download_client_evt *event)
 				LOG_INF("Downloading %zd bytes", image_size);
 			}
 		}
-		err = peripheral_dfu(event->fragment.buf,
-				     event->fragment.len);
+		err = pipe_put(event->fragment.buf, event->fragment.len);
 		if (err) {
-			LOG_ERR("Error from peripheral_dfu: %d", err);
+			LOG_ERR("Stopping download: %d", err);
+			(void)download_client_disconnect(&dlc);
 		}
 		break;
 	case DOWNLOAD_CLIENT_EVT_DONE:
@@ -587,7 +982,11 @@ static int download_client_callback(const struct download_client_evt *event)
 			LOG_ERR("Error disconnecting from download client: %d",
 				err);
 		}
-		k_work_reschedule(&fota_job_work, K_SECONDS(1));
+		/* the sender moves to the next file once this is sent */
+		if (pipe_end()) {
+			pipe_abort();
+		}
+		err = 0;
 		break;
 	case DOWNLOAD_CLIENT_EVT_ERROR: {
 		/* In case of socket errors we can return 0 to retry/continue,
@@ -608,7 +1007,7 @@ static int download_client_callback(const struct download_client_evt *event)
 					"download client: %d", err);
 			}
 			LOG_ERR("Download client error");
-			cancel_dfu(NRF_CLOUD_FOTA_ERROR_DOWNLOAD);
+			pipe_abort();
 			err = -EIO;
 		}
 		break;
@@ -749,6 +1148,43 @@ static void fota_ble_callback(const struct nrf_cloud_fota_ble_job *
 	(void)start_ble_job(&fota_ble_job);
 }
 
+static void report_speed(void)
+{
+	uint32_t total_ms = k_uptime_get() - job_start;
+	uint32_t stream_ms;
+
+	/* bring the current step's time up to date */
+	dfu_set_state(dfu_state);
+	stream_ms = phase_ms[DFU_STREAM];
+
+	LOGPKINF("DFU of %d bytes took %u ms: %u bytes/s overall, "
+		 "%u bytes/s while streaming; chunk %u, PRN %u",
+		 total_completed_size, total_ms,
+		 total_ms ? (uint32_t)(total_completed_size * 1000LL /
+				       total_ms) : 0,
+		 stream_ms ? (uint32_t)(total_completed_size * 1000LL /
+					stream_ms) : 0,
+		 chunk_size, prn_interval);
+	LOGPKINF("LTE %u bytes/s, held back %u ms; BLE %u bytes/s, "
+		 "waited %u ms; most buffers queued %u",
+		 pipe_stats.dl_ms ? (uint32_t)(pipe_stats.dl_bytes * 1000LL /
+					       pipe_stats.dl_ms) : 0,
+		 pipe_stats.dl_stall_ms,
+		 pipe_stats.ble_ms ? (uint32_t)(pipe_stats.ble_bytes * 1000LL /
+						pipe_stats.ble_ms) : 0,
+		 phase_ms[DFU_DOWNLOAD], pipe_stats.max_queued);
+	if (pipe_stats.saved_bytes) {
+		LOGPKINF("%u bytes already on the target were not sent again",
+			 pipe_stats.saved_bytes);
+	}
+	for (int i = DFU_SWITCHING; i < DFU_STATES; i++) {
+		if (phase_ms[i]) {
+			LOGPKINF("  %s: %u ms", dfu_states[i].name,
+				 phase_ms[i]);
+		}
+	}
+}
+
 static void fota_job_next(struct k_work *work)
 {
 	if (!start_next_job()) {
@@ -758,6 +1194,8 @@ static void fota_job_next(struct k_work *work)
 		}
 		ble_register_notify_callback(NULL);
 		LOGPKINF("DFU complete");
+		report_speed();
+		resume_clear();
 		free_job();
 		peripheral_dfu_cleanup();
 		ble_conn_mgr_check_pending();
@@ -845,11 +1283,261 @@ static void cancel_dfu(enum nrf_cloud_fota_error error)
 	ble_conn_mgr_check_pending();
 }
 
+static void resume_key(char *key, size_t len)
+{
+	char *p = key + snprintk(key, len, DFU_RESUME_SUBTREE "/");
+	char *end = key + len - 1;
+
+	for (const char *addr = ble_dfu_addr; *addr && (p < end); addr++) {
+		if (isxdigit((int)*addr)) {
+			*p++ = *addr;
+		}
+	}
+	*p = '\0';
+}
+
+static int resume_load_cb(const char *key, size_t len,
+			  settings_read_cb read_cb, void *cb_arg, void *param)
+{
+	/* only the exact key, not anything below it */
+	if ((key == NULL) && (len == sizeof(resume))) {
+		if (read_cb(cb_arg, &resume, len) != len) {
+			memset(&resume, 0, sizeof(resume));
+		}
+	}
+	return 0;
+}
+
+static void resume_load(void)
+{
+	char key[DFU_RESUME_KEY_LEN];
+
+	memset(&resume, 0, sizeof(resume));
+	resume_key(key, sizeof(key));
+	(void)settings_load_subtree_direct(key, resume_load_cb, NULL);
+	if (resume.version != DFU_RESUME_VERSION) {
+		memset(&resume, 0, sizeof(resume));
+		resume.version = DFU_RESUME_VERSION;
+	}
+}
+
+/* Called once the target has executed the object ending at
+ * completed_size
+ */
+static void resume_save(void)
+{
+	struct dfu_resume_file *f = &resume.files[!init_packet];
+	char key[DFU_RESUME_KEY_LEN];
+	int err;
+
+	f->size = download_size;
+	f->exec_offset = completed_size;
+	f->exec_crc = stream_crc;
+	if (init_packet) {
+		/* a new init packet makes the target drop any firmware */
+		memset(&resume.files[1], 0, sizeof(resume.files[1]));
+	}
+	resume_key(key, sizeof(key));
+	err = settings_save_one(key, &resume, sizeof(resume));
+	if (err) {
+		LOG_WRN("Unable to save DFU progress: %d", err);
+	}
+}
+
+static void resume_clear(void)
+{
+	char key[DFU_RESUME_KEY_LEN];
+
+	resume_key(key, sizeof(key));
+	(void)settings_delete(key);
+}
+
+/* Compare the offset and CRC the target just answered a select with to
+ * what was saved for this file. Returns the file offset to carry on from,
+ * or -EALREADY when the target already holds all of it.
+ */
+static int resume_offset(void)
+{
+	struct dfu_resume_file *f = &resume.files[!init_packet];
+	uint32_t path_crc = crc32_ieee((const uint8_t *)dl_file,
+				       strlen(dl_file));
+	uint32_t offset = dfu_notify_packet_data->select.offset;
+	uint32_t crc = dfu_notify_packet_data->select.crc;
+	uint32_t page;
+	int err;
+
+	if ((f->path_crc != path_crc) || !f->exec_offset ||
+	    (offset < f->exec_offset)) {
+		memset(f, 0, sizeof(*f));
+		f->path_crc = path_crc;
+		return 0;
+	}
+	if ((f->exec_offset == f->size) && (offset == f->size) &&
+	    (crc == f->exec_crc)) {
+		LOGPKINF("Target already holds all %u bytes", f->size);
+		pipe_stats.saved_bytes += f->size;
+		return -EALREADY;
+	}
+	if (init_packet) {
+		return 0;
+	}
+
+	/* a new object starts over from the end of the last one executed;
+	 * check that is the prefix sent before
+	 */
+	page = MIN(max_size, f->size - f->exec_offset);
+	dfu_set_state(DFU_CREATE);
+	err = send_create_data(ble_dfu_addr, page);
+	if (err) {
+		return err;
+	}
+	dfu_set_state(DFU_CRC);
+	err = send_request_crc(ble_dfu_addr);
+	if (err) {
+		return err;
+	}
+	if ((dfu_notify_packet_data->crc.offset != f->exec_offset) ||
+	    (dfu_notify_packet_data->crc.crc != f->exec_crc)) {
+		LOG_ERR("Target holds %u bytes with CRC 0x%08X, not %u with "
+			"0x%08X; the job must start over",
+			dfu_notify_packet_data->crc.offset,
+			dfu_notify_packet_data->crc.crc, f->exec_offset,
+			f->exec_crc);
+		resume_clear();
+		return -ESTALE;
+	}
+
+	LOGPKINF("Resuming at %u of %u bytes", f->exec_offset, f->size);
+	completed_size = f->exec_offset;
+	stream_crc = f->exec_crc;
+	receipt_offset = f->exec_offset;
+	total_completed_size += f->exec_offset;
+	pipe_stats.saved_bytes += f->exec_offset;
+	/* the object just created takes the first page */
+	page_remaining = page;
+	finish_page = true;
+	return f->exec_offset;
+}
+
+/* Prepare the target for the next file; returns the file offset to
+ * download from, or -EALREADY when there is nothing to send
+ */
+static int dfu_setup(void)
+{
+	int err;
+
+	LOGPKINF("BLE DFU starting to %s...", STRDUP(ble_dfu_addr));
+
+	if (fota_ble_job.info.id) {
+		fota_ble_job.dl_progress = (100 * total_completed_size) /
+					   fota_ble_job.info.file_size;
+		err = nrf_cloud_fota_ble_job_update(&fota_ble_job,
+						    NRF_CLOUD_FOTA_DOWNLOADING);
+		if (err) {
+			LOG_ERR("Error updating job: %d", err);
+			return err;
+		}
+	}
+	completed_size = 0;
+	stream_crc = 0;
+	receipt_offset = 0;
+	page_remaining = 0;
+	finish_page = false;
+	resume_load();
+
+	dfu_set_state(DFU_LINK);
+	err = link_setup();
+	if (err) {
+		return err;
+	}
+
+	dfu_set_state(DFU_SELECT);
+	if (init_packet) {
+		verbose = true;
+		flash_page_size = 0;
+
+		LOG_INF("Loading Init Packet and "
+			"turning on notifications...");
+		err = ble_subscribe_prio(ble_dfu_addr,
+					 DFU_CONTROL_POINT_UUID,
+					 BT_GATT_CCC_NOTIFY,
+					 BLE_RX_PRIO_CONTROL);
+		if (err) {
+			return err;
+		}
+
+		LOG_INF("Setting DFU PRN to 0...");
+		err = send_prn(ble_dfu_addr, 0);
+		if (err) {
+			return err;
+		}
+
+		LOG_INF("Querying hardware version...");
+		(void)send_hw_version_get(ble_dfu_addr);
+
+		LOG_INF("Querying firmware version (APP)...");
+		(void)send_fw_version_get(ble_dfu_addr,
+					  NRF_DFU_FIRMWARE_TYPE_APPLICATION);
+
+		LOG_INF("Sending DFU select command...");
+		err = send_select_command(ble_dfu_addr);
+	} else {
+		verbose = false;
+
+		LOG_INF("Loading Firmware");
+		LOG_INF("Setting DFU PRN to %u...", prn_size());
+		err = send_prn(ble_dfu_addr, prn_size());
+		if (err) {
+			return err;
+		}
+
+		LOG_INF("Sending DFU select data...");
+		err = send_select_data(ble_dfu_addr);
+	}
+	if (err) {
+		return err;
+	}
+	return resume_offset();
+}
+
+/* Tell the cloud how far the job has got, every PROGRESS_UPDATE_INTERVAL
+ * percent and once it is done; the device is no longer pending after that.
+ */
+static int job_progress(size_t percent)
+{
+	enum nrf_cloud_fota_status status;
+	int err;
+
+	if (!fota_ble_job.info.id ||
+	    (((percent - prev_update_percent) < PROGRESS_UPDATE_INTERVAL) &&
+	     (percent < 100))) {
+		return 0;
+	}
+
+	LOG_INF("Sending job update at %zd%% percent", percent);
+	fota_ble_job.error = NRF_CLOUD_FOTA_ERROR_NONE;
+	if (percent < 100) {
+		status = NRF_CLOUD_FOTA_DOWNLOADING;
+		fota_ble_job.dl_progress = percent;
+	} else {
+		status = NRF_CLOUD_FOTA_SUCCEEDED;
+		fota_ble_job.dl_progress = 100;
+		if (dfu_conn_ptr) {
+			dfu_conn_ptr->dfu_pending = false;
+		}
+	}
+	err = nrf_cloud_fota_ble_job_update(&fota_ble_job, status);
+	if (err) {
+		LOG_ERR("Error updating job: %d", err);
+		return err;
+	}
+	prev_update_percent = percent;
+	return 0;
+}
+
 static uint8_t peripheral_dfu(const char *buf, size_t len)
 {
 	static size_t prev_percent = 0;
-	static size_t prev_update_percent = 0;
-	static uint32_t prev_crc = 0;
 	size_t percent = 0;
 	int err = 0;
 
@@ -883,126 +1571,8 @@ static uint8_t peripheral_dfu(const char *buf, size_t len)
 
 	if (first_fragment) {
 		first_fragment = false;
-		LOGPKINF("BLE DFU starting to %s...", STRDUP(ble_dfu_addr));
-
-		if (fota_ble_job.info.id) {
-			fota_ble_job.dl_progress = (100 * total_completed_size) /
-						   fota_ble_job.info.file_size;
-			err = nrf_cloud_fota_ble_job_update(&fota_ble_job,
-						    NRF_CLOUD_FOTA_DOWNLOADING);
-			if (err) {
-				LOG_ERR("Error updating job: %d", err);
-				free_job();
-				peripheral_dfu_cleanup();
-				return err;
-			}
-		}
 		prev_percent = 0;
 		prev_update_percent = 0;
-		completed_size = 0;
-		prev_crc = 0;
-		page_remaining = 0;
-		finish_page = false;
-
-		if (init_packet) {
-			verbose = true;
-			flash_page_size = 0;
-
-			LOG_INF("Loading Init Packet and "
-			       "turning on notifications...");
-			err = ble_subscribe(ble_dfu_addr, DFU_CONTROL_POINT_UUID,
-					    BT_GATT_CCC_NOTIFY);
-			if (err) {
-				goto cleanup;
-			}
-
-			LOG_INF("Setting DFU PRN to 0...");
-			err = send_prn(ble_dfu_addr, 0);
-			if (err) {
-				goto cleanup;
-			}
-
-			LOG_INF("Querying hardware version...");
-			(void)send_hw_version_get(ble_dfu_addr);
-
-			LOG_INF("Querying firmware version (APP)...");
-			(void)send_fw_version_get(ble_dfu_addr,
-					     NRF_DFU_FIRMWARE_TYPE_APPLICATION);
-
-			LOG_INF("Sending DFU select command...");
-			err = send_select_command(ble_dfu_addr);
-			if (err) {
-				goto cleanup;
-			}
-			/* TODO: check offset and CRC; do no transfer
-			 * and skip execute if offset != init length or
-			 * CRC mismatch -- however, to do this, we need the
-			 * cloud to send us the expected CRC for the file
-			 */
-			if (dfu_notify_packet_data->select.offset != image_size) {
-				LOG_INF("Image size mismatched, so continue; "
-				       "offset:%u, size:%u",
-				       dfu_notify_packet_data->select.offset,
-				       image_size);
-			} else {
-				LOG_INF("Image size matches device!");
-				if (dfu_notify_packet_data->select.crc != original_crc) {
-					LOG_INF("CRC mismatched, so continue; "
-					       "dev crc:0x%08X, this crc:"
-					       "0x%08X",
-					       dfu_notify_packet_data->select.crc,
-					       original_crc);
-				} else {
-					LOG_INF("CRC matches device!");
-				}
-			}
-
-			LOG_INF("Sending DFU create command...");
-			err = send_create_command(ble_dfu_addr, image_size);
-			/* This will need to be the size of the entire init
-			 * file. If http chunks it smaller this won't work
-			 */
-			if (err) {
-				goto cleanup;
-			}
-		} else {
-			verbose = false;
-			finish_page = false;
-
-			LOG_INF("Loading Firmware");
-			LOG_INF("Setting DFU PRN to 0...");
-			err = send_prn(ble_dfu_addr, 0);
-			if (err) {
-				goto cleanup;
-			}
-
-			LOG_INF("Sending DFU select data...");
-			err = send_select_data(ble_dfu_addr);
-			if (err) {
-				goto cleanup;
-			}
-			if (dfu_notify_packet_data->select.offset != image_size) {
-				LOG_INF("Image size mismatched, so continue; "
-				       "offset:%u, size:%u",
-				       dfu_notify_packet_data->select.offset,
-				       image_size);
-			} else {
-				LOG_INF("Image size matches device!");
-				if (dfu_notify_packet_data->select.crc != original_crc) {
-					LOG_INF("CRC mismatched, so continue; "
-					       "dev crc:0x%08X, this crc:"
-					       "0x%08X",
-					       dfu_notify_packet_data->select.crc,
-					       original_crc);
-				} else {
-					LOG_INF("CRC matches device!");
-					/* TODO: we could skip the entire file,
-					 * and just send an indication to the
-					 * cloud that the job is complete
-					 */
-				}
-			}
-		}
 	}
 
 	/* output data while handing page boundaries */
@@ -1014,11 +1584,16 @@ static uint8_t peripheral_dfu(const char *buf, size_t len)
 
 			LOG_DBG("Page remaining %u, max_size %u, len %u",
 			       page_remaining, max_size, len);
-			if (!init_packet) {
-				err = send_create_data(ble_dfu_addr, page_remaining);
-				if (err) {
-					goto cleanup;
-				}
+			dfu_set_state(DFU_CREATE);
+			if (init_packet) {
+				err = send_create_command(ble_dfu_addr,
+							  page_remaining);
+			} else {
+				err = send_create_data(ble_dfu_addr,
+						       page_remaining);
+			}
+			if (err) {
+				goto cleanup;
 			}
 			if (len < page_remaining) {
 				LOG_DBG("Need to transfer %u in page",
@@ -1035,13 +1610,12 @@ static uint8_t peripheral_dfu(const char *buf, size_t len)
 		size_t page_len = MIN(len, page_remaining);
 
 		LOG_DBG("Sending DFU data len %u...", page_len);
-		err = send_data(ble_dfu_addr, buf, page_len);
+		dfu_set_state(DFU_STREAM);
+		err = send_data(ble_dfu_addr, buf, page_len, completed_size);
 		if (err) {
 			goto cleanup;
 		}
 
-		prev_crc = crc32_ieee_update(prev_crc, buf, page_len);
-
 		completed_size += page_len;
 		total_completed_size += page_len;
 		len -= page_len;
@@ -1058,57 +1632,23 @@ static uint8_t peripheral_dfu(const char *buf, size_t len)
 		}
 
 		if (!finish_page) {
-			/* give hardware time to finish; omitting this step
-			 * results in an error on the execute request and/or
-			 * CRC mismatch; sometimes we are too fast so we
-			 * need to retry, because the transfer was still
-			 * going on
-			 */
-			for (int i = 1; i <= 5; i++) {
-				k_sleep(K_MSEC(100));
-
-				LOG_DBG("Sending DFU request CRC %d...", i);
-				err = send_request_crc(ble_dfu_addr);
-				if (err) {
-					break;
-				}
-				if (dfu_notify_packet_data->crc.offset !=
-				    completed_size) {
-					err = -EIO;
-				}
-				else if (dfu_notify_packet_data->crc.crc !=
-					 prev_crc) {
-					err = -EBADMSG;
-				} else {
-					LOG_INF("CRC and length match.");
-					err = 0;
-					break;
-				}
-			}
-			if (err == -EIO) {
-				LOG_ERR("Transfer offset wrong; received: %u,"
-					" expected: %u",
-					dfu_notify_packet_data->crc.offset,
-					completed_size);
-			}
-			if (err == -EBADMSG) {
-				LOG_ERR("CRC wrong; received: 0x%08X, "
-					"expected: 0x%08X",
-					dfu_notify_packet_data->crc.crc,
-					prev_crc);
-			}
+			dfu_set_state(DFU_CRC);
+			err = check_crc(ble_dfu_addr);
 			if (err) {
 				goto cleanup;
 			}
 
+			dfu_set_state(DFU_EXECUTE);
 			LOG_DBG("Sending DFU execute...");
 			err = send_execute(ble_dfu_addr);
 			if (err) {
 				goto cleanup;
 			}
+			resume_save();
 		}
 	}
 
+	dfu_set_state(DFU_DOWNLOAD);
 	if (download_size) {
 		percent = (100 * total_completed_size) / fota_ble_job.info.file_size;
 	}
@@ -1118,32 +1658,9 @@ static uint8_t peripheral_dfu(const char *buf, size_t len)
 		       completed_size, download_size);
 		prev_percent = percent;
 
-		if (fota_ble_job.info.id &&
-		    (((percent - prev_update_percent) >=
-		      PROGRESS_UPDATE_INTERVAL) ||
-		     (percent >= 100))) {
-			enum nrf_cloud_fota_status status;
-
-			LOG_INF("Sending job update at %zd%% percent",
-			       percent);
-			fota_ble_job.error = NRF_CLOUD_FOTA_ERROR_NONE;
-			if (percent < 100) {
-				status = NRF_CLOUD_FOTA_DOWNLOADING;
-				fota_ble_job.dl_progress = percent;
-			} else {
-				status = NRF_CLOUD_FOTA_SUCCEEDED;
-				fota_ble_job.dl_progress = 100;
-				if (dfu_conn_ptr) {
-					dfu_conn_ptr->dfu_pending = false;
-				}
-			}
-			err = nrf_cloud_fota_ble_job_update(&fota_ble_job,
-							    status);
-			if (err) {
-				LOG_ERR("Error updating job: %d", err);
-				goto cleanup;
-			}
-			prev_update_percent = percent;
+		err = job_progress(percent);
+		if (err) {
+			goto cleanup;
 		}
 	}
 
@@ -1154,23 +1671,214 @@ cleanup:
 	return err;
 }
 
-static int send_data(char *ble_addr, const char *buf, size_t len)
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err,
+			  struct bt_gatt_exchange_params *params)
+{
+	mtu_err = err;
+	k_sem_give(&mtu_sem);
+}
+
+/* Ask the target for 2M PHY, the longest data length and the largest ATT
+ * MTU both sides support, then open its DFU characteristics and size data
+ * packets to the MTU. Any link request the target refuses just leaves the
+ * link as it was.
+ */
+static int link_setup(void)
+{
+	static struct bt_gatt_exchange_params params;
+	struct bt_conn *conn;
+	int err;
+
+	ble_chan_close(&packet_chan);
+	ble_chan_close(&ctrl_chan);
+	/* a dropped link can leave sent callbacks uncalled */
+	k_sem_init(&tx_window, TX_WINDOW, TX_WINDOW);
+
+	if (dfu_conn_ptr == NULL) {
+		return -ENOTCONN;
+	}
+	conn = ble_conn_mgr_get_bt_conn(dfu_conn_ptr);
+	if (conn == NULL) {
+		return -ENOTCONN;
+	}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	if (err) {
+		LOG_WRN("2M PHY request failed: %d", err);
+	}
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		LOG_WRN("Data length update failed: %d", err);
+	}
+#endif
+
+	/* only once per link; a later DFU file reuses the result */
+	if (bt_gatt_get_mtu(conn) <= DEFAULT_ATT_MTU) {
+		k_sem_reset(&mtu_sem);
+		params.func = mtu_exchanged;
+		err = bt_gatt_exchange_mtu(conn, &params);
+		if (!err) {
+			err = k_sem_take(&mtu_sem, state_timeout());
+		}
+		if (!err && mtu_err) {
+			err = -EIO;
+		}
+		if (err) {
+			LOG_WRN("MTU exchange failed: %d", err);
+		}
+	}
+	bt_conn_unref(conn);
+
+	err = ble_chan_open(&packet_chan, ble_dfu_addr, DFU_PACKET_UUID);
+	if (!err) {
+		err = ble_chan_open(&ctrl_chan, ble_dfu_addr,
+				    DFU_CONTROL_POINT_UUID);
+	}
+	if (err) {
+		LOG_ERR("Unable to open DFU characteristics: %d", err);
+		ble_chan_close(&packet_chan);
+		return err;
+	}
+
+	chunk_size = MAX(packet_chan.mtu - 3, MIN_CHUNK_SIZE);
+	LOG_INF("DFU link MTU %u, chunk size %u", packet_chan.mtu,
+		chunk_size);
+	return 0;
+}
+
+/* Packets between receipts, so CONFIG_GATEWAY_DFU_PRN_BYTES are in
+ * flight whatever the chunk size
+ */
+static uint16_t prn_size(void)
+{
+	if (!CONFIG_GATEWAY_DFU_PRN_BYTES) {
+		return 0;
+	}
+	return MAX(CONFIG_GATEWAY_DFU_PRN_BYTES / chunk_size, 1);
+}
+
+/* The target reports its offset after each PRN interval; expected is
+ * where the object stream should be by then
+ */
+static int wait_for_receipt(size_t expected)
+{
+	int err;
+
+	err = wait_for_notification();
+	if (err) {
+		LOG_ERR("Timeout waiting for packet receipt: %d", err);
+		return err;
+	}
+	err = decode_dfu();
+	if (err) {
+		return err;
+	}
+	if (dfu_notify_packet_data->op != NRF_DFU_OP_CRC_GET) {
+		LOG_ERR("Unexpected notification 0x%02X instead of receipt",
+			dfu_notify_packet_data->op);
+		return -EINVAL;
+	}
+	if (dfu_notify_packet_data->crc.offset != expected) {
+		LOG_ERR("Receipt offset wrong; received: %u, expected: %u",
+			dfu_notify_packet_data->crc.offset, expected);
+		return -EIO;
+	}
+	if (dfu_notify_packet_data->crc.crc != stream_crc) {
+		LOG_ERR("Receipt CRC wrong; received: 0x%08X, expected: 0x%08X",
+			dfu_notify_packet_data->crc.crc, stream_crc);
+		return -EBADMSG;
+	}
+	receipt_offset = expected;
+	return 0;
+}
+
+/* Check the target holds the object as sent. When the object ended on a
+ * receipt interval that receipt already says so; otherwise ask for the CRC.
+ */
+static int check_crc(char *ble_addr)
+{
+	int err;
+
+	if (receipt_offset != completed_size) {
+		LOG_DBG("Sending DFU request CRC...");
+		err = send_request_crc(ble_addr);
+		if (err) {
+			return err;
+		}
+	}
+	if (dfu_notify_packet_data->crc.offset != completed_size) {
+		LOG_ERR("Transfer offset wrong; received: %u, expected: %u",
+			dfu_notify_packet_data->crc.offset, completed_size);
+		return -EIO;
+	}
+	if (dfu_notify_packet_data->crc.crc != stream_crc) {
+		LOG_ERR("CRC wrong; received: 0x%08X, expected: 0x%08X",
+			dfu_notify_packet_data->crc.crc, stream_crc);
+		return -EBADMSG;
+	}
+	LOG_INF("CRC and length match.");
+	return 0;
+}
+
+static void packet_sent(struct bt_conn *conn, void *user_data)
+{
+	k_sem_give(&tx_window);
+}
+
+/* offset is where buf starts in the file; returns once every packet has
+ * been sent
+ */
+static int send_data(char *ble_addr, const char *buf, size_t len,
+		     size_t offset)
 {
 	/* "chunk" The data */
 	int idx = 0;
 	int err = 0;
+	int i;
 
 	while (idx < len) {
-		uint8_t size = MIN(MAX_CHUNK_SIZE, (len - idx));
+		uint16_t size = MIN(chunk_size, (len - idx));
+
+		err = k_sem_take(&tx_window, state_timeout());
+		if (err) {
+			LOG_ERR("Timeout waiting for packets to be sent");
+			break;
+		}
+		if (prn_interval && (prn_left == 1)) {
+			k_sem_reset(&notify_sem);
+		}
 		LOG_DBG("Sending write without response: %d, %d", size, idx);
-		err = gatt_write_without_response(ble_addr, DFU_PACKET_UUID,
-					    (uint8_t *)&buf[idx], size);
+		err = ble_chan_write_nr(&packet_chan, (uint8_t *)&buf[idx],
+					size, packet_sent, NULL);
 		if (err) {
+			k_sem_give(&tx_window);
 			LOG_ERR("Error writing chunk at %d size %u: %d",
 				idx, size, err);
 			break;
 		}
+		stream_crc = crc32_ieee_update(stream_crc, &buf[idx], size);
 		idx += size;
+
+		if (prn_interval && (--prn_left == 0)) {
+			prn_left = prn_interval;
+			err = wait_for_receipt(offset + idx);
+			if (err) {
+				break;
+			}
+		}
+	}
+
+	/* drain, so a CRC asked for next covers every packet */
+	for (i = 0; i < TX_WINDOW; i++) {
+		if (k_sem_take(&tx_window, state_timeout())) {
+			break;
+		}
+	}
+	while (i--) {
+		k_sem_give(&tx_window);
 	}
 	return err;
 }
@@ -1187,9 +1895,13 @@ static int do_cmd(char *ble_addr, bool normal_mode, uint8_t *buf, uint16_t len,
 	} else {
 		uuid = DFU_CONTROL_POINT_UUID;
 	}
-	notify_received = false;
+	k_sem_reset(&notify_sem);
 
-	err = gatt_write(ble_addr, uuid, buf, len, on_sent);
+	if (!normal_mode && ble_chan_is_open(&ctrl_chan)) {
+		err = ble_chan_write(&ctrl_chan, buf, len, on_sent);
+	} else {
+		err = gatt_write(ble_addr, uuid, buf, len, on_sent);
+	}
 	if (err) {
 		LOG_ERR("Error writing %s: %d", name, err);
 		return err;
@@ -1222,13 +1934,19 @@ static int send_switch_to_dfu(char *ble_addr)
 static int send_prn(char *ble_addr, uint16_t receipt_rate)
 {
 	char smol_buf[3];
+	int err;
 
 	smol_buf[0] = NRF_DFU_OP_RECEIPT_NOTIF_SET;
 	smol_buf[1] = receipt_rate & 0xff;
 	smol_buf[2] = (receipt_rate >> 8) & 0xff;
 
-	return do_cmd(ble_addr, false, smol_buf,
-		      sizeof(smol_buf), "PRN", true);
+	err = do_cmd(ble_addr, false, smol_buf,
+		     sizeof(smol_buf), "PRN", true);
+	if (!err) {
+		prn_interval = receipt_rate;
+		prn_left = receipt_rate;
+	}
+	return err;
 }
 
 static int send_select_command(char *ble_addr)
@@ -1256,6 +1974,7 @@ static int send_select_data(char *ble_addr)
 static int send_create_command(char *ble_addr, uint32_t size)
 {
 	uint8_t smol_buf[6];
+	int err;
 
 	smol_buf[0] = NRF_DFU_OP_OBJECT_CREATE;
 	smol_buf[1] = 0x01;
@@ -1264,13 +1983,19 @@ static int send_create_command(char *ble_addr, uint32_t size)
 	smol_buf[4] = (size >> 16) & 0xFF;
 	smol_buf[5] = (size >> 24) & 0xFF;
 
-	return do_cmd(ble_addr, false, smol_buf,
-		      sizeof(smol_buf), "Create Cmd", true);
+	err = do_cmd(ble_addr, false, smol_buf,
+		     sizeof(smol_buf), "Create Cmd", true);
+	if (!err) {
+		/* the target restarts its receipt count per object */
+		prn_left = prn_interval;
+	}
+	return err;
 }
 
 static int send_create_data(char *ble_addr, uint32_t size)
 {
 	uint8_t smol_buf[6];
+	int err;
 
 	LOG_DBG("Size is %d", size);
 
@@ -1281,8 +2006,12 @@ static int send_create_data(char *ble_addr, uint32_t size)
 	smol_buf[4] = (size >> 16) & 0xFF;
 	smol_buf[5] = (size >> 24) & 0xFF;
 
-	return do_cmd(ble_addr, false, smol_buf,
-		      sizeof(smol_buf), "Create Data", true);
+	err = do_cmd(ble_addr, false, smol_buf,
+		     sizeof(smol_buf), "Create Data", true);
+	if (!err) {
+		prn_left = prn_interval;
+	}
+	return err;
 }
 
 static void on_sent(struct bt_conn *conn, uint8_t err,
@@ -1358,120 +2087,3 @@ static int send_abort(char *ble_addr)
 	return do_cmd(ble_addr, false, smol_buf,
 		      sizeof(smol_buf), "Abort", true);
 }
-
-#if 0
-/* unclear what these functions are for */
-
-int write_image_size_to_dfu_packet(char *ble_addr, int image_size)
-{
-	/* The length here is expected to be
-	 * <len softdevice><len bootloader><len app> where each is a uint32
-	 * In the case we aren't updating all of them (psst we are only doing
-	 * the app) the others need to be 0 So ours should look like
-	 * 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x00 <len app>
-	 * all lengths are little endian
-	 *
-	 * https://infocenter.nordicsemi.com/index.jsp?topic=%2Fcom.nordic.infocenter.sdk5.v11.0.0%2Fbledfu_transport_bleservice.html
-	 */
-#define SIZE_LEN 12 /* Size of 3 uint32s */
-	char buf[SIZE_LEN];
-	int err;
-
-	memset(buf, 0, sizeof(char) * SIZE_LEN);
-	buf[8] = image_size & 0xFF;
-	buf[9] = (image_size >> 8) & 0xFF;
-	buf[10] = (image_size >> 16) & 0xFF;
-	buf[11] = (image_size >> 24) & 0xFF;
-	err = gatt_write_without_response(ble_addr, DFU_PACKET_UUID, buf,
-					  SIZE_LEN);
-	if (err) {
-		LOG_ERR("Error sending image size: %d", err);
-	}
-	return err;
-}
-
-int send_initialize_dfu_parameters(char *ble_addr)
-{
-	char smol_buf[1];
-	int err;
-
-	smol_buf[0] = 0x02;
-	err = gatt_write(ble_addr, false, smol_buf,
-			 sizeof(smol_buf), on_sent);
-	if (err) {
-		LOG_ERR("Error sending initialize dfu: %d", err);
-	}
-	return err;
-}
-
-int write_dfu_parameters(char *ble_addr, uint32_t app_version, uint16_t crc)
-{
-#define NUM_DEVICES 1
-#define ANY_SOFTDEVICE 0xFFFE
-	uint16_t device_type = 0;
-	uint16_t device_rev = 0;
-	/* This is bad if we change but it is fine for now */
-	uint16_t softdevice[NUM_DEVICES] = {ANY_SOFTDEVICE};
-	uint16_t softdevice_len = NUM_DEVICES;
-	char *buf;
-	int buf_len = (sizeof(device_type) + sizeof(device_rev) +
-		       (sizeof(softdevice) * NUM_DEVICES) +
-		       sizeof(softdevice_len));
-	buf = malloc(buf_len);
-	int i;
-	int j;
-	int err;
-
-	if (buf == NULL) {
-		LOG_ERR("Out of memory allocating DFU parameter buffer");
-		return -ENOMEM;
-	}
-
-	/* Order is:
-	 * 1) device type
-	 * 2) device revision
-	 * 3) application version
-	 * 4) softdevice array length
-	 * n) each softdevice
-	 * n+1) CRC-16-CCITT of the image
-	 */
-	buf[0] = device_type & 0xFF;
-	buf[1] = (device_type >> 8) & 0xFF;
-	buf[2] = device_rev & 0xFF;
-	buf[3] = (device_rev >> 8) & 0xFF;
-	buf[4] = app_version & 0xFF;
-	buf[5] = (app_version >> 8) & 0xFF;
-	buf[6] = (app_version >> 16) & 0xFF;
-	buf[7] = (app_version >> 24) & 0xFF;
-	buf[8] = softdevice_len & 0xFF;
-	buf[9] = (softdevice_len >> 8) & 0xFF;
-	for (i = 10, j = 0; (i < (10 + (2 * softdevice_len))); i += 2, j++) {
-		buf[i] = softdevice[j] & 0xFF;
-		buf[i + 1] = (softdevice[j] >> 8) & 0xFF;
-	}
-	buf[i] = crc & 0xFF;
-	buf[i + 1] = (crc >> 8) & 0xFF;
-
-	err = gatt_write_without_response(ble_addr, DFU_PACKET_UUID, buf,
-					  buf_len);
-	if (err) {
-		LOG_ERR("Error sending dfu parameters: %d", err);
-	}
-	free(buf);
-	return err;
-}
-
-int send_start_dfu_packet(char *ble_addr)
-{
-	char smol_buf[1];
-	int err;
-
-	smol_buf[0] = 0x01;
-	err = gatt_write(ble_addr, false, smol_buf,
-			 sizeof(smol_buf), on_sent);
-	if (err) {
-		LOG_ERR("Error sending start dfu: %d", err);
-	}
-	return err;
-}
-#endif
@@ -8,4 +8,28 @@ int peripheral_dfu_start(const char *host, const char *file, int sec_tag,
 			 const char *apn, size_t fragment_size);
 int peripheral_dfu_cleanup(void);
 
+/* Both legs of the current or last BLE DFU job */
+struct peripheral_dfu_stats {
+	/* LTE download: bytes received and time spent receiving them,
+	 * not counting time held back waiting for a free buffer
+	 */
+	uint32_t dl_bytes;
+	uint32_t dl_ms;
+	uint32_t dl_stall_ms;
+	/* BLE transfer: bytes sent to the target and time spent sending
+	 * them, not counting time waiting for the download
+	 */
+	uint32_t ble_bytes;
+	uint32_t ble_ms;
+	uint32_t ble_idle_ms;
+	/* most buffers filled and waiting to be sent */
+	uint32_t max_queued;
+	/* bytes the target already held from an interrupted job, so
+	 * neither downloaded nor sent again
+	 */
+	uint32_t saved_bytes;
+};
+
+void peripheral_dfu_get_stats(struct peripheral_dfu_stats *stats);
+
 #endif
\ No newline at end of file
@@ -21,8 +21,7 @@
 #include "nrf_cloud_mem.h"
 
 #include "ui.h"
-#include "cJSON.h"
-#include "cJSON_os.h"
+#include "gateway_op.h"
 #include "ble.h"
 #include "bluetooth/bluetooth.h"
 #include "ble_codec.h"
@@ -35,91 +34,36 @@ LOG_MODULE_REGISTER(gateway, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
 #define CLOUD_PROC_STACK_SIZE 2048
 #define CLOUD_PROC_PRIORITY 5
 
-#define QUEUE_CHAR_READS
-
 #define GET_PSK_ID "AT%CMNG=2,16842753,4"
 #define GET_PSK_ID_LEN (sizeof(GET_PSK_ID)-1)
 #define GET_PSK_ID_ERR "ERROR"
 
-/* Uncomment below to enable writing characteristics from cloud_data_process()
- * rather than from gateway_handler(). However, writing added too much data
- * to the fifo. There was no memory to unsubscribe from memory intensive
- * subscribes.
- */
-/* #define QUEUE_CHAR_WRITES */
-
-#define VALUE_BUF_SIZE 256
-static uint8_t value_buf[VALUE_BUF_SIZE];
-
 char gateway_id[NRF_CLOUD_CLIENT_ID_LEN+1];
 
 struct cloud_data_t {
 	void *fifo_reserved;
 	char addr[BT_ADDR_STR_LEN];
-	char uuid[UUID_STR_LEN];
-	bool read;
-	bool ccc;
-	bool sub;
+	/* characteristic uuid, or service/characteristic path */
+	char uuid[BT_MAX_PATH_LEN];
 	uint8_t client_char_config;
+	uint8_t priority;
 };
 
+/* Subscription changes wait here for a thread that may block on the
+ * outgoing message pool; reads and writes go to the GATT operation queues
+ */
 K_FIFO_DEFINE(cloud_data_fifo);
 
 void cloud_data_process(int unused1, int unused2, int unused3)
 {
-	struct k_mutex lock;
-	int ret;
-
-	k_mutex_init(&lock);
-
 	while (1) {
 		struct cloud_data_t *cloud_data = k_fifo_get(&cloud_data_fifo,
-							     K_NO_WAIT);
+							     K_FOREVER);
 
-		if (cloud_data != NULL) {
-			k_mutex_lock(&lock, K_FOREVER);
-
-			if (cloud_data->sub) {
-				ble_subscribe(cloud_data->addr,
-					      cloud_data->uuid,
-					      cloud_data->client_char_config);
-			}
-#if defined(QUEUE_CHAR_READS)
-			else if (cloud_data->read) {
-				LOG_DBG("Dequeued gatt_read request %s, %s, %u",
-					log_strdup(cloud_data->addr),
-					log_strdup(cloud_data->uuid),
-					cloud_data->ccc);
-				ret = gatt_read(cloud_data->addr,
-						cloud_data->uuid,
-						cloud_data->ccc);
-				if (ret) {
-					LOG_ERR("Error on gatt_read(%s, %s, %u): %d",
-						log_strdup(cloud_data->addr),
-						log_strdup(cloud_data->uuid),
-						cloud_data->ccc,
-						ret);
-				}
-			}
-#endif
-#if defined(QUEUE_CHAR_WRITES)
-			else if (cloud_data->write) {
-				ret = gatt_write(cloud_data->addr,
-						 cloud_data->uuid,
-						 cloud_data->data,
-						 cloud_data->data_len, NULL);
-				if (ret) {
-					LOG_ERR("Error on gatt_write(%s, %s): %d",
-						log_strdup(cloud_data->addr),
-						log_strdup(cloud_data->uuid),
-						ret);
-				}
-			}
-#endif
-			k_free(cloud_data);
-			k_mutex_unlock(&lock);
-		}
-		k_sleep(K_MSEC(100));
+		ble_subscribe_prio(cloud_data->addr, cloud_data->uuid,
+				   cloud_data->client_char_config,
+				   cloud_data->priority);
+		k_free(cloud_data);
 	}
 }
 
@@ -127,64 +71,121 @@ K_THREAD_DEFINE(cloud_proc_thread, CLOUD_PROC_STACK_SIZE,
 		cloud_data_process, NULL, NULL, NULL,
 		CLOUD_PROC_PRIORITY, 0, 0);
 
-static cJSON *json_object_decode(cJSON *obj, const char *str)
+/* Only used from the cloud event handler */
+static struct gw_op op;
+
+/* Optional forwarding priority of a subscription; BLE_RX_PRIOS when absent
+ * or unknown, which keeps the current lane
+ */
+static uint8_t get_rx_priority(const char *name)
 {
-	return obj ? cJSON_GetObjectItem(obj, str) : NULL;
+	static const char * const names[] = {"control", "alarm", "bulk"};
+
+	if (name[0] == '\0') {
+		return BLE_RX_PRIOS;
+	}
+	for (int i = 0; i < BLE_RX_PRIOS; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+	LOG_WRN("Unknown priority %s", log_strdup(name));
+	return BLE_RX_PRIOS;
 }
 
-static bool compare(const char *s1, const char *s2)
+/* The characteristic an operation targets: its uuid, or a
+ * service/characteristic path when the cloud names the service, so equal
+ * characteristic uuids in different services resolve correctly
+ */
+static char *get_chrc_path(struct gw_op *op, char *buf, size_t len)
 {
-	return !strncmp(s1, s2, strlen(s2));
+	if (op->svc_uuid[0] == '\0') {
+		return op->chrc_uuid;
+	}
+	snprintf(buf, len, "%s/%s", op->svc_uuid, op->chrc_uuid);
+	return buf;
 }
 
-int gateway_handler(const struct cloud_msg *gw_data)
+static int queue_cloud_data(const struct cloud_data_t *cloud_data)
 {
-	int ret = 0;
-	cJSON *root_obj;
-	cJSON *desired_obj;
-
-	cJSON *type_obj;
-	cJSON *operation_obj;
+	struct cloud_data_t *mem_ptr = k_malloc(sizeof(*mem_ptr));
 
-	cJSON *ble_address;
+	if (mem_ptr == NULL) {
+		LOG_ERR("Out of memory!");
+		return -ENOMEM;
+	}
+	memcpy(mem_ptr, cloud_data, sizeof(*mem_ptr));
+	k_fifo_put(&cloud_data_fifo, mem_ptr);
+	return 0;
+}
 
-	cJSON *chrc_uuid;
-	cJSON *service_uuid;
-	cJSON *desc_arr;
-	uint8_t desc_buf[2] = {0};
-	uint8_t desc_len = 0;
+/* Reads and writes are queued on the device's connection and answered
+ * from the Bluetooth side once it responds
+ */
+static int read_op(struct gw_op *op, bool ccc)
+{
+	char path_buf[BT_MAX_PATH_LEN];
+	char *chrc_path = get_chrc_path(op, path_buf, sizeof(path_buf));
+	int ret;
 
-	cJSON *value_arr;
-	uint8_t value_len = 0;
+	ret = gatt_read(op->addr, chrc_path, ccc);
+	if (ret) {
+		LOG_ERR("Error on gatt_read(%s, %s, %u): %d",
+			log_strdup(op->addr), log_strdup(chrc_path), ccc,
+			ret);
+	}
+	return ret;
+}
 
-	root_obj = cJSON_Parse(gw_data->buf);
+static int subscribe_op(struct gw_op *op)
+{
+	char path_buf[BT_MAX_PATH_LEN];
+	struct cloud_data_t cloud_data = {
+		.client_char_config = op->desc[0],
+		.priority = get_rx_priority(op->priority)
+	};
+
+	strncpy(cloud_data.addr, op->addr, sizeof(cloud_data.addr) - 1);
+	strncpy(cloud_data.uuid, get_chrc_path(op, path_buf, sizeof(path_buf)),
+		sizeof(cloud_data.uuid) - 1);
+	return queue_cloud_data(&cloud_data);
+}
 
-	if (root_obj == NULL) {
-		LOG_ERR("cJSON_Parse failed: %s",
-			log_strdup((char *)gw_data->buf));
-		return -ENOENT;
-	}
+static int write_op(struct gw_op *op)
+{
+	char path_buf[BT_MAX_PATH_LEN];
+	char *chrc_path = get_chrc_path(op, path_buf, sizeof(path_buf));
+	int ret;
 
-	type_obj = json_object_decode(root_obj, "type");
+	LOG_HEXDUMP_DBG(op->value, op->value_len, "Device Write Value");
 
-	if (type_obj == NULL) {
-		ret = -ENOENT;
-		goto exit_handler;
+	ret = gatt_write_report(op->addr, chrc_path, op->value,
+				op->value_len);
+	if (ret) {
+		LOG_ERR("Error on gatt_write(%s, %s): %d",
+			log_strdup(op->addr), log_strdup(chrc_path), ret);
 	}
+	return ret;
+}
 
-	const char *type_str = type_obj->valuestring;
+int gateway_handler(const struct cloud_msg *gw_data)
+{
+	int ret;
 
-	if (!compare(type_str, "operation")) {
-		ret = -EINVAL;
-		goto exit_handler;
+	ret = gw_op_decode(gw_data->buf, gw_data->len, &op);
+	if (ret) {
+		LOG_ERR("Unable to decode operation: %d", ret);
+		return ret;
 	}
 
-	operation_obj = json_object_decode(root_obj, "operation");
-	desired_obj = json_object_decode(operation_obj, "type");
+	/* every operation but scan names a device */
+	if ((op.type != GW_OP_SCAN) && (op.addr[0] == '\0')) {
+		return 0;
+	}
 
-	if (compare(desired_obj->valuestring, "scan")) {
-		desired_obj = json_object_decode(operation_obj, "scanType");
-		switch (desired_obj->valueint) {
+	switch (op.type) {
+	case GW_OP_SCAN:
+		switch (op.scan_type) {
 		case 0:
 			/* submit k_work to respond */
 			scan_start(false);
@@ -196,224 +197,40 @@ int gateway_handler(const struct cloud_msg *gw_data)
 		default:
 			break;
 		}
-
-	} else if (compare(desired_obj->valuestring,
-			   "device_characteristic_value_read")) {
-		ble_address = json_object_decode(operation_obj,
-						 "deviceAddress");
-		chrc_uuid = json_object_decode(operation_obj,
-					       "characteristicUUID");
-
-		LOG_INF("Got device_characteristic_value_read: %s",
-			log_strdup(ble_address->valuestring));
-		if ((ble_address != NULL) && (chrc_uuid != NULL)) {
-#if defined(QUEUE_CHAR_READS)
-			struct cloud_data_t cloud_data = {
-				.read = true,
-				.ccc = false,
-				.sub = false
-			};
-
-			memcpy(&cloud_data.addr,
-			       ble_address->valuestring,
-			       strlen(ble_address->valuestring));
-			memcpy(&cloud_data.uuid,
-			       chrc_uuid->valuestring,
-			       strlen(chrc_uuid->valuestring));
-
-			size_t size = sizeof(struct cloud_data_t);
-			char *mem_ptr = k_malloc(size);
-
-			if (mem_ptr == NULL) {
-				LOG_ERR("Out of memory!");
-				ret = -ENOMEM;
-				goto exit_handler;
-			}
-
-			memcpy(mem_ptr, &cloud_data, size);
-			k_fifo_put(&cloud_data_fifo, mem_ptr);
-			LOG_INF("Queued device_characteristic_value_read %s, %s, 0",
-				log_strdup(cloud_data.addr),
-				log_strdup(cloud_data.uuid));
-#else
-			ret = gatt_read(ble_address->valuestring,
-					chrc_uuid->valuestring);
-			if (ret) {
-				LOG_ERR("Error on gatt_read(%s, %s, 0): %d",
-					log_strdup(ble_address->valuestring),
-					log_strdup(chrc_uuid->valuestring),
-					ret);
-			}
-#endif
+		break;
+
+	case GW_OP_CHRC_READ:
+	case GW_OP_DESC_READ:
+		LOG_INF("Got %s: %s", (op.type == GW_OP_DESC_READ) ?
+			"device_descriptor_value_read" :
+			"device_characteristic_value_read",
+			log_strdup(op.addr));
+		if (op.chrc_uuid[0] != '\0') {
+			ret = read_op(&op, op.type == GW_OP_DESC_READ);
 		}
+		break;
 
-	} else if (compare(desired_obj->valuestring,
-			   "device_descriptor_value_read")) {
-
-		ble_address = json_object_decode(operation_obj,
-						 "deviceAddress");
-		chrc_uuid = json_object_decode(operation_obj,
-					       "characteristicUUID");
-
-		LOG_INF("Got device_descriptor_value_read: %s",
-			log_strdup(ble_address->valuestring));
-		if ((ble_address != NULL) && (chrc_uuid != NULL)) {
-#if defined(QUEUE_CHAR_READS)
-			struct cloud_data_t cloud_data = {
-				.read = true,
-				.ccc = true,
-				.sub = false
-			};
-
-			memcpy(&cloud_data.addr,
-			       ble_address->valuestring,
-			       strlen(ble_address->valuestring));
-			memcpy(&cloud_data.uuid,
-			       chrc_uuid->valuestring,
-			       strlen(chrc_uuid->valuestring));
-
-			size_t size = sizeof(struct cloud_data_t);
-			char *mem_ptr = k_malloc(size);
-
-			if (mem_ptr == NULL) {
-				LOG_ERR("Out of memory!");
-				ret = -ENOMEM;
-				goto exit_handler;
-			}
-
-			memcpy(mem_ptr, &cloud_data, size);
-			k_fifo_put(&cloud_data_fifo, mem_ptr);
-			LOG_INF("Queued device_descriptor_value_read %s, %s",
-				log_strdup(cloud_data.addr),
-				log_strdup(cloud_data.uuid));
-#else
-			ret = gatt_read(ble_address->valuestring,
-					chrc_uuid->valuestring, true);
-			if (ret) {
-				LOG_ERR("Error on gatt_read(%s, %s, 1): %d",
-					log_strdup(ble_address->valuestring),
-					log_strdup(chrc_uuid->valuestring),
-					ret);
-			}
-#endif
+	case GW_OP_DESC_WRITE:
+		if (op.chrc_uuid[0] != '\0') {
+			ret = subscribe_op(&op);
 		}
+		break;
 
-	} else if (compare(desired_obj->valuestring,
-			   "device_descriptor_value_write")) {
-		ble_address = json_object_decode(operation_obj,
-						 "deviceAddress");
-		chrc_uuid = json_object_decode(operation_obj,
-					       "characteristicUUID");
-		desc_arr = json_object_decode(operation_obj,
-					      "descriptorValue");
-
-		desc_len = cJSON_GetArraySize(desc_arr);
-		for (int i = 0; i < desc_len; i++) {
-			cJSON *item = cJSON_GetArrayItem(desc_arr, i);
-
-			desc_buf[i] = item->valueint;
-		}
-
-		if ((ble_address != NULL) && (chrc_uuid != NULL)) {
-			struct cloud_data_t cloud_data = {
-				.sub = true,
-				.read = false
-			};
-
-			memcpy(&cloud_data.addr,
-			       ble_address->valuestring,
-			       strlen(ble_address->valuestring));
-			memcpy(&cloud_data.uuid,
-			       chrc_uuid->valuestring,
-			       strlen(chrc_uuid->valuestring));
-
-			cloud_data.client_char_config = desc_buf[0];
-
-			size_t size = sizeof(struct cloud_data_t);
-			char *mem_ptr = k_malloc(size);
-
-			if (mem_ptr == NULL) {
-				LOG_ERR("Out of memory!");
-				ret = -ENOMEM;
-				goto exit_handler;
-			}
-
-			memcpy(mem_ptr, &cloud_data, size);
-			k_fifo_put(&cloud_data_fifo, mem_ptr);
+	case GW_OP_CHRC_WRITE:
+		if (op.chrc_uuid[0] != '\0') {
+			ret = write_op(&op);
 		}
+		break;
 
-	} else if (compare(desired_obj->valuestring,
-			   "device_characteristic_value_write")) {
-		ble_address = json_object_decode(operation_obj,
-						 "deviceAddress");
-		chrc_uuid = json_object_decode(operation_obj,
-					       "characteristicUUID");
-		service_uuid = json_object_decode(operation_obj,
-						  "serviceUUID");
-		value_arr = json_object_decode(operation_obj,
-					       "characteristicValue");
-
-		value_len = MIN(cJSON_GetArraySize(value_arr), VALUE_BUF_SIZE);
-
-		for (int i = 0; i < value_len; i++) {
-			cJSON *item = cJSON_GetArrayItem(value_arr, i);
-			value_buf[i] = item->valueint;
-		}
-
-		LOG_DBG("Device Write Value: %s\n", value_buf);
-
-		if ((ble_address != NULL) && (chrc_uuid != NULL)) {
-#if defined(QUEUE_CHAR_WRITES)
-			struct cloud_data_t cloud_data = {
-				.write = true,
-				.data_len = value_len
-			};
-
-			memcpy(&cloud_data.addr,
-			       ble_address->valuestring,
-			       strlen(ble_address->valuestring));
-			memcpy(&cloud_data.uuid,
-			       chrc_uuid->valuestring,
-			       strlen(chrc_uuid->valuestring));
-			memcpy(&cloud_data.data,
-			       value_buf,
-			       value_len);
-
-			size_t size = sizeof(struct cloud_data_t);
-			char *mem_ptr = k_malloc(size);
-
-			if (mem_ptr == NULL) {
-				LOG_ERR("Out of memory!");
-				ret = -ENOMEM;
-				goto exit_handler;
-			}
+	case GW_OP_DISCOVER:
+		LOG_INF("Cloud requested device_discover");
+		ble_conn_mgr_rediscover(op.addr);
+		break;
 
-			memcpy(mem_ptr, &cloud_data, size);
-			k_fifo_put(&cloud_data_fifo, mem_ptr);
-#else
-			ret = gatt_write(ble_address->valuestring,
-					 chrc_uuid->valuestring,
-					 value_buf, value_len, NULL);
-			if (ret) {
-				LOG_ERR("Error on gatt_write(%s, %s): %d",
-					log_strdup(ble_address->valuestring),
-					log_strdup(chrc_uuid->valuestring),
-					ret);
-			}
-#endif
-		}
-
-	} else if (compare(desired_obj->valuestring, "device_discover")) {
-		ble_address = json_object_decode(operation_obj,
-						 "deviceAddress");
-		if (ble_address != NULL) {
-			LOG_INF("Cloud requested device_discover");
-			ble_conn_mgr_rediscover(ble_address->valuestring);
-		}
+	default:
+		break;
 	}
 
-exit_handler:
-	cJSON_Delete(root_obj);
 	return ret;
 }
 
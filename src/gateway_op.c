@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <string.h>
+
+#include "json_reader.h"
+#include "gateway_op.h"
+
+static enum gw_op_type gw_op_lookup(const char *name, size_t len)
+{
+	switch (len) {
+#define GW_OP_CASE(id, str) \
+	case sizeof(str) - 1: \
+		return memcmp(name, str, len) ? GW_OP_COUNT : GW_OP_##id;
+	GW_OPS(GW_OP_CASE)
+#undef GW_OP_CASE
+	default:
+		return GW_OP_COUNT;
+	}
+}
+
+/* Copy a string member; other types leave dst empty */
+static void decode_str(struct json_reader *r, char *dst, size_t size)
+{
+	if (jr_peek(r) == '"') {
+		(void)jr_str(r, dst, size);
+	} else {
+		jr_skip(r);
+	}
+}
+
+/* Byte array member; elements past size are checked but dropped */
+static size_t decode_bytes(struct json_reader *r, uint8_t *dst, size_t size)
+{
+	size_t len = 0;
+	int32_t val;
+
+	if (jr_peek(r) != '[') {
+		jr_skip(r);
+		return 0;
+	}
+	jr_arr_start(r);
+	while (jr_arr_next(r)) {
+		if (jr_int(r, &val)) {
+			break;
+		}
+		if (len < size) {
+			dst[len++] = val;
+		}
+	}
+	return len;
+}
+
+static void decode_operation(struct json_reader *r, struct gw_op *op)
+{
+	char name[GW_OP_NAME_MAX];
+	const char *key;
+	size_t len;
+
+	if (!jr_obj_start(r)) {
+		return;
+	}
+	while (jr_next_key(r, &key, &len)) {
+		if (jr_key_is(key, len, "type")) {
+			decode_str(r, name, sizeof(name));
+			op->type = gw_op_lookup(name, strlen(name));
+		} else if (jr_key_is(key, len, "deviceAddress")) {
+			decode_str(r, op->addr, sizeof(op->addr));
+		} else if (jr_key_is(key, len, "characteristicUUID")) {
+			decode_str(r, op->chrc_uuid, sizeof(op->chrc_uuid));
+		} else if (jr_key_is(key, len, "serviceUUID")) {
+			decode_str(r, op->svc_uuid, sizeof(op->svc_uuid));
+		} else if (jr_key_is(key, len, "characteristicValue")) {
+			op->value_len = decode_bytes(r, op->value,
+						     sizeof(op->value));
+		} else if (jr_key_is(key, len, "descriptorValue")) {
+			op->desc_len = decode_bytes(r, op->desc,
+						    sizeof(op->desc));
+		} else if (jr_key_is(key, len, "scanType")) {
+			(void)jr_int(r, &op->scan_type);
+		} else if (jr_key_is(key, len, "priority")) {
+			decode_str(r, op->priority, sizeof(op->priority));
+		} else {
+			jr_skip(r);
+		}
+	}
+}
+
+int gw_op_decode(const char *buf, size_t len, struct gw_op *op)
+{
+	struct json_reader r;
+	bool is_operation = false;
+	bool has_type = false;
+	char type[sizeof("operation")];
+	const char *key;
+	size_t key_len;
+	int err;
+
+	memset(op, 0, offsetof(struct gw_op, value));
+	op->type = GW_OP_COUNT;
+
+	jr_init(&r, buf, len);
+	if (jr_obj_start(&r)) {
+		while (jr_next_key(&r, &key, &key_len)) {
+			if (jr_key_is(key, key_len, "type")) {
+				has_type = true;
+				is_operation = (jr_peek(&r) == '"') &&
+					       (jr_str(&r, type,
+						       sizeof(type)) >= 0) &&
+					       !strcmp(type, "operation");
+				/* not an operation; nothing else matters */
+				if (!is_operation) {
+					return -EINVAL;
+				}
+			} else if (jr_key_is(key, key_len, "operation")) {
+				decode_operation(&r, op);
+			} else {
+				jr_skip(&r);
+			}
+		}
+	}
+	err = jr_finish(&r);
+	if (err) {
+		return err;
+	}
+	return !has_type ? -ENOENT : 0;
+}
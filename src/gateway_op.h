@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GATEWAY_OP_H__
+#define GATEWAY_OP_H__
+
+#include <zephyr.h>
+#include <bluetooth/addr.h>
+#include "ble_conn_mgr.h"
+
+#define GW_OP_VALUE_MAX 256
+
+/* Operations the cloud sends. The names differ in length, so
+ * gw_op_lookup() picks one with a switch on the length and a single
+ * memcmp; a new name of an existing length fails to compile there.
+ */
+#define GW_OPS(X) \
+	X(SCAN, "scan") \
+	X(CHRC_READ, "device_characteristic_value_read") \
+	X(DESC_READ, "device_descriptor_value_read") \
+	X(DESC_WRITE, "device_descriptor_value_write") \
+	X(CHRC_WRITE, "device_characteristic_value_write") \
+	X(DISCOVER, "device_discover")
+
+enum gw_op_type {
+#define GW_OP_ENUM(id, name) GW_OP_##id,
+	GW_OPS(GW_OP_ENUM)
+#undef GW_OP_ENUM
+	GW_OP_COUNT
+};
+
+#define GW_OP_NAME_MAX sizeof("device_characteristic_value_write")
+#define GW_OP_PRIO_MAX sizeof("control")
+
+/* An operation decoded from a cloud message; absent strings are empty */
+struct gw_op {
+	enum gw_op_type type;
+	int32_t scan_type;
+	char addr[BT_ADDR_STR_LEN];
+	char svc_uuid[BT_MAX_UUID_LEN];
+	char chrc_uuid[BT_MAX_UUID_LEN];
+	char priority[GW_OP_PRIO_MAX];
+	uint8_t desc[2];
+	uint8_t desc_len;
+	uint16_t value_len;
+	uint8_t value[GW_OP_VALUE_MAX];
+};
+
+/** Decode {"type":"operation","operation":{...}} in one pass over buf.
+ * Returns 0, -ENOENT if the message has no type, or another negative
+ * error if it is not an operation or is malformed. type is GW_OP_COUNT
+ * for an operation that is not known; value bytes past GW_OP_VALUE_MAX
+ * are dropped.
+ */
+int gw_op_decode(const char *buf, size_t len, struct gw_op *op);
+
+#endif /* GATEWAY_OP_H__ */
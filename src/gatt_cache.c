@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <ctype.h>
+#include <string.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+#include <bluetooth/uuid.h>
+#include <settings/settings.h>
+
+#include "ble.h"
+#include "ble_conn_mgr.h"
+#include "gatt_cache.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(gatt_cache, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
+
+#define GATT_CACHE_SUBTREE "gw_gatt"
+#define GATT_CACHE_VERSION 1
+#define GATT_CACHE_KEY_LEN 32
+#define DB_HASH_LEN 16
+#define HASH_READ_TIMEOUT K_SECONDS(5)
+
+struct gatt_cache_hdr {
+	uint8_t version;
+	uint8_t num_pairs;
+	uint8_t has_hash;
+	uint8_t reserved;
+	uint8_t hash[DB_HASH_LEN];
+} __packed;
+
+/* one per attribute, followed by its 2 or 16 byte uuid value */
+struct gatt_cache_rec {
+	uint16_t handle;
+	uint8_t uuid_type;
+	uint8_t attr_type;
+	uint8_t path_depth;
+	uint8_t properties;
+	uint8_t is_service;
+} __packed;
+
+/* the blob is read into a buffer of its own size */
+struct load_ctx {
+	uint8_t *buf;
+	ssize_t len;
+};
+
+static atomic_t cache_hits;
+static atomic_t cache_misses;
+static atomic_t cache_stale;
+static atomic_t cache_saves;
+static atomic_t cache_errors;
+
+static struct bt_gatt_read_params hash_params;
+static K_SEM_DEFINE(hash_sem, 0, 1);
+static uint8_t hash_val[DB_HASH_LEN];
+static int hash_err;
+/* set while hash_params is owned by the host */
+static atomic_t hash_busy;
+
+static struct bt_gatt_subscribe_params sc_params[CONFIG_BT_MAX_CONN];
+
+/* gw_gatt/<address hex digits> */
+static void make_key(const char *addr, char *key, size_t len)
+{
+	char *p = key + snprintk(key, len, GATT_CACHE_SUBTREE "/");
+	char *end = key + len - 1;
+
+	for (; *addr && (p < end); addr++) {
+		if (isxdigit((int)*addr)) {
+			*p++ = *addr;
+		}
+	}
+	*p = '\0';
+}
+
+static uint8_t hash_read_cb(struct bt_conn *conn, uint8_t err,
+			    struct bt_gatt_read_params *params,
+			    const void *data, uint16_t length)
+{
+	if (err == BT_ATT_ERR_ATTRIBUTE_NOT_FOUND) {
+		hash_err = -ENOENT;
+	} else if (err) {
+		hash_err = -EIO;
+	} else if (data == NULL) {
+		hash_err = -ENOENT;
+	} else if (length != DB_HASH_LEN) {
+		hash_err = -EINVAL;
+	} else {
+		memcpy(hash_val, data, DB_HASH_LEN);
+		hash_err = 0;
+	}
+	atomic_clear(&hash_busy);
+	k_sem_give(&hash_sem);
+	return BT_GATT_ITER_STOP;
+}
+
+/* Read the Database Hash characteristic by uuid, waiting for the result */
+static int read_db_hash(struct ble_device_conn *conn_ptr, uint8_t *hash)
+{
+	struct bt_conn *conn;
+	int err;
+
+	conn = ble_conn_mgr_get_bt_conn(conn_ptr);
+	if (conn == NULL) {
+		return -ENOTCONN;
+	}
+	if (!atomic_cas(&hash_busy, 0, 1)) {
+		/* an earlier read timed out and is still outstanding */
+		bt_conn_unref(conn);
+		return -EBUSY;
+	}
+
+	k_sem_reset(&hash_sem);
+	memset(&hash_params, 0, sizeof(hash_params));
+	hash_params.func = hash_read_cb;
+	hash_params.handle_count = 0;
+	hash_params.by_uuid.uuid = BT_UUID_GATT_DB_HASH;
+	hash_params.by_uuid.start_handle = 0x0001;
+	hash_params.by_uuid.end_handle = 0xffff;
+
+	err = bt_gatt_read(conn, &hash_params);
+	bt_conn_unref(conn);
+	if (err) {
+		atomic_clear(&hash_busy);
+		return err;
+	}
+	if (k_sem_take(&hash_sem, HASH_READ_TIMEOUT)) {
+		return -ETIMEDOUT;
+	}
+	if (!hash_err) {
+		memcpy(hash, hash_val, DB_HASH_LEN);
+	}
+	return hash_err;
+}
+
+static bool has_chrc(const struct ble_device_conn *conn_ptr,
+		     const struct bt_uuid *uuid, int *index)
+{
+	struct uuid_handle_pair *up;
+
+	for (int i = 0; i < conn_ptr->num_pairs; i++) {
+		up = &conn_ptr->uuid_handle_pairs[i];
+		if ((up->attr_type == BT_ATTR_CHRC) &&
+		    (up->uuid_type == BT_UUID_TYPE_16) &&
+		    !bt_uuid_cmp(&up->uuid_16.uuid, uuid)) {
+			if (index) {
+				*index = i;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint8_t sc_indicated(struct bt_conn *conn,
+			    struct bt_gatt_subscribe_params *params,
+			    const void *data, uint16_t length)
+{
+	struct ble_device_conn *conn_ptr;
+
+	if (data == NULL) {
+		/* unsubscribed, e.g. because the link went down */
+		params->value_handle = 0;
+		return BT_GATT_ITER_STOP;
+	}
+
+	conn_ptr = ble_conn_mgr_get_conn_by_bt_conn(conn);
+	if (conn_ptr != NULL) {
+		LOG_INF("Service Changed on %s; rediscovering",
+			log_strdup(conn_ptr->addr));
+		atomic_inc(&cache_stale);
+		/* the manager thread marks the stored table stale */
+		(void)ble_conn_mgr_force_dfu_rediscover(conn_ptr->addr);
+	}
+	return BT_GATT_ITER_CONTINUE;
+}
+
+void gatt_cache_watch(struct ble_device_conn *conn_ptr)
+{
+	struct bt_gatt_subscribe_params *params;
+	struct uuid_handle_pair *ccc;
+	struct bt_conn *conn;
+	int i;
+	int err;
+
+	if (!has_chrc(conn_ptr, BT_UUID_GATT_SC, &i) ||
+	    ((i + 1) >= conn_ptr->num_pairs)) {
+		return;
+	}
+	ccc = &conn_ptr->uuid_handle_pairs[i + 1];
+	if (ccc->attr_type != BT_ATTR_CCC) {
+		return;
+	}
+
+	conn = ble_conn_mgr_get_bt_conn(conn_ptr);
+	if (conn == NULL) {
+		return;
+	}
+	params = &sc_params[bt_conn_index(conn)];
+	if (params->value_handle == 0) {
+		memset(params, 0, sizeof(*params));
+		params->notify = sc_indicated;
+		params->value = BT_GATT_CCC_INDICATE;
+		params->value_handle = conn_ptr->uuid_handle_pairs[i].handle;
+		params->ccc_handle = ccc->handle;
+		err = bt_gatt_subscribe(conn, params);
+		if (err) {
+			LOG_WRN("Service Changed subscribe failed: %d", err);
+			params->value_handle = 0;
+		}
+	}
+	bt_conn_unref(conn);
+}
+
+static int load_cb(const char *key, size_t len, settings_read_cb read_cb,
+		   void *cb_arg, void *param)
+{
+	struct load_ctx *ctx = param;
+
+	/* only the exact key, not anything below it */
+	if (key != NULL) {
+		return 0;
+	}
+	k_free(ctx->buf);
+	ctx->buf = k_malloc(len);
+	if (ctx->buf == NULL) {
+		ctx->len = -ENOMEM;
+		return 0;
+	}
+	ctx->len = read_cb(cb_arg, ctx->buf, len);
+	return 0;
+}
+
+static int unpack(struct ble_device_conn *conn_ptr, const uint8_t *p,
+		  size_t len, uint8_t num_pairs)
+{
+	const uint8_t *end = p + len;
+	struct gatt_cache_rec rec;
+	union {
+		struct bt_uuid uuid;
+		struct bt_uuid_16 u16;
+		struct bt_uuid_128 u128;
+	} u;
+	int err;
+
+	ble_conn_mgr_clear_attrs(conn_ptr);
+	for (int i = 0; i < num_pairs; i++) {
+		if ((end - p) < sizeof(rec)) {
+			return -EINVAL;
+		}
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+
+		if (rec.uuid_type == BT_UUID_TYPE_16) {
+			if ((end - p) < sizeof(u.u16.val)) {
+				return -EINVAL;
+			}
+			u.u16.uuid.type = BT_UUID_TYPE_16;
+			memcpy(&u.u16.val, p, sizeof(u.u16.val));
+			p += sizeof(u.u16.val);
+		} else if (rec.uuid_type == BT_UUID_TYPE_128) {
+			if ((end - p) < sizeof(u.u128.val)) {
+				return -EINVAL;
+			}
+			u.u128.uuid.type = BT_UUID_TYPE_128;
+			memcpy(u.u128.val, p, sizeof(u.u128.val));
+			p += sizeof(u.u128.val);
+		} else {
+			return -EINVAL;
+		}
+
+		err = ble_conn_mgr_add_uuid_pair(&u.uuid, rec.handle,
+						 rec.path_depth,
+						 rec.properties,
+						 rec.attr_type, conn_ptr,
+						 rec.is_service);
+		if (err) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+int gatt_cache_restore(struct ble_device_conn *conn_ptr)
+{
+	char key[GATT_CACHE_KEY_LEN];
+	struct gatt_cache_hdr *hdr;
+	uint8_t hash[DB_HASH_LEN];
+	struct load_ctx ctx;
+	int err;
+
+	make_key(conn_ptr->addr, key, sizeof(key));
+	if (conn_ptr->gatt_cache_stale) {
+		conn_ptr->gatt_cache_stale = false;
+		(void)settings_delete(key);
+		return -ESTALE;
+	}
+
+	ctx.buf = NULL;
+	ctx.len = 0;
+
+	err = settings_load_subtree_direct(key, load_cb, &ctx);
+	hdr = (struct gatt_cache_hdr *)ctx.buf;
+	if (err || (ctx.len < (ssize_t)sizeof(*hdr)) ||
+	    (hdr->version != GATT_CACHE_VERSION)) {
+		atomic_inc(&cache_misses);
+		err = -ENOENT;
+		goto done;
+	}
+
+	if (!hdr->has_hash) {
+		/* nothing to check it against after a reboot */
+		atomic_inc(&cache_misses);
+		(void)settings_delete(key);
+		err = -ENOENT;
+		goto done;
+	}
+	err = read_db_hash(conn_ptr, hash);
+	if (err) {
+		LOG_WRN("Unable to read database hash: %d", err);
+		atomic_inc(&cache_errors);
+		goto done;
+	}
+	if (memcmp(hash, hdr->hash, DB_HASH_LEN)) {
+		LOG_INF("Cached GATT table for %s is stale",
+			log_strdup(conn_ptr->addr));
+		atomic_inc(&cache_stale);
+		(void)settings_delete(key);
+		err = -ESTALE;
+		goto done;
+	}
+
+	err = unpack(conn_ptr, ctx.buf + sizeof(*hdr), ctx.len - sizeof(*hdr),
+		     hdr->num_pairs);
+	if (err) {
+		LOG_ERR("Cached GATT table for %s is corrupt: %d",
+			log_strdup(conn_ptr->addr), err);
+		ble_conn_mgr_clear_attrs(conn_ptr);
+		atomic_inc(&cache_errors);
+		(void)settings_delete(key);
+		goto done;
+	}
+
+	LOG_INF("Restored %u attributes for %s from cache",
+		conn_ptr->num_pairs, log_strdup(conn_ptr->addr));
+	atomic_inc(&cache_hits);
+	conn_ptr->gatt_cache_hit = true;
+
+done:
+	k_free(ctx.buf);
+	return err;
+}
+
+int gatt_cache_save(struct ble_device_conn *conn_ptr)
+{
+	char key[GATT_CACHE_KEY_LEN];
+	struct gatt_cache_hdr *hdr;
+	struct gatt_cache_rec rec;
+	struct uuid_handle_pair *up;
+	size_t len = sizeof(*hdr);
+	uint8_t *buf;
+	uint8_t hash[DB_HASH_LEN];
+	uint8_t *p;
+	int err;
+
+	/* an unbonded gateway never hears of a Service Changed sent while
+	 * it was disconnected, so only a table the hash can vouch for is
+	 * kept
+	 */
+	if (!has_chrc(conn_ptr, BT_UUID_GATT_DB_HASH, NULL)) {
+		LOG_DBG("%s has no database hash; not caching",
+			log_strdup(conn_ptr->addr));
+		return -ENOTSUP;
+	}
+	err = read_db_hash(conn_ptr, hash);
+	if (err) {
+		LOG_WRN("Unable to read database hash: %d", err);
+		atomic_inc(&cache_errors);
+		return err;
+	}
+
+	for (int i = 0; i < conn_ptr->num_pairs; i++) {
+		len += sizeof(rec) +
+		       ((conn_ptr->uuid_handle_pairs[i].uuid_type ==
+			 BT_UUID_TYPE_16) ? sizeof(uint16_t) :
+					    sizeof(((struct bt_uuid_128 *)0)->val));
+	}
+	buf = k_malloc(len);
+	if (buf == NULL) {
+		atomic_inc(&cache_errors);
+		return -ENOMEM;
+	}
+	hdr = (struct gatt_cache_hdr *)buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = GATT_CACHE_VERSION;
+	hdr->has_hash = true;
+	memcpy(hdr->hash, hash, DB_HASH_LEN);
+	p = buf + sizeof(*hdr);
+
+	for (int i = 0; i < conn_ptr->num_pairs; i++) {
+		up = &conn_ptr->uuid_handle_pairs[i];
+		rec.handle = up->handle;
+		rec.uuid_type = up->uuid_type;
+		rec.attr_type = up->attr_type;
+		rec.path_depth = up->path_depth;
+		rec.properties = up->properties;
+		rec.is_service = up->is_service;
+		memcpy(p, &rec, sizeof(rec));
+		p += sizeof(rec);
+		if (up->uuid_type == BT_UUID_TYPE_16) {
+			memcpy(p, &up->uuid_16.val, sizeof(up->uuid_16.val));
+			p += sizeof(up->uuid_16.val);
+		} else {
+			const struct bt_uuid_128 *u128 =
+				&conn_ptr->uuids_128[up->uuid_128_index];
+
+			memcpy(p, u128->val, sizeof(u128->val));
+			p += sizeof(u128->val);
+		}
+		hdr->num_pairs++;
+	}
+
+	make_key(conn_ptr->addr, key, sizeof(key));
+	err = settings_save_one(key, buf, p - buf);
+	if (err) {
+		LOG_ERR("Unable to save GATT table for %s: %d",
+			log_strdup(conn_ptr->addr), err);
+		atomic_inc(&cache_errors);
+	} else {
+		LOG_INF("Saved %u attributes for %s, %u bytes",
+			hdr->num_pairs, log_strdup(conn_ptr->addr), p - buf);
+		atomic_inc(&cache_saves);
+	}
+	k_free(buf);
+	return err;
+}
+
+int gatt_cache_delete(const char *addr)
+{
+	char key[GATT_CACHE_KEY_LEN];
+
+	make_key(addr, key, sizeof(key));
+	return settings_delete(key);
+}
+
+void gatt_cache_get_stats(struct gatt_cache_stats *stats)
+{
+	stats->hits = atomic_get(&cache_hits);
+	stats->misses = atomic_get(&cache_misses);
+	stats->stale = atomic_get(&cache_stale);
+	stats->saves = atomic_get(&cache_saves);
+	stats->errors = atomic_get(&cache_errors);
+}
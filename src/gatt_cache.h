@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GATT_CACHE_H__
+#define GATT_CACHE_H__
+
+#include "ble_conn_mgr.h"
+
+/**
+ * @file gatt_cache.h
+ *
+ * @brief Persistent copy of each device's discovered attribute table.
+ *
+ * Tables are kept in settings, keyed by device address, only for devices
+ * that expose a GATT Database Hash; the stored hash is compared with the
+ * device's before the table is used. While connected, a Service Changed
+ * indication marks the stored table stale. Everything here except
+ * gatt_cache_get_stats() runs on the connection manager thread.
+ * @{
+ */
+
+struct gatt_cache_stats {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t stale;
+	uint32_t saves;
+	uint32_t errors;
+};
+
+/** Fill conn_ptr's attribute table from the cache.
+ * Returns 0 on a valid hit, -ENOENT if nothing is stored, -ESTALE if the
+ * stored table no longer matches the device.
+ */
+int gatt_cache_restore(struct ble_device_conn *conn_ptr);
+
+/** Store conn_ptr's freshly discovered attribute table.
+ * Returns -ENOTSUP if the device has no Database Hash to validate it with.
+ */
+int gatt_cache_save(struct ble_device_conn *conn_ptr);
+
+/** Ask for Service Changed indications, so a change to the table is
+ * noticed while connected; call whenever conn_ptr's table becomes known
+ */
+void gatt_cache_watch(struct ble_device_conn *conn_ptr);
+
+/** Forget the table stored for addr */
+int gatt_cache_delete(const char *addr);
+
+void gatt_cache_get_stats(struct gatt_cache_stats *stats);
+
+/** @} */
+
+#endif /* GATT_CACHE_H__ */
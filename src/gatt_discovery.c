@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <string.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+#include <bluetooth/uuid.h>
+
+#include "ble.h"
+#include "ble_conn_mgr.h"
+#include "gatt_discovery.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(gatt_discovery, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
+
+enum disc_state {
+	DISC_SVC,
+	DISC_CHRC,
+	DISC_DESC,
+	DISC_DONE
+};
+
+enum disc_flag {
+	DISC_IN_USE,
+	/* a bt_gatt_discover() request is owned by the host */
+	DISC_PENDING,
+	DISC_FAILED
+};
+
+struct disc_chrc {
+	union {
+		struct bt_uuid uuid;
+		struct bt_uuid_16 uuid_16;
+		struct bt_uuid_128 uuid_128;
+	};
+	uint16_t value_handle;
+	uint8_t properties;
+	bool valid;
+};
+
+/* State is only changed by the discover callback while DISC_PENDING is
+ * set, and by the work items while it is clear
+ */
+struct disc_session {
+	struct bt_gatt_discover_params params;
+	struct k_work work;
+	struct k_work_delayable timeout;
+	struct bt_conn *conn;
+	gatt_discovery_done_t done;
+	atomic_t flags;
+	enum disc_state state;
+	int err;
+	uint16_t next_handle;
+	uint16_t svc_end;
+	uint16_t desc_end;
+	/* characteristic whose descriptors are searched next, and the one
+	 * following it, found while looking for the end of that range
+	 */
+	struct disc_chrc cur;
+	struct disc_chrc next;
+};
+
+static struct disc_session sessions[CONFIG_GATEWAY_BLE_DISCOVERY_SESSIONS];
+
+static struct k_spinlock stats_lock;
+static struct gatt_discovery_stats stats;
+static int64_t burst_start;
+
+static int chrc_copy(struct disc_chrc *dst, const struct bt_gatt_chrc *chrc)
+{
+	switch (chrc->uuid->type) {
+	case BT_UUID_TYPE_16:
+		memcpy(&dst->uuid_16, BT_UUID_16(chrc->uuid),
+		       sizeof(dst->uuid_16));
+		break;
+	case BT_UUID_TYPE_128:
+		memcpy(&dst->uuid_128, BT_UUID_128(chrc->uuid),
+		       sizeof(dst->uuid_128));
+		break;
+	default:
+		return -EINVAL;
+	}
+	dst->value_handle = chrc->value_handle;
+	dst->properties = chrc->properties;
+	dst->valid = true;
+	return 0;
+}
+
+static int chrc_add(struct ble_device_conn *dev, struct disc_chrc *chrc)
+{
+	return ble_conn_mgr_add_uuid_pair(&chrc->uuid, chrc->value_handle, 1,
+					  chrc->properties, BT_ATTR_CHRC,
+					  dev, false);
+}
+
+static void next_service(struct disc_session *s)
+{
+	s->cur.valid = false;
+	if (s->svc_end == 0xffff) {
+		s->state = DISC_DONE;
+	} else {
+		s->next_handle = s->svc_end + 1;
+		s->state = DISC_SVC;
+	}
+}
+
+/* The current characteristic's descriptors were searched; move on */
+static int desc_done(struct disc_session *s, struct ble_device_conn *dev)
+{
+	if (!s->next.valid) {
+		next_service(s);
+		return 0;
+	}
+	s->cur = s->next;
+	s->next.valid = false;
+	s->next_handle = s->cur.value_handle + 1;
+	s->state = DISC_CHRC;
+	return chrc_add(dev, &s->cur);
+}
+
+/* Look for a CCC between the current characteristic's value and end */
+static int desc_start(struct disc_session *s, struct ble_device_conn *dev,
+		      uint16_t end)
+{
+	s->next_handle = s->cur.value_handle + 1;
+	s->desc_end = end;
+	if (s->next_handle > end) {
+		return desc_done(s, dev);
+	}
+	s->state = DISC_DESC;
+	return 0;
+}
+
+static uint8_t discover_cb(struct bt_conn *conn,
+			   const struct bt_gatt_attr *attr,
+			   struct bt_gatt_discover_params *params)
+{
+	struct disc_session *s = CONTAINER_OF(params, struct disc_session,
+					      params);
+	struct ble_device_conn *dev = ble_conn_mgr_get_conn_by_bt_conn(conn);
+	const struct bt_gatt_service_val *svc;
+	const struct bt_gatt_chrc *chrc;
+	int err = 0;
+
+	if (dev == NULL) {
+		err = -ENOENT;
+		goto next;
+	}
+
+	switch (s->state) {
+	case DISC_SVC:
+		if (attr == NULL) {
+			s->state = DISC_DONE;
+			break;
+		}
+		svc = attr->user_data;
+		err = ble_conn_mgr_add_uuid_pair(svc->uuid, attr->handle, 0, 0,
+						 BT_ATTR_SERVICE, dev, true);
+		s->svc_end = svc->end_handle;
+		s->next_handle = attr->handle + 1;
+		s->cur.valid = false;
+		s->next.valid = false;
+		s->state = DISC_CHRC;
+		break;
+
+	case DISC_CHRC:
+		if (attr == NULL) {
+			if (s->cur.valid) {
+				err = desc_start(s, dev, s->svc_end);
+			} else {
+				next_service(s);
+			}
+			break;
+		}
+		chrc = attr->user_data;
+		if (!s->cur.valid) {
+			err = chrc_copy(&s->cur, chrc);
+			if (!err) {
+				err = chrc_add(dev, &s->cur);
+			}
+			s->next_handle = chrc->value_handle + 1;
+		} else {
+			err = chrc_copy(&s->next, chrc);
+			if (!err) {
+				err = desc_start(s, dev, attr->handle - 1);
+			}
+		}
+		break;
+
+	case DISC_DESC:
+		if (attr != NULL) {
+			err = ble_conn_mgr_add_uuid_pair(BT_UUID_GATT_CCC,
+							 attr->handle, 2, 0,
+							 BT_ATTR_CCC, dev,
+							 false);
+		}
+		if (!err) {
+			err = desc_done(s, dev);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+next:
+	if (err) {
+		s->err = err;
+		atomic_set_bit(&s->flags, DISC_FAILED);
+	}
+	atomic_clear_bit(&s->flags, DISC_PENDING);
+	k_work_submit(&s->work);
+	return BT_GATT_ITER_STOP;
+}
+
+static void session_finish(struct disc_session *s)
+{
+	struct bt_conn *conn = s->conn;
+	gatt_discovery_done_t done = s->done;
+	int err = atomic_test_bit(&s->flags, DISC_FAILED) ? s->err : 0;
+	k_spinlock_key_t key;
+
+	(void)k_work_cancel_delayable(&s->timeout);
+
+	key = k_spin_lock(&stats_lock);
+	if (err) {
+		stats.failed++;
+	} else {
+		stats.completed++;
+	}
+	if (--stats.active == 0) {
+		stats.last_burst_ms = k_uptime_get() - burst_start;
+	}
+	k_spin_unlock(&stats_lock, key);
+
+	s->conn = NULL;
+	atomic_clear(&s->flags);
+
+	done(ble_conn_mgr_get_conn_by_bt_conn(conn), conn, err);
+	bt_conn_unref(conn);
+}
+
+static void session_work_fn(struct k_work *work)
+{
+	struct disc_session *s = CONTAINER_OF(work, struct disc_session, work);
+	int err;
+
+	if (!atomic_test_bit(&s->flags, DISC_IN_USE) ||
+	    atomic_test_bit(&s->flags, DISC_PENDING)) {
+		return;
+	}
+	if (atomic_test_bit(&s->flags, DISC_FAILED) ||
+	    (s->state == DISC_DONE)) {
+		session_finish(s);
+		return;
+	}
+
+	memset(&s->params, 0, sizeof(s->params));
+	s->params.func = discover_cb;
+	s->params.start_handle = s->next_handle;
+	switch (s->state) {
+	case DISC_SVC:
+		s->params.type = BT_GATT_DISCOVER_PRIMARY;
+		s->params.end_handle = 0xffff;
+		break;
+	case DISC_CHRC:
+		s->params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+		s->params.end_handle = s->svc_end;
+		break;
+	default:
+		s->params.type = BT_GATT_DISCOVER_DESCRIPTOR;
+		s->params.uuid = BT_UUID_GATT_CCC;
+		s->params.end_handle = s->desc_end;
+		break;
+	}
+
+	atomic_set_bit(&s->flags, DISC_PENDING);
+	err = bt_gatt_discover(s->conn, &s->params);
+	if (err) {
+		LOG_ERR("Discover request failed: %d", err);
+		atomic_clear_bit(&s->flags, DISC_PENDING);
+		s->err = err;
+		atomic_set_bit(&s->flags, DISC_FAILED);
+		session_finish(s);
+	}
+}
+
+static void session_timeout_fn(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct disc_session *s = CONTAINER_OF(dwork, struct disc_session,
+					      timeout);
+	k_spinlock_key_t key;
+
+	if (!atomic_test_bit(&s->flags, DISC_IN_USE)) {
+		return;
+	}
+	LOG_WRN("Discovery on conn %u timed out", bt_conn_index(s->conn));
+
+	key = k_spin_lock(&stats_lock);
+	stats.timeouts++;
+	k_spin_unlock(&stats_lock, key);
+
+	s->err = -ETIMEDOUT;
+	atomic_set_bit(&s->flags, DISC_FAILED);
+	/* cancels an outstanding request, which ends up in session_work_fn */
+	(void)bt_conn_disconnect(s->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	k_work_submit(&s->work);
+}
+
+int gatt_discovery_start(struct bt_conn *conn, gatt_discovery_done_t done)
+{
+	struct disc_session *s = NULL;
+	k_spinlock_key_t key;
+
+	for (int i = 0; i < ARRAY_SIZE(sessions); i++) {
+		if (atomic_test_bit(&sessions[i].flags, DISC_IN_USE) &&
+		    (sessions[i].conn == conn)) {
+			return -EALREADY;
+		}
+	}
+	for (int i = 0; i < ARRAY_SIZE(sessions); i++) {
+		if (!atomic_test_and_set_bit(&sessions[i].flags,
+					     DISC_IN_USE)) {
+			s = &sessions[i];
+			break;
+		}
+	}
+	if (s == NULL) {
+		return -EBUSY;
+	}
+
+	s->conn = bt_conn_ref(conn);
+	s->done = done;
+	s->err = 0;
+	s->state = DISC_SVC;
+	s->next_handle = 0x0001;
+	s->svc_end = 0;
+	s->cur.valid = false;
+	s->next.valid = false;
+	k_work_init(&s->work, session_work_fn);
+	k_work_init_delayable(&s->timeout, session_timeout_fn);
+
+	key = k_spin_lock(&stats_lock);
+	if (stats.active++ == 0) {
+		burst_start = k_uptime_get();
+		stats.last_burst_devices = 0;
+	}
+	stats.last_burst_devices++;
+	stats.max_active = MAX(stats.max_active, stats.active);
+	k_spin_unlock(&stats_lock, key);
+
+	LOG_INF("Discovery started on conn %u", bt_conn_index(conn));
+	k_work_schedule(&s->timeout,
+			K_SECONDS(CONFIG_GATEWAY_BLE_DISCOVERY_TIMEOUT));
+	k_work_submit(&s->work);
+	return 0;
+}
+
+int gatt_discovery_active(void)
+{
+	return stats.active;
+}
+
+void gatt_discovery_get_stats(struct gatt_discovery_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	*out = stats;
+	k_spin_unlock(&stats_lock, key);
+}
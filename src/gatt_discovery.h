@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GATT_DISCOVERY_H__
+#define GATT_DISCOVERY_H__
+
+#include <bluetooth/conn.h>
+#include "ble_conn_mgr.h"
+
+/**
+ * @file gatt_discovery.h
+ *
+ * @brief Attribute discovery running on several connections at once.
+ *
+ * Each session walks one device's services, characteristics and CCC
+ * descriptors with bt_gatt_discover() and adds them to its connection
+ * manager entry in the same order bt_gatt_dm produced. Up to
+ * CONFIG_GATEWAY_BLE_DISCOVERY_SESSIONS sessions run in parallel.
+ * A session that takes longer than CONFIG_GATEWAY_BLE_DISCOVERY_TIMEOUT
+ * seconds is aborted and its link dropped.
+ * @{
+ */
+
+/** Called from the system work queue when a session ends. conn_ptr is
+ * NULL if the device was removed meanwhile.
+ */
+typedef void (*gatt_discovery_done_t)(struct ble_device_conn *conn_ptr,
+				      struct bt_conn *conn, int err);
+
+struct gatt_discovery_stats {
+	uint32_t active;
+	uint32_t max_active;
+	uint32_t completed;
+	uint32_t failed;
+	uint32_t timeouts;
+	/* from the first session starting while none were active until
+	 * none were left, for the most recent such period
+	 */
+	uint32_t last_burst_ms;
+	uint32_t last_burst_devices;
+};
+
+/** Returns -EBUSY when all sessions are in use, or -EALREADY when conn is
+ * already being discovered
+ */
+int gatt_discovery_start(struct bt_conn *conn, gatt_discovery_done_t done);
+
+/** Number of sessions in progress */
+int gatt_discovery_active(void);
+
+void gatt_discovery_get_stats(struct gatt_discovery_stats *stats);
+
+/** @} */
+
+#endif /* GATT_DISCOVERY_H__ */
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <string.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+
+#include "gatt_ops.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(gatt_ops, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
+
+enum op_state {
+	OP_QUEUED,
+	/* the request is owned by the host until its callback */
+	OP_ACTIVE,
+	OP_DONE
+};
+
+/* One per connection; active is only changed by the work item */
+struct op_queue {
+	sys_slist_t pending;
+	struct gatt_op *active;
+	struct k_work work;
+	uint8_t len;
+};
+
+static struct gatt_op ops[CONFIG_GATEWAY_GATT_OPS];
+static sys_slist_t free_ops;
+static struct op_queue queues[CONFIG_BT_MAX_CONN];
+
+/* guards the lists, queue lengths, op states and stats */
+static struct k_spinlock lock;
+static struct gatt_ops_stats stats;
+static int64_t burst_start;
+
+static void op_complete(struct gatt_op *op, int err)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	op->err = err;
+	op->state = OP_DONE;
+	k_spin_unlock(&lock, key);
+	k_work_submit(&queues[bt_conn_index(op->conn)].work);
+}
+
+static uint8_t read_cb(struct bt_conn *conn, uint8_t err,
+		       struct bt_gatt_read_params *params,
+		       const void *data, uint16_t length)
+{
+	struct gatt_op *op = CONTAINER_OF(params, struct gatt_op, read);
+
+	if (!err && (data != NULL)) {
+		if ((op->on_data == NULL) ||
+		    (op->on_data(conn, op, data, length) ==
+		     BT_GATT_ITER_CONTINUE)) {
+			/* the host calls again without data at the end */
+			return BT_GATT_ITER_CONTINUE;
+		}
+	}
+	op_complete(op, err);
+	return BT_GATT_ITER_STOP;
+}
+
+static void write_cb(struct bt_conn *conn, uint8_t err,
+		     struct bt_gatt_write_params *params)
+{
+	struct gatt_op *op = CONTAINER_OF(params, struct gatt_op, write);
+
+	if (op->on_write != NULL) {
+		op->on_write(conn, err, params);
+	}
+	op_complete(op, err);
+}
+
+static int op_start(struct gatt_op *op)
+{
+	if (op->type == GATT_OP_READ) {
+		op->read.func = read_cb;
+		op->read.handle_count = 1;
+		op->read.single.handle = op->handle;
+		op->read.single.offset = 0;
+		return bt_gatt_read(op->conn, &op->read);
+	}
+
+	op->write.func = write_cb;
+	op->write.handle = op->handle;
+	op->write.offset = 0;
+	op->write.data = op->data;
+	op->write.length = op->len;
+	return bt_gatt_write(op->conn, &op->write);
+}
+
+static void op_finish(struct gatt_op *op)
+{
+	if (op->err) {
+		LOG_DBG("%s of handle %u on conn %u failed: %d",
+			(op->type == GATT_OP_READ) ? "Read" : "Write",
+			op->handle, bt_conn_index(op->conn), op->err);
+	}
+	if (op->done != NULL) {
+		op->done(op->conn, op, op->err);
+	}
+	bt_conn_unref(op->conn);
+	gatt_op_free(op);
+}
+
+/* Finish the connection's completed operation, if any, and start the
+ * next one
+ */
+static void queue_work_fn(struct k_work *work)
+{
+	struct op_queue *q = CONTAINER_OF(work, struct op_queue, work);
+	struct gatt_op *op;
+	sys_snode_t *node;
+	k_spinlock_key_t key;
+	int err;
+
+	for (;;) {
+		key = k_spin_lock(&lock);
+		op = q->active;
+		if (op != NULL) {
+			if (op->state != OP_DONE) {
+				k_spin_unlock(&lock, key);
+				return;
+			}
+			q->active = NULL;
+			q->len--;
+			stats.active--;
+			if (op->err) {
+				stats.failed++;
+			} else {
+				stats.completed++;
+			}
+			if (--stats.queued == 0) {
+				stats.last_burst_ms = k_uptime_get() -
+						      burst_start;
+			}
+			k_spin_unlock(&lock, key);
+			op_finish(op);
+			continue;
+		}
+
+		node = sys_slist_get(&q->pending);
+		if (node == NULL) {
+			k_spin_unlock(&lock, key);
+			return;
+		}
+		op = CONTAINER_OF(node, struct gatt_op, node);
+		op->state = OP_ACTIVE;
+		q->active = op;
+		stats.active++;
+		stats.max_active = MAX(stats.max_active, stats.active);
+		k_spin_unlock(&lock, key);
+
+		err = op_start(op);
+		if (err) {
+			/* e.g. the link went down while op was queued */
+			key = k_spin_lock(&lock);
+			op->err = err;
+			op->state = OP_DONE;
+			k_spin_unlock(&lock, key);
+		}
+	}
+}
+
+void gatt_ops_init(void)
+{
+	sys_slist_init(&free_ops);
+	for (int i = 0; i < ARRAY_SIZE(ops); i++) {
+		sys_slist_append(&free_ops, &ops[i].node);
+	}
+	for (int i = 0; i < ARRAY_SIZE(queues); i++) {
+		sys_slist_init(&queues[i].pending);
+		queues[i].active = NULL;
+		queues[i].len = 0;
+		k_work_init(&queues[i].work, queue_work_fn);
+	}
+}
+
+struct gatt_op *gatt_op_alloc(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	sys_snode_t *node = sys_slist_get(&free_ops);
+	struct gatt_op *op;
+
+	if (node == NULL) {
+		stats.rejected++;
+		k_spin_unlock(&lock, key);
+		return NULL;
+	}
+	k_spin_unlock(&lock, key);
+
+	op = CONTAINER_OF(node, struct gatt_op, node);
+	memset(op, 0, offsetof(struct gatt_op, data));
+	return op;
+}
+
+void gatt_op_free(struct gatt_op *op)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	sys_slist_prepend(&free_ops, &op->node);
+	k_spin_unlock(&lock, key);
+}
+
+int gatt_op_submit(struct bt_conn *conn, struct gatt_op *op)
+{
+	struct op_queue *q = &queues[bt_conn_index(conn)];
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (q->len >= CONFIG_GATEWAY_GATT_OP_QUEUE_LEN) {
+		stats.rejected++;
+		k_spin_unlock(&lock, key);
+		return -EBUSY;
+	}
+
+	op->conn = bt_conn_ref(conn);
+	op->state = OP_QUEUED;
+	op->err = 0;
+	sys_slist_append(&q->pending, &op->node);
+	q->len++;
+
+	if (stats.queued++ == 0) {
+		burst_start = k_uptime_get();
+		stats.last_burst_ops = 0;
+	}
+	stats.last_burst_ops++;
+	stats.max_queued = MAX(stats.max_queued, stats.queued);
+	k_spin_unlock(&lock, key);
+
+	k_work_submit(&q->work);
+	return 0;
+}
+
+int gatt_ops_pending(void)
+{
+	return stats.queued;
+}
+
+void gatt_ops_get_stats(struct gatt_ops_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GATT_OPS_H__
+#define GATT_OPS_H__
+
+#include <zephyr.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+
+/**
+ * @file gatt_ops.h
+ *
+ * @brief GATT reads and writes queued per connection.
+ *
+ * Each operation carries its own request parameters, taken from a pool of
+ * CONFIG_GATEWAY_GATT_OPS, so requests to different devices are in flight
+ * at the same time. ATT allows one request per link, so each connection
+ * runs its operations one after another from a queue of at most
+ * CONFIG_GATEWAY_GATT_OP_QUEUE_LEN.
+ * @{
+ */
+
+enum gatt_op_type {
+	GATT_OP_READ,
+	GATT_OP_WRITE
+};
+
+struct gatt_op;
+
+/** Called from the Bluetooth receive thread with each part of a read
+ * value; returning BT_GATT_ITER_STOP ends the read
+ */
+typedef uint8_t (*gatt_op_data_t)(struct bt_conn *conn, struct gatt_op *op,
+				  const void *data, uint16_t length);
+
+/** Called from the system work queue once op is finished; it is freed on
+ * return. err is 0, a negative errno if the request could not be sent, or
+ * the ATT error the device answered with. Every connection's queue runs on
+ * that work queue, so this must not block.
+ */
+typedef void (*gatt_op_done_t)(struct bt_conn *conn, struct gatt_op *op,
+			       int err);
+
+struct gatt_op {
+	sys_snode_t node;
+	union {
+		struct bt_gatt_read_params read;
+		struct bt_gatt_write_params write;
+	};
+	struct bt_conn *conn;
+	enum gatt_op_type type;
+	uint8_t state;
+	uint16_t handle;
+	int err;
+	union {
+		gatt_op_data_t on_data;
+		/* called from the receive thread with the write response */
+		bt_gatt_write_func_t on_write;
+	};
+	gatt_op_done_t done;
+	void *user_data;
+	uint16_t len;
+	/* value to write; the caller's buffer may go away once queued */
+	uint8_t data[CONFIG_GATEWAY_GATT_OP_DATA_LEN];
+};
+
+struct gatt_ops_stats {
+	/* operations queued or in flight */
+	uint32_t queued;
+	uint32_t max_queued;
+	/* connections with a request in flight */
+	uint32_t active;
+	uint32_t max_active;
+	uint32_t completed;
+	uint32_t failed;
+	/* refused because the pool or the device's queue was full */
+	uint32_t rejected;
+	/* from the first operation queued while none were until none were
+	 * left, for the most recent such period
+	 */
+	uint32_t last_burst_ms;
+	uint32_t last_burst_ops;
+};
+
+void gatt_ops_init(void);
+
+/** Take a cleared operation from the pool; NULL when all are in use */
+struct gatt_op *gatt_op_alloc(void);
+
+/** Return an operation that was not submitted */
+void gatt_op_free(struct gatt_op *op);
+
+/** Queue op on conn. On success the engine owns op and frees it after
+ * done; on error the caller still does. Returns -EBUSY when the
+ * connection's queue is full.
+ */
+int gatt_op_submit(struct bt_conn *conn, struct gatt_op *op);
+
+/** Operations queued or in flight on all connections */
+int gatt_ops_pending(void);
+
+void gatt_ops_get_stats(struct gatt_ops_stats *stats);
+
+/** @} */
+
+#endif /* GATT_OPS_H__ */
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <string.h>
+#include "json_reader.h"
+
+void jr_init(struct json_reader *r, const char *buf, size_t len)
+{
+	r->p = buf;
+	r->end = buf + len;
+	r->err = (buf == NULL) ? -EINVAL : 0;
+	r->need_comma = false;
+}
+
+static void fail(struct json_reader *r, int err)
+{
+	if (!r->err) {
+		r->err = err;
+	}
+}
+
+static void skip_ws(struct json_reader *r)
+{
+	while ((r->p < r->end) &&
+	       ((*r->p == ' ') || (*r->p == '\t') ||
+		(*r->p == '\n') || (*r->p == '\r'))) {
+		r->p++;
+	}
+}
+
+/* Next non-whitespace character, without consuming it */
+static char next_char(struct json_reader *r)
+{
+	if (r->err) {
+		return 0;
+	}
+	skip_ws(r);
+	if ((r->p == r->end) || (*r->p == '\0')) {
+		fail(r, -ENODATA);
+		return 0;
+	}
+	return *r->p;
+}
+
+static bool expect(struct json_reader *r, char c)
+{
+	if (next_char(r) != c) {
+		fail(r, -EINVAL);
+		return false;
+	}
+	r->p++;
+	return true;
+}
+
+int jr_finish(struct json_reader *r)
+{
+	if (!r->err) {
+		skip_ws(r);
+		if ((r->p != r->end) && (*r->p != '\0')) {
+			fail(r, -EINVAL);
+		}
+	}
+	return r->err;
+}
+
+char jr_peek(struct json_reader *r)
+{
+	return next_char(r);
+}
+
+bool jr_obj_start(struct json_reader *r)
+{
+	r->need_comma = false;
+	return expect(r, '{');
+}
+
+/* Find the end of the string starting at r->p, leaving r->p on its
+ * closing quote; returns whether it holds escapes
+ */
+static bool scan_string(struct json_reader *r)
+{
+	bool escaped = false;
+
+	while (r->p < r->end) {
+		switch (*r->p) {
+		case '"':
+			return escaped;
+		case '\\':
+			escaped = true;
+			/* the escaped character must be in the buffer too */
+			if ((r->end - r->p) < 2) {
+				r->p = r->end;
+				continue;
+			}
+			r->p++;
+			break;
+		case '\0':
+			r->p = r->end;
+			continue;
+		default:
+			break;
+		}
+		r->p++;
+	}
+	fail(r, -EINVAL);
+	return escaped;
+}
+
+bool jr_next_key(struct json_reader *r, const char **key, size_t *len)
+{
+	char c = next_char(r);
+
+	if (c == '}') {
+		r->p++;
+		r->need_comma = true;
+		return false;
+	}
+	if (r->need_comma && !expect(r, ',')) {
+		return false;
+	}
+	if (!expect(r, '"')) {
+		return false;
+	}
+	*key = r->p;
+	(void)scan_string(r);
+	if (r->err) {
+		return false;
+	}
+	*len = r->p - *key;
+	r->p++;
+	r->need_comma = false;
+	return expect(r, ':');
+}
+
+bool jr_arr_start(struct json_reader *r)
+{
+	r->need_comma = false;
+	return expect(r, '[');
+}
+
+bool jr_arr_next(struct json_reader *r)
+{
+	char c = next_char(r);
+
+	if (c == ']') {
+		r->p++;
+		r->need_comma = true;
+		return false;
+	}
+	if (r->need_comma && !expect(r, ',')) {
+		return false;
+	}
+	r->need_comma = false;
+	return !r->err;
+}
+
+static int hex_digit(char c)
+{
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	}
+	c |= 0x20;
+	if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* Decode the escape following a backslash at *src; returns the character
+ * and advances *src past it
+ */
+static int unescape(struct json_reader *r, const char **src)
+{
+	const char *s = *src + 1;
+	uint32_t cp = 0;
+	int d;
+
+	*src = s + 1;
+	switch (*s) {
+	case '"':
+	case '\\':
+	case '/':
+		return *s;
+	case 'b':
+		return '\b';
+	case 'f':
+		return '\f';
+	case 'n':
+		return '\n';
+	case 'r':
+		return '\r';
+	case 't':
+		return '\t';
+	case 'u':
+		if ((r->end - s) < 5) {
+			break;
+		}
+		for (int i = 1; i <= 4; i++) {
+			d = hex_digit(s[i]);
+			if (d < 0) {
+				return -EINVAL;
+			}
+			cp = (cp << 4) | d;
+		}
+		*src = s + 5;
+		return (cp < 0x80) ? cp : '?';
+	default:
+		break;
+	}
+	return -EINVAL;
+}
+
+int jr_str(struct json_reader *r, char *dst, size_t size)
+{
+	const char *start;
+	const char *src;
+	bool escaped;
+	size_t len = 0;
+	int c;
+
+	if (!expect(r, '"')) {
+		return r->err;
+	}
+	start = r->p;
+	escaped = scan_string(r);
+	if (r->err) {
+		return r->err;
+	}
+
+	if (!escaped) {
+		len = r->p - start;
+		if (len < size) {
+			memcpy(dst, start, len);
+		}
+	} else {
+		for (src = start; (src < r->p) && (len < size); len++) {
+			if (*src != '\\') {
+				dst[len] = *src++;
+				continue;
+			}
+			c = unescape(r, &src);
+			if (c < 0) {
+				fail(r, c);
+				return r->err;
+			}
+			dst[len] = c;
+		}
+	}
+	r->p++;
+	r->need_comma = true;
+
+	/* too long; the value is skipped and dst left empty */
+	if (len >= size) {
+		if (size) {
+			dst[0] = '\0';
+		}
+		return -ENOMEM;
+	}
+	dst[len] = '\0';
+	return len;
+}
+
+static bool is_number_char(char c)
+{
+	return ((c >= '0') && (c <= '9')) || (c == '-') || (c == '+') ||
+	       (c == '.') || (c == 'e') || (c == 'E');
+}
+
+int jr_int(struct json_reader *r, int32_t *val)
+{
+	char c = next_char(r);
+	bool negative = (c == '-');
+	int64_t v = 0;
+
+	if (negative) {
+		r->p++;
+	}
+	if ((r->p == r->end) || (*r->p < '0') || (*r->p > '9')) {
+		fail(r, -EINVAL);
+		return r->err;
+	}
+	while ((r->p < r->end) && (*r->p >= '0') && (*r->p <= '9')) {
+		if (v <= INT32_MAX) {
+			v = v * 10 + (*r->p - '0');
+		}
+		r->p++;
+	}
+	/* fraction and exponent are ignored */
+	while ((r->p < r->end) && is_number_char(*r->p)) {
+		r->p++;
+	}
+
+	if (negative) {
+		*val = (v > INT32_MAX) ? INT32_MIN : -(int32_t)v;
+	} else {
+		*val = (v > INT32_MAX) ? INT32_MAX : (int32_t)v;
+	}
+	r->need_comma = true;
+	return 0;
+}
+
+void jr_skip(struct json_reader *r)
+{
+	int depth = 0;
+	char c;
+
+	do {
+		c = next_char(r);
+		switch (c) {
+		case 0:
+			return;
+		case '{':
+		case '[':
+			depth++;
+			r->p++;
+			continue;
+		case '}':
+		case ']':
+			depth--;
+			r->p++;
+			continue;
+		case ',':
+		case ':':
+			r->p++;
+			continue;
+		case '"':
+			r->p++;
+			(void)scan_string(r);
+			if (!r->err) {
+				r->p++;
+			}
+			continue;
+		default:
+			/* number or literal */
+			if (!is_number_char(c) && ((c < 'a') || (c > 'z'))) {
+				fail(r, -EINVAL);
+				return;
+			}
+			while ((r->p < r->end) &&
+			       (is_number_char(*r->p) ||
+				((*r->p >= 'a') && (*r->p <= 'z')))) {
+				r->p++;
+			}
+			continue;
+		}
+	} while (depth > 0);
+	r->need_comma = true;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef JSON_READER_H__
+#define JSON_READER_H__
+
+#include <zephyr.h>
+#include <string.h>
+
+/**
+ * @file json_reader.h
+ *
+ * @brief Forward-only JSON reader working directly on a caller buffer.
+ *
+ * The caller walks the document in order, asking for each member or
+ * element and either decoding or skipping its value. Nothing is allocated
+ * and the input is not modified. The first error is kept in err; every
+ * later call then does nothing and loops over members or elements end.
+ * @{
+ */
+
+struct json_reader {
+	const char *p;
+	const char *end;
+	int err;
+	bool need_comma;
+};
+
+void jr_init(struct json_reader *r, const char *buf, size_t len);
+
+/** Check nothing but whitespace follows; returns 0 or the first error */
+int jr_finish(struct json_reader *r);
+
+/** First character of the next value: '{', '[', '"', a digit, '-', 't',
+ * 'f' or 'n'; 0 on error or at the end of the input
+ */
+char jr_peek(struct json_reader *r);
+
+bool jr_obj_start(struct json_reader *r);
+
+/** Move to the next member of the current object. Returns false after
+ * consuming its closing brace, or on error. The name is not unescaped.
+ */
+bool jr_next_key(struct json_reader *r, const char **key, size_t *len);
+
+bool jr_arr_start(struct json_reader *r);
+
+/** True when another element follows; false after consuming the closing
+ * bracket, or on error
+ */
+bool jr_arr_next(struct json_reader *r);
+
+/** Unescape a string value into dst; returns its length. A value that
+ * does not fit with its terminating NUL is skipped, leaving dst empty, and
+ * -ENOMEM returned without failing the reader. Non-ASCII characters given
+ * as \u escapes become '?'.
+ */
+int jr_str(struct json_reader *r, char *dst, size_t size);
+
+/** Integer part of a number value, saturated to the int32_t range;
+ * any fraction or exponent is ignored
+ */
+int jr_int(struct json_reader *r, int32_t *val);
+
+/** Skip over the next value, whatever its type */
+void jr_skip(struct json_reader *r);
+
+static inline bool jr_key_is(const char *key, size_t len, const char *name)
+{
+	return (strlen(name) == len) && !memcmp(key, name, len);
+}
+
+/** @} */
+
+#endif /* JSON_READER_H__ */
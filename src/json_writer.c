@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <string.h>
+#include "json_writer.h"
+
+void jw_init(struct json_writer *w, char *buf, size_t size)
+{
+	w->buf = buf;
+	w->size = size;
+	w->len = 0;
+	w->err = ((buf != NULL) && (size == 0)) ? -ENOMEM : 0;
+	w->need_comma = false;
+}
+
+int jw_finish(struct json_writer *w)
+{
+	if (w->err) {
+		if (w->buf && w->size) {
+			w->buf[0] = '\0';
+		}
+		return w->err;
+	}
+	if (w->buf) {
+		w->buf[w->len] = '\0';
+	}
+	return w->len;
+}
+
+/* always leave room for the terminating NUL */
+static void put(struct json_writer *w, const char *src, size_t len)
+{
+	if (w->err) {
+		return;
+	}
+	if (w->buf == NULL) {
+		w->len += len;
+		return;
+	}
+	if ((w->len + len) >= w->size) {
+		w->err = -ENOMEM;
+		return;
+	}
+	memcpy(&w->buf[w->len], src, len);
+	w->len += len;
+}
+
+static void put_char(struct json_writer *w, char c)
+{
+	put(w, &c, 1);
+}
+
+static void separate(struct json_writer *w)
+{
+	if (w->need_comma) {
+		put_char(w, ',');
+	}
+}
+
+static void put_uint(struct json_writer *w, uint32_t val)
+{
+	char digits[10];
+	int i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+	put(w, &digits[i], sizeof(digits) - i);
+}
+
+/* same escaping as cJSON's print_string_ptr() */
+static void put_string(struct json_writer *w, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run = str;
+	char esc[6] = {'\\', 'u', '0', '0'};
+
+	put_char(w, '"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+		size_t esc_len = 2;
+
+		if ((c >= 32) && (c != '"') && (c != '\\')) {
+			continue;
+		}
+		put(w, run, str - run);
+		run = str + 1;
+
+		switch (c) {
+		case '"':
+		case '\\':
+			esc[1] = c;
+			break;
+		case '\b':
+			esc[1] = 'b';
+			break;
+		case '\f':
+			esc[1] = 'f';
+			break;
+		case '\n':
+			esc[1] = 'n';
+			break;
+		case '\r':
+			esc[1] = 'r';
+			break;
+		case '\t':
+			esc[1] = 't';
+			break;
+		default:
+			esc[1] = 'u';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			esc_len = 6;
+			break;
+		}
+		put(w, esc, esc_len);
+	}
+	put(w, run, str - run);
+	put_char(w, '"');
+}
+
+void jw_obj_start(struct json_writer *w)
+{
+	separate(w);
+	put_char(w, '{');
+	w->need_comma = false;
+}
+
+void jw_obj_end(struct json_writer *w)
+{
+	put_char(w, '}');
+	w->need_comma = true;
+}
+
+void jw_arr_start(struct json_writer *w)
+{
+	separate(w);
+	put_char(w, '[');
+	w->need_comma = false;
+}
+
+void jw_arr_end(struct json_writer *w)
+{
+	put_char(w, ']');
+	w->need_comma = true;
+}
+
+void jw_key(struct json_writer *w, const char *key)
+{
+	separate(w);
+	put_string(w, key);
+	put_char(w, ':');
+	w->need_comma = false;
+}
+
+void jw_str(struct json_writer *w, const char *str)
+{
+	if (str == NULL) {
+		if (!w->err) {
+			w->err = -EINVAL;
+		}
+		return;
+	}
+	separate(w);
+	put_string(w, str);
+	w->need_comma = true;
+}
+
+void jw_int(struct json_writer *w, int32_t val)
+{
+	separate(w);
+	if (val < 0) {
+		put_char(w, '-');
+		put_uint(w, -(uint32_t)val);
+	} else {
+		put_uint(w, val);
+	}
+	w->need_comma = true;
+}
+
+void jw_bool(struct json_writer *w, bool val)
+{
+	separate(w);
+	if (val) {
+		put(w, "true", 4);
+	} else {
+		put(w, "false", 5);
+	}
+	w->need_comma = true;
+}
+
+void jw_null(struct json_writer *w)
+{
+	separate(w);
+	put(w, "null", 4);
+	w->need_comma = true;
+}
+
+void jw_bytes(struct json_writer *w, const uint8_t *data, size_t len)
+{
+	jw_arr_start(w);
+	for (size_t i = 0; i < len; i++) {
+		if (i) {
+			put_char(w, ',');
+		}
+		put_uint(w, data[i]);
+	}
+	jw_arr_end(w);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef JSON_WRITER_H__
+#define JSON_WRITER_H__
+
+#include <zephyr.h>
+
+/**
+ * @file json_writer.h
+ *
+ * @brief Forward-only JSON writer emitting directly into a caller buffer.
+ *
+ * Output matches cJSON_PrintPreallocated() with format disabled: members
+ * are written in call order, strings are escaped the same way and
+ * integers are printed in decimal. Nothing is allocated; once the buffer
+ * is full further calls are ignored and jw_finish() reports the error.
+ * @{
+ */
+
+struct json_writer {
+	char *buf;
+	size_t size;
+	size_t len;
+	int err;
+	bool need_comma;
+};
+
+/** A NULL buf only measures: nothing is written and jw_finish() returns
+ * the length the output would have
+ */
+void jw_init(struct json_writer *w, char *buf, size_t size);
+
+/** NUL terminate the output; returns its length or a negative error */
+int jw_finish(struct json_writer *w);
+
+void jw_obj_start(struct json_writer *w);
+void jw_obj_end(struct json_writer *w);
+void jw_arr_start(struct json_writer *w);
+void jw_arr_end(struct json_writer *w);
+
+/** Write a member name; the next value call supplies its value */
+void jw_key(struct json_writer *w, const char *key);
+
+/** A NULL string is an error, as cJSON cannot create one either */
+void jw_str(struct json_writer *w, const char *str);
+void jw_int(struct json_writer *w, int32_t val);
+void jw_bool(struct json_writer *w, bool val);
+void jw_null(struct json_writer *w);
+
+/** Array of byte values, as used for characteristic and descriptor values */
+void jw_bytes(struct json_writer *w, const uint8_t *data, size_t len);
+
+static inline void jw_key_obj_start(struct json_writer *w, const char *key)
+{
+	jw_key(w, key);
+	jw_obj_start(w);
+}
+
+static inline void jw_key_str(struct json_writer *w, const char *key,
+			      const char *str)
+{
+	jw_key(w, key);
+	jw_str(w, str);
+}
+
+static inline void jw_key_int(struct json_writer *w, const char *key,
+			      int32_t val)
+{
+	jw_key(w, key);
+	jw_int(w, val);
+}
+
+static inline void jw_key_bool(struct json_writer *w, const char *key,
+			       bool val)
+{
+	jw_key(w, key);
+	jw_bool(w, val);
+}
+
+static inline void jw_key_null(struct json_writer *w, const char *key)
+{
+	jw_key(w, key);
+	jw_null(w);
+}
+
+/** @} */
+
+#endif /* JSON_WRITER_H__ */
@@ -47,6 +47,7 @@
 #include "watchdog.h"
 #include "ble_conn_mgr.h"
 #include "ble_codec.h"
+#include "timestamp.h"
 #include "ble.h"
 #include "config.h"
 #include "gateway.h"
@@ -676,6 +677,7 @@ void cloud_event_handler(const struct cloud_backend *const backend,
 		boot_write_img_confirmed();
 #endif
 		atomic_set(&cloud_association, CLOUD_ASSOCIATION_STATE_READY);
+		ble_conn_mgr_post(NULL, BLE_CONN_EVT_CLOUD_READY);
 
 		modem = query_modem_info();
 		set_shadow_modem(modem);
@@ -752,6 +754,7 @@ struct modem_param_info * query_modem_info(void)
 				 */
 
 				if (!clock_settime(CLOCK_REALTIME, &ts)) {
+					ts_sync();
 					LOG_INF("Time set");
 				} else {
 					LOG_ERR("Error %d on clock_settime()",
@@ -789,6 +792,8 @@ static void date_time_event_handler(const struct date_time_evt *evt)
 		return;
 	}
 
+	ts_sync();
+
 	char time_str[30] = {0};
 
 	if (get_time_str(time_str, sizeof(time_str))) {
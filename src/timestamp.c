@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <string.h>
+#include <posix/time.h>
+#include <date_time.h>
+
+#include "timestamp.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(timestamp, CONFIG_NRF_CLOUD_GATEWAY_LOG_LEVEL);
+
+#define SEC_PER_DAY 86400
+#define DATE_LEN 11 /* YYYY-MM-DDT */
+#define TIME_LEN 9 /* HH:MM:SS. */
+
+static struct k_spinlock ts_lock;
+
+/* UTC ms minus k_uptime_get() ms; valid once synced */
+static int64_t utc_offset_ms;
+static bool synced;
+
+/* last rendered timestamp; only the parts that changed are redone */
+static int64_t cached_sec = -1;
+static int64_t cached_day = -1;
+static char cached_str[TS_STR_LEN] = "0000-00-00T00:00:00.000Z";
+
+static int read_utc_ms(int64_t *unix_ms)
+{
+#ifdef CONFIG_DATE_TIME
+	return date_time_now(unix_ms);
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts)) {
+		return -errno;
+	}
+	*unix_ms = (int64_t)ts.tv_sec * MSEC_PER_SEC +
+		   ts.tv_nsec / NSEC_PER_MSEC;
+	return 0;
+#endif
+}
+
+static int sync_offset(void)
+{
+	int64_t unix_ms;
+	int64_t uptime;
+	k_spinlock_key_t key;
+	int err;
+
+	err = read_utc_ms(&unix_ms);
+	if (err) {
+		LOG_ERR("Date/time not available: %d", err);
+		return err;
+	}
+	uptime = k_uptime_get();
+
+	key = k_spin_lock(&ts_lock);
+	utc_offset_ms = unix_ms - uptime;
+	synced = true;
+	k_spin_unlock(&ts_lock, key);
+	return 0;
+}
+
+void ts_sync(void)
+{
+	(void)sync_offset();
+}
+
+/* UTC ms for a k_uptime_get() value, syncing first if needed */
+static int uptime_to_utc(int64_t uptime, int64_t *unix_ms)
+{
+	k_spinlock_key_t key;
+	int err;
+
+	if (!synced) {
+		err = sync_offset();
+		if (err) {
+			return err;
+		}
+	}
+
+	key = k_spin_lock(&ts_lock);
+	*unix_ms = uptime + utc_offset_ms;
+	k_spin_unlock(&ts_lock, key);
+	return 0;
+}
+
+int ts_now_ms(int64_t *unix_ms)
+{
+	return uptime_to_utc(k_uptime_get(), unix_ms);
+}
+
+int ts_cycles_to_ms(uint32_t cycles, int64_t *unix_ms)
+{
+	uint32_t age_ms = k_cyc_to_ms_floor32(k_cycle_get_32() - cycles);
+
+	return uptime_to_utc(k_uptime_get() - age_ms, unix_ms);
+}
+
+static void put_digits(char *dst, uint32_t val, int n)
+{
+	while (n--) {
+		dst[n] = '0' + (val % 10);
+		val /= 10;
+	}
+}
+
+/* Proleptic Gregorian date from days since 1970-01-01 */
+static void render_date(char *dst, int64_t days)
+{
+	int64_t era;
+	uint32_t doe, yoe, doy, mp;
+	int64_t year;
+	uint32_t month, day;
+
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = (uint32_t)(days - era * 146097);
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = (mp < 10) ? (mp + 3) : (mp - 9);
+	year = (int64_t)yoe + era * 400 + (month <= 2);
+
+	put_digits(&dst[0], (uint32_t)year, 4);
+	put_digits(&dst[5], month, 2);
+	put_digits(&dst[8], day, 2);
+}
+
+char *ts_format(int64_t unix_ms, char *dst, size_t len)
+{
+	k_spinlock_key_t key;
+	int64_t sec;
+	uint32_t sec_of_day;
+
+	if ((unix_ms < 0) || (len < TS_STR_LEN)) {
+		return NULL;
+	}
+	sec = unix_ms / MSEC_PER_SEC;
+
+	key = k_spin_lock(&ts_lock);
+	if (sec != cached_sec) {
+		if ((sec / SEC_PER_DAY) != cached_day) {
+			cached_day = sec / SEC_PER_DAY;
+			render_date(cached_str, cached_day);
+		}
+		sec_of_day = sec % SEC_PER_DAY;
+		put_digits(&cached_str[DATE_LEN], sec_of_day / 3600, 2);
+		put_digits(&cached_str[DATE_LEN + 3], (sec_of_day / 60) % 60, 2);
+		put_digits(&cached_str[DATE_LEN + 6], sec_of_day % 60, 2);
+		cached_sec = sec;
+	}
+	put_digits(&cached_str[DATE_LEN + TIME_LEN],
+		   unix_ms % MSEC_PER_SEC, 3);
+	memcpy(dst, cached_str, TS_STR_LEN);
+	k_spin_unlock(&ts_lock, key);
+	return dst;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef TIMESTAMP_H__
+#define TIMESTAMP_H__
+
+#include <zephyr.h>
+
+/**
+ * @file timestamp.h
+ *
+ * @brief UTC timestamps for cloud events.
+ *
+ * The offset between UTC and k_uptime is cached when date_time syncs,
+ * so getting the current time is an addition rather than a library call.
+ * Timestamps are rendered as ISO-8601 with milliseconds; the date and
+ * time of day are only re-rendered when the second or day changes.
+ * @{
+ */
+
+/* 2020-02-19T18:38:50.363Z plus NUL */
+#define TS_STR_LEN 25
+
+/** Refresh the cached UTC offset; call whenever date_time obtains time */
+void ts_sync(void);
+
+/** Current UTC time in ms since the epoch */
+int ts_now_ms(int64_t *unix_ms);
+
+/** UTC time at which k_cycle_get_32() returned cycles, in ms since the
+ * epoch; for stamping data with the time it was received rather than
+ * the time it was encoded. cycles must be less than one counter
+ * wrap in the past.
+ */
+int ts_cycles_to_ms(uint32_t cycles, int64_t *unix_ms);
+
+/** Render unix_ms into dst, which must hold TS_STR_LEN bytes;
+ * returns dst, or NULL on error
+ */
+char *ts_format(int64_t unix_ms, char *dst, size_t len);
+
+/** @} */
+
+#endif /* TIMESTAMP_H__ */
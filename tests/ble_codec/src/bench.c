@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <string.h>
+#include <net/nrf_cloud.h>
+
+#include "cJSON.h"
+#include "cJSON_os.h"
+#include "ble_codec.h"
+#include "gateway.h"
+#include "timestamp.h"
+#include "stubs.h"
+#include "bench.h"
+
+#define BENCH_LOOPS 2000
+#define BENCH_ADDR "C8:2F:0F:A5:31:7E"
+
+static char baseline_buf[2048];
+static char writer_buf[2048];
+
+/* device_value_changed_encode() as it was before the writer, with the
+ * timestamp taken from ts_format() so both produce the same bytes
+ */
+static int baseline_value_changed_encode(char *ble_address, char *uuid,
+					 char *path, char *value,
+					 uint16_t value_length,
+					 struct gw_msg *msg)
+{
+	int ret = -ENOMEM;
+	cJSON *root_obj = cJSON_CreateObject();
+	cJSON *event = cJSON_CreateObject();
+	cJSON *device = cJSON_CreateObject();
+	cJSON *address = cJSON_CreateObject();
+	cJSON *chrc = cJSON_CreateObject();
+	cJSON *value_arr = cJSON_CreateArray();
+	char str[64];
+
+	if ((root_obj == NULL) || (event == NULL) || (device == NULL) ||
+	    (address == NULL) || (chrc == NULL) || (value_arr == NULL)) {
+		goto cleanup;
+	}
+
+	cJSON_AddStringToObjectCS(root_obj, "type", "event");
+	cJSON_AddStringToObjectCS(root_obj, "gatewayId", gateway_id);
+	cJSON_AddNullToObjectCS(root_obj, "requestId");
+
+	cJSON_AddStringToObjectCS(event, "type",
+				  "device_characteristic_value_changed");
+	cJSON_AddStringToObjectCS(event, "timestamp",
+				  ts_format(TEST_NOW_MS, str, sizeof(str)));
+
+	cJSON_AddStringToObjectCS(device, "id", ble_address);
+	cJSON_AddStringToObjectCS(address, "address", ble_address);
+	cJSON_AddStringToObjectCS(address, "type", "random");
+
+	cJSON_AddStringToObjectCS(chrc, "uuid", uuid);
+	cJSON_AddStringToObjectCS(chrc, "path", path);
+
+	for (int i = 0; i < value_length; i++) {
+		/* char is unsigned on target */
+		cJSON *num = cJSON_CreateNumber((uint8_t)value[i]);
+
+		if (num == NULL) {
+			goto cleanup;
+		}
+		cJSON_AddItemToArray(value_arr, num);
+	}
+
+	cJSON_AddItemReferenceToObjectCS(device, "address", address);
+	cJSON_AddItemReferenceToObjectCS(chrc, "value", value_arr);
+	cJSON_AddItemReferenceToObjectCS(event, "device", device);
+	cJSON_AddItemReferenceToObjectCS(event, "characteristic", chrc);
+	cJSON_AddItemReferenceToObjectCS(root_obj, "event", event);
+
+	if (!cJSON_PrintPreallocated(root_obj, (char *)msg->data.ptr,
+				     msg->data_max_len, 0)) {
+		goto cleanup;
+	}
+	msg->data.len = strlen((char *)msg->data.ptr);
+	ret = 0;
+
+cleanup:
+	cJSON_Delete(value_arr);
+	cJSON_Delete(chrc);
+	cJSON_Delete(address);
+	cJSON_Delete(device);
+	cJSON_Delete(event);
+	cJSON_Delete(root_obj);
+	return ret;
+}
+
+static void msg_init(struct gw_msg *msg, char *buf, size_t size)
+{
+	msg->data.ptr = buf;
+	msg->data.len = 0;
+	msg->data_max_len = size;
+}
+
+/* Value changed events, the bulk of the gateway's traffic, through the
+ * cJSON encoder and the writer
+ */
+void test_encode_bench(void)
+{
+	static const uint16_t value_lens[] = {4, 20, 128};
+	struct bench_result baseline;
+	struct bench_result writer;
+	struct gw_msg baseline_msg;
+	struct gw_msg writer_msg;
+	char value[128];
+	char name[32];
+
+	cJSON_Init();
+	for (int i = 0; i < sizeof(value); i++) {
+		value[i] = (char)(i * 37);
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(value_lens); i++) {
+		uint16_t len = value_lens[i];
+
+		msg_init(&baseline_msg, baseline_buf, sizeof(baseline_buf));
+		msg_init(&writer_msg, writer_buf, sizeof(writer_buf));
+		zassert_equal(baseline_value_changed_encode(BENCH_ADDR, "2A37",
+							    "180D/2A37", value,
+							    len,
+							    &baseline_msg),
+			      0, NULL);
+		zassert_equal(device_value_changed_encode(BENCH_ADDR, "2A37",
+							  "180D/2A37", value,
+							  len, &writer_msg, 0),
+			      0, NULL);
+		zassert_equal(writer_msg.data.len, baseline_msg.data.len,
+			      NULL);
+		zassert_true(!memcmp(writer_buf, baseline_buf,
+				     baseline_msg.data.len),
+			     "output differs from cJSON for %u bytes", len);
+
+		bench_start(&baseline);
+		for (int j = 0; j < BENCH_LOOPS; j++) {
+			(void)baseline_value_changed_encode(BENCH_ADDR, "2A37",
+							    "180D/2A37", value,
+							    len,
+							    &baseline_msg);
+		}
+		bench_stop(&baseline, BENCH_LOOPS);
+
+		bench_start(&writer);
+		for (int j = 0; j < BENCH_LOOPS; j++) {
+			(void)device_value_changed_encode(BENCH_ADDR, "2A37",
+							  "180D/2A37", value,
+							  len, &writer_msg, 0);
+		}
+		bench_stop(&writer, BENCH_LOOPS);
+
+		snprintk(name, sizeof(name), "cJSON, %u value bytes", len);
+		bench_print(name, &baseline);
+		snprintk(name, sizeof(name), "writer, %u value bytes", len);
+		bench_print(name, &writer);
+		zassert_equal(writer.heap_calls, 0, "the writer allocated");
+	}
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <string.h>
+#include <bluetooth/uuid.h>
+#include <net/nrf_cloud.h>
+
+#include "ble_codec.h"
+#include "ble_conn_mgr.h"
+#include "ble.h"
+#include "stubs.h"
+
+/* Expected messages are the output of the cJSON encoders these replaced,
+ * captured with the same gateway id, time and arguments
+ */
+#define ADDR "C8:2F:0F:A5:31:7E"
+#define HEAD "{\"type\":\"event\",\"gatewayId\":\"" TEST_GATEWAY_ID "\"," \
+	     "\"requestId\":null,\"event\":"
+#define DEVICE "\"device\":{\"id\":\"" ADDR "\",\"address\":" \
+	       "{\"address\":\"" ADDR "\",\"type\":\"random\"}}"
+
+static char buf[2048];
+static struct gw_msg msg;
+
+static void msg_reset(size_t size)
+{
+	memset(buf, 0xAA, sizeof(buf));
+	msg.data.ptr = buf;
+	msg.data.len = 0;
+	msg.data_max_len = size;
+}
+
+static void check(int ret, const char *expected)
+{
+	zassert_equal(ret, 0, "encode failed: %d", ret);
+	zassert_true(!strcmp(buf, expected), "got %s", buf);
+	zassert_equal(msg.data.len, strlen(expected), NULL);
+}
+
+static void setup(void)
+{
+	msg_reset(sizeof(buf));
+	test_time_valid = true;
+}
+
+static char value[] = {0x16, 0xC8, 0x00, 0x7F};
+
+static void test_value_changed(void)
+{
+	check(device_value_changed_encode(ADDR, "2A37", "180D/2A37",
+					  value, sizeof(value), &msg, 0),
+	      HEAD "{\"type\":\"device_characteristic_value_changed\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\"," DEVICE ","
+	      "\"characteristic\":{\"uuid\":\"2A37\",\"path\":\"180D/2A37\","
+	      "\"value\":[22,200,0,127]}}}");
+
+	/* stamped with the receive time when given */
+	msg_reset(sizeof(buf));
+	check(device_value_changed_encode(ADDR, "2A37", "180D/2A37",
+					  value, 1, &msg, TEST_RX_MS),
+	      HEAD "{\"type\":\"device_characteristic_value_changed\","
+	      "\"timestamp\":\"" TEST_RX_STR "\"," DEVICE ","
+	      "\"characteristic\":{\"uuid\":\"2A37\",\"path\":\"180D/2A37\","
+	      "\"value\":[22]}}}");
+}
+
+static void test_chrc_read(void)
+{
+	check(device_chrc_read_encode(ADDR, "2A19", "180F/2A19", value, 0,
+				      &msg, 0),
+	      HEAD "{\"type\":\"device_characteristic_value_read_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\"," DEVICE ","
+	      "\"characteristic\":{\"uuid\":\"2A19\",\"path\":\"180F/2A19\","
+	      "\"value\":[]}}}");
+}
+
+static void test_descriptor(void)
+{
+	check(device_descriptor_value_encode(ADDR, "2902", "180D/2A37/2902",
+					     value, 2, &msg, false, 0),
+	      HEAD "{\"type\":\"device_descriptor_value_read_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\"," DEVICE ","
+	      "\"descriptor\":{\"uuid\":\"2902\","
+	      "\"path\":\"180D/2A37/2902\",\"value\":[22,200]}}}");
+
+	msg_reset(sizeof(buf));
+	check(device_descriptor_value_encode(ADDR, "2902", "180D/2A37/2902",
+					     value, 2, &msg, true,
+					     TEST_RX_MS),
+	      HEAD "{\"type\":\"device_descriptor_value_changed\","
+	      "\"timestamp\":\"" TEST_RX_STR "\"," DEVICE ","
+	      "\"descriptor\":{\"uuid\":\"2902\","
+	      "\"path\":\"180D/2A37/2902\",\"value\":[22,200]}}}");
+}
+
+static void test_write_result(void)
+{
+	char ccc[] = {1, 0};
+
+	check(device_value_write_result_encode(ADDR, "2902",
+					       "180D/2A37/2902", ccc,
+					       sizeof(ccc), &msg),
+	      HEAD "{\"type\":\"device_descriptor_value_write_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\"," DEVICE ","
+	      "\"descriptor\":{\"uuid\":\"2902\","
+	      "\"path\":\"180D/2A37/2902\",\"value\":[1,0]}}}");
+
+	msg_reset(sizeof(buf));
+	check(device_chrc_write_result_encode(ADDR, "2A39", "180D/2A39",
+					      value, 1, &msg),
+	      HEAD "{\"type\":\"device_characteristic_value_write_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\"," DEVICE ","
+	      "\"characteristic\":{\"uuid\":\"2A39\",\"path\":\"180D/2A39\","
+	      "\"value\":[22]}}}");
+}
+
+static void test_connect(void)
+{
+	check(device_connect_result_encode(ADDR, true, &msg),
+	      HEAD "{\"type\":\"device_connect_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"device\":{\"id\":\"" ADDR "\","
+	      "\"address\":{\"address\":\"" ADDR "\"},"
+	      "\"status\":{\"connected\":true}}}}");
+
+	msg_reset(sizeof(buf));
+	check(device_connect_result_encode(ADDR, false, &msg),
+	      HEAD "{\"type\":\"device_connect_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"device\":{\"id\":\"" ADDR "\","
+	      "\"address\":{\"address\":\"" ADDR "\"},"
+	      "\"status\":{\"connected\":false}}}}");
+}
+
+static void test_disconnect(void)
+{
+	/* status comes before address here */
+	check(device_disconnect_result_encode(ADDR, false, &msg),
+	      HEAD "{\"type\":\"device_disconnect\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"device\":{\"id\":\"" ADDR "\","
+	      "\"status\":{\"connected\":false},"
+	      "\"address\":{\"address\":\"" ADDR "\"}}}}");
+}
+
+static void test_error(void)
+{
+	/* no requestId, and the timestamp is at the top level */
+	check(device_error_encode(ADDR, "Bad \"value\"\n\\", &msg),
+	      "{\"type\":\"event\",\"gatewayId\":\"" TEST_GATEWAY_ID "\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"event\":{\"type\":\"error\","
+	      "\"device\":{\"deviceAddress\":\"" ADDR "\"},"
+	      "\"error\":{\"description\":\"Bad \\\"value\\\"\\n\\\\\"}}}");
+}
+
+static void test_scan(void)
+{
+	memset(ble_scanned_devices, 0, sizeof(ble_scanned_devices));
+	strcpy(ble_scanned_devices[0].addr, ADDR);
+	strcpy(ble_scanned_devices[0].name, "Thingy");
+	ble_scanned_devices[0].rssi = -60;
+	strcpy(ble_scanned_devices[1].addr, "E0:1F:2A:3B:4C:5D");
+	ble_scanned_devices[1].rssi = -85;
+
+	check(device_found_encode(2, &msg),
+	      HEAD "{\"type\":\"scan_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"subType\":\"instant\",\"timeout\":true,\"devices\":["
+	      "{\"deviceType\":\"BLE\",\"rssi\":-60,\"name\":\"Thingy\","
+	      "\"address\":{\"address\":\"" ADDR "\"}},"
+	      "{\"deviceType\":\"BLE\",\"rssi\":-85,"
+	      "\"address\":{\"address\":\"E0:1F:2A:3B:4C:5D\"}}]}}");
+
+	msg_reset(sizeof(buf));
+	check(device_found_encode(0, &msg),
+	      HEAD "{\"type\":\"scan_result\","
+	      "\"timestamp\":\"" TEST_NOW_STR "\","
+	      "\"subType\":\"instant\",\"timeout\":true,\"devices\":[]}}");
+}
+
+#define SVC_128 "8EC90001F3154F609FB8838830DAEA50"
+#define CHRC_128 "8EC90002F3154F609FB8838830DAEA50"
+
+static struct bt_uuid_128 uuids_128[] = {
+	BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x8ec90001, 0xf315, 0x4f60,
+					    0x9fb8, 0x838830daea50)),
+	BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x8ec90002, 0xf315, 0x4f60,
+					    0x9fb8, 0x838830daea50)),
+};
+
+#define PAIR_16(h, u, type, depth) \
+	.handle = (h), .uuid_type = BT_UUID_TYPE_16, .attr_type = (type), \
+	.path_depth = (depth), .uuid_16 = BT_UUID_INIT_16(u)
+#define PAIR_128(h, i, type, depth) \
+	.handle = (h), .uuid_type = BT_UUID_TYPE_128, .attr_type = (type), \
+	.path_depth = (depth), .uuid_128_index = (i)
+
+/* Heart rate service and a vendor service as discovery leaves them */
+static struct uuid_handle_pair pairs[] = {
+	{PAIR_16(1, 0x180d, BT_ATTR_SERVICE, 0), .is_service = true},
+	{PAIR_16(3, 0x2a37, BT_ATTR_CHRC, 1),
+	 .properties = BT_GATT_CHRC_NOTIFY, .sub_enabled = true},
+	{PAIR_16(4, 0x2902, BT_ATTR_CCC, 2)},
+	{PAIR_16(6, 0x2a38, BT_ATTR_CHRC, 1),
+	 .properties = BT_GATT_CHRC_READ},
+	{PAIR_128(8, 0, BT_ATTR_SERVICE, 0), .is_service = true},
+	{PAIR_128(10, 1, BT_ATTR_CHRC, 1),
+	 .properties = BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP |
+		       BT_GATT_CHRC_INDICATE},
+	{PAIR_16(11, 0x2902, BT_ATTR_CCC, 2)},
+};
+
+static const char discovery[] =
+	HEAD "{\"type\":\"device_discover_result\","
+	"\"timestamp\":\"" TEST_NOW_STR "\","
+	"\"device\":{\"id\":\"" ADDR "\",\"status\":{\"connected\":true},"
+	"\"address\":{\"address\":\"" ADDR "\"}},"
+	"\"services\":{"
+	"\"180D\":{\"uuid\":\"180D\",\"characteristics\":{"
+	"\"2A37\":{\"uuid\":\"2A37\",\"path\":\"180D/2A37\","
+	"\"properties\":{\"notify\":true},\"value\":[0],"
+	"\"descriptors\":{\"2902\":{\"uuid\":\"2902\","
+	"\"path\":\"180D/2A37/2902\",\"value\":[1,0]}}},"
+	"\"2A38\":{\"uuid\":\"2A38\",\"path\":\"180D/2A38\","
+	"\"properties\":{\"read\":true},\"value\":[0],"
+	"\"descriptors\":{}}}},"
+	"\"" SVC_128 "\":{\"uuid\":\"" SVC_128 "\",\"characteristics\":{"
+	"\"" CHRC_128 "\":{\"uuid\":\"" CHRC_128 "\","
+	"\"path\":\"" SVC_128 "/" CHRC_128 "\","
+	"\"properties\":{\"write\":true,\"indicate\":true,"
+	"\"writeWithoutResponse\":true},\"value\":[0],"
+	"\"descriptors\":{\"2902\":{\"uuid\":\"2902\","
+	"\"path\":\"" SVC_128 "/" CHRC_128 "/2902\","
+	"\"value\":[0,0]}}}}}}}}";
+
+static void conn_init(struct ble_device_conn *conn)
+{
+	memset(conn, 0, sizeof(*conn));
+	strcpy(conn->addr, ADDR);
+	conn->uuid_handle_pairs = pairs;
+	conn->num_pairs = ARRAY_SIZE(pairs);
+	conn->max_pairs = ARRAY_SIZE(pairs);
+	conn->uuids_128 = uuids_128;
+	conn->num_uuids_128 = ARRAY_SIZE(uuids_128);
+	conn->max_uuids_128 = ARRAY_SIZE(uuids_128);
+}
+
+static void test_discovery(void)
+{
+	struct ble_device_conn conn;
+
+	conn_init(&conn);
+	zassert_equal(device_discovery_len(&conn), strlen(discovery), NULL);
+	check(device_discovery_encode(&conn, &msg), discovery);
+
+	/* nothing to send */
+	conn.num_pairs = 0;
+	msg_reset(sizeof(buf));
+	zassert_true(device_discovery_len(&conn) < 0, NULL);
+	zassert_true(device_discovery_encode(&conn, &msg) < 0, NULL);
+}
+
+static void test_no_room(void)
+{
+	struct ble_device_conn conn;
+	size_t len = strlen(discovery);
+
+	/* exactly enough, counting the NUL */
+	conn_init(&conn);
+	msg_reset(len + 1);
+	check(device_discovery_encode(&conn, &msg), discovery);
+
+	msg_reset(len);
+	zassert_equal(device_discovery_encode(&conn, &msg), -ENOMEM, NULL);
+	zassert_equal((uint8_t)buf[len], 0xAA, "wrote past the buffer");
+
+	msg_reset(16);
+	zassert_equal(device_connect_result_encode(ADDR, true, &msg),
+		      -ENOMEM, NULL);
+	zassert_equal((uint8_t)buf[16], 0xAA, "wrote past the buffer");
+}
+
+static void test_no_time(void)
+{
+	test_time_valid = false;
+	zassert_true(device_connect_result_encode(ADDR, true, &msg) < 0,
+		     NULL);
+	zassert_true(device_error_encode(ADDR, "x", &msg) < 0, NULL);
+
+	/* a receive time does not need the clock */
+	msg_reset(sizeof(buf));
+	zassert_equal(device_value_changed_encode(ADDR, "2A37", "180D/2A37",
+						  value, 1, &msg,
+						  TEST_RX_MS),
+		      0, NULL);
+}
+
+extern void test_encode_bench(void);
+
+void test_main(void)
+{
+	ztest_test_suite(ble_codec,
+			 ztest_unit_test_setup_teardown(test_value_changed,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_chrc_read,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_descriptor,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_write_result,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_connect,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_disconnect,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_error,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_scan,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_discovery,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_no_room,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_no_time,
+							setup, unit_test_noop),
+			 ztest_unit_test_setup_teardown(test_encode_bench,
+							setup, unit_test_noop));
+	ztest_run_test_suite(ble_codec);
+}
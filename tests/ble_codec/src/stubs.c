@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <zephyr.h>
+#include <ctype.h>
+#include <string.h>
+#include <bluetooth/uuid.h>
+
+#include "ble.h"
+#include "gateway.h"
+#include "timestamp.h"
+#include "stubs.h"
+
+char gateway_id[NRF_CLOUD_CLIENT_ID_LEN+1] = TEST_GATEWAY_ID;
+struct ble_scanned_dev ble_scanned_devices[MAX_SCAN_RESULTS];
+bool test_time_valid = true;
+
+/* Same as the one in ble.c */
+void bt_to_upper(char *addr, uint8_t addr_len)
+{
+	for (int i = 0; i < addr_len; i++) {
+		addr[i] = toupper(addr[i]);
+	}
+}
+
+/* Same as the one in ble.c */
+void bt_uuid_get_str(const struct bt_uuid *uuid, char *str, size_t len)
+{
+	uint32_t tmp1, tmp5;
+	uint16_t tmp0, tmp2, tmp3, tmp4;
+
+	switch (uuid->type) {
+	case BT_UUID_TYPE_16:
+		snprintk(str, len, "%04x", BT_UUID_16(uuid)->val);
+		break;
+	case BT_UUID_TYPE_32:
+		snprintk(str, len, "%08x", BT_UUID_32(uuid)->val);
+		break;
+	case BT_UUID_TYPE_128:
+		memcpy(&tmp0, &BT_UUID_128(uuid)->val[0], sizeof(tmp0));
+		memcpy(&tmp1, &BT_UUID_128(uuid)->val[2], sizeof(tmp1));
+		memcpy(&tmp2, &BT_UUID_128(uuid)->val[6], sizeof(tmp2));
+		memcpy(&tmp3, &BT_UUID_128(uuid)->val[8], sizeof(tmp3));
+		memcpy(&tmp4, &BT_UUID_128(uuid)->val[10], sizeof(tmp4));
+		memcpy(&tmp5, &BT_UUID_128(uuid)->val[12], sizeof(tmp5));
+
+		snprintk(str, len, "%08x%04x%04x%04x%08x%04x",
+			tmp5, tmp4, tmp3, tmp2, tmp1, tmp0);
+		break;
+	default:
+		(void)memset(str, 0, len);
+		return;
+	}
+}
+
+int ts_now_ms(int64_t *unix_ms)
+{
+	if (!test_time_valid) {
+		return -ENODATA;
+	}
+	*unix_ms = TEST_NOW_MS;
+	return 0;
+}
+
+/* Only the times the tests use */
+char *ts_format(int64_t unix_ms, char *dst, size_t len)
+{
+	const char *str;
+
+	switch (unix_ms) {
+	case TEST_NOW_MS:
+		str = TEST_NOW_STR;
+		break;
+	case TEST_RX_MS:
+		str = TEST_RX_STR;
+		break;
+	default:
+		return NULL;
+	}
+	if (len < TS_STR_LEN) {
+		return NULL;
+	}
+	strcpy(dst, str);
+	return dst;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef STUBS_H__
+#define STUBS_H__
+
+#include <zephyr.h>
+#include "ble.h"
+
+#define TEST_GATEWAY_ID "nrf-352656100000000"
+
+#define TEST_NOW_MS 1623069296789LL
+#define TEST_NOW_STR "2021-06-07T12:34:56.789Z"
+#define TEST_RX_MS 1623069295001LL
+#define TEST_RX_STR "2021-06-07T12:34:55.001Z"
+
+/* The scan results device_found_encode() reports; ble.c owns them */
+extern struct ble_scanned_dev ble_scanned_devices[MAX_SCAN_RESULTS];
+
+/* ts_now_ms() fails while this is false */
+extern bool test_time_valid;
+
+#endif /* STUBS_H__ */
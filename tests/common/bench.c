@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <time.h>
+
+#include "bench.h"
+
+static uint32_t heap_calls;
+
+void *__real_k_malloc(size_t size);
+void *__real_k_calloc(size_t nmemb, size_t size);
+void __real_k_free(void *ptr);
+
+void *__wrap_k_malloc(size_t size)
+{
+	heap_calls++;
+	return __real_k_malloc(size);
+}
+
+void *__wrap_k_calloc(size_t nmemb, size_t size)
+{
+	heap_calls++;
+	return __real_k_calloc(nmemb, size);
+}
+
+void __wrap_k_free(void *ptr)
+{
+	if (ptr != NULL) {
+		heap_calls++;
+	}
+	__real_k_free(ptr);
+}
+
+/* native_posix builds against the host C library */
+static uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void bench_start(struct bench_result *res)
+{
+	res->heap_calls = heap_calls;
+	res->ns = host_now_ns();
+}
+
+void bench_stop(struct bench_result *res, uint32_t msgs)
+{
+	res->ns = host_now_ns() - res->ns;
+	res->heap_calls = heap_calls - res->heap_calls;
+	res->msgs = msgs;
+}
+
+void bench_print(const char *name, const struct bench_result *res)
+{
+	uint64_t per_sec = res->ns ? ((uint64_t)res->msgs * NSEC_PER_SEC) /
+				     res->ns : 0;
+	uint32_t calls_x100 = res->msgs ? (100U * res->heap_calls) /
+					  res->msgs : 0;
+
+	TC_PRINT("%-28s %10u msgs/s %4u.%02u heap calls/msg\n", name,
+		 (uint32_t)per_sec, calls_x100 / 100, calls_x100 % 100);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef BENCH_H__
+#define BENCH_H__
+
+#include <zephyr.h>
+
+/**
+ * @file bench.h
+ *
+ * @brief Timing and heap call counts for the native_posix benchmarks.
+ *
+ * Code runs in zero simulated time on native_posix, so timing uses the
+ * host's monotonic clock. Heap calls are counted by linking with
+ * -Wl,--wrap=k_malloc,--wrap=k_calloc,--wrap=k_free; cJSON_Init() routes
+ * cJSON through k_malloc() and k_free() as it does on target.
+ * @{
+ */
+
+struct bench_result {
+	uint32_t msgs;
+	uint64_t ns;
+	uint32_t heap_calls;
+};
+
+/** Start counting time and heap calls */
+void bench_start(struct bench_result *res);
+
+/** Stop counting; msgs is how many messages were handled since the start */
+void bench_stop(struct bench_result *res, uint32_t msgs);
+
+/** Print one result line: messages/s and heap calls per message */
+void bench_print(const char *name, const struct bench_result *res);
+
+/** @} */
+
+#endif /* BENCH_H__ */
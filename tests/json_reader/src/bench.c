@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "cJSON_os.h"
+#include "json_reader.h"
+#include "gateway_op.h"
+#include "bench.h"
+
+#define BENCH_LOOPS 2000
+
+struct sample {
+	const char *name;
+	const char *msg;
+	enum gw_op_type type;
+};
+
+/* Operations as recorded from the cloud */
+static const struct sample samples[] = {
+	{"scan",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":\"scan\","
+	 "\"scanType\":0},\"id\":1}",
+	 GW_OP_SCAN},
+	{"chrc read",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":"
+	 "\"device_characteristic_value_read\",\"deviceAddress\":"
+	 "\"C8:2F:0F:A5:31:7E\",\"serviceUUID\":\"180F\","
+	 "\"characteristicUUID\":\"2A19\"},\"id\":4}",
+	 GW_OP_CHRC_READ},
+	{"desc write",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":"
+	 "\"device_descriptor_value_write\",\"deviceAddress\":"
+	 "\"C8:2F:0F:A5:31:7E\",\"serviceUUID\":\"180D\","
+	 "\"characteristicUUID\":\"2A37\",\"descriptorUUID\":\"2902\","
+	 "\"descriptorValue\":[1,0]},\"id\":2}",
+	 GW_OP_DESC_WRITE},
+	{"chrc write, 20 bytes",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":"
+	 "\"device_characteristic_value_write\",\"deviceAddress\":"
+	 "\"C8:2F:0F:A5:31:7E\",\"serviceUUID\":"
+	 "\"8EC90001F3154F609FB8838830DAEA50\",\"characteristicUUID\":"
+	 "\"8EC90002F3154F609FB8838830DAEA50\",\"characteristicValue\":"
+	 "[1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20]},\"id\":3}",
+	 GW_OP_CHRC_WRITE},
+	{"chrc write, 128 bytes",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":"
+	 "\"device_characteristic_value_write\",\"deviceAddress\":"
+	 "\"C8:2F:0F:A5:31:7E\",\"serviceUUID\":"
+	 "\"8EC90001F3154F609FB8838830DAEA50\",\"characteristicUUID\":"
+	 "\"8EC90002F3154F609FB8838830DAEA50\",\"characteristicValue\":"
+	 "[1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,"
+	 "25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,"
+	 "47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,66,67,68,"
+	 "69,70,71,72,73,74,75,76,77,78,79,80,81,82,83,84,85,86,87,88,89,90,"
+	 "91,92,93,94,95,96,97,98,99,100,101,102,103,104,105,106,107,108,109,"
+	 "110,111,112,113,114,115,116,117,118,119,120,121,122,123,124,125,126,"
+	 "127,128]},\"id\":3}",
+	 GW_OP_CHRC_WRITE},
+	{"discover",
+	 "{\"type\":\"operation\",\"operation\":{\"type\":"
+	 "\"device_discover\",\"deviceAddress\":\"C8:2F:0F:A5:31:7E\"},"
+	 "\"id\":5}",
+	 GW_OP_DISCOVER},
+};
+
+static struct gw_op op;
+
+/* Recorded cloud operations through cJSON_Parse()+cJSON_Delete(), as the
+ * gateway handled them before, and through the operation decoder
+ */
+void test_decode_bench(void)
+{
+	struct bench_result baseline;
+	struct bench_result reader;
+
+	cJSON_Init();
+	for (int i = 0; i < ARRAY_SIZE(samples); i++) {
+		const char *msg = samples[i].msg;
+		size_t len = strlen(msg);
+		cJSON *root = cJSON_Parse(msg);
+
+		zassert_not_null(root, "cJSON rejects %s", samples[i].name);
+		cJSON_Delete(root);
+		zassert_equal(gw_op_decode(msg, len, &op), 0, "%s",
+			      samples[i].name);
+		zassert_equal(op.type, samples[i].type, "%s",
+			      samples[i].name);
+
+		bench_start(&baseline);
+		for (int j = 0; j < BENCH_LOOPS; j++) {
+			cJSON_Delete(cJSON_Parse(msg));
+		}
+		bench_stop(&baseline, BENCH_LOOPS);
+
+		bench_start(&reader);
+		for (int j = 0; j < BENCH_LOOPS; j++) {
+			(void)gw_op_decode(msg, len, &op);
+		}
+		bench_stop(&reader, BENCH_LOOPS);
+
+		TC_PRINT("%s, %u bytes\n", samples[i].name, (uint32_t)len);
+		bench_print("  cJSON", &baseline);
+		bench_print("  decoder", &reader);
+		zassert_equal(reader.heap_calls, 0, "the decoder allocated");
+	}
+}
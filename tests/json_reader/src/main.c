@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json_reader.h"
+#include "gateway_op.h"
+
+#define ADDR "C8:2F:0F:A5:31:7E"
+
+static struct gw_op op;
+
+static int decode(const char *msg)
+{
+	return gw_op_decode(msg, strlen(msg), &op);
+}
+
+static void test_scan(void)
+{
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":"
+			     "{\"type\":\"scan\",\"scanType\":0},\"id\":1}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_SCAN, NULL);
+	zassert_equal(op.scan_type, 0, NULL);
+	zassert_equal(op.addr[0], '\0', NULL);
+
+	zassert_equal(decode("{\"operation\":{\"scanType\":1,"
+			     "\"type\":\"scan\"},\"type\":\"operation\"}"),
+		      0, "members may come in any order");
+	zassert_equal(op.type, GW_OP_SCAN, NULL);
+	zassert_equal(op.scan_type, 1, NULL);
+}
+
+static void test_read(void)
+{
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_characteristic_value_read\","
+			     "\"deviceAddress\":\"" ADDR "\","
+			     "\"serviceUUID\":\"180F\","
+			     "\"characteristicUUID\":\"2A19\"},\"id\":4}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_CHRC_READ, NULL);
+	zassert_true(!strcmp(op.addr, ADDR), NULL);
+	zassert_true(!strcmp(op.svc_uuid, "180F"), NULL);
+	zassert_true(!strcmp(op.chrc_uuid, "2A19"), NULL);
+
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_descriptor_value_read\","
+			     "\"deviceAddress\":\"" ADDR "\","
+			     "\"characteristicUUID\":\"2A37\","
+			     "\"descriptorUUID\":\"2902\"}}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_DESC_READ, NULL);
+	zassert_equal(op.svc_uuid[0], '\0', "absent members are empty");
+	zassert_true(!strcmp(op.chrc_uuid, "2A37"), NULL);
+}
+
+static void test_subscribe(void)
+{
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_descriptor_value_write\","
+			     "\"deviceAddress\":\"" ADDR "\","
+			     "\"serviceUUID\":\"180D\","
+			     "\"characteristicUUID\":\"2A37\","
+			     "\"descriptorUUID\":\"2902\","
+			     "\"descriptorValue\":[1,0],"
+			     "\"priority\":\"alarm\"},\"id\":2}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_DESC_WRITE, NULL);
+	zassert_equal(op.desc_len, 2, NULL);
+	zassert_equal(op.desc[0], 1, NULL);
+	zassert_equal(op.desc[1], 0, NULL);
+	zassert_true(!strcmp(op.priority, "alarm"), NULL);
+
+	/* an unknown priority that does not fit is dropped, not failed */
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_descriptor_value_write\","
+			     "\"deviceAddress\":\"" ADDR "\","
+			     "\"characteristicUUID\":\"2A37\","
+			     "\"descriptorValue\":[0,0],"
+			     "\"priority\":\"background\"}}"),
+		      0, NULL);
+	zassert_equal(op.priority[0], '\0', NULL);
+	zassert_true(!strcmp(op.chrc_uuid, "2A37"), NULL);
+}
+
+static void test_write(void)
+{
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_characteristic_value_write\","
+			     "\"deviceAddress\":\"" ADDR "\","
+			     "\"serviceUUID\":"
+			     "\"8EC90001F3154F609FB8838830DAEA50\","
+			     "\"characteristicUUID\":"
+			     "\"8EC90002F3154F609FB8838830DAEA50\","
+			     "\"characteristicValue\":[1,2,255,0]},\"id\":3}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_CHRC_WRITE, NULL);
+	zassert_true(!strcmp(op.svc_uuid, "8EC90001F3154F609FB8838830DAEA50"),
+		     NULL);
+	zassert_true(!strcmp(op.chrc_uuid, "8EC90002F3154F609FB8838830DAEA50"),
+		     NULL);
+	zassert_equal(op.value_len, 4, NULL);
+	zassert_mem_equal(op.value, ((uint8_t[]){1, 2, 255, 0}), 4, NULL);
+}
+
+static void test_discover(void)
+{
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":{\"type\":"
+			     "\"device_discover\",\"deviceAddress\":\"" ADDR
+			     "\"},\"id\":5}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_DISCOVER, NULL);
+	zassert_true(!strcmp(op.addr, ADDR), NULL);
+}
+
+static void test_not_operation(void)
+{
+	zassert_equal(decode("{\"type\":\"event\",\"event\":{}}"), -EINVAL,
+		      NULL);
+	zassert_equal(decode("{\"type\":1,\"operation\":{}}"), -EINVAL, NULL);
+	zassert_equal(decode("{\"operation\":{\"type\":\"scan\"}}"), -ENOENT,
+		      NULL);
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":"
+			     "{\"type\":\"device_reboot\"}}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_COUNT, "unknown operations decode");
+	/* a name the length of a known one */
+	zassert_equal(decode("{\"type\":\"operation\",\"operation\":"
+			     "{\"type\":\"scam\"}}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_COUNT, NULL);
+}
+
+static void test_malformed(void)
+{
+	static const char * const bad[] = {
+		"",
+		"   ",
+		"[]",
+		"\"operation\"",
+		"{\"type\" \"operation\"}",
+		"{\"type\":\"operation\",}",
+		"{\"type\":\"operation\" \"operation\":{}}",
+		"{\"type\":\"operation\",\"operation\":{\"type\":\"scan\"]}",
+		"{\"type\":\"operation\",\"operation\":{\"scanType\":x}}",
+		"{\"type\":\"operation\",\"operation\":"
+		"{\"characteristicValue\":[1,,2]}}",
+		"{\"type\":\"operation\",\"operation\":"
+		"{\"characteristicValue\":[1 2]}}",
+		"{\"type\":\"operation\",\"operation\":{}}}",
+		"{\"type\":\"operation\",\"operation\":{}} x",
+		"{\"type\":\"operation\",\"id\":#}",
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(bad); i++) {
+		zassert_true(decode(bad[i]) < 0, "accepted %s", bad[i]);
+	}
+}
+
+static void test_truncated(void)
+{
+	static const char msg[] =
+		"{\"type\":\"operation\",\"operation\":{\"type\":"
+		"\"device_descriptor_value_write\","
+		"\"deviceAddress\":\"" ADDR "\","
+		"\"characteristicUUID\":\"2A\\u0033\\u0037\","
+		"\"descriptorValue\":[1,0],\"priority\":\"bulk\"},"
+		"\"id\":12,\"ok\":true,\"none\":null}";
+	static char buf[sizeof(msg) - 1];
+	size_t len = sizeof(buf);
+
+	zassert_equal(gw_op_decode(msg, len, &op), 0, NULL);
+	zassert_true(!strcmp(op.chrc_uuid, "2A37"), NULL);
+
+	/* every prefix, in a buffer ending right after it */
+	for (size_t i = 0; i < len; i++) {
+		char *p = buf + len - i;
+
+		memcpy(p, msg, i);
+		zassert_true(gw_op_decode(p, i, &op) < 0,
+			     "accepted %zu bytes", i);
+	}
+}
+
+static void test_escapes(void)
+{
+	static const char in[] =
+		"[\"a\\\"b\\\\c\\/d\",\"\\b\\f\\n\\r\\t\",\"\\u0041\\u00e9\","
+		"\"\\uZZZZ\"]";
+	struct json_reader r;
+	char str[16];
+
+	jr_init(&r, in, sizeof(in) - 1);
+	zassert_true(jr_arr_start(&r), NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_str(&r, str, sizeof(str)), 7, NULL);
+	zassert_true(!strcmp(str, "a\"b\\c/d"), NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_str(&r, str, sizeof(str)), 5, NULL);
+	zassert_true(!strcmp(str, "\b\f\n\r\t"), NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_str(&r, str, sizeof(str)), 2, NULL);
+	zassert_true(!strcmp(str, "A?"), "non-ASCII becomes '?'");
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_str(&r, str, sizeof(str)), -EINVAL, NULL);
+
+	jr_init(&r, "\"a\\x\"", 5);
+	zassert_equal(jr_str(&r, str, sizeof(str)), -EINVAL, NULL);
+
+	/* an escaped quote does not end the key */
+	zassert_equal(decode("{\"type\":\"operation\",\"a\\\"b\":1,"
+			     "\"operation\":{\"type\":\"scan\"}}"),
+		      0, NULL);
+	zassert_equal(op.type, GW_OP_SCAN, NULL);
+}
+
+static void test_backslash_at_end(void)
+{
+	/* the byte after the buffer would close the string */
+	static const char in[] = "\"ab\\\"";
+	static const char key[] = "{\"ab\\\":1}";
+	struct json_reader r;
+	const char *name;
+	size_t name_len;
+	char str[8];
+
+	jr_init(&r, in, 4);
+	zassert_equal(jr_str(&r, str, sizeof(str)), -EINVAL, NULL);
+	zassert_true(r.p <= r.end, "read past the end");
+
+	jr_init(&r, in, 4);
+	jr_skip(&r);
+	zassert_equal(r.err, -EINVAL, NULL);
+	zassert_true(r.p <= r.end, "read past the end");
+
+	jr_init(&r, key, 5);
+	zassert_true(jr_obj_start(&r), NULL);
+	zassert_false(jr_next_key(&r, &name, &name_len), NULL);
+	zassert_equal(r.err, -EINVAL, NULL);
+	zassert_true(r.p <= r.end, "read past the end");
+
+	/* later calls leave it there */
+	zassert_equal(jr_peek(&r), 0, NULL);
+	zassert_equal(jr_finish(&r), -EINVAL, NULL);
+	zassert_true(r.p <= r.end, NULL);
+}
+
+static void test_long_values(void)
+{
+	static const char in[] =
+		"[\"abcd\",\"abc\",2147483648,-2147483649,1.5e3]";
+	struct json_reader r;
+	char str[4];
+	int32_t val;
+
+	jr_init(&r, in, sizeof(in) - 1);
+	zassert_true(jr_arr_start(&r), NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_str(&r, str, sizeof(str)), -ENOMEM, NULL);
+	zassert_equal(str[0], '\0', NULL);
+	zassert_true(jr_arr_next(&r), "a value too long is skipped");
+	zassert_equal(jr_str(&r, str, sizeof(str)), 3, NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_int(&r, &val), 0, NULL);
+	zassert_equal(val, INT32_MAX, NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_int(&r, &val), 0, NULL);
+	zassert_equal(val, INT32_MIN, NULL);
+	zassert_true(jr_arr_next(&r), NULL);
+	zassert_equal(jr_int(&r, &val), 0, NULL);
+	zassert_equal(val, 1, NULL);
+	zassert_false(jr_arr_next(&r), NULL);
+	zassert_equal(jr_finish(&r), 0, NULL);
+}
+
+#define OVERSIZED_VALUE_LEN (GW_OP_VALUE_MAX + 44)
+
+static void test_oversized_value(void)
+{
+	static char msg[OVERSIZED_VALUE_LEN * 4 + 256];
+	int dropped = 0;
+	int len;
+
+	len = snprintf(msg, sizeof(msg),
+		       "{\"type\":\"operation\",\"operation\":{\"type\":"
+		       "\"device_characteristic_value_write\","
+		       "\"characteristicValue\":[");
+	for (int i = 0; i < OVERSIZED_VALUE_LEN; i++) {
+		if (i == GW_OP_VALUE_MAX + 8) {
+			dropped = len + 1;
+		}
+		len += snprintf(msg + len, sizeof(msg) - len, "%s%d",
+				i ? "," : "", i & 0xFF);
+	}
+	len += snprintf(msg + len, sizeof(msg) - len,
+			"],\"deviceAddress\":\"" ADDR "\","
+			"\"characteristicUUID\":\"2A37\"},\"id\":9}");
+	zassert_true(len < sizeof(msg), NULL);
+
+	zassert_equal(gw_op_decode(msg, len, &op), 0, NULL);
+	zassert_equal(op.type, GW_OP_CHRC_WRITE, NULL);
+	zassert_equal(op.value_len, GW_OP_VALUE_MAX, NULL);
+	for (int i = 0; i < GW_OP_VALUE_MAX; i++) {
+		zassert_equal(op.value[i], i & 0xFF, "value[%d]", i);
+	}
+	zassert_true(!strcmp(op.addr, ADDR), "members after it are decoded");
+	zassert_true(!strcmp(op.chrc_uuid, "2A37"), NULL);
+
+	/* the elements dropped are still checked */
+	msg[dropped] = 'x';
+	zassert_true(gw_op_decode(msg, len, &op) < 0, NULL);
+}
+
+extern void test_decode_bench(void);
+
+void test_main(void)
+{
+	ztest_test_suite(json_reader,
+			 ztest_unit_test(test_scan),
+			 ztest_unit_test(test_read),
+			 ztest_unit_test(test_subscribe),
+			 ztest_unit_test(test_write),
+			 ztest_unit_test(test_discover),
+			 ztest_unit_test(test_not_operation),
+			 ztest_unit_test(test_malformed),
+			 ztest_unit_test(test_truncated),
+			 ztest_unit_test(test_escapes),
+			 ztest_unit_test(test_backslash_at_end),
+			 ztest_unit_test(test_long_values),
+			 ztest_unit_test(test_oversized_value),
+			 ztest_unit_test(test_decode_bench));
+	ztest_run_test_suite(json_reader);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2021 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+#include <ztest.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timestamp.h"
+#include "bench.h"
+
+#define BENCH_LOOPS 10000
+
+/* 2020-02-19T18:38:50.363Z */
+#define TEST_NOW_MS 1582137530363LL
+
+/* Timestamps as they were rendered before the formatter */
+static char *legacy_format(int64_t unix_ms, char *dst, size_t len)
+{
+	time_t t = unix_ms / MSEC_PER_SEC;
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(dst, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(&dst[19], len - 19, ".%03uZ",
+		 (unsigned int)(unix_ms % MSEC_PER_SEC));
+	return dst;
+}
+
+static void check(int64_t unix_ms)
+{
+	char expect[TS_STR_LEN];
+	char str[TS_STR_LEN];
+
+	legacy_format(unix_ms, expect, sizeof(expect));
+	zassert_not_null(ts_format(unix_ms, str, sizeof(str)), NULL);
+	zassert_true(!strcmp(str, expect), "%s, expected %s", str, expect);
+}
+
+static void test_known(void)
+{
+	char str[TS_STR_LEN];
+
+	zassert_true(!strcmp(ts_format(0, str, sizeof(str)),
+			     "1970-01-01T00:00:00.000Z"), NULL);
+	zassert_true(!strcmp(ts_format(TEST_NOW_MS, str, sizeof(str)),
+			     "2020-02-19T18:38:50.363Z"), NULL);
+	zassert_true(!strcmp(ts_format(951782400000LL, str, sizeof(str)),
+			     "2000-02-29T00:00:00.000Z"), NULL);
+	zassert_true(!strcmp(ts_format(4107542399999LL, str, sizeof(str)),
+			     "2100-02-28T23:59:59.999Z"), NULL);
+	zassert_true(!strcmp(ts_format(4107542400000LL, str, sizeof(str)),
+			     "2100-03-01T00:00:00.000Z"), "2100 is not leap");
+}
+
+/* Within a second only the milliseconds change, then the time, then the
+ * date; walk both ways across those boundaries
+ */
+static void test_cached_parts(void)
+{
+	int64_t midnight = 1609459200000LL; /* 2021-01-01 */
+
+	for (int64_t ms = midnight - 2500; ms < midnight + 2500; ms += 7) {
+		check(ms);
+	}
+	for (int64_t ms = midnight + 2500; ms > midnight - 2500; ms -= 11) {
+		check(ms);
+	}
+	check(TEST_NOW_MS);
+	check(midnight);
+}
+
+/* Every day from 1970 to 2200 at a varying time of day */
+static void test_against_gmtime(void)
+{
+	for (int64_t day = 0; day < 84000; day++) {
+		int64_t ms = day * 86400000LL + (day * 7919 % 86400000);
+
+		check(ms);
+	}
+}
+
+static void test_errors(void)
+{
+	char str[TS_STR_LEN];
+
+	zassert_is_null(ts_format(-1, str, sizeof(str)), NULL);
+	zassert_is_null(ts_format(TEST_NOW_MS, str, sizeof(str) - 1), NULL);
+}
+
+/* The gateway stamped each event with date_time_now()+gmtime()+strftime();
+ * date_time_now() needs the modem, so only the rendering is compared here.
+ * Steps of 7 ms hit a new second every 143 events, like a busy gateway.
+ */
+static void test_bench(void)
+{
+	struct bench_result legacy;
+	struct bench_result cached;
+	char str[TS_STR_LEN];
+
+	bench_start(&legacy);
+	for (int i = 0; i < BENCH_LOOPS; i++) {
+		legacy_format(TEST_NOW_MS + i * 7, str, sizeof(str));
+	}
+	bench_stop(&legacy, BENCH_LOOPS);
+
+	bench_start(&cached);
+	for (int i = 0; i < BENCH_LOOPS; i++) {
+		ts_format(TEST_NOW_MS + i * 7, str, sizeof(str));
+	}
+	bench_stop(&cached, BENCH_LOOPS);
+
+	bench_print("gmtime+strftime", &legacy);
+	bench_print("ts_format", &cached);
+	zassert_equal(cached.heap_calls, 0, "ts_format allocated");
+}
+
+void test_main(void)
+{
+	ztest_test_suite(timestamp,
+			 ztest_unit_test(test_known),
+			 ztest_unit_test(test_cached_parts),
+			 ztest_unit_test(test_against_gmtime),
+			 ztest_unit_test(test_errors),
+			 ztest_unit_test(test_bench));
+	ztest_run_test_suite(timestamp);
+}